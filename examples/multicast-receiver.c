@@ -32,6 +32,8 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <netdb.h>
@@ -43,6 +45,9 @@
 
 #include "nghq/nghq.h"
 #include "multicast_interfaces.h"
+#include "shm_object_store.h"
+#include "pack_store.h"
+#include "repair_client.h"
 
 static uint8_t _default_session_id[] = {
     0x53, 0x65, 0x73, 0x73, 0x69, 0x6f, 0x6e, 0x20, 0x49, 0x44 /* "Session ID" */
@@ -62,6 +67,16 @@ bool filename_ok = false;
 #define DEFAULT_FAKE_REORDER      0 /* don't deliberately reorder packets */
 #define DEFAULT_DROP_PACKET       0 /* don't deliberately drop packets */
 #define DEFAULT_DEBUG_LEVEL       "INFO"
+#define DEFAULT_SHM_SIZE_MB       256
+#define DEFAULT_SHM_SLOTS         1024
+#define DEFAULT_SHM_RESERVE       (4*1024*1024) /* when no content-length */
+#define DEFAULT_PACK_SIZE_MB      1024
+#define PACK_FLUSH_INTERVAL       1.0 /* seconds between pack file syncs */
+#define DEFAULT_STATE_INTERVAL    2.0 /* seconds between state snapshots */
+#define COALESCE_MAX_DELAY        0.1 /* seconds body data is held for -c */
+#define DEFAULT_MAX_PACKET_SIZE   9000 /* room for jumbo frame senders */
+#define MIN_PACKET_SIZE           1200 /* smallest QUIC allows */
+#define MAX_DELTA_PATHS           16
 
 #define OPT_ARG_DEFAULT_FAKE_REORDER   3 /* reorder every 3rd packet */
 #define OPT_ARG_DEFAULT_DROP_PACKET    7 /* drop every 7th packet */
@@ -72,9 +87,22 @@ typedef enum ReceivingHeaders {
 } ReceivingHeaders;
 
 typedef struct push_request {
+  nghq_session *session;
   ReceivingHeaders headers_incoming;
   bool text_body;
   bool final_request;
+  bool repairing;
+  char *path;
+  /* Only used when writing into the shared memory object store */
+  char *content_type;
+  size_t content_length; /* or into pack files */
+  int shm_obj;
+  bool shm_failed;
+  /* Only used when writing into pack files */
+  pack_object *pack_obj;
+  char *pack_hdrs;
+  size_t pack_hdrs_len;
+  bool pack_failed;
 } push_request;
 
 typedef struct push_request_list {
@@ -84,6 +112,12 @@ typedef struct push_request_list {
 
 static push_request_list *push_requests;
 
+static shm_object_store *g_shm_store = NULL;
+static pack_store *g_pack_store = NULL;
+static repair_client *g_repair = NULL;
+static const char *g_state_file = NULL;
+static bool g_interrupted = false;
+
 typedef struct session_data {
   nghq_session *session;
   ev_io socket_readable;
@@ -219,6 +253,8 @@ static int on_begin_promise_cb (nghq_session *session, void* session_user_data,
 {
     //session_data *data = (session_data*) session_user_data;
     push_request *new_request = calloc(1, sizeof(push_request));
+    new_request->session = session;
+    new_request->shm_obj = -1;
     nghq_set_request_user_data(session, promise_user_data, new_request);
     push_request_list *it = push_requests;
     push_request_list *new_entry = calloc (1, sizeof (push_request_list));
@@ -237,6 +273,18 @@ static int on_begin_promise_cb (nghq_session *session, void* session_user_data,
     return NGHQ_OK;
 }
 
+/* Keep the response headers to store with the object in its pack */
+static void _pack_add_header (push_request *req, const nghq_header *hdr)
+{
+    size_t len = hdr->name_len + hdr->value_len + 3;
+    char *hdrs = realloc(req->pack_hdrs, req->pack_hdrs_len + len + 1);
+    if (hdrs == NULL) return;
+    snprintf(hdrs + req->pack_hdrs_len, len + 1, "%.*s: %.*s\n",
+             (int) hdr->name_len, hdr->name, (int) hdr->value_len, hdr->value);
+    req->pack_hdrs = hdrs;
+    req->pack_hdrs_len += len;
+}
+
 static int on_headers_cb (nghq_session *session, uint8_t flags,
                           nghq_header *hdr, void *request_user_data)
 {
@@ -245,8 +293,37 @@ static int on_headers_cb (nghq_session *session, uint8_t flags,
     static const char content_type_text[] = "text/";
     static const char connection_field[] = "connection";
     static const char connection_close_value[] = "close";
+    static const char path_field[] = ":path";
+    static const char content_length_field[] = "content-length";
+
+    if (req->headers_incoming==HEADERS_REQUEST &&
+        hdr->name_len == sizeof(path_field)-1 &&
+        strncasecmp((const char*)hdr->name, path_field, hdr->name_len) == 0) {
+      free (req->path);
+      req->path = strndup((const char*)hdr->value, hdr->value_len);
+    }
+
+    if (g_pack_store && req->headers_incoming!=HEADERS_REQUEST) {
+      _pack_add_header(req, hdr);
+    }
 
-    if(!filename_ok){
+    if (g_shm_store || g_pack_store) {
+      if (req->headers_incoming!=HEADERS_REQUEST &&
+                 hdr->name_len == sizeof(content_type_field)-1 &&
+                 strncasecmp((const char*)hdr->name, content_type_field,
+                             hdr->name_len) == 0) {
+        free (req->content_type);
+        req->content_type = strndup((const char*)hdr->value, hdr->value_len);
+      } else if (req->headers_incoming!=HEADERS_REQUEST &&
+                 hdr->name_len == sizeof(content_length_field)-1 &&
+                 strncasecmp((const char*)hdr->name, content_length_field,
+                             hdr->name_len) == 0) {
+        char len_str[24];
+        snprintf(len_str, sizeof(len_str), "%.*s", (int) hdr->value_len,
+                 hdr->value);
+        req->content_length = strtoull(len_str, NULL, 10);
+      }
+    } else if(!filename_ok){
       if(req->headers_incoming==HEADERS_REQUEST)
       {
         if (strncasecmp((const char*)hdr->name, (const char*)":path", 6) == 0)
@@ -261,7 +338,9 @@ static int on_headers_cb (nghq_session *session, uint8_t flags,
           filename = strsep(&filename, "/");
           strcat(filepath, filename);
           //printf("FILEPATH: %s\n", filepath);
-          if (strcmp(filepath, "/root/client/mcast_received/stream.m3u8") == 0){
+          /* a resumed transfer carries on writing its partial file */
+          if (strcmp(filepath, "/root/client/mcast_received/stream.m3u8") == 0 &&
+              !(flags & NGHQ_HEADERS_FLAGS_RESUMED)){
             remove(filepath);
           }
           filename_ok = true;
@@ -301,6 +380,55 @@ static int on_data_recv_cb (nghq_session *session, uint8_t flags,
 
     FILE *fp;
 
+    if (g_shm_store) {
+      /* Reassemble straight into shared memory, no file I/O */
+      if (req->shm_obj < 0 && !req->shm_failed) {
+        req->shm_obj = shm_object_store_begin(g_shm_store, req->path,
+                                              req->content_type,
+                                              req->content_length);
+        if (req->shm_obj < 0) {
+          fprintf(stderr, "No room in object store for %s, dropping it\n",
+                  req->path?req->path:"(unknown)");
+          req->shm_failed = true;
+        }
+      }
+      if (req->shm_obj >= 0 &&
+          shm_object_store_write(g_shm_store, req->shm_obj, data, len,
+                                 off) != 0) {
+        fprintf(stderr, "%s is larger than its object store reservation\n",
+                req->path?req->path:"(unknown)");
+        shm_object_store_end(g_shm_store, req->shm_obj, NGHQ_TOO_MUCH_DATA);
+        req->shm_obj = -1;
+        req->shm_failed = true;
+      }
+      return NGHQ_OK;
+    }
+
+    if (g_pack_store) {
+      /* Collect the body, it goes into a pack once the object is complete */
+      if (req->pack_failed) {
+        return NGHQ_OK;
+      }
+      if (req->pack_obj == NULL) {
+        req->pack_obj = pack_store_begin(g_pack_store, req->path,
+                                         req->content_length);
+        if (req->pack_obj == NULL) {
+          fprintf(stderr, "No memory to collect %s, dropping it\n",
+                  req->path?req->path:"(unknown)");
+          req->pack_failed = true;
+          return NGHQ_OK;
+        }
+      }
+      if (pack_store_write(req->pack_obj, data, len, off) != 0) {
+        fprintf(stderr, "%s is too large to collect for a pack\n",
+                req->path?req->path:"(unknown)");
+        pack_store_end(g_pack_store, req->pack_obj, req->pack_hdrs,
+                       req->pack_hdrs_len, NGHQ_TOO_MUCH_DATA);
+        req->pack_obj = NULL;
+        req->pack_failed = true;
+      }
+      return NGHQ_OK;
+    }
 
     //printf("Received %zu bytes of body data (offset=%zu).\n", len, off);
     //printf("%.*s", &req->headers_incoming);
@@ -336,11 +464,26 @@ static int on_push_cancel_cb (nghq_session *session, void *request_user_data)
     return NGHQ_OK;
 }
 
-static int on_request_close_cb  (nghq_session *session, nghq_error status,
-                                 void *request_user_data)
+static void _finish_request (nghq_session *session, push_request *req,
+                             nghq_error status)
 {
-    push_request *req = (push_request *) request_user_data;
     push_request_list *prev = NULL, *it = push_requests;
+
+    if (g_shm_store && req->shm_obj >= 0) {
+      shm_object_store_end(g_shm_store, req->shm_obj, status);
+      req->shm_obj = -1;
+    }
+    if (g_pack_store && !req->pack_failed) {
+      if (req->pack_obj == NULL && status == NGHQ_OK) {
+        /* no body, but it should still be found */
+        req->pack_obj = pack_store_begin(g_pack_store, req->path, 0);
+      }
+      if (req->pack_obj != NULL) {
+        pack_store_end(g_pack_store, req->pack_obj, req->pack_hdrs,
+                       req->pack_hdrs_len, status);
+        req->pack_obj = NULL;
+      }
+    }
     while (it != NULL) {
       if (it->req == req) {
         if (prev == NULL) {
@@ -369,13 +512,74 @@ static int on_request_close_cb  (nghq_session *session, nghq_error status,
           ev_break (EV_DEFAULT_UC_ EVBREAK_ALL);
         }
 
+        free(it->req->path);
+        free(it->req->content_type);
+        free(it->req->pack_hdrs);
         free(it->req);
         free(it);
+        break;
       } else {
         prev = it;
         it = it->next;
       }
     }
+}
+
+static void repair_data_cb (void *user_data, const uint8_t *data, size_t len,
+                            uint64_t off)
+{
+    push_request *req = (push_request *) user_data;
+    on_data_recv_cb (req->session, 0, data, len, (size_t) off, req);
+}
+
+static void repair_done_cb (void *user_data, int success)
+{
+    push_request *req = (push_request *) user_data;
+    fprintf(stderr, "Repair of %s %s\n", req->path,
+            success?"complete":"failed");
+    req->repairing = false;
+    _finish_request (req->session, req,
+                     success?NGHQ_OK:NGHQ_MISSING_DATA);
+}
+
+static int on_request_close_cb  (nghq_session *session, nghq_error status,
+                                 void *request_user_data)
+{
+    push_request *req = (push_request *) request_user_data;
+
+    if (status == NGHQ_MISSING_DATA) {
+      nghq_byte_range holes[16];
+      ssize_t num_holes = nghq_get_stream_holes(session, request_user_data,
+                                                holes, 16);
+      fprintf(stderr, "%s is incomplete, %zd hole(s) in the body:\n",
+              req->path?req->path:"Object", num_holes);
+      for (ssize_t i = 0; i < num_holes && i < 16; i++) {
+        if (holes[i].end == NGHQ_BYTE_RANGE_END_UNKNOWN) {
+          fprintf(stderr, "  %" PRIu64 "-(end)\n", holes[i].begin);
+        } else {
+          fprintf(stderr, "  %" PRIu64 "-%" PRIu64 "\n", holes[i].begin,
+                  holes[i].end - 1);
+        }
+      }
+      /* Fetch the missing ranges over unicast and finish the object when
+       * they arrive. More than 16 holes means the stream was mostly lost,
+       * so just re-fetch everything from the first hole onwards.
+       */
+      if (g_repair && req->path && num_holes > 0) {
+        if (num_holes > 16) {
+          holes[0].end = NGHQ_BYTE_RANGE_END_UNKNOWN;
+          num_holes = 1;
+        }
+        /* set first, the fetch can fail and finish req before returning */
+        req->repairing = true;
+        if (repair_client_fetch(g_repair, req->path, holes, num_holes,
+                                repair_data_cb, repair_done_cb, req) == 0) {
+          return NGHQ_OK;
+        }
+        req->repairing = false;
+      }
+    }
+    _finish_request (session, req, status);
     //printf("Request finished\n");
     return NGHQ_OK;
 }
@@ -467,7 +671,7 @@ static nghq_transport_settings g_trans_settings = {
     16,                          /* max_open_requests */
     16,                          /* max_open_server_pushes */
     60,                          /* idle_timeout (seconds) */
-    1400,                        /* max_packet_size */
+    DEFAULT_MAX_PACKET_SIZE,     /* max_packet_size */
     0,  /* use default */        /* ack_delay_exponent */
     NULL, 0,                     /* session_id and session_id_len */
     UINT32_C(2)*1024*1024*1024,  /* max_stream_data */
@@ -479,6 +683,9 @@ static nghq_transport_settings g_trans_settings = {
     NGHQ_PKTNUM_LEN_AUTO,        /* packet_number_length */
     0,                           /* encryption_overhead */
     5,                           /* stream_timeout */
+    4096,                        /* max_recv_fragments */
+    1024,                        /* max_pending_frames */
+    4096,                        /* max_frame_gaps */
 };
 
 static void socket_readable_cb (EV_P_ ev_io *w, int revents)
@@ -551,11 +758,133 @@ _name_and_port_to_sockaddr(struct sockaddr *addr, socklen_t addr_len,
     return 0;
 }
 
+static void shm_accept_cb (EV_P_ ev_io *w, int revents)
+{
+    shm_object_store_accept ((shm_object_store*)(w->data));
+}
+
+static void pack_flush_cb (EV_P_ ev_timer *w, int revents)
+{
+    pack_store_flush ((pack_store*)(w->data));
+}
+
 static void sigint_cb (struct ev_loop *loop, ev_signal *w, int revents)
 {
+    g_interrupted = true;
     ev_break (loop, EVBREAK_ALL);
 }
 
+static void save_state (nghq_session *session)
+{
+    uint8_t *buf = NULL;
+    ssize_t len = nghq_session_snapshot (session, &buf);
+    char tmp_file[4096];
+    FILE *fp;
+
+    if (len < 0) {
+        fprintf(stderr, "Couldn't snapshot session: %s\n", nghq_strerror(len));
+        return;
+    }
+
+    /* write then rename, so a crash never leaves half a snapshot */
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", g_state_file);
+    fp = fopen(tmp_file, "wb");
+    if (fp == NULL || fwrite(buf, 1, len, fp) != (size_t) len) {
+        fprintf(stderr, "Couldn't write state file %s: %s\n", tmp_file,
+                strerror(errno));
+        if (fp) fclose(fp);
+        free(buf);
+        return;
+    }
+    fclose(fp);
+    free(buf);
+    if (rename(tmp_file, g_state_file) != 0) {
+        fprintf(stderr, "Couldn't replace state file %s: %s\n", g_state_file,
+                strerror(errno));
+    }
+}
+
+static void restore_state (nghq_session *session)
+{
+    FILE *fp = fopen(g_state_file, "rb");
+    uint8_t *buf;
+    long len;
+    int rv;
+
+    if (fp == NULL) {
+        /* nothing to resume */
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    buf = (uint8_t *) malloc(len > 0 ? len : 1);
+    if (buf == NULL || fread(buf, 1, len, fp) != (size_t) len) {
+        fprintf(stderr, "Couldn't read state file %s\n", g_state_file);
+    } else {
+        rv = nghq_session_restore (session, buf, len);
+        if (rv != NGHQ_OK) {
+            fprintf(stderr, "Couldn't resume from state file %s: %s\n",
+                    g_state_file, nghq_strerror(rv));
+        }
+    }
+    free(buf);
+    fclose(fp);
+}
+
+static void state_timer_cb (EV_P_ ev_timer *w, int revents)
+{
+    save_state ((nghq_session *) w->data);
+}
+
+static void print_latency (nghq_session *session)
+{
+    static const char *names[NGHQ_LATENCY_MAX] = { "packet", "object" };
+    nghq_latency_histogram hist;
+    int kind, i;
+
+    for (kind = 0; kind < NGHQ_LATENCY_MAX; kind++) {
+        if (nghq_session_get_latency (session, kind, &hist) != NGHQ_OK) {
+            continue;
+        }
+        printf("%s latency: %lu samples", names[kind], hist.count);
+        if (hist.count > 0) {
+            printf(", mean %luus, max %luus", hist.total_usecs / hist.count,
+                   hist.max_usecs);
+        }
+        if (hist.clock_behind > 0) {
+            printf(", %lu sent ahead of our clock", hist.clock_behind);
+        }
+        printf("\n");
+        for (i = 0; i < NGHQ_LATENCY_BUCKETS; i++) {
+            if (hist.buckets[i] == 0) continue;
+            if (i == NGHQ_LATENCY_BUCKETS - 1) {
+                printf("  >= %luus: %lu\n", 1UL << (i - 1), hist.buckets[i]);
+            } else {
+                printf("  < %luus: %lu\n", 1UL << i, hist.buckets[i]);
+            }
+        }
+    }
+}
+
+static uint8_t *_load_dictionary(const char *filename, size_t *len)
+{
+    uint8_t *dict = NULL;
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        dict = malloc(st.st_size);
+        if (dict && read(fd, dict, st.st_size) != st.st_size) {
+            free(dict);
+            dict = NULL;
+        }
+        *len = st.st_size;
+    }
+    close(fd);
+    return dict;
+}
+
 int main(int argc, char *argv[])
 {
     session_data this_session;
@@ -563,14 +892,28 @@ int main(int argc, char *argv[])
     struct sockaddr_storage src_addr;
     struct group_source_req gsr;
 
-    static const char short_opts[] = "d::hi:p:r::D:";
+    static const char short_opts[] = "c:d::hi:jk:K:Lm:M:p:P:r::R:S:ux:zZ:D:";
     static const struct option long_opts[] = {
         {"help", 0, NULL, 'h'},
         {"session-id", 1, NULL, 'i'},
         {"port", 1, NULL, 'p'},
+        {"max-packet-size", 1, NULL, 'P'},
         {"reorder-every", 2, NULL, 'r'},
         {"drop-every", 2, NULL, 'd'},
         {"debug", 1, NULL, 'D'},
+        {"shm-socket", 1, NULL, 'm'},
+        {"shm-size", 1, NULL, 'M'},
+        {"pack-dir", 1, NULL, 'k'},
+        {"pack-size", 1, NULL, 'K'},
+        {"repair-origin", 1, NULL, 'R'},
+        {"state-file", 1, NULL, 'S'},
+        {"delta", 1, NULL, 'x'},
+        {"decode", 0, NULL, 'z'},
+        {"dictionary", 1, NULL, 'Z'},
+        {"join-late", 0, NULL, 'j'},
+        {"unordered", 0, NULL, 'u'},
+        {"coalesce", 1, NULL, 'c'},
+        {"latency", 0, NULL, 'L'},
         {NULL, 0, NULL, 0}
     };
 
@@ -585,6 +928,24 @@ int main(int argc, char *argv[])
     const char *default_mcast_grp = NULL;
     const char *default_src_ip = NULL;
     const char *debug_level = DEFAULT_DEBUG_LEVEL;
+    const char *shm_socket = NULL;
+    size_t shm_size_mb = DEFAULT_SHM_SIZE_MB;
+    const char *pack_dir = NULL;
+    size_t pack_size_mb = DEFAULT_PACK_SIZE_MB;
+    const char *repair_origin = NULL;
+    const char *delta_paths[MAX_DELTA_PATHS];
+    int num_delta_paths = 0;
+    int decode = 0;
+    int join_late = 0;
+    int unordered = 0;
+    size_t coalesce_kib = 0;
+    int latency = 0;
+    const char *dict_file = NULL;
+    uint8_t *dict = NULL;
+    size_t dict_len = 0;
+    ev_timer state_timer;
+    ev_io shm_accept;
+    ev_timer pack_timer;
     int opt;
     int option_index = 0;
 
@@ -628,9 +989,34 @@ int main(int argc, char *argv[])
             g_trans_settings.session_id_len = nghq_convert_session_id_string (
                 optarg, 0, &g_trans_settings.session_id);
             break;
+        case 'm':
+            shm_socket = optarg;
+            break;
+        case 'M':
+            shm_size_mb = strtoul(optarg, NULL, 10);
+            if (shm_size_mb == 0) shm_size_mb = DEFAULT_SHM_SIZE_MB;
+            break;
+        case 'k':
+            pack_dir = optarg;
+            break;
+        case 'K':
+            pack_size_mb = strtoul(optarg, NULL, 10);
+            if (pack_size_mb == 0) pack_size_mb = DEFAULT_PACK_SIZE_MB;
+            break;
         case 'p':
             recv_port = atoi(optarg);
             break;
+        case 'P':
+            g_trans_settings.max_packet_size = atoi(optarg);
+            if (g_trans_settings.max_packet_size < MIN_PACKET_SIZE ||
+                g_trans_settings.max_packet_size > NGHQ_MAX_PACKET_SIZE) {
+                fprintf(stderr, "Maximum packet size must be from "
+                        STR(MIN_PACKET_SIZE) " to " STR(NGHQ_MAX_PACKET_SIZE)
+                        " bytes\n");
+                usage = 1;
+                err_out = 1;
+            }
+            break;
         case 'r':
             if (optarg) {
                 this_session.do_fake_reorder = atoi(optarg);
@@ -641,6 +1027,39 @@ int main(int argc, char *argv[])
                 this_session.do_fake_reorder = OPT_ARG_DEFAULT_FAKE_REORDER;
             }
             break;
+        case 'R':
+            repair_origin = optarg;
+            break;
+        case 'S':
+            g_state_file = optarg;
+            break;
+        case 'x':
+            if (num_delta_paths < MAX_DELTA_PATHS) {
+                delta_paths[num_delta_paths++] = optarg;
+            } else {
+                fprintf(stderr, "Too many --delta paths\n");
+                usage = 1;
+                err_out = 1;
+            }
+            break;
+        case 'z':
+            decode = 1;
+            break;
+        case 'j':
+            join_late = 1;
+            break;
+        case 'u':
+            unordered = 1;
+            break;
+        case 'c':
+            coalesce_kib = atoi (optarg);
+            break;
+        case 'L':
+            latency = 1;
+            break;
+        case 'Z':
+            dict_file = optarg;
+            break;
         case 'D':
             debug_level = optarg;
             break;
@@ -659,7 +1078,11 @@ int main(int argc, char *argv[])
 
     if (usage) {
       fprintf(err_out?stderr:stdout,
-"Usage: %s [-h] [-p <port>] [-i <id>] [-d[<n>]] [-r[<n>]]\n"
+"Usage: %s [-h] [-p <port>] [-P <bytes>] [-i <id>] [-d[<n>]] [-r[<n>]]\n"
+"                         [-m <socket> [-M <MiB>]] [-k <dir> [-K <MiB>]]\n"
+"                         [-R <host[:port]>]\n"
+"                         [-S <state-file>] [-z [-Z <dict-file>]] [-x <path>]...\n"
+"                         [-j] [-u] [-c <KiB>] [-L]\n"
 "                         [<mcast-grp> [<src-addr>]]\n",
               argv[0]);
     }
@@ -668,12 +1091,47 @@ int main(int argc, char *argv[])
 "Options:\n"
 "  --help          -h         Display this help text.\n"
 "  --port          -p <port>  UDP port number to receive on [default: " STR(DEFAULT_MCAST_PORT) "].\n"
+"  --max-packet-size -P <bytes>\n"
+"                             Largest UDP payload to accept, larger packets\n"
+"                             are dropped. Must be at least the sender's\n"
+"                             --max-packet-size [default: " STR(DEFAULT_MAX_PACKET_SIZE) "].\n"
 "  --session-id    -i <id>    The session ID to expect [default: " STR(DEFAULT_SESSION_ID) "].\n"
 "  --drop-every    -d [<n>]   Drop every nth packet (n=" STR(OPT_ARG_DEFAULT_DROP_PACKET) " if not given)\n"
 "                             [default: no dropped packets].\n"
 "  --reorder-every -r [<n>]   Reorder every nth packet (n=" STR(OPT_ARG_DEFAULT_FAKE_REORDER) " if not given)\n"
 "                             [default: no reordering].\n"
 "  --debug         -D <level> Specify the debug level, one of ALERT, ERROR, WARN, INFO, DEBUG or TRACE [default: " DEFAULT_DEBUG_LEVEL "].\n"
+"  --shm-socket    -m <path>  Reassemble objects into shared memory instead of\n"
+"                             files, handing it to consumers that connect to\n"
+"                             the Unix socket at <path>.\n"
+"  --shm-size      -M <MiB>   Size of the shared memory data ring [default: " STR(DEFAULT_SHM_SIZE_MB) "].\n"
+"  --pack-dir      -k <dir>   Append completed objects to pack files in <dir>\n"
+"                             instead of writing a file for each one. Use\n"
+"                             pack-lookup to get them out again.\n"
+"  --pack-size     -K <MiB>   Start a new pack file after this much [default: " STR(DEFAULT_PACK_SIZE_MB) "].\n"
+"  --repair-origin -R <host[:port]>\n"
+"                             Fetch body ranges lost on multicast from this\n"
+"                             HTTP origin with Range requests before\n"
+"                             finishing the object. Needs -m or -k, as file\n"
+"                             output only appends.\n"
+"  --state-file    -S <path>  Save partially received objects to <path> while\n"
+"                             running, and resume them from it on start up.\n"
+"                             Not available with -m or -k.\n"
+"  --delta         -x <path>  Reconstruct pushes of <path> sent as deltas against\n"
+"                             the last full version. May be given up to\n"
+"                             " STR(MAX_DELTA_PATHS) " times.\n"
+"  --decode        -z         Decode compressed bodies before saving them.\n"
+"  --dictionary    -Z <file>  The compression dictionary the sender uses.\n"
+"  --join-late     -j         Use the sender's push beacons to pick up pushes\n"
+"                             already in progress when joining part way\n"
+"                             through a session.\n"
+"  --unordered     -u         Carry on delivering bodies past lost DATA frame\n"
+"                             headers. Use with -m or -k, as file output only\n"
+"                             appends.\n"
+"  --coalesce      -c <KiB>   Write body data in chunks of up to <KiB>, held for\n"
+"                             at most " STR(COALESCE_MAX_DELAY) " seconds.\n"
+"  --latency       -L         Report one-way latency on exit, for a sender using\n"
+"                             --timestamps. Needs the clocks to be in sync.\n"
 "\n"
 "Arguments:\n"
 "  <mcast-grp> The multicast group to receive on [default: %s].\n"
@@ -684,6 +1142,23 @@ int main(int argc, char *argv[])
       return err_out;
     }
 
+    if (g_state_file && (shm_socket || pack_dir)) {
+        /* the object store doesn't outlive us, so there's nothing to resume */
+        fprintf(stderr, "--state-file can only be used with file output.\n");
+        return 1;
+    }
+
+    if (shm_socket && pack_dir) {
+        fprintf(stderr, "--shm-socket and --pack-dir can't both be used.\n");
+        return 1;
+    }
+
+    if (repair_origin && !shm_socket && !pack_dir) {
+        /* file output only appends, so repaired ranges can't go back in */
+        fprintf(stderr, "--repair-origin needs --shm-socket or --pack-dir.\n");
+        return 1;
+    }
+
     if (optind < argc) {
         mcast_grp = argv[optind];
     }
@@ -753,6 +1228,38 @@ int main(int argc, char *argv[])
     ev_idle_init (&this_session.recv_idle, recv_idle_cb);
     this_session.recv_idle.data = &this_session;
 
+    if (shm_socket) {
+        g_shm_store = shm_object_store_new (shm_socket,
+                                            shm_size_mb * 1024 * 1024,
+                                            DEFAULT_SHM_SLOTS,
+                                            DEFAULT_SHM_RESERVE);
+        if (g_shm_store == NULL) {
+            return -1;
+        }
+        ev_io_init (&shm_accept, shm_accept_cb,
+                    shm_object_store_listen_fd (g_shm_store), EV_READ);
+        shm_accept.data = g_shm_store;
+        ev_io_start (EV_DEFAULT_UC_ &shm_accept);
+    }
+
+    if (pack_dir) {
+        g_pack_store = pack_store_new (pack_dir, pack_size_mb * 1024 * 1024);
+        if (g_pack_store == NULL) {
+            return -1;
+        }
+        ev_timer_init (&pack_timer, pack_flush_cb, PACK_FLUSH_INTERVAL,
+                       PACK_FLUSH_INTERVAL);
+        pack_timer.data = g_pack_store;
+        ev_timer_start (EV_DEFAULT_UC_ &pack_timer);
+    }
+
+    if (repair_origin) {
+        g_repair = repair_client_new (EV_DEFAULT_UC_ repair_origin);
+        if (g_repair == NULL) {
+            return -1;
+        }
+    }
+
     /* initialise the client */
     this_session.session = nghq_session_client_new (&g_callbacks, &g_settings,
                                        &g_trans_settings, &this_session);
@@ -767,6 +1274,66 @@ int main(int argc, char *argv[])
                                                    strnlen(debug_level, 6)),
                        log_cb);
 
+    if (decode) {
+        int result;
+        if (dict_file) {
+            dict = _load_dictionary(dict_file, &dict_len);
+            if (dict == NULL) {
+                fprintf(stderr, "Failed to read dictionary file '%s'\n",
+                        dict_file);
+                return -1;
+            }
+        }
+        /* any supported encoding turns on decoding of all of them */
+        result = nghq_session_set_content_encoding (this_session.session,
+                                                    NGHQ_CONTENT_ENCODING_GZIP,
+                                                    0, dict, dict_len);
+        free(dict);
+        if (result != NGHQ_OK) {
+            fprintf(stderr, "Can't decode bodies: %s\n", nghq_strerror(result));
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < num_delta_paths; i++) {
+        int result = nghq_session_enable_delta_encoding (this_session.session,
+                                                         delta_paths[i],
+                                                         strlen(delta_paths[i]),
+                                                         1);
+        if (result != NGHQ_OK) {
+            fprintf(stderr, "Can't reconstruct deltas of %s: %s\n",
+                    delta_paths[i], nghq_strerror(result));
+            return -1;
+        }
+    }
+
+    if (join_late) {
+        int result = nghq_session_enable_push_beacons (this_session.session, 0);
+        if (result != NGHQ_OK) {
+            fprintf(stderr, "Can't join late: %s\n", nghq_strerror(result));
+            return -1;
+        }
+    }
+
+    if (unordered) {
+        nghq_session_set_unordered_delivery (this_session.session, 1);
+    }
+
+    if (coalesce_kib > 0) {
+        nghq_session_set_body_coalescing (this_session.session,
+                                          coalesce_kib * 1024,
+                                          COALESCE_MAX_DELAY);
+    }
+
+    if (g_state_file) {
+        nghq_session_enable_snapshots (this_session.session);
+        restore_state (this_session.session);
+        ev_timer_init (&state_timer, state_timer_cb, DEFAULT_STATE_INTERVAL,
+                       DEFAULT_STATE_INTERVAL);
+        state_timer.data = this_session.session;
+        ev_timer_start (EV_DEFAULT_UC_ &state_timer);
+    }
+
     ev_io_start (EV_DEFAULT_UC_ &this_session.socket_readable);
 
     ev_run (EV_DEFAULT_UC_ 0);
@@ -776,6 +1343,27 @@ int main(int argc, char *argv[])
 
 
     /* tidy up */
+    if (g_state_file) {
+        ev_timer_stop (EV_DEFAULT_UC_ &state_timer);
+        if (g_interrupted) {
+            save_state (this_session.session);
+        } else {
+            /* session finished, nothing left to resume */
+            unlink (g_state_file);
+        }
+    }
+    if (latency) {
+        print_latency (this_session.session);
+    }
+    repair_client_free (g_repair);
+    if (g_shm_store) {
+        ev_io_stop (EV_DEFAULT_UC_ &shm_accept);
+        shm_object_store_free (g_shm_store);
+    }
+    if (g_pack_store) {
+        ev_timer_stop (EV_DEFAULT_UC_ &pack_timer);
+        pack_store_free (g_pack_store);
+    }
     nghq_session_free (this_session.session);
     setsockopt(this_session.socket, IPPROTO_IP, MCAST_LEAVE_SOURCE_GROUP, &gsr,
            sizeof(gsr));
@@ -67,6 +67,7 @@
  * Worst case QUIC + STREAM + Stream Type + Push Stream + H3 header = ~80 bytes
  */
 #define MAX_PACKET_LEN        1470
+#define MIN_PACKET_LEN        1200 /* smallest QUIC allows */
 /* MAX_PAYLOAD_LEN - maximum block size used in stream data */
 /*** ngtcp2 bug means that payload must fit in a packet. ***/
 //#define MAX_PAYLOAD_LEN              (MAX_PACKET_LEN-29)
@@ -400,8 +401,10 @@ static void _send_file(const char *filename, size_t filename_skip_chars,
       return;
     }
 
-    ev_idle_start(EV_DEFAULT_UC_ &g_server_session.send_idle);
-    ev_run(EV_DEFAULT_UC_ 0);
+    /* send_ready_cb has started the send watcher */
+    if (nghq_session_want_write(g_server_session.session)) {
+        ev_run(EV_DEFAULT_UC_ 0);
+    }
 
     if (!final) {
       --num_resp_hdrs;
@@ -459,8 +462,9 @@ static void _send_file(const char *filename, size_t filename_skip_chars,
                                               read_buffer + off, res,
                                               sent_bytes == file_size,
                                               (void*)promise_request_user_data);
-                    ev_idle_start(EV_DEFAULT_UC_ &g_server_session.send_idle);
-                    ev_run(EV_DEFAULT_UC_ EVRUN_ONCE);
+                    if (nghq_session_want_write(g_server_session.session)) {
+                        ev_run(EV_DEFAULT_UC_ EVRUN_ONCE);
+                    }
                     //printf("_send_file: result = %i\n", result);
                 } while (result == NGHQ_REQUEST_BLOCKED);
                 if (result == NGHQ_REQUEST_CLOSED) {
@@ -473,8 +477,9 @@ static void _send_file(const char *filename, size_t filename_skip_chars,
         }
     }
     /* flush data out */
-    ev_idle_start(EV_DEFAULT_UC_ &g_server_session.send_idle);
-    ev_run(EV_DEFAULT_UC_ 0);
+    if (nghq_session_want_write(g_server_session.session)) {
+        ev_run(EV_DEFAULT_UC_ 0);
+    }
 }
 
 typedef struct path_list {
@@ -625,6 +630,11 @@ static ssize_t send_cb (nghq_session *session, const uint8_t *data, size_t len,
 
     ev_idle_start(EV_DEFAULT_UC_ &sdata->recv_idle); // need to fake ack
 
+    if (result < 0 && errno == EMSGSIZE) {
+        fprintf(stderr, "A %zu byte packet is too big for the network path, "
+                "use a smaller --max-packet-size\n", len);
+    }
+
     if (result == EWOULDBLOCK) {
         return NGHQ_OK;
     }
@@ -739,6 +749,12 @@ static int reset_timer_cb (nghq_session *session, void *session_user_data, void
   return NGHQ_OK;
 }
 
+static void send_ready_cb (nghq_session *session, void *session_user_data)
+{
+    server_session *sdata = (server_session*)session_user_data;
+    ev_idle_start (EV_DEFAULT_UC_ &sdata->send_idle);
+}
+
 static nghq_callbacks g_callbacks = {
     recv_cb,
     decrypt_cb,
@@ -754,8 +770,9 @@ static nghq_callbacks g_callbacks = {
     on_request_close_cb,
     set_timer_cb,
     cancel_timer_cb,
-    reset_timer_cb
-
+    reset_timer_cb,
+    NULL,
+    send_ready_cb
 };
 
 static nghq_settings g_settings = {
@@ -817,9 +834,12 @@ static void send_idle_cb (EV_P_ ev_idle *w, int revents)
 
     switch (rv) {
     case NGHQ_OK:
-        /* not finished yet, continue sending */
-        ev_idle_start (EV_A_ w);
-        break;
+        if (nghq_session_want_write (sdata->session)) {
+            /* not finished yet, continue sending */
+            ev_idle_start (EV_A_ w);
+            break;
+        }
+        /* everything sent, fall through */
     case NGHQ_NO_MORE_DATA:
         /* nothing left to send */
         ev_break (EV_A_ EVBREAK_ONE);
@@ -952,18 +972,49 @@ static int parse_url(const char *url, const char **authority, const char **path)
     return 1;
 }
 
+static nghq_content_encoding _parse_content_encoding(const char *name)
+{
+    if (strcmp(name, "deflate") == 0) return NGHQ_CONTENT_ENCODING_DEFLATE;
+    if (strcmp(name, "gzip") == 0) return NGHQ_CONTENT_ENCODING_GZIP;
+    if (strcmp(name, "zstd") == 0) return NGHQ_CONTENT_ENCODING_ZSTD;
+    return NGHQ_CONTENT_ENCODING_NONE;
+}
+
+static uint8_t *_load_dictionary(const char *filename, size_t *len)
+{
+    uint8_t *dict = NULL;
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        dict = malloc(st.st_size);
+        if (dict && read(fd, dict, st.st_size) != st.st_size) {
+            free(dict);
+            dict = NULL;
+        }
+        *len = st.st_size;
+    }
+    close(fd);
+    return dict;
+}
+
 int main(int argc, char *argv[])
 {
     static const int on = 1;
 
-    static const char short_opts[] = "hi:p:t:u:sD:";
+    static const char short_opts[] = "hi:p:P:t:u:sz:Z:b:TD:";
     static const struct option long_opts[] = {
         {"help", 0, NULL, 'h'},
         {"session-id", 1, NULL, 'i'},
         {"port", 1, NULL, 'p'},
+        {"max-packet-size", 1, NULL, 'P'},
         {"ttl", 1, NULL, 't'},
         {"url-prefix", 1, NULL, 'u'},
         {"single-data", 0, NULL, 's'},
+        {"content-encoding", 1, NULL, 'z'},
+        {"dictionary", 1, NULL, 'Z'},
+        {"beacon-interval", 1, NULL, 'b'},
+        {"timestamps", 0, NULL, 'T'},
         {"debug", 1, NULL, 'd'},
         {NULL, 0, NULL, 0}
     };
@@ -984,6 +1035,12 @@ int main(int argc, char *argv[])
     const char *default_mcast_grp = NULL;
     const char *default_ifc_ip = NULL;
     const char *debug_level = DEFAULT_DEBUG_LEVEL;
+    nghq_content_encoding content_encoding = NGHQ_CONTENT_ENCODING_NONE;
+    const char *dict_file = NULL;
+    uint8_t *dict = NULL;
+    size_t dict_len = 0;
+    double beacon_interval = 0;
+    int timestamps = 0;
     int opt;
     int option_index = 0;
 
@@ -1018,6 +1075,17 @@ int main(int argc, char *argv[])
         case 'p':
             send_port = atoi (optarg);
             break;
+        case 'P':
+            g_trans_settings.max_packet_size = atoi (optarg);
+            if (g_trans_settings.max_packet_size < MIN_PACKET_LEN ||
+                g_trans_settings.max_packet_size > NGHQ_MAX_PACKET_SIZE) {
+                fprintf(stderr, "Maximum packet size must be from "
+                        STR(MIN_PACKET_LEN) " to " STR(NGHQ_MAX_PACKET_SIZE)
+                        " bytes\n");
+                usage = 1;
+                err_out = 1;
+            }
+            break;
         case 't':
             ttl = atoi (optarg);
             if (ttl<1) ttl = 1;
@@ -1033,6 +1101,28 @@ int main(int argc, char *argv[])
         case 's':
             g_server_session.single_data_frame = 1;
             break;
+        case 'z':
+            content_encoding = _parse_content_encoding(optarg);
+            if (content_encoding == NGHQ_CONTENT_ENCODING_NONE) {
+                fprintf(stderr, "Unknown content encoding '%s'\n", optarg);
+                usage = 1;
+                err_out = 1;
+            }
+            break;
+        case 'Z':
+            dict_file = optarg;
+            break;
+        case 'b':
+            beacon_interval = atof (optarg);
+            if (beacon_interval <= 0) {
+                fprintf(stderr, "Beacon interval must be more than 0 seconds\n");
+                usage = 1;
+                err_out = 1;
+            }
+            break;
+        case 'T':
+            timestamps = 1;
+            break;
         case 'D':
             debug_level = optarg;
             break;
@@ -1049,9 +1139,17 @@ int main(int argc, char *argv[])
         err_out = 1;
     }
 
+    if (content_encoding != NGHQ_CONTENT_ENCODING_NONE &&
+        g_server_session.single_data_frame) {
+        fprintf(stderr, "--content-encoding can't be used with --single-data, "
+                "the compressed size isn't known in advance\n");
+        usage = 1;
+        err_out = 1;
+    }
+
     if (usage) {
       fprintf(err_out?stderr:stdout,
-"Usage: %s [-h] [-s] [-d] [-p <port>] [-i <id>] [-t <ttl>] [-u <url-prefix>] [<mcast-grp> [<ifc-addr>]] <send-directory>\n",
+"Usage: %s [-h] [-s] [-d] [-p <port>] [-P <bytes>] [-i <id>] [-t <ttl>] [-u <url-prefix>] [-z <coding> [-Z <dict-file>]] [-b <secs>] [-T] [<mcast-grp> [<ifc-addr>]] <send-directory>\n",
               argv[0]);
     }
     if (help) {
@@ -1059,10 +1157,22 @@ int main(int argc, char *argv[])
 "Options:\n"
 "  --help          -h          Display this help text.\n"
 "  --port          -p <port>   UDP port number to send to [default: " STR(DEFAULT_MCAST_PORT) "].\n"
+"  --max-packet-size -P <bytes>\n"
+"                              Largest UDP payload to send, up to " STR(NGHQ_MAX_PACKET_SIZE) " for\n"
+"                              jumbo frame networks (e.g. 8952 for a 9000 byte\n"
+"                              MTU over IPv6) [default: " STR(MAX_PACKET_LEN) "].\n"
 "  --session-id    -i <id>     The session ID to send [default: " STR(DEFAULT_SESSION_ID) "].\n"
 "  --ttl           -t <ttl>    The TTL to use for multicast [default: " STR(DEFAULT_MCAST_TTL) "].\n"
 "  --url-prefix    -u <url>    The URL prefix to transmit with the files [default: " DEFAULT_URL_PREFIX "].\n"
 "  --single-data   -s          Package all files in a single HTTP/3 DATA frame.\n"
+"  --content-encoding -z <coding>\n"
+"                              Compress files as they are sent, one of deflate,\n"
+"                              gzip or zstd.\n"
+"  --dictionary    -Z <file>   A compression dictionary, which receivers also need.\n"
+"  --beacon-interval -b <secs> Send a beacon of the pushes in progress this often,\n"
+"                              so receivers can join part way through.\n"
+"  --timestamps    -T          Stamp each push and packet with the time it was\n"
+"                              sent, so receivers can measure latency.\n"
 "  --debug         -D <level>  Specify the debug level, one of ALERT, ERROR, WARN, INFO, DEBUG or TRACE [default: " DEFAULT_DEBUG_LEVEL "].\n"
 "\n"
 "Arguments:\n"
@@ -1137,11 +1247,26 @@ int main(int argc, char *argv[])
                     sizeof(on));
         setsockopt (g_server_session.socket, SOL_IP, IP_MULTICAST_TTL, &ttl,
                     sizeof(ttl));
+#ifdef IP_MTU_DISCOVER
+        {
+            /* Don't fragment, an oversized packet should fail to send */
+            static const int pmtudisc = IP_PMTUDISC_DO;
+            setsockopt (g_server_session.socket, SOL_IP, IP_MTU_DISCOVER,
+                        &pmtudisc, sizeof(pmtudisc));
+        }
+#endif
     } else {
         setsockopt (g_server_session.socket, SOL_IPV6, IPV6_MULTICAST_LOOP, &on,
                     sizeof(on));
         setsockopt (g_server_session.socket, SOL_IPV6, IPV6_MULTICAST_HOPS,
                     &ttl, sizeof(ttl));
+#ifdef IPV6_MTU_DISCOVER
+        {
+            static const int pmtudisc = IPV6_PMTUDISC_DO;
+            setsockopt (g_server_session.socket, SOL_IPV6, IPV6_MTU_DISCOVER,
+                        &pmtudisc, sizeof(pmtudisc));
+        }
+#endif
     }
 
     ev_io_init (&g_server_session.socket_writable, socket_writable_cb,
@@ -1168,6 +1293,39 @@ int main(int argc, char *argv[])
                                                    strnlen(debug_level, 6)),
                        log_cb);
 
+    if (dict_file) {
+        dict = _load_dictionary(dict_file, &dict_len);
+        if (dict == NULL) {
+            fprintf(stderr, "Failed to read dictionary file '%s'\n", dict_file);
+            return -1;
+        }
+    }
+
+    if (content_encoding != NGHQ_CONTENT_ENCODING_NONE) {
+        int result = nghq_session_set_content_encoding (
+                g_server_session.session, content_encoding, 0, dict, dict_len);
+        if (result != NGHQ_OK) {
+            fprintf(stderr, "Can't use that content encoding: %s\n",
+                    nghq_strerror(result));
+            return -1;
+        }
+    }
+    free (dict);
+
+    if (beacon_interval > 0) {
+        int result = nghq_session_enable_push_beacons (
+                g_server_session.session, beacon_interval);
+        if (result != NGHQ_OK) {
+            fprintf(stderr, "Can't send push beacons: %s\n",
+                    nghq_strerror(result));
+            return -1;
+        }
+    }
+
+    if (timestamps) {
+        nghq_session_enable_send_timestamps (g_server_session.session, 1, 1);
+    }
+
     ev_io_start (EV_DEFAULT_UC_ &g_server_session.socket_writable);
 
     do_file_send (authority, path_prefix, send_dir, 1 /* recursive */);
@@ -0,0 +1,189 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Finds objects in the pack files written by multicast-receiver --pack-dir.
+ *
+ * Packs are searched newest first, so the most recent complete copy of a path
+ * that was sent more than once is the one found. An incomplete copy is only
+ * written if there is no complete one, and the exit status says so. The body
+ * is written to stdout straight from the mapped pack file.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pack_store.h"
+
+static void _list_pack(const char *dir, unsigned int num)
+{
+    pack_reader reader;
+
+    if (pack_reader_open(&reader, dir, num) != 0) return;
+    for (size_t i = 0; i < reader.num_entries; i++) {
+        const pack_index_entry *entry = &reader.entries[i];
+        const pack_record *rec = pack_reader_record(&reader, entry);
+        if (rec == NULL) {
+            fprintf(stderr, "pack %u: damaged record at %" PRIu64 "\n", num,
+                    entry->offset);
+            continue;
+        }
+        printf("%u %.*s %" PRIu64 " bytes%s\n", num, (int) rec->path_len,
+               PACK_RECORD_PATH(rec), rec->body_len,
+               (rec->status == 0)?"":" [incomplete]");
+    }
+    pack_reader_close(&reader);
+}
+
+/*
+ * Returns -1 if path isn't in the pack, 0 if a complete copy was written, or
+ * 1 if there is only an incomplete copy, which is written if write_incomplete
+ * is set.
+ */
+static int _lookup(const char *dir, unsigned int num, const char *path,
+                   int show_headers, int write_incomplete)
+{
+    pack_reader reader;
+    const pack_record *rec;
+    int found;
+
+    if (pack_reader_open(&reader, dir, num) != 0) return -1;
+    rec = pack_reader_find(&reader, path);
+    if (rec == NULL) {
+        pack_reader_close(&reader);
+        return -1;
+    }
+
+    if (rec->status != 0) {
+        if (!write_incomplete) {
+            pack_reader_close(&reader);
+            return 1;
+        }
+        fprintf(stderr, "%s is incomplete (status %d), and there is no "
+                "complete copy\n", path, rec->status);
+    }
+    if (show_headers) {
+        fwrite(PACK_RECORD_HEADERS(rec), 1, rec->headers_len, stdout);
+        fputc('\n', stdout);
+    }
+    fwrite(PACK_RECORD_BODY(rec), 1, rec->body_len, stdout);
+    found = (rec->status == 0)?0:1;
+    pack_reader_close(&reader);
+    return found;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char short_opts[] = "hHl";
+    static const struct option long_opts[] = {
+        {"help", 0, NULL, 'h'},
+        {"headers", 0, NULL, 'H'},
+        {"list", 0, NULL, 'l'},
+        {NULL, 0, NULL, 0}
+    };
+    int show_headers = 0;
+    int list = 0;
+    unsigned int *nums = NULL;
+    ssize_t incomplete = -1; /* newest pack with only an incomplete copy */
+    ssize_t num_packs;
+    const char *dir;
+    int opt;
+    int rv = 1;
+
+    while ((opt = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'H':
+            show_headers = 1;
+            break;
+        case 'l':
+            list = 1;
+            break;
+        case 'h':
+        default:
+            fprintf((opt == 'h')?stdout:stderr,
+"Usage: %s [-h] [-H] <pack-dir> <path>\n"
+"       %s -l <pack-dir>\n"
+"\n"
+"Options:\n"
+"  --help    -h  Display this help text.\n"
+"  --headers -H  Write the response headers and a blank line before the body.\n"
+"  --list    -l  List every object in every pack.\n"
+"\n"
+"Arguments:\n"
+"  <pack-dir>    The directory given to multicast-receiver --pack-dir.\n"
+"  <path>        The :path of the object to write to stdout.\n"
+"\n"
+"Exits with 0 when a complete copy is written, 1 if <path> is not found, and\n"
+"3 when only an incomplete copy could be found and was written.\n"
+"\n", argv[0], argv[0]);
+            return (opt == 'h')?0:2;
+        }
+    }
+
+    if (optind + (list?1:2) != argc) {
+        fprintf(stderr, "Usage: %s [-h] [-H] <pack-dir> <path>\n", argv[0]);
+        return 2;
+    }
+    dir = argv[optind];
+
+    num_packs = pack_list(dir, &nums);
+    if (num_packs < 0) {
+        fprintf(stderr, "Unable to read pack directory '%s'\n", dir);
+        return 2;
+    }
+
+    if (list) {
+        for (ssize_t i = 0; i < num_packs; i++) {
+            _list_pack(dir, nums[i]);
+        }
+        rv = 0;
+    } else {
+        for (ssize_t i = num_packs - 1; i >= 0; i--) {
+            int found = _lookup(dir, nums[i], argv[optind + 1], show_headers,
+                                0);
+            if (found == 0) {
+                rv = 0;
+                break;
+            }
+            if (found == 1 && incomplete < 0) {
+                incomplete = i;
+            }
+        }
+        if (rv != 0 && incomplete >= 0) {
+            _lookup(dir, nums[incomplete], argv[optind + 1], show_headers, 1);
+            rv = 3;
+        } else if (rv != 0) {
+            fprintf(stderr, "%s not found\n", argv[optind + 1]);
+        }
+    }
+
+    free(nums);
+    return rv;
+}
+
+// vim:ts=8:sts=4:sw=4:expandtab:
@@ -0,0 +1,581 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pack_store.h"
+
+#define PACK_BUFFER_LEN     (1024 * 1024) /* records gathered per write */
+#define PACK_FLUSH_OBJECTS  256           /* objects added between syncs */
+#define PACK_MAX_OBJECT     (256 * 1024 * 1024) /* largest body collected */
+#define PACK_NAME_MAX       4096
+
+struct pack_object {
+    char    *path;
+    uint8_t *body;
+    size_t   alloc;
+    size_t   len;
+};
+
+struct pack_store {
+    char             *dir;
+    size_t            pack_size;
+    unsigned int      num;            /* the pack being written */
+    int               data_fd;
+    int               idx_fd;
+    uint64_t          data_size;      /* including what's still in buf */
+    uint8_t          *buf;            /* records not yet written */
+    size_t            buf_len;
+    pack_index_entry *entries;        /* every object in this pack */
+    size_t            num_entries;
+    size_t            alloc_entries;
+    size_t            synced_entries; /* entries in the index file */
+};
+
+uint64_t pack_path_hash(const char *path, size_t len)
+{
+    uint64_t h = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t) path[i];
+        h *= UINT64_C(1099511628211);
+    }
+    return h;
+}
+
+static void _pack_file_name(char *name, const char *dir, unsigned int num,
+                            const char *ext)
+{
+    snprintf(name, PACK_NAME_MAX, "%s/pack-%06u.%s", dir, num, ext);
+}
+
+static int _write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    while (len > 0) {
+        ssize_t rv = write(fd, p, len);
+        if (rv < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += rv;
+        len -= rv;
+    }
+    return 0;
+}
+
+static int _cmp_num(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *) a;
+    unsigned int y = *(const unsigned int *) b;
+    return (x > y) - (x < y);
+}
+
+ssize_t pack_list(const char *dir, unsigned int **nums)
+{
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    unsigned int *list = NULL;
+    size_t num = 0, alloc = 0;
+
+    if (d == NULL) return -1;
+    while ((ent = readdir(d)) != NULL) {
+        unsigned int n;
+        int end = 0;
+        if (sscanf(ent->d_name, "pack-%u.idx%n", &n, &end) != 1 ||
+            ent->d_name[end] != '\0' || end == 0) {
+            continue;
+        }
+        if (num == alloc) {
+            unsigned int *bigger;
+            alloc = alloc?alloc*2:16;
+            bigger = (unsigned int *) realloc(list, alloc * sizeof(*list));
+            if (bigger == NULL) {
+                free(list);
+                closedir(d);
+                return -1;
+            }
+            list = bigger;
+        }
+        list[num++] = n;
+    }
+    closedir(d);
+
+    if (num > 0) qsort(list, num, sizeof(*list), _cmp_num);
+    *nums = list;
+    return num;
+}
+
+static int _pack_open(pack_store *store)
+{
+    char name[PACK_NAME_MAX];
+    pack_index_header hdr;
+
+    _pack_file_name(name, store->dir, store->num, "dat");
+    store->data_fd = open(name, O_WRONLY|O_CREAT|O_EXCL|O_APPEND|O_CLOEXEC,
+                          0644);
+    if (store->data_fd < 0) {
+        fprintf(stderr, "Failed to create pack '%s': %s\n", name,
+                strerror(errno));
+        return -1;
+    }
+
+    _pack_file_name(name, store->dir, store->num, "idx");
+    store->idx_fd = open(name, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PACK_INDEX_MAGIC;
+    hdr.version = PACK_VERSION;
+    hdr.entry_size = sizeof(pack_index_entry);
+    if (store->idx_fd < 0 || _write_all(store->idx_fd, &hdr, sizeof(hdr)) != 0) {
+        fprintf(stderr, "Failed to create pack index '%s': %s\n", name,
+                strerror(errno));
+        return -1;
+    }
+
+    store->data_size = 0;
+    store->buf_len = 0;
+    store->num_entries = 0;
+    store->synced_entries = 0;
+    return 0;
+}
+
+static int _cmp_entry(const void *a, const void *b)
+{
+    const pack_index_entry *x = (const pack_index_entry *) a;
+    const pack_index_entry *y = (const pack_index_entry *) b;
+    if (x->path_hash != y->path_hash) {
+        return (x->path_hash > y->path_hash)?1:-1;
+    }
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* Rewrite the index sorted, so it can be searched, and close the pack */
+static int _pack_seal(pack_store *store)
+{
+    char name[PACK_NAME_MAX], tmp_name[PACK_NAME_MAX + 4];
+    pack_index_header hdr;
+    int rv = pack_store_flush(store);
+    int fd;
+
+    close(store->data_fd);
+    close(store->idx_fd);
+    store->data_fd = -1;
+    store->idx_fd = -1;
+    if (rv != 0) return rv;
+
+    qsort(store->entries, store->num_entries, sizeof(pack_index_entry),
+          _cmp_entry);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PACK_INDEX_MAGIC;
+    hdr.version = PACK_VERSION;
+    hdr.entry_size = sizeof(pack_index_entry);
+    hdr.flags = PACK_INDEX_SORTED;
+    hdr.num_entries = store->num_entries;
+    hdr.data_size = store->data_size;
+
+    _pack_file_name(name, store->dir, store->num, "idx");
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+    fd = open(tmp_name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd < 0 ||
+        _write_all(fd, &hdr, sizeof(hdr)) != 0 ||
+        _write_all(fd, store->entries,
+                   store->num_entries * sizeof(pack_index_entry)) != 0 ||
+        fdatasync(fd) != 0) {
+        fprintf(stderr, "Failed to write sorted index '%s': %s\n", tmp_name,
+                strerror(errno));
+        if (fd >= 0) close(fd);
+        unlink(tmp_name);
+        return -1;
+    }
+    close(fd);
+    /* The unsorted index is still good if this fails */
+    return rename(tmp_name, name);
+}
+
+pack_store *pack_store_new(const char *dir, size_t pack_size)
+{
+    pack_store *store;
+    unsigned int *nums = NULL;
+    ssize_t num;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create pack directory '%s': %s\n", dir,
+                strerror(errno));
+        return NULL;
+    }
+    num = pack_list(dir, &nums);
+    if (num < 0) {
+        fprintf(stderr, "Failed to read pack directory '%s': %s\n", dir,
+                strerror(errno));
+        return NULL;
+    }
+
+    store = (pack_store*) calloc(1, sizeof(pack_store));
+    if (store == NULL) {
+        free(nums);
+        return NULL;
+    }
+    store->data_fd = -1;
+    store->idx_fd = -1;
+    store->pack_size = pack_size;
+    /* Never add to a pack left by an earlier run, it may not be sealed */
+    store->num = (num > 0)?nums[num - 1] + 1:1;
+    free(nums);
+    store->dir = strdup(dir);
+    store->buf = (uint8_t*) malloc(PACK_BUFFER_LEN);
+    if (store->dir == NULL || store->buf == NULL || _pack_open(store) != 0) {
+        pack_store_free(store);
+        return NULL;
+    }
+
+    return store;
+}
+
+void pack_store_free(pack_store *store)
+{
+    if (store == NULL) return;
+    if (store->data_fd >= 0 && store->idx_fd >= 0) {
+        if (store->num_entries > 0) {
+            _pack_seal(store);
+        } else {
+            /* Nothing was added, so don't leave an empty pack behind */
+            char name[PACK_NAME_MAX];
+            _pack_file_name(name, store->dir, store->num, "dat");
+            unlink(name);
+            _pack_file_name(name, store->dir, store->num, "idx");
+            unlink(name);
+        }
+    }
+    if (store->data_fd >= 0) close(store->data_fd);
+    if (store->idx_fd >= 0) close(store->idx_fd);
+    free(store->entries);
+    free(store->buf);
+    free(store->dir);
+    free(store);
+}
+
+int pack_store_flush(pack_store *store)
+{
+    pack_index_header hdr;
+    size_t unsynced = store->num_entries - store->synced_entries;
+
+    if (store->buf_len > 0) {
+        if (_write_all(store->data_fd, store->buf, store->buf_len) != 0) {
+            goto flush_fail;
+        }
+        store->buf_len = 0;
+    }
+    if (unsynced == 0) return 0;
+
+    /* Data first, so the index never points at anything not on disk */
+    if (fdatasync(store->data_fd) != 0 ||
+        pwrite(store->idx_fd, store->entries + store->synced_entries,
+               unsynced * sizeof(pack_index_entry),
+               sizeof(pack_index_header) +
+               store->synced_entries * sizeof(pack_index_entry)) !=
+            (ssize_t) (unsynced * sizeof(pack_index_entry)) ||
+        fdatasync(store->idx_fd) != 0) {
+        goto flush_fail;
+    }
+    store->synced_entries = store->num_entries;
+
+    /* Then count them, which is synced along with the next batch */
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PACK_INDEX_MAGIC;
+    hdr.version = PACK_VERSION;
+    hdr.entry_size = sizeof(pack_index_entry);
+    hdr.num_entries = store->num_entries;
+    hdr.data_size = store->data_size;
+    if (pwrite(store->idx_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        goto flush_fail;
+    }
+    return 0;
+
+flush_fail:
+    fprintf(stderr, "Failed to write pack %u: %s\n", store->num,
+            strerror(errno));
+    return -1;
+}
+
+pack_object *pack_store_begin(pack_store *store, const char *path,
+                              size_t size_hint)
+{
+    pack_object *obj = (pack_object*) calloc(1, sizeof(pack_object));
+    if (obj == NULL) return NULL;
+    obj->path = strdup(path?path:"");
+    if (obj->path == NULL) {
+        free(obj);
+        return NULL;
+    }
+    if (size_hint > 0 && size_hint <= PACK_MAX_OBJECT) {
+        obj->body = (uint8_t*) calloc(1, size_hint);
+        if (obj->body != NULL) obj->alloc = size_hint;
+    }
+    return obj;
+}
+
+int pack_store_write(pack_object *obj, const uint8_t *data, size_t len,
+                     size_t off)
+{
+    if (off + len > PACK_MAX_OBJECT) return -1;
+    if (off + len > obj->alloc) {
+        size_t alloc = obj->alloc?obj->alloc*2:4096;
+        uint8_t *bigger;
+        if (alloc < off + len) alloc = off + len;
+        bigger = (uint8_t*) realloc(obj->body, alloc);
+        if (bigger == NULL) return -1;
+        /* Zeroes in any holes left by loss */
+        memset(bigger + obj->alloc, 0, alloc - obj->alloc);
+        obj->body = bigger;
+        obj->alloc = alloc;
+    }
+    memcpy(obj->body + off, data, len);
+    if (off + len > obj->len) obj->len = off + len;
+    return 0;
+}
+
+static void _pack_object_free(pack_object *obj)
+{
+    free(obj->path);
+    free(obj->body);
+    free(obj);
+}
+
+int pack_store_end(pack_store *store, pack_object *obj, const char *headers,
+                   size_t headers_len, int status)
+{
+    pack_record rec;
+    pack_index_entry *entry;
+    static const uint8_t padding[PACK_RECORD_ALIGN(1)];
+    size_t path_len = strlen(obj->path);
+    size_t len = sizeof(rec) + path_len + headers_len + obj->len;
+    size_t total = PACK_RECORD_ALIGN(len);
+    int rv = 0;
+
+    if (store->data_fd < 0) {
+        _pack_object_free(obj);
+        return -1;
+    }
+
+    if (store->num_entries == store->alloc_entries) {
+        size_t alloc = store->alloc_entries?store->alloc_entries*2:1024;
+        pack_index_entry *bigger = (pack_index_entry*) realloc(store->entries,
+                                        alloc * sizeof(pack_index_entry));
+        if (bigger == NULL) {
+            _pack_object_free(obj);
+            return -1;
+        }
+        store->entries = bigger;
+        store->alloc_entries = alloc;
+    }
+
+    rec.magic = PACK_RECORD_MAGIC;
+    rec.path_len = path_len;
+    rec.headers_len = headers_len;
+    rec.status = status;
+    rec.body_len = obj->len;
+
+    /* Small objects are gathered into one write, large ones go straight out */
+    if (store->buf_len + total > PACK_BUFFER_LEN) {
+        if (pack_store_flush(store) != 0) rv = -1;
+    }
+    if (rv == 0 && total > PACK_BUFFER_LEN) {
+        if (_write_all(store->data_fd, &rec, sizeof(rec)) != 0 ||
+            _write_all(store->data_fd, obj->path, path_len) != 0 ||
+            _write_all(store->data_fd, headers, headers_len) != 0 ||
+            _write_all(store->data_fd, obj->body, obj->len) != 0 ||
+            _write_all(store->data_fd, padding, total - len) != 0) {
+            fprintf(stderr, "Failed to write pack %u: %s\n", store->num,
+                    strerror(errno));
+            rv = -1;
+        }
+    } else if (rv == 0) {
+        uint8_t *p = store->buf + store->buf_len;
+        memcpy(p, &rec, sizeof(rec));
+        p += sizeof(rec);
+        memcpy(p, obj->path, path_len);
+        p += path_len;
+        if (headers_len > 0) memcpy(p, headers, headers_len);
+        p += headers_len;
+        if (obj->len > 0) memcpy(p, obj->body, obj->len);
+        p += obj->len;
+        memset(p, 0, total - len);
+        store->buf_len += total;
+    }
+
+    if (rv == 0) {
+        entry = &store->entries[store->num_entries++];
+        memset(entry, 0, sizeof(*entry));
+        entry->path_hash = pack_path_hash(obj->path, path_len);
+        entry->offset = store->data_size;
+        entry->body_len = obj->len;
+        entry->path_len = path_len;
+        entry->headers_len = headers_len;
+        entry->status = status;
+        store->data_size += total;
+    }
+    _pack_object_free(obj);
+    if (rv != 0) return rv;
+
+    if (store->data_size >= store->pack_size) {
+        rv = _pack_seal(store);
+        store->num++;
+        if (_pack_open(store) != 0) rv = -1;
+    } else if (store->num_entries - store->synced_entries >=
+               PACK_FLUSH_OBJECTS) {
+        rv = pack_store_flush(store);
+    }
+    return rv;
+}
+
+static const void *_map_file(const char *name, size_t *len)
+{
+    struct stat st;
+    void *map = NULL;
+    int fd = open(name, O_RDONLY|O_CLOEXEC);
+
+    *len = 0;
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        } else {
+            *len = st.st_size;
+        }
+    }
+    close(fd);
+    return map;
+}
+
+int pack_reader_open(pack_reader *reader, const char *dir, unsigned int num)
+{
+    char name[PACK_NAME_MAX];
+
+    memset(reader, 0, sizeof(pack_reader));
+    _pack_file_name(name, dir, num, "idx");
+    reader->hdr = (const pack_index_header*) _map_file(name,
+                                                       &reader->idx_len);
+    if (reader->hdr == NULL || reader->idx_len < sizeof(pack_index_header) ||
+        reader->hdr->magic != PACK_INDEX_MAGIC ||
+        reader->hdr->version != PACK_VERSION ||
+        reader->hdr->entry_size != sizeof(pack_index_entry)) {
+        fprintf(stderr, "'%s' isn't a pack index\n", name);
+        pack_reader_close(reader);
+        return -1;
+    }
+    reader->entries = (const pack_index_entry*)(reader->hdr + 1);
+    reader->num_entries = (reader->idx_len - sizeof(pack_index_header)) /
+                          sizeof(pack_index_entry);
+    if (reader->hdr->num_entries < reader->num_entries) {
+        reader->num_entries = reader->hdr->num_entries;
+    }
+
+    _pack_file_name(name, dir, num, "dat");
+    reader->data = (const uint8_t*) _map_file(name, &reader->data_len);
+    return 0;
+}
+
+void pack_reader_close(pack_reader *reader)
+{
+    if (reader->hdr) munmap((void*) reader->hdr, reader->idx_len);
+    if (reader->data) munmap((void*) reader->data, reader->data_len);
+    memset(reader, 0, sizeof(pack_reader));
+}
+
+const pack_record *pack_reader_record(const pack_reader *reader,
+                                      const pack_index_entry *entry)
+{
+    const pack_record *rec;
+
+    if (reader->data == NULL || entry->offset > reader->data_len ||
+        reader->data_len - entry->offset < sizeof(pack_record)) {
+        return NULL;
+    }
+    rec = (const pack_record*)(reader->data + entry->offset);
+    if (rec->magic != PACK_RECORD_MAGIC || rec->path_len != entry->path_len ||
+        rec->headers_len != entry->headers_len ||
+        rec->body_len != entry->body_len ||
+        reader->data_len - entry->offset - sizeof(pack_record) <
+            (uint64_t) rec->path_len + rec->headers_len + rec->body_len) {
+        return NULL;
+    }
+    return rec;
+}
+
+const pack_record *pack_reader_find(const pack_reader *reader,
+                                    const char *path)
+{
+    size_t path_len = strlen(path);
+    uint64_t hash = pack_path_hash(path, path_len);
+    const pack_record *found = NULL;
+    size_t i = 0, end = reader->num_entries;
+
+    if (reader->hdr->flags & PACK_INDEX_SORTED) {
+        /* Find the first entry with the hash, then only look at those */
+        size_t lo = 0, hi = reader->num_entries;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (reader->entries[mid].path_hash < hash) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        i = lo;
+    }
+
+    for (; i < end; i++) {
+        const pack_index_entry *entry = &reader->entries[i];
+        const pack_record *rec;
+        if (entry->path_hash != hash) {
+            if (reader->hdr->flags & PACK_INDEX_SORTED) break;
+            continue;
+        }
+        rec = pack_reader_record(reader, entry);
+        if (rec == NULL || rec->path_len != path_len ||
+            memcmp(PACK_RECORD_PATH(rec), path, path_len) != 0) {
+            continue;
+        }
+        /* A complete copy beats any incomplete one, then the newest wins */
+        if (found == NULL ||
+            (rec->status == 0 && found->status != 0) ||
+            ((rec->status == 0) == (found->status == 0) &&
+             (const uint8_t*) rec > (const uint8_t*) found)) {
+            found = rec;
+        }
+    }
+    return found;
+}
+
+// vim:ts=8:sts=4:sw=4:expandtab:
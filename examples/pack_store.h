@@ -0,0 +1,159 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PACK_STORE_H_
+#define _PACK_STORE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/*
+ * Pack file object store
+ *
+ * A receiver appends completed objects to large pack files in a directory,
+ * rather than creating a file for each one. Pack N is a data file,
+ * pack-N.dat, of pack_record entries, and an index file, pack-N.idx, of a
+ * pack_index_header followed by pack_index_entry slots.
+ *
+ * Records and index entries are written in batches, and are only counted in
+ * the index header once both files have been synced, so a reader never sees
+ * an entry for data that isn't on disk. While a pack is being written its
+ * index entries are in the order the objects completed. When the pack
+ * reaches its size limit it is sealed: the index is rewritten sorted by path
+ * hash with PACK_INDEX_SORTED set, and the next pack is started.
+ *
+ * The index may be mapped and searched in place: a binary search on a sealed
+ * pack, or a scan of an open one. Entries with the same hash must have their
+ * paths checked against the record, and a path sent more than once has an
+ * entry for each copy, the newest being the one with the highest offset.
+ */
+
+#define PACK_INDEX_MAGIC    UINT32_C(0x4950474e) /* "NGPI" */
+#define PACK_RECORD_MAGIC   UINT32_C(0x5250474e) /* "NGPR" */
+#define PACK_VERSION        1
+
+#define PACK_INDEX_SORTED   0x1
+
+typedef struct pack_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;    /* sizeof(pack_index_entry) */
+    uint32_t flags;         /* PACK_INDEX_SORTED once sealed */
+    uint64_t num_entries;   /* entries that are synced to disk */
+    uint64_t data_size;     /* length of the data file they cover */
+} pack_index_header;
+
+typedef struct pack_index_entry {
+    uint64_t path_hash;     /* pack_path_hash() of the :path */
+    uint64_t offset;        /* of the pack_record in the data file */
+    uint64_t body_len;
+    uint32_t path_len;
+    uint32_t headers_len;
+    int32_t  status;        /* nghq_error the object was closed with */
+    uint32_t reserved;
+} pack_index_entry;
+
+/* A record in the data file, followed by the path, headers and body, then
+ * padded so the next record is 8 byte aligned */
+typedef struct pack_record {
+    uint32_t magic;
+    uint32_t path_len;
+    uint32_t headers_len;   /* "name: value\n" lines */
+    int32_t  status;
+    uint64_t body_len;
+} pack_record;
+
+#define PACK_RECORD_ALIGN(x) (((x) + 7) & ~((uint64_t)7))
+#define PACK_RECORD_PATH(rec) ((const char*)(rec) + sizeof(pack_record))
+#define PACK_RECORD_HEADERS(rec) (PACK_RECORD_PATH(rec) + (rec)->path_len)
+#define PACK_RECORD_BODY(rec) \
+    ((const uint8_t*)PACK_RECORD_HEADERS(rec) + (rec)->headers_len)
+
+/* FNV-1a, 64 bit */
+extern uint64_t pack_path_hash(const char *path, size_t len);
+
+/*
+ * Writer side (receiver)
+ */
+
+typedef struct pack_store pack_store;
+typedef struct pack_object pack_object;
+
+/* Packs are sealed once their data file reaches pack_size bytes */
+extern pack_store *pack_store_new(const char *dir, size_t pack_size);
+/* Flushes and seals the pack being written */
+extern void pack_store_free(pack_store *store);
+
+/* Returns an object to collect the body in, or NULL if out of memory */
+extern pack_object *pack_store_begin(pack_store *store, const char *path,
+                                     size_t size_hint);
+extern int pack_store_write(pack_object *obj, const uint8_t *data, size_t len,
+                            size_t off);
+/* Adds the object to the pack, and frees it */
+extern int pack_store_end(pack_store *store, pack_object *obj,
+                          const char *headers, size_t headers_len,
+                          int status);
+/* Writes and syncs everything added so far */
+extern int pack_store_flush(pack_store *store);
+
+/*
+ * Reader side
+ */
+
+typedef struct pack_reader {
+    size_t                   idx_len;
+    const pack_index_header *hdr;
+    const pack_index_entry  *entries;
+    size_t                   num_entries;
+    size_t                   data_len;
+    const uint8_t           *data;
+} pack_reader;
+
+/* Finds the pack numbers in dir, ascending. Returns how many, or -1 */
+extern ssize_t pack_list(const char *dir, unsigned int **nums);
+
+extern int pack_reader_open(pack_reader *reader, const char *dir,
+                            unsigned int num);
+extern void pack_reader_close(pack_reader *reader);
+
+/* Returns the record for the newest complete copy of path in the pack, the
+ * newest incomplete one if there is no complete copy, or NULL */
+extern const pack_record *pack_reader_find(const pack_reader *reader,
+                                           const char *path);
+/* Returns the record for an index entry, or NULL if it is damaged */
+extern const pack_record *pack_reader_record(const pack_reader *reader,
+                                             const pack_index_entry *entry);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif /* _PACK_STORE_H_ */
+
+// vim:ts=8:sts=4:sw=4:expandtab:
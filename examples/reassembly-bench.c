@@ -0,0 +1,555 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Benchmark of the cost of a received packet as reassembly state builds up.
+ *
+ * A server session in this process publishes a few large objects, and the
+ * packets it sends are kept. They are then given to a client session in the
+ * worst order for reassembly, every other packet first and then the rest,
+ * so each stream holds as many separate pieces as it can before any of them
+ * join up. The time taken by each packet is measured, and the mean and
+ * largest are reported for each tenth of the run along with how much the
+ * client was holding.
+ *
+ * Run without limits, the cost of a packet grows with what is held. With the
+ * reassembly limits of nghq_transport_settings set, it should stay bounded.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nghq/nghq.h"
+
+#define _STR(a) #a
+#define STR(a) _STR(a)
+#define DEFAULT_OBJECTS       4
+#define DEFAULT_OBJECT_KIB    4096
+#define DEFAULT_DEBUG_LEVEL   "ERROR"
+#define MAX_PACKET_LEN        1470
+#define CHUNK_LEN             16384 /* body data fed at a time */
+#define REPORT_STEPS          10
+
+typedef struct bench_packet {
+    size_t len;
+    uint8_t data[MAX_PACKET_LEN];
+} bench_packet;
+
+static bench_packet *g_packets;
+static size_t g_num_packets;
+static size_t g_alloc_packets;
+static bench_packet *g_next_packet; /* to hand to the client, or NULL */
+static uint64_t g_body_bytes;
+static uint64_t g_objects;
+static int g_dummy_timer;
+
+static uint8_t g_body[CHUNK_LEN];
+
+static char method_hdr[] = ":method";
+static char method_value[] = "GET";
+static char scheme_hdr[] = ":scheme";
+static char scheme_value[] = "https";
+static char host_hdr[] = ":authority";
+static char host_value[] = "localhost";
+static char path_hdr[] = ":path";
+static char path_value[32];
+static char status_hdr[] = ":status";
+static char status_value[] = "200";
+
+static nghq_header method_header = {
+    (uint8_t *) method_hdr, sizeof(method_hdr) - 1,
+    (uint8_t *) method_value, sizeof(method_value) - 1
+};
+static nghq_header scheme_header = {
+    (uint8_t *) scheme_hdr, sizeof(scheme_hdr) - 1,
+    (uint8_t *) scheme_value, sizeof(scheme_value) - 1
+};
+static nghq_header host_header = {
+    (uint8_t *) host_hdr, sizeof(host_hdr) - 1,
+    (uint8_t *) host_value, sizeof(host_value) - 1
+};
+static nghq_header path_header = {
+    (uint8_t *) path_hdr, sizeof(path_hdr) - 1,
+    (uint8_t *) path_value, 0
+};
+static nghq_header status_header = {
+    (uint8_t *) status_hdr, sizeof(status_hdr) - 1,
+    (uint8_t *) status_value, sizeof(status_value) - 1
+};
+
+static const nghq_header *g_request_hdrs[] = {
+    &method_header, &scheme_header, &host_header, &path_header
+};
+static const nghq_header *g_response_hdrs[] = {
+    &status_header
+};
+
+static double _now(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/*
+ * Session callbacks
+ */
+
+static ssize_t server_recv_cb(nghq_session *session, uint8_t *data, size_t len,
+                              void *session_user_data)
+{
+    return 0; // nothing comes back over multicast
+}
+
+/* One packet for each call to nghq_session_recv(), so each can be timed */
+static ssize_t client_recv_cb(nghq_session *session, uint8_t *data, size_t len,
+                              void *session_user_data)
+{
+    bench_packet *pkt = g_next_packet;
+
+    if (pkt == NULL) {
+        return 0;
+    }
+    g_next_packet = NULL;
+    if (pkt->len > len) {
+        return NGHQ_ERROR;
+    }
+    memcpy(data, pkt->data, pkt->len);
+    return pkt->len;
+}
+
+static int decrypt_cb(nghq_session *session, const uint8_t *encrypted,
+                      size_t encrypted_len, const uint8_t *key,
+                      const uint8_t *nonce, size_t noncelen, const uint8_t *ad,
+                      size_t adlen, uint8_t *clear, void *session_user_data)
+{
+    memmove(clear, encrypted, encrypted_len);
+    return 0;
+}
+
+static int encrypt_cb(nghq_session *session, const uint8_t *clear,
+                      size_t clear_len, const uint8_t *nonce,
+                      size_t noncelen, const uint8_t *ad, size_t adlen,
+                      const uint8_t *key, uint8_t *encrypted,
+                      void *session_user_data)
+{
+    memmove(encrypted, clear, clear_len);
+    return 0;
+}
+
+/* Keep every packet the server sends, to be replayed to the client later */
+static ssize_t server_send_cb(nghq_session *session, const uint8_t *data,
+                              size_t len, void *session_user_data)
+{
+    if (len > MAX_PACKET_LEN) {
+        return NGHQ_ERROR;
+    }
+    if (g_num_packets == g_alloc_packets) {
+        size_t alloc = (g_alloc_packets)?(g_alloc_packets * 2):(4096);
+        bench_packet *packets = (bench_packet *) realloc(g_packets,
+                                                alloc * sizeof(bench_packet));
+        if (packets == NULL) {
+            return NGHQ_ERROR;
+        }
+        g_packets = packets;
+        g_alloc_packets = alloc;
+    }
+    memcpy(g_packets[g_num_packets].data, data, len);
+    g_packets[g_num_packets].len = len;
+    g_num_packets++;
+    return len;
+}
+
+static ssize_t client_send_cb(nghq_session *session, const uint8_t *data,
+                              size_t len, void *session_user_data)
+{
+    return len; // receive only, nowhere to send to
+}
+
+static void session_status_cb(nghq_session *session, nghq_error status,
+                              void *session_user_data)
+{
+}
+
+static int recv_control_data_cb(nghq_session *session, const uint8_t *buf,
+                                size_t buflen, void *session_user_data)
+{
+    return NGHQ_OK;
+}
+
+static int on_begin_headers_cb(nghq_session *session, void *session_user_data,
+                               void *request_user_data)
+{
+    return NGHQ_OK;
+}
+
+static int on_begin_promise_cb(nghq_session *session, void *session_user_data,
+                               void *request_user_data,
+                               void *promise_user_data)
+{
+    return NGHQ_OK;
+}
+
+static int on_headers_cb(nghq_session *session, uint8_t flags,
+                         nghq_header *hdr, void *request_user_data)
+{
+    return NGHQ_OK;
+}
+
+static int on_data_recv_cb(nghq_session *session, uint8_t flags,
+                           const uint8_t *data, size_t len, size_t off,
+                           void *request_user_data)
+{
+    g_body_bytes += len;
+    return NGHQ_OK;
+}
+
+static int on_push_cancel_cb(nghq_session *session, void *request_user_data)
+{
+    return NGHQ_OK;
+}
+
+static int on_request_close_cb(nghq_session *session, nghq_error status,
+                               void *request_user_data)
+{
+    g_objects++;
+    return NGHQ_OK;
+}
+
+/* The run is over long before any stream could time out, so timers never
+ * need to fire */
+static void *set_timer_cb(nghq_session *session, double seconds,
+                          void *session_user_data, nghq_timer_event fn,
+                          void *nghq_data)
+{
+    return &g_dummy_timer;
+}
+
+static int cancel_timer_cb(nghq_session *session, void *session_user_data,
+                           void *timer_id)
+{
+    return NGHQ_OK;
+}
+
+static int reset_timer_cb(nghq_session *session, void *session_user_data,
+                          void *timer_id, double seconds)
+{
+    return NGHQ_OK;
+}
+
+static void log_cb(nghq_session *session, nghq_log_level lvl, const char *msg,
+                   size_t len)
+{
+    fprintf(stderr, "[%s] %s", nghq_get_loglevel_str(lvl), msg);
+}
+
+static nghq_callbacks g_server_callbacks = {
+    server_recv_cb,
+    decrypt_cb,
+    encrypt_cb,
+    server_send_cb,
+    session_status_cb,
+    recv_control_data_cb,
+    on_begin_headers_cb,
+    NULL,
+    on_headers_cb,
+    on_data_recv_cb,
+    on_push_cancel_cb,
+    on_request_close_cb,
+    set_timer_cb,
+    cancel_timer_cb,
+    reset_timer_cb
+};
+
+static nghq_callbacks g_client_callbacks = {
+    client_recv_cb,
+    decrypt_cb,
+    encrypt_cb,
+    client_send_cb,
+    session_status_cb,
+    recv_control_data_cb,
+    on_begin_headers_cb,
+    on_begin_promise_cb,
+    on_headers_cb,
+    on_data_recv_cb,
+    on_push_cancel_cb,
+    on_request_close_cb,
+    set_timer_cb,
+    cancel_timer_cb,
+    reset_timer_cb
+};
+
+static nghq_settings g_settings = {
+    NGHQ_SETTINGS_DEFAULT_MAX_HEADER_LIST_SIZE,   /* max_header_list_size */
+    NGHQ_SETTINGS_DEFAULT_NUM_PLACEHOLDERS,       /* number_of_placeholders */
+};
+
+static uint8_t _session_id[] = {
+    0x42, 0x65, 0x6e, 0x63, 0x68 /* "Bench" */
+};
+
+static nghq_transport_settings g_trans_settings = {
+    NGHQ_MODE_MULTICAST,         /* mode */
+    16,                          /* max_open_requests */
+    0x3FFFFFFFFFFFFFFFULL,       /* max_open_server_pushes */
+    60,                          /* idle_timeout (seconds) */
+    MAX_PACKET_LEN,              /* max_packet_size */
+    0,  /* use default */        /* ack_delay_exponent */
+    _session_id, sizeof(_session_id), /* session_id and session_id_len */
+    UINT32_C(2)*1024*1024*1024,  /* max_stream_data */
+    4611686018427387903ULL,      /* max_data - 2^62 max value */
+    NULL,                        /* destination_address */
+    0,                           /* destination_address_len */
+    NULL,                        /* source_address */
+    0,                           /* source_address_len */
+    NGHQ_PKTNUM_LEN_4_BYTE,      /* packet_number_length, for the reordering */
+    0,                           /* encryption_overhead */
+    60,                          /* stream_timeout */
+    0,                           /* max_recv_fragments */
+    0,                           /* max_pending_frames */
+    0,                           /* max_frame_gaps */
+};
+
+/*
+ * Workload
+ */
+
+static int _publish(nghq_session *server, uint64_t n, size_t size)
+{
+    void *user_data = (void *) (uintptr_t) (n + 1);
+    size_t sent = 0;
+    int result;
+
+    path_header.value_len = snprintf(path_value, sizeof(path_value),
+                                     "/bench/%" PRIu64, n);
+    result = nghq_submit_push_promise(server, NULL, g_request_hdrs,
+                                      sizeof(g_request_hdrs) /
+                                      sizeof(g_request_hdrs[0]), user_data);
+    if (result != NGHQ_OK) {
+        fprintf(stderr, "Failed to submit push promise: %s\n",
+                nghq_strerror(result));
+        return -1;
+    }
+    result = nghq_feed_headers(server, g_response_hdrs,
+                               sizeof(g_response_hdrs) /
+                               sizeof(g_response_hdrs[0]), 0, user_data);
+    if (result != NGHQ_OK) {
+        fprintf(stderr, "Failed to feed push headers: %s\n",
+                nghq_strerror(result));
+        return -1;
+    }
+
+    while (sent < size) {
+        size_t len = size - sent;
+        ssize_t fed;
+
+        if (len > CHUNK_LEN) len = CHUNK_LEN;
+        fed = nghq_feed_payload_data(server, g_body, len, sent + len == size,
+                                     user_data);
+        if (fed == NGHQ_REQUEST_BLOCKED) {
+            fed = 0;
+        } else if (fed < 0) {
+            fprintf(stderr, "Failed to feed push body: %s\n",
+                    nghq_strerror(fed));
+            return -1;
+        }
+        sent += fed;
+        while (nghq_session_want_write(server)) {
+            result = nghq_session_send(server);
+            if (result != NGHQ_OK && result != NGHQ_SESSION_BLOCKED) break;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char short_opts[] = "hn:s:f:F:g:D:";
+    static const struct option long_opts[] = {
+        {"help", 0, NULL, 'h'},
+        {"objects", 1, NULL, 'n'},
+        {"object-size", 1, NULL, 's'},
+        {"max-fragments", 1, NULL, 'f'},
+        {"max-frames", 1, NULL, 'F'},
+        {"max-gaps", 1, NULL, 'g'},
+        {"debug", 1, NULL, 'D'},
+        {NULL, 0, NULL, 0}
+    };
+    uint64_t objects = DEFAULT_OBJECTS;
+    size_t object_kib = DEFAULT_OBJECT_KIB;
+    const char *debug_level = DEFAULT_DEBUG_LEVEL;
+    nghq_log_level log_level;
+    nghq_session *server, *client;
+    size_t order_len, step, i;
+    size_t *order;
+    double worst = 0, total = 0;
+    int opt, l;
+
+    while ((opt = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            objects = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            object_kib = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            g_trans_settings.max_recv_fragments = strtoul(optarg, NULL, 10);
+            break;
+        case 'F':
+            g_trans_settings.max_pending_frames = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            g_trans_settings.max_frame_gaps = strtoul(optarg, NULL, 10);
+            break;
+        case 'D':
+            debug_level = optarg;
+            break;
+        case 'h':
+        default:
+            fprintf((opt == 'h')?stdout:stderr,
+"Usage: %s [-h] [-n <n>] [-s <KiB>] [-f <n>] [-F <n>] [-g <n>] [-D <level>]\n"
+"\n"
+"Options:\n"
+"  --help          -h          Display this help text.\n"
+"  --objects       -n <n>      Objects to publish [default: " STR(DEFAULT_OBJECTS) "].\n"
+"  --object-size   -s <KiB>    Size of each object [default: " STR(DEFAULT_OBJECT_KIB) "].\n"
+"  --max-fragments -f <n>      The receiver's max_recv_fragments [default: no limit].\n"
+"  --max-frames    -F <n>      The receiver's max_pending_frames [default: no limit].\n"
+"  --max-gaps      -g <n>      The receiver's max_frame_gaps [default: no limit].\n"
+"  --debug         -D <level>  Specify the debug level, one of ALERT, ERROR, WARN, INFO, DEBUG or TRACE [default: " DEFAULT_DEBUG_LEVEL "].\n"
+"\n", argv[0]);
+            return (opt == 'h')?0:2;
+        }
+    }
+
+    if (objects == 0 || object_kib == 0) {
+        fprintf(stderr, "Bad workload, see --help\n");
+        return 2;
+    }
+
+    for (i = 0; i < CHUNK_LEN; i++) {
+        g_body[i] = (uint8_t) random();
+    }
+    log_level = nghq_get_loglevel_from_str(debug_level,
+                                           strnlen(debug_level, 6));
+
+    server = nghq_session_server_new(&g_server_callbacks, &g_settings,
+                                     &g_trans_settings, NULL);
+    if (server == NULL) {
+        fprintf(stderr, "Failed to get nghq server instance!\n");
+        return 2;
+    }
+    nghq_set_loglevel(server, log_level, log_cb);
+    for (i = 0; i < objects; i++) {
+        if (_publish(server, i, object_kib * 1024) != 0) return 2;
+    }
+    nghq_session_free(server);
+    g_objects = 0;
+    g_body_bytes = 0;
+
+    client = nghq_session_client_new(&g_client_callbacks, &g_settings,
+                                     &g_trans_settings, NULL);
+    if (client == NULL) {
+        fprintf(stderr, "Failed to get nghq client instance!\n");
+        return 2;
+    }
+    nghq_set_loglevel(client, log_level, log_cb);
+
+    /* Every other packet, then the ones in between */
+    order_len = g_num_packets;
+    order = (size_t *) malloc(order_len * sizeof(size_t));
+    if (order == NULL) return 2;
+    for (i = 0; i < order_len; i++) {
+        size_t half = (order_len + 1) / 2;
+        order[i] = (i < half)?(i * 2):((i - half) * 2 + 1);
+    }
+
+    printf("# %zu packets of %" PRIu64 " objects, limits: fragments %zu, "
+           "frames %zu, gaps %zu (0 for none)\n", order_len, objects,
+           g_trans_settings.max_recv_fragments,
+           g_trans_settings.max_pending_frames,
+           g_trans_settings.max_frame_gaps);
+    printf("packets,fragments,frames,mean_ns,max_ns\n");
+
+    step = (order_len + REPORT_STEPS - 1) / REPORT_STEPS;
+    for (i = 0; i < order_len; i += step) {
+        size_t end = (i + step < order_len)?(i + step):(order_len);
+        size_t j, most_fragments = 0, most_frames = 0;
+        double sum = 0, max = 0;
+
+        for (j = i; j < end; j++) {
+            nghq_session_sizes sizes;
+            double start, took;
+
+            g_next_packet = &g_packets[order[j]];
+            start = _now();
+            nghq_session_recv(client);
+            took = _now() - start;
+
+            sum += took;
+            if (took > max) max = took;
+            nghq_session_get_sizes(client, &sizes);
+            if (sizes.recv_fragments > most_fragments) {
+                most_fragments = sizes.recv_fragments;
+            }
+            if (sizes.pending_frames > most_frames) {
+                most_frames = sizes.pending_frames;
+            }
+        }
+
+        printf("%zu,%zu,%zu,%.0f,%.0f\n", end, most_fragments, most_frames,
+               sum * 1e9 / (end - i), max * 1e9);
+        total += sum;
+        if (max > worst) worst = max;
+    }
+
+    printf("# mean %.0f ns, worst %.0f ns per packet, %" PRIu64 " requests "
+           "closed, %" PRIu64 " body bytes\n", total * 1e9 / order_len,
+           worst * 1e9, g_objects, g_body_bytes);
+    printf("# streams cut off:");
+    for (l = 0; l < NGHQ_LIMIT_MAX; l++) {
+        printf(" %" PRIu64, nghq_session_get_limit_hits(client,
+                                                        (nghq_limit) l));
+    }
+    printf(" (fragments, frames, gaps, header list size)\n");
+
+    nghq_session_free(client);
+    free(order);
+    free(g_packets);
+    return 0;
+}
+
+// vim:ts=8:sts=4:sw=4:expandtab:
@@ -0,0 +1,271 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Minimal HTTP/1.1 origin for exercising the multicast receiver's unicast
+ * repair path (--repair-origin). Serves files from a directory, honouring a
+ * single "Range: bytes=first-[last]" request header, one connection at a time.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 8080
+#define MAX_REQUEST_SIZE 8192
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *) buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void send_status(int fd, int status, const char *reason)
+{
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf),
+                       "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n"
+                       "Connection: close\r\n\r\n", status, reason);
+    write_all(fd, buf, len);
+}
+
+static const char *find_header(const char *hdrs, const char *name)
+{
+    size_t name_len = strlen(name);
+    const char *line = strstr(hdrs, "\r\n");
+
+    while (line != NULL && line[2] != '\r') {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            line += name_len + 1;
+            while (*line == ' ' || *line == '\t') line++;
+            return line;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+static void handle_connection(int fd, const char *docroot)
+{
+    char req[MAX_REQUEST_SIZE];
+    size_t req_len = 0;
+    char method[16], path[4096], filename[4096 + 256];
+    const char *range;
+    unsigned long long first = 0, last;
+    int partial = 0;
+    struct stat st;
+    int file_fd;
+    char hdr[512];
+    int hdr_len;
+    off_t pos, end;
+
+    for (;;) {
+        ssize_t n = read(fd, req + req_len, sizeof(req) - 1 - req_len);
+        if (n <= 0) return;
+        req_len += n;
+        req[req_len] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL) break;
+        if (req_len == sizeof(req) - 1) {
+            send_status(fd, 431, "Request Header Fields Too Large");
+            return;
+        }
+    }
+
+    if (sscanf(req, "%15s %4095s HTTP/1.%*d", method, path) != 2) {
+        send_status(fd, 400, "Bad Request");
+        return;
+    }
+    if (strcmp(method, "GET") != 0) {
+        send_status(fd, 405, "Method Not Allowed");
+        return;
+    }
+    path[strcspn(path, "?#")] = '\0';
+    if (path[0] != '/' || strstr(path, "..") != NULL) {
+        send_status(fd, 400, "Bad Request");
+        return;
+    }
+    snprintf(filename, sizeof(filename), "%s%s", docroot, path);
+
+    file_fd = open(filename, O_RDONLY);
+    if (file_fd < 0 || fstat(file_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (file_fd >= 0) close(file_fd);
+        send_status(fd, 404, "Not Found");
+        return;
+    }
+
+    last = (unsigned long long) st.st_size - 1;
+    range = find_header(req, "range");
+    if (range != NULL) {
+        int matched = sscanf(range, "bytes=%llu-%llu", &first, &last);
+        if (matched < 1 || strchr(range, ',') != NULL) {
+            /* unsupported range form, send the whole object */
+            first = 0;
+            last = (unsigned long long) st.st_size - 1;
+        } else if (first >= (unsigned long long) st.st_size) {
+            hdr_len = snprintf(hdr, sizeof(hdr),
+                               "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                               "Content-Range: bytes */%llu\r\n"
+                               "Content-Length: 0\r\nConnection: close\r\n\r\n",
+                               (unsigned long long) st.st_size);
+            write_all(fd, hdr, hdr_len);
+            close(file_fd);
+            return;
+        } else {
+            if (matched < 2 || last >= (unsigned long long) st.st_size) {
+                last = (unsigned long long) st.st_size - 1;
+            }
+            partial = 1;
+        }
+    }
+
+    if (partial) {
+        hdr_len = snprintf(hdr, sizeof(hdr),
+                           "HTTP/1.1 206 Partial Content\r\n"
+                           "Content-Range: bytes %llu-%llu/%llu\r\n"
+                           "Content-Length: %llu\r\nConnection: close\r\n\r\n",
+                           first, last, (unsigned long long) st.st_size,
+                           last - first + 1);
+    } else {
+        hdr_len = snprintf(hdr, sizeof(hdr),
+                           "HTTP/1.1 200 OK\r\nContent-Length: %llu\r\n"
+                           "Connection: close\r\n\r\n",
+                           (unsigned long long) st.st_size);
+    }
+    printf("%s %s -> %d (%llu-%llu)\n", method, path, partial?206:200,
+           first, (st.st_size > 0)?last:0);
+    if (write_all(fd, hdr, hdr_len) != 0) {
+        close(file_fd);
+        return;
+    }
+
+    pos = (off_t) first;
+    end = (st.st_size > 0)?(off_t) last + 1:0;
+    while (pos < end) {
+        char buf[65536];
+        size_t want = sizeof(buf);
+        ssize_t n;
+        if ((off_t) want > end - pos) want = (size_t) (end - pos);
+        n = pread(file_fd, buf, want, pos);
+        if (n <= 0 || write_all(fd, buf, n) != 0) break;
+        pos += n;
+    }
+    close(file_fd);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char short_opts[] = "d:hp:";
+    static const struct option long_opts[] = {
+        {"docroot", 1, NULL, 'd'},
+        {"help", 0, NULL, 'h'},
+        {"port", 1, NULL, 'p'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *docroot = ".";
+    int port = DEFAULT_PORT;
+    struct sockaddr_in6 addr;
+    int listen_fd, on = 1;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            docroot = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            fprintf((opt == 'h')?stdout:stderr,
+"Usage: %s [-h] [-d <dir>] [-p <port>]\n"
+"\n"
+"Options:\n"
+"  --help    -h         Display this help text.\n"
+"  --docroot -d <dir>   Directory to serve objects from [default: .].\n"
+"  --port    -p <port>  TCP port to listen on [default: 8080].\n"
+"\n", argv[0]);
+            return (opt == 'h')?0:1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return 2;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 16) != 0) {
+        perror("bind");
+        close(listen_fd);
+        return 2;
+    }
+
+    printf("Serving %s on port %d\n", docroot, port);
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        handle_connection(fd, docroot);
+        close(fd);
+    }
+
+    close(listen_fd);
+    return 0;
+}
+
+// vim:ts=8:sts=4:sw=4:expandtab:
@@ -0,0 +1,467 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "repair_client.h"
+
+#define REPAIR_TIMEOUT          10.0 /* seconds without progress */
+#define MAX_RESPONSE_HEADER     8192
+
+typedef enum {
+    JOB_CONNECTING,
+    JOB_SENDING,
+    JOB_HEADERS,
+    JOB_BODY
+} repair_job_state;
+
+typedef struct repair_job {
+    ev_io               io;
+    ev_timer            timeout;
+    repair_client      *client;
+    char               *path;
+    nghq_byte_range    *ranges;
+    size_t              num_ranges;
+    size_t              cur;
+    int                 all_ok;
+    int                 fd;
+    repair_job_state    state;
+    char                request[1024];
+    size_t              request_len;
+    size_t              request_sent;
+    char                hdr_buf[MAX_RESPONSE_HEADER];
+    size_t              hdr_len;
+    uint64_t            body_pos;   /* object offset of the next response byte */
+    uint64_t            body_end;   /* object offset after the response body */
+    uint64_t            filled;     /* bytes delivered for the current range */
+    repair_data_fn      data_fn;
+    repair_done_fn      done_fn;
+    void               *user_data;
+    struct repair_job  *next;
+} repair_job;
+
+struct repair_client {
+    struct ev_loop     *loop;
+    char               *host;       /* for the Host header */
+    struct addrinfo    *addr;
+    repair_job         *jobs;
+};
+
+static void _start_range(repair_job *job);
+
+static void _job_stop_io(repair_job *job)
+{
+    ev_io_stop(job->client->loop, &job->io);
+    ev_timer_stop(job->client->loop, &job->timeout);
+    if (job->fd >= 0) {
+        close(job->fd);
+        job->fd = -1;
+    }
+}
+
+static void _job_free(repair_job *job)
+{
+    _job_stop_io(job);
+    free(job->path);
+    free(job->ranges);
+    free(job);
+}
+
+static void _job_finish(repair_job *job)
+{
+    repair_client *client = job->client;
+    repair_job **pj;
+
+    for (pj = &client->jobs; *pj; pj = &(*pj)->next) {
+        if (*pj == job) {
+            *pj = job->next;
+            break;
+        }
+    }
+
+    /* unlinked first, so the callback may start another repair */
+    job->done_fn(job->user_data, job->all_ok);
+    _job_free(job);
+}
+
+static void _range_done(repair_job *job, int ok)
+{
+    const nghq_byte_range *range = &job->ranges[job->cur];
+
+    _job_stop_io(job);
+
+    if (ok && range->end != NGHQ_BYTE_RANGE_END_UNKNOWN &&
+        job->filled < range->end - range->begin) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Repair of %s bytes %llu-%llu failed\n", job->path,
+                (unsigned long long) range->begin,
+                (unsigned long long) range->end);
+        job->all_ok = 0;
+    }
+
+    job->cur++;
+    _start_range(job);
+}
+
+static const char *_find_header(const char *hdrs, const char *name)
+{
+    size_t name_len = strlen(name);
+    const char *line = strstr(hdrs, "\r\n");
+
+    while (line != NULL && line[2] != '\r') {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            line += name_len + 1;
+            while (*line == ' ' || *line == '\t') line++;
+            return line;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+/* Returns 0 if the response can be used to fill the current range */
+static int _parse_response(repair_job *job)
+{
+    const nghq_byte_range *range = &job->ranges[job->cur];
+    const char *value;
+    int status = 0;
+
+    if (sscanf(job->hdr_buf, "HTTP/1.%*d %d", &status) != 1) {
+        return -1;
+    }
+
+    if (status == 206) {
+        unsigned long long first, last;
+        value = _find_header(job->hdr_buf, "content-range");
+        if (value == NULL ||
+            sscanf(value, "bytes %llu-%llu", &first, &last) != 2 ||
+            first > range->begin) {
+            return -1;
+        }
+        job->body_pos = first;
+        job->body_end = last + 1;
+    } else if (status == 200) {
+        /* Origin ignored the Range, pick our bytes out of the full body */
+        job->body_pos = 0;
+        job->body_end = NGHQ_BYTE_RANGE_END_UNKNOWN;
+        value = _find_header(job->hdr_buf, "content-length");
+        if (value != NULL) {
+            job->body_end = strtoull(value, NULL, 10);
+        }
+    } else {
+        fprintf(stderr, "Repair origin returned status %d for %s\n", status,
+                job->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns non-zero once the current range needs nothing more */
+static int _body_data(repair_job *job, const uint8_t *data, size_t len)
+{
+    const nghq_byte_range *range = &job->ranges[job->cur];
+    uint64_t begin = job->body_pos;
+    uint64_t end = job->body_pos + len;
+
+    if (end > job->body_end) end = job->body_end;
+    if (begin < range->begin) begin = range->begin;
+    if (end > range->end) end = range->end;
+
+    if (begin < end) {
+        job->data_fn(job->user_data, data + (begin - job->body_pos),
+                     (size_t) (end - begin), begin);
+        job->filled += end - begin;
+    }
+
+    job->body_pos += len;
+    return (job->body_pos >= job->body_end) || (job->body_pos >= range->end);
+}
+
+static void _job_io_cb(EV_P_ ev_io *w, int revents)
+{
+    repair_job *job = (repair_job *) w->data;
+    uint8_t buf[16384];
+    ssize_t n;
+
+    ev_timer_again(EV_A_ &job->timeout);
+
+    if (job->state == JOB_CONNECTING) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(job->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err != 0) {
+            fprintf(stderr, "Couldn't connect to repair origin: %s\n",
+                    strerror(err));
+            _range_done(job, 0);
+            return;
+        }
+        job->state = JOB_SENDING;
+    }
+
+    if (job->state == JOB_SENDING) {
+        n = send(job->fd, job->request + job->request_sent,
+                 job->request_len - job->request_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) _range_done(job, 0);
+            return;
+        }
+        job->request_sent += n;
+        if (job->request_sent == job->request_len) {
+            job->state = JOB_HEADERS;
+            ev_io_stop(EV_A_ &job->io);
+            ev_io_set(&job->io, job->fd, EV_READ);
+            ev_io_start(EV_A_ &job->io);
+        }
+        return;
+    }
+
+    n = recv(job->fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) _range_done(job, 0);
+        return;
+    }
+    if (n == 0) {
+        /* Connection: close, so EOF ends the body */
+        _range_done(job, job->state == JOB_BODY);
+        return;
+    }
+
+    if (job->state == JOB_HEADERS) {
+        char *end;
+        size_t take = (size_t) n;
+        if (take > sizeof(job->hdr_buf) - 1 - job->hdr_len) {
+            take = sizeof(job->hdr_buf) - 1 - job->hdr_len;
+        }
+        memcpy(job->hdr_buf + job->hdr_len, buf, take);
+        job->hdr_len += take;
+        job->hdr_buf[job->hdr_len] = '\0';
+
+        end = strstr(job->hdr_buf, "\r\n\r\n");
+        if (end == NULL) {
+            if (job->hdr_len == sizeof(job->hdr_buf) - 1) _range_done(job, 0);
+            return;
+        }
+        if (_parse_response(job) != 0) {
+            _range_done(job, 0);
+            return;
+        }
+        job->state = JOB_BODY;
+
+        /* Any bytes after the headers are the start of the body */
+        {
+            size_t hdr_bytes = (size_t) (end + 4 - job->hdr_buf);
+            size_t prev_len = job->hdr_len - take;
+            size_t body_off = hdr_bytes - prev_len;
+            if (body_off < (size_t) n &&
+                _body_data(job, buf + body_off, (size_t) n - body_off)) {
+                _range_done(job, 1);
+            } else if (job->body_pos >= job->body_end) {
+                _range_done(job, 1);
+            }
+        }
+        return;
+    }
+
+    if (_body_data(job, buf, (size_t) n)) {
+        _range_done(job, 1);
+    }
+}
+
+static void _job_timeout_cb(EV_P_ ev_timer *w, int revents)
+{
+    repair_job *job = (repair_job *) w->data;
+    fprintf(stderr, "Repair of %s timed out\n", job->path);
+    _range_done(job, 0);
+}
+
+static void _start_range(repair_job *job)
+{
+    repair_client *client = job->client;
+    const nghq_byte_range *range;
+    int rv;
+
+    if (job->cur >= job->num_ranges) {
+        _job_finish(job);
+        return;
+    }
+    range = &job->ranges[job->cur];
+
+    if (range->end == NGHQ_BYTE_RANGE_END_UNKNOWN) {
+        rv = snprintf(job->request, sizeof(job->request),
+                      "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%llu-\r\n"
+                      "Connection: close\r\n\r\n", job->path, client->host,
+                      (unsigned long long) range->begin);
+    } else {
+        rv = snprintf(job->request, sizeof(job->request),
+                      "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%llu-%llu\r\n"
+                      "Connection: close\r\n\r\n", job->path, client->host,
+                      (unsigned long long) range->begin,
+                      (unsigned long long) range->end - 1);
+    }
+    if (rv < 0 || (size_t) rv >= sizeof(job->request)) {
+        _range_done(job, 0);
+        return;
+    }
+    job->request_len = rv;
+    job->request_sent = 0;
+    job->hdr_len = 0;
+    job->filled = 0;
+
+    job->fd = socket(client->addr->ai_family, client->addr->ai_socktype,
+                     client->addr->ai_protocol);
+    if (job->fd < 0) {
+        _range_done(job, 0);
+        return;
+    }
+    fcntl(job->fd, F_SETFL, fcntl(job->fd, F_GETFL) | O_NONBLOCK);
+    if (connect(job->fd, client->addr->ai_addr, client->addr->ai_addrlen) < 0
+        && errno != EINPROGRESS) {
+        fprintf(stderr, "Couldn't connect to repair origin: %s\n",
+                strerror(errno));
+        _range_done(job, 0);
+        return;
+    }
+
+    job->state = JOB_CONNECTING;
+    ev_io_init(&job->io, _job_io_cb, job->fd, EV_WRITE);
+    job->io.data = job;
+    ev_io_start(client->loop, &job->io);
+    ev_timer_init(&job->timeout, _job_timeout_cb, 0., REPAIR_TIMEOUT);
+    job->timeout.data = job;
+    ev_timer_again(client->loop, &job->timeout);
+}
+
+repair_client *repair_client_new(struct ev_loop *loop, const char *origin)
+{
+    struct addrinfo hints;
+    repair_client *client;
+    const char *port = "80";
+    char *host, *colon;
+    int rv;
+
+    if (strncmp(origin, "http://", 7) == 0) origin += 7;
+
+    client = (repair_client *) calloc(1, sizeof(repair_client));
+    if (client == NULL) return NULL;
+    client->loop = loop;
+    client->host = strdup(origin);
+    host = strdup(origin);
+    if (client->host == NULL || host == NULL) {
+        free(host);
+        repair_client_free(client);
+        return NULL;
+    }
+    /* strip any trailing path, and split off the port */
+    host[strcspn(host, "/")] = '\0';
+    client->host[strcspn(client->host, "/")] = '\0';
+    colon = strrchr(host, ':');
+    if (colon != NULL && strchr(host, ']') < colon) {
+        *colon = '\0';
+        port = colon + 1;
+    }
+    if (host[0] == '[') {
+        memmove(host, host + 1, strlen(host));
+        host[strcspn(host, "]")] = '\0';
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    rv = getaddrinfo(host, port, &hints, &client->addr);
+    free(host);
+    if (rv != 0) {
+        fprintf(stderr, "Couldn't resolve repair origin %s: %s\n", origin,
+                gai_strerror(rv));
+        client->addr = NULL;
+        repair_client_free(client);
+        return NULL;
+    }
+
+    return client;
+}
+
+void repair_client_free(repair_client *client)
+{
+    if (client == NULL) return;
+    while (client->jobs) {
+        repair_job *job = client->jobs;
+        client->jobs = job->next;
+        _job_free(job);
+    }
+    if (client->addr) freeaddrinfo(client->addr);
+    free(client->host);
+    free(client);
+}
+
+int repair_client_fetch(repair_client *client, const char *path,
+                        const nghq_byte_range *ranges, size_t num_ranges,
+                        repair_data_fn data_fn, repair_done_fn done_fn,
+                        void *user_data)
+{
+    repair_job *job;
+
+    if (client == NULL || path == NULL || num_ranges == 0) return -1;
+
+    job = (repair_job *) calloc(1, sizeof(repair_job));
+    if (job == NULL) return -1;
+    job->path = strdup(path);
+    job->ranges = (nghq_byte_range *) malloc(num_ranges *
+                                             sizeof(nghq_byte_range));
+    if (job->path == NULL || job->ranges == NULL) {
+        free(job->path);
+        free(job->ranges);
+        free(job);
+        return -1;
+    }
+    memcpy(job->ranges, ranges, num_ranges * sizeof(nghq_byte_range));
+    job->num_ranges = num_ranges;
+    job->client = client;
+    job->all_ok = 1;
+    job->fd = -1;
+    job->data_fn = data_fn;
+    job->done_fn = done_fn;
+    job->user_data = user_data;
+
+    job->next = client->jobs;
+    client->jobs = job;
+
+    _start_range(job);
+    return 0;
+}
+
+// vim:ts=8:sts=4:sw=4:expandtab:
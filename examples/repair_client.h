@@ -0,0 +1,76 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _REPAIR_CLIENT_H_
+#define _REPAIR_CLIENT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <ev.h>
+
+#include "nghq/nghq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/*
+ * Unicast repair client
+ *
+ * Fetches byte ranges of an object that were lost on the multicast session
+ * from a unicast HTTP/1.1 origin, using one Range request per hole. Received
+ * bytes are handed back with their offset within the object body so that they
+ * can be fed into the same path as multicast body data.
+ */
+
+typedef struct repair_client repair_client;
+
+/* Called with each block of repaired body data, at body offset @off */
+typedef void (*repair_data_fn)(void *user_data, const uint8_t *data,
+                               size_t len, uint64_t off);
+
+/* Called once all ranges have been tried, @success is non-zero if all of
+ * them were filled. Not called if the client is freed first. */
+typedef void (*repair_done_fn)(void *user_data, int success);
+
+/* @origin is "host" or "host:port", optionally prefixed with "http://" */
+extern repair_client *repair_client_new(struct ev_loop *loop,
+                                        const char *origin);
+extern void repair_client_free(repair_client *client);
+
+/* Returns 0 if the repair was started. The ranges are copied. */
+extern int repair_client_fetch(repair_client *client, const char *path,
+                               const nghq_byte_range *ranges,
+                               size_t num_ranges, repair_data_fn data_fn,
+                               repair_done_fn done_fn, void *user_data);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif /* _REPAIR_CLIENT_H_ */
+
+// vim:ts=8:sts=4:sw=4:expandtab:
@@ -0,0 +1,169 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Example consumer for the multicast-receiver --shm-socket output mode.
+ *
+ * Maps the receiver's object store read-only and reports each object as it is
+ * completed. Object bodies are read in place, nothing is copied out of the
+ * shared memory region.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shm_object_store.h"
+
+#define DEFAULT_SOCKET_PATH "/tmp/nghq-objects.sock"
+
+/* FNV-1a, just to show the consumer touching the body in place */
+static uint32_t _body_hash(const uint8_t *data, uint64_t len)
+{
+    uint32_t h = 2166136261u;
+    for (uint64_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void _report_object(const shm_store_reader *reader,
+                           const shm_object_desc *desc, int write_body)
+{
+    uint64_t seq = __atomic_load_n(&desc->seq, __ATOMIC_ACQUIRE);
+    uint32_t state = __atomic_load_n(&desc->state, __ATOMIC_ACQUIRE);
+    const uint8_t *body = SHM_STORE_DATA(reader->hdr) + desc->data_offset;
+    uint64_t len = desc->length;
+    uint32_t hash = 0;
+
+    if (state == SHM_OBJECT_COMPLETE) {
+        if (write_body) {
+            fwrite(body, 1, len, stdout);
+        } else {
+            hash = _body_hash(body, len);
+        }
+    }
+
+    /* The slot may have been recycled while we were reading it */
+    if (__atomic_load_n(&desc->seq, __ATOMIC_ACQUIRE) != seq) {
+        fprintf(stderr, "%s: overwritten while being read\n", desc->path);
+        return;
+    }
+
+    if (!write_body) {
+        printf("%s %s %" PRIu64 " bytes%s (status %d, fnv1a %08x)\n",
+               desc->path, desc->content_type, len,
+               (state == SHM_OBJECT_COMPLETE)?"":" [incomplete]",
+               desc->status, hash);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const char short_opts[] = "hs:w";
+    static const struct option long_opts[] = {
+        {"help", 0, NULL, 'h'},
+        {"socket", 1, NULL, 's'},
+        {"write-bodies", 0, NULL, 'w'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *socket_path = DEFAULT_SOCKET_PATH;
+    int write_body = 0;
+    int opt;
+    shm_store_reader reader;
+    uint64_t last_seen;
+
+    while ((opt = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'w':
+            write_body = 1;
+            break;
+        case 'h':
+        default:
+            fprintf((opt == 'h')?stdout:stderr,
+"Usage: %s [-h] [-w] [-s <socket>]\n"
+"\n"
+"Options:\n"
+"  --help         -h           Display this help text.\n"
+"  --socket       -s <socket>  The receiver's object store socket [default: " DEFAULT_SOCKET_PATH "].\n"
+"  --write-bodies -w           Write completed object bodies to stdout.\n"
+"\n", argv[0]);
+            return (opt == 'h')?0:1;
+        }
+    }
+
+    if (shm_store_reader_attach(&reader, socket_path) != 0) {
+        fprintf(stderr, "Unable to attach to object store at '%s'\n",
+                socket_path);
+        return 2;
+    }
+
+    last_seen = __atomic_load_n(&reader.hdr->last_seq, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        struct pollfd pfd[2] = {
+            { reader.event_fd, POLLIN, 0 },
+            { reader.conn_fd, POLLIN, 0 }
+        };
+        uint64_t count, newest = last_seen;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfd[1].revents & (POLLIN|POLLHUP)) {
+            /* receiver has gone away */
+            break;
+        }
+        if (read(reader.event_fd, &count, sizeof(count)) != sizeof(count)) {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < reader.hdr->num_slots; i++) {
+            const shm_object_desc *desc = &SHM_STORE_DESCS(reader.hdr)[i];
+            uint64_t done = __atomic_load_n(&desc->done_seq, __ATOMIC_ACQUIRE);
+            if (done > last_seen) {
+                _report_object(&reader, desc, write_body);
+                if (done > newest) newest = done;
+            }
+        }
+        last_seen = newest;
+    }
+
+    shm_store_reader_detach(&reader);
+    return 0;
+}
+
+// vim:ts=8:sts=4:sw=4:expandtab:
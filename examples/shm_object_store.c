@@ -0,0 +1,430 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "shm_object_store.h"
+
+#define SHM_STORE_ALIGN(x) (((x) + 63) & ~((uint64_t)63))
+
+typedef struct shm_consumer {
+    int conn_fd;
+    int event_fd;
+} shm_consumer;
+
+struct shm_object_store {
+    int               shm_fd;
+    int               listen_fd;
+    char             *socket_path;
+    size_t            map_len;
+    shm_store_header *hdr;
+    shm_object_desc  *descs;
+    uint8_t          *data;
+    uint64_t          head;
+    uint64_t          next_seq;
+    size_t            default_reserve;
+    shm_consumer     *consumers;
+    size_t            num_consumers;
+};
+
+shm_object_store *shm_object_store_new(const char *socket_path,
+                                       size_t data_size,
+                                       unsigned int num_slots,
+                                       size_t default_reserve)
+{
+    struct sockaddr_un addr;
+    shm_object_store *store;
+    size_t data_start;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "shm store socket path '%s' is too long\n",
+                socket_path);
+        return NULL;
+    }
+
+    store = (shm_object_store*) calloc(1, sizeof(shm_object_store));
+    if (store == NULL) return NULL;
+    store->shm_fd = -1;
+    store->listen_fd = -1;
+
+    data_start = SHM_STORE_ALIGN(sizeof(shm_store_header) +
+                                 num_slots * sizeof(shm_object_desc));
+    store->map_len = data_start + data_size;
+    store->default_reserve = default_reserve;
+    store->next_seq = 1;
+
+    store->shm_fd = memfd_create("nghq-objects", MFD_CLOEXEC);
+    if (store->shm_fd < 0 || ftruncate(store->shm_fd, store->map_len) != 0) {
+        fprintf(stderr, "Failed to create shared memory object store: %s\n",
+                strerror(errno));
+        goto store_fail;
+    }
+
+    store->hdr = (shm_store_header*) mmap(NULL, store->map_len,
+                                          PROT_READ|PROT_WRITE, MAP_SHARED,
+                                          store->shm_fd, 0);
+    if (store->hdr == MAP_FAILED) {
+        store->hdr = NULL;
+        fprintf(stderr, "Failed to map shared memory object store: %s\n",
+                strerror(errno));
+        goto store_fail;
+    }
+
+    store->hdr->magic = SHM_STORE_MAGIC;
+    store->hdr->version = SHM_STORE_VERSION;
+    store->hdr->num_slots = num_slots;
+    store->hdr->desc_size = sizeof(shm_object_desc);
+    store->hdr->data_start = data_start;
+    store->hdr->data_size = data_size;
+    store->hdr->last_seq = 0;
+    store->descs = SHM_STORE_DESCS(store->hdr);
+    store->data = SHM_STORE_DATA(store->hdr);
+
+    store->listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+                              0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    if (store->listen_fd < 0 ||
+        bind(store->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(store->listen_fd, 8) != 0) {
+        fprintf(stderr, "Failed to listen on '%s': %s\n", socket_path,
+                strerror(errno));
+        goto store_fail;
+    }
+    store->socket_path = strdup(socket_path);
+
+    return store;
+
+store_fail:
+    shm_object_store_free(store);
+    return NULL;
+}
+
+void shm_object_store_free(shm_object_store *store)
+{
+    if (store == NULL) return;
+    for (size_t i = 0; i < store->num_consumers; i++) {
+        close(store->consumers[i].event_fd);
+        close(store->consumers[i].conn_fd);
+    }
+    free(store->consumers);
+    if (store->listen_fd >= 0) close(store->listen_fd);
+    if (store->socket_path) {
+        unlink(store->socket_path);
+        free(store->socket_path);
+    }
+    if (store->hdr) munmap(store->hdr, store->map_len);
+    if (store->shm_fd >= 0) close(store->shm_fd);
+    free(store);
+}
+
+int shm_object_store_listen_fd(shm_object_store *store)
+{
+    return store->listen_fd;
+}
+
+static int _send_fds(int sock, int fd1, int fd2)
+{
+    char byte = 'N';
+    struct iovec iov = { &byte, 1 };
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[2] = { fd1, fd2 };
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    return (sendmsg(sock, &msg, MSG_NOSIGNAL) == 1)?0:-1;
+}
+
+void shm_object_store_accept(shm_object_store *store)
+{
+    int conn;
+    while ((conn = accept4(store->listen_fd, NULL, NULL,
+                           SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+        shm_consumer *consumers;
+        int efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (efd < 0 || _send_fds(conn, store->shm_fd, efd) != 0) {
+            if (efd >= 0) close(efd);
+            close(conn);
+            continue;
+        }
+        consumers = (shm_consumer*) realloc(store->consumers,
+                        (store->num_consumers + 1) * sizeof(shm_consumer));
+        if (consumers == NULL) {
+            close(efd);
+            close(conn);
+            continue;
+        }
+        store->consumers = consumers;
+        store->consumers[store->num_consumers].conn_fd = conn;
+        store->consumers[store->num_consumers].event_fd = efd;
+        store->num_consumers++;
+    }
+}
+
+static void _notify_consumers(shm_object_store *store)
+{
+    static const uint64_t one = 1;
+    size_t i = 0;
+    while (i < store->num_consumers) {
+        char c;
+        if (recv(store->consumers[i].conn_fd, &c, 1, MSG_PEEK|MSG_DONTWAIT)
+            == 0) {
+            /* consumer hung up, forget it */
+            close(store->consumers[i].event_fd);
+            close(store->consumers[i].conn_fd);
+            store->consumers[i] = store->consumers[--store->num_consumers];
+            continue;
+        }
+        if (write(store->consumers[i].event_fd, &one, sizeof(one)) < 0) {
+            /* counter saturated - the consumer will still see the objects */
+        }
+        i++;
+    }
+}
+
+static int _ranges_overlap(uint64_t a, uint64_t alen, uint64_t b,
+                           uint64_t blen)
+{
+    return a < b + blen && b < a + alen;
+}
+
+int shm_object_store_begin(shm_object_store *store, const char *path,
+                           const char *content_type, size_t size_hint)
+{
+    uint64_t reserve = SHM_STORE_ALIGN(size_hint?size_hint:
+                                       store->default_reserve);
+    uint64_t start = store->head;
+    shm_object_desc *desc = NULL;
+    int obj = -1;
+    uint32_t i;
+
+    if (reserve == 0 || reserve > store->hdr->data_size) return -1;
+    if (start + reserve > store->hdr->data_size) start = 0;
+
+    /* Objects still being written can't be overwritten */
+    for (i = 0; i < store->hdr->num_slots; i++) {
+        shm_object_desc *d = &store->descs[i];
+        if (d->state == SHM_OBJECT_WRITING &&
+            _ranges_overlap(start, reserve, d->data_offset, d->reserved)) {
+            return -1;
+        }
+    }
+
+    /* Retire finished objects whose data is about to be overwritten */
+    for (i = 0; i < store->hdr->num_slots; i++) {
+        shm_object_desc *d = &store->descs[i];
+        if (d->state != SHM_OBJECT_FREE && d->state != SHM_OBJECT_WRITING &&
+            _ranges_overlap(start, reserve, d->data_offset, d->reserved)) {
+            __atomic_store_n(&d->seq, 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&d->state, SHM_OBJECT_FREE, __ATOMIC_RELEASE);
+        }
+    }
+
+    /* Pick a free slot, or else the oldest finished one */
+    for (i = 0; i < store->hdr->num_slots; i++) {
+        shm_object_desc *d = &store->descs[i];
+        if (d->state == SHM_OBJECT_FREE) {
+            desc = d;
+            break;
+        }
+        if (d->state != SHM_OBJECT_WRITING &&
+            (desc == NULL || d->seq < desc->seq)) {
+            desc = d;
+        }
+    }
+    if (desc == NULL) return -1;
+    obj = (int)(desc - store->descs);
+
+    __atomic_store_n(&desc->done_seq, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&desc->state, SHM_OBJECT_WRITING, __ATOMIC_RELEASE);
+    __atomic_store_n(&desc->seq, store->next_seq++, __ATOMIC_RELEASE);
+    desc->status = 0;
+    desc->data_offset = start;
+    desc->reserved = reserve;
+    desc->length = 0;
+    snprintf(desc->path, sizeof(desc->path), "%s", path?path:"");
+    snprintf(desc->content_type, sizeof(desc->content_type), "%s",
+             content_type?content_type:"");
+
+    store->head = start + reserve;
+
+    return obj;
+}
+
+int shm_object_store_write(shm_object_store *store, int obj,
+                           const uint8_t *data, size_t len, size_t off)
+{
+    shm_object_desc *desc;
+
+    if (obj < 0 || (uint32_t)obj >= store->hdr->num_slots) return -1;
+    desc = &store->descs[obj];
+    if (desc->state != SHM_OBJECT_WRITING) return -1;
+    if (off + len > desc->reserved) return -1;
+
+    memcpy(store->data + desc->data_offset + off, data, len);
+    if (off + len > desc->length) desc->length = off + len;
+
+    return 0;
+}
+
+void shm_object_store_end(shm_object_store *store, int obj, int status)
+{
+    shm_object_desc *desc;
+
+    if (obj < 0 || (uint32_t)obj >= store->hdr->num_slots) return;
+    desc = &store->descs[obj];
+    if (desc->state != SHM_OBJECT_WRITING) return;
+
+    /* Give back unused space if this was the most recent reservation */
+    if (desc->data_offset + desc->reserved == store->head) {
+        desc->reserved = SHM_STORE_ALIGN(desc->length);
+        store->head = desc->data_offset + desc->reserved;
+    }
+
+    desc->status = status;
+    __atomic_store_n(&desc->state,
+                     (status == 0)?SHM_OBJECT_COMPLETE:SHM_OBJECT_FAILED,
+                     __ATOMIC_RELEASE);
+    /* done_seq last, so a consumer that sees it also sees the final state */
+    __atomic_store_n(&desc->done_seq, store->hdr->last_seq + 1,
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&store->hdr->last_seq, store->hdr->last_seq + 1,
+                     __ATOMIC_RELEASE);
+
+    _notify_consumers(store);
+}
+
+static int _recv_fds(int sock, int *fd1, int *fd2)
+{
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[2];
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) return -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    *fd1 = fds[0];
+    *fd2 = fds[1];
+    return 0;
+}
+
+int shm_store_reader_attach(shm_store_reader *reader, const char *socket_path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int sock;
+    void *map;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->shm_fd = reader->event_fd = reader->conn_fd = -1;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        _recv_fds(sock, &reader->shm_fd, &reader->event_fd) != 0) {
+        close(sock);
+        return -1;
+    }
+    /* The receiver notices we have gone when this socket closes, so keep it */
+    reader->conn_fd = sock;
+
+    if (fstat(reader->shm_fd, &st) != 0) goto attach_fail;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, reader->shm_fd, 0);
+    if (map == MAP_FAILED) goto attach_fail;
+    reader->map_len = st.st_size;
+    reader->hdr = (const shm_store_header*) map;
+
+    if (reader->hdr->magic != SHM_STORE_MAGIC ||
+        reader->hdr->version != SHM_STORE_VERSION ||
+        reader->hdr->desc_size != sizeof(shm_object_desc)) {
+        goto attach_fail;
+    }
+
+    return 0;
+
+attach_fail:
+    shm_store_reader_detach(reader);
+    return -1;
+}
+
+void shm_store_reader_detach(shm_store_reader *reader)
+{
+    if (reader->hdr) munmap((void*)reader->hdr, reader->map_len);
+    if (reader->event_fd >= 0) close(reader->event_fd);
+    if (reader->shm_fd >= 0) close(reader->shm_fd);
+    if (reader->conn_fd >= 0) close(reader->conn_fd);
+    memset(reader, 0, sizeof(*reader));
+    reader->shm_fd = reader->event_fd = reader->conn_fd = -1;
+}
+
+// vim:ts=8:sts=4:sw=4:expandtab:
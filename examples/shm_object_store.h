@@ -0,0 +1,139 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _SHM_OBJECT_STORE_H_
+#define _SHM_OBJECT_STORE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+/*
+ * Shared memory object store
+ *
+ * A receiver reassembles pushed objects directly into a memfd-backed region
+ * which local consumer processes map read-only. The region starts with a
+ * shm_store_header, followed by a table of shm_object_desc slots and then the
+ * data ring that object bodies are written into.
+ *
+ * Consumers connect to the store's Unix socket and are handed the memfd and
+ * a private eventfd (via SCM_RIGHTS). The eventfd is signalled every time an
+ * object is completed or fails. A consumer then scans the slot table for
+ * descriptors with a done_seq newer than the last one it saw.
+ *
+ * The data ring is reused once it is full, so a consumer must check that the
+ * descriptor's seq is unchanged after it has finished with an object's data.
+ * If it has changed (or dropped to 0), the data was overwritten while it was
+ * being read.
+ */
+
+#define SHM_STORE_MAGIC         UINT32_C(0x4e474851) /* "NGHQ" */
+#define SHM_STORE_VERSION       1
+
+#define SHM_STORE_PATH_MAX      256
+#define SHM_STORE_TYPE_MAX      64
+
+typedef enum shm_object_state {
+    SHM_OBJECT_FREE = 0,
+    SHM_OBJECT_WRITING,
+    SHM_OBJECT_COMPLETE,
+    SHM_OBJECT_FAILED
+} shm_object_state;
+
+typedef struct shm_object_desc {
+    uint64_t seq;           /* increases every time the slot is (re)used */
+    uint64_t done_seq;      /* completion order, compare with last_seq */
+    uint32_t state;         /* shm_object_state */
+    int32_t  status;        /* nghq_error the object was closed with */
+    uint64_t data_offset;   /* from the start of the data ring */
+    uint64_t reserved;      /* bytes reserved in the data ring */
+    uint64_t length;        /* highest body offset written */
+    char     path[SHM_STORE_PATH_MAX];
+    char     content_type[SHM_STORE_TYPE_MAX];
+} shm_object_desc;
+
+typedef struct shm_store_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t desc_size;     /* sizeof(shm_object_desc) */
+    uint64_t data_start;    /* offset of the data ring in the region */
+    uint64_t data_size;
+    uint64_t last_seq;      /* done_seq of the most recently finished object */
+} shm_store_header;
+
+#define SHM_STORE_DESCS(hdr) \
+    ((shm_object_desc*)((uint8_t*)(hdr) + sizeof(shm_store_header)))
+#define SHM_STORE_DATA(hdr) ((uint8_t*)(hdr) + (hdr)->data_start)
+
+/*
+ * Producer side (receiver)
+ */
+
+typedef struct shm_object_store shm_object_store;
+
+extern shm_object_store *shm_object_store_new(const char *socket_path,
+                                              size_t data_size,
+                                              unsigned int num_slots,
+                                              size_t default_reserve);
+extern void shm_object_store_free(shm_object_store *store);
+
+/* The listening socket to watch for readability, then call _accept */
+extern int shm_object_store_listen_fd(shm_object_store *store);
+extern void shm_object_store_accept(shm_object_store *store);
+
+/* Returns an object handle, or -1 if no space could be reserved */
+extern int shm_object_store_begin(shm_object_store *store, const char *path,
+                                  const char *content_type, size_t size_hint);
+extern int shm_object_store_write(shm_object_store *store, int obj,
+                                  const uint8_t *data, size_t len, size_t off);
+extern void shm_object_store_end(shm_object_store *store, int obj, int status);
+
+/*
+ * Consumer side
+ */
+
+typedef struct shm_store_reader {
+    int                     shm_fd;
+    int                     event_fd;
+    int                     conn_fd;
+    size_t                  map_len;
+    const shm_store_header *hdr;
+} shm_store_reader;
+
+extern int shm_store_reader_attach(shm_store_reader *reader,
+                                   const char *socket_path);
+extern void shm_store_reader_detach(shm_store_reader *reader);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+#endif /* _SHM_OBJECT_STORE_H_ */
+
+// vim:ts=8:sts=4:sw=4:expandtab:
@@ -0,0 +1,1014 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Long running soak test of a multicast server session and its receivers.
+ *
+ * A server session and a few client sessions run in this one process, with
+ * packets passed between them through in-memory queues that drop a share of
+ * them. The server publishes a steady stream of objects of mixed sizes, some
+ * of which are cancelled part way through, while one receiver is replaced by
+ * a new one joining part way through every so often.
+ *
+ * Every interval the memory used by the process, the state held by the
+ * sessions, the CPU time per packet and the latency of objects are written
+ * out as a line of CSV. The first few samples after the warm up are the
+ * baseline, and the run fails as soon as the average of the latest samples
+ * of any of them has grown past the baseline by more than the allowed drift.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#if (__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33)
+#define HAVE_MALLINFO2 1
+#endif
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "nghq/nghq.h"
+
+#define _STR(a) #a
+#define STR(a) _STR(a)
+#define DEFAULT_DURATION      14400 /* seconds, 4 hours */
+#define DEFAULT_INTERVAL      60    /* seconds between samples */
+#define DEFAULT_WARMUP        600   /* seconds before the baseline is taken */
+#define DEFAULT_RATE          20    /* objects published a second */
+#define DEFAULT_LOSS          1     /* percent of packets each receiver loses */
+#define DEFAULT_CANCEL        2     /* percent of pushes cancelled part way */
+#define DEFAULT_CLIENTS       2     /* receivers there from the start */
+#define DEFAULT_JOIN_INTERVAL 30    /* seconds between late joiners */
+#define DEFAULT_DRIFT         25    /* percent growth allowed over baseline */
+#define DEFAULT_DEBUG_LEVEL   "WARN"
+#define WINDOW_SAMPLES        5     /* samples averaged for each comparison */
+#define MAX_CLIENTS           16
+#define MAX_PACKET_LEN        1470
+#define QUEUE_PACKETS         4096  /* packets queued for each receiver */
+#define BEACON_INTERVAL       1.0   /* seconds */
+#define CHUNK_LEN             16384 /* body data fed at a time */
+
+typedef struct soak_packet {
+    size_t len;
+    uint8_t data[MAX_PACKET_LEN];
+} soak_packet;
+
+typedef struct soak_client {
+    nghq_session *session;
+    int late;               /* joined part way through */
+    soak_packet *queue;     /* QUEUE_PACKETS, a ring */
+    size_t head;
+    size_t count;
+    uint64_t objects;
+    uint64_t body_bytes;
+    uint64_t latency_count; /* object latencies seen at the last sample */
+    uint64_t latency_usecs;
+} soak_client;
+
+typedef struct soak_timer {
+    double due;             /* from _now() */
+    nghq_session *session;
+    nghq_timer_event event_fn;
+    void *nghq_data;
+    int active;
+    struct soak_timer *next;
+} soak_timer;
+
+/* The figures that must not drift, in the order they are written out */
+typedef enum {
+    METRIC_RSS,
+    METRIC_HEAP,
+    METRIC_STREAMS,
+    METRIC_PROMISES,
+    METRIC_RECV,
+    METRIC_PUSH_STREAM,
+    METRIC_ORPHANS,
+    METRIC_SEND,
+    METRIC_PACKET_CPU,
+    METRIC_LATENCY,
+    NUM_METRICS
+} metric_id;
+
+static const struct {
+    const char *name;
+    double slack; /* growth by less than this is never drift */
+} g_metrics[NUM_METRICS] = {
+    { "rss_kib",         4096 },
+    { "heap_kib",        4096 },
+    { "streams",         32 },
+    { "promises",        32 },
+    { "recv_kib",        1024 },
+    { "push_stream_kib", 64 },
+    { "orphan_kib",      64 },
+    { "send_kib",        4096 },
+    { "ns_per_packet",   2000 },
+    { "latency_us",      5000 },
+};
+
+typedef struct soak_window {
+    double sum[NUM_METRICS];
+    double samples[WINDOW_SAMPLES][NUM_METRICS];
+    size_t num;
+} soak_window;
+
+static nghq_session *g_server;
+static soak_client g_clients[MAX_CLIENTS];
+static int g_num_clients;
+static soak_timer *g_timers;
+static int g_loss = DEFAULT_LOSS;
+static uint64_t g_packets;
+static uint64_t g_dropped;
+static uint64_t g_pushes;
+static uint64_t g_cancelled;
+static volatile sig_atomic_t g_interrupted;
+static nghq_log_level g_log_level;
+
+static uint8_t g_body[CHUNK_LEN];
+
+static char method_hdr[] = ":method";
+static char method_value[] = "GET";
+static char scheme_hdr[] = ":scheme";
+static char scheme_value[] = "https";
+static char host_hdr[] = ":authority";
+static char host_value[] = "localhost";
+static char path_hdr[] = ":path";
+static char path_value[32];
+static char status_hdr[] = ":status";
+static char status_value[] = "200";
+
+static nghq_header method_header = {
+    (uint8_t *) method_hdr, sizeof(method_hdr) - 1,
+    (uint8_t *) method_value, sizeof(method_value) - 1
+};
+static nghq_header scheme_header = {
+    (uint8_t *) scheme_hdr, sizeof(scheme_hdr) - 1,
+    (uint8_t *) scheme_value, sizeof(scheme_value) - 1
+};
+static nghq_header host_header = {
+    (uint8_t *) host_hdr, sizeof(host_hdr) - 1,
+    (uint8_t *) host_value, sizeof(host_value) - 1
+};
+static nghq_header path_header = {
+    (uint8_t *) path_hdr, sizeof(path_hdr) - 1,
+    (uint8_t *) path_value, 0
+};
+static nghq_header status_header = {
+    (uint8_t *) status_hdr, sizeof(status_hdr) - 1,
+    (uint8_t *) status_value, sizeof(status_value) - 1
+};
+
+static const nghq_header *g_request_hdrs[] = {
+    &method_header, &scheme_header, &host_header, &path_header
+};
+static const nghq_header *g_response_hdrs[] = {
+    &status_header
+};
+
+static double _now(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+static void sig_cb(int sig)
+{
+    g_interrupted = 1;
+}
+
+/*
+ * Session callbacks
+ */
+
+static ssize_t server_recv_cb(nghq_session *session, uint8_t *data, size_t len,
+                              void *session_user_data)
+{
+    return 0; // nothing comes back over multicast
+}
+
+static ssize_t client_recv_cb(nghq_session *session, uint8_t *data, size_t len,
+                              void *session_user_data)
+{
+    soak_client *client = (soak_client *) session_user_data;
+    soak_packet *pkt;
+
+    if (client->count == 0) {
+        return 0;
+    }
+    pkt = &client->queue[client->head];
+    client->head = (client->head + 1) % QUEUE_PACKETS;
+    client->count--;
+    if (pkt->len > len) {
+        return NGHQ_ERROR;
+    }
+    memcpy(data, pkt->data, pkt->len);
+    return pkt->len;
+}
+
+static int decrypt_cb(nghq_session *session, const uint8_t *encrypted,
+                      size_t encrypted_len, const uint8_t *key,
+                      const uint8_t *nonce, size_t noncelen, const uint8_t *ad,
+                      size_t adlen, uint8_t *clear, void *session_user_data)
+{
+    memmove(clear, encrypted, encrypted_len);
+    return 0;
+}
+
+static int encrypt_cb(nghq_session *session, const uint8_t *clear,
+                      size_t clear_len, const uint8_t *nonce,
+                      size_t noncelen, const uint8_t *ad, size_t adlen,
+                      const uint8_t *key, uint8_t *encrypted,
+                      void *session_user_data)
+{
+    memmove(encrypted, clear, clear_len);
+    return 0;
+}
+
+static ssize_t server_send_cb(nghq_session *session, const uint8_t *data,
+                              size_t len, void *session_user_data)
+{
+    int i;
+
+    if (len > MAX_PACKET_LEN) {
+        return NGHQ_ERROR;
+    }
+
+    /* Hold the packet back until every receiver has room for it */
+    for (i = 0; i < g_num_clients; i++) {
+        if (g_clients[i].count == QUEUE_PACKETS) {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < g_num_clients; i++) {
+        soak_client *client = &g_clients[i];
+        soak_packet *pkt;
+
+        if (client->session == NULL) continue;
+        if (random() % 100 < g_loss) {
+            g_dropped++;
+            continue;
+        }
+        pkt = &client->queue[(client->head + client->count) % QUEUE_PACKETS];
+        memcpy(pkt->data, data, len);
+        pkt->len = len;
+        client->count++;
+    }
+    g_packets++;
+    return len;
+}
+
+static ssize_t client_send_cb(nghq_session *session, const uint8_t *data,
+                              size_t len, void *session_user_data)
+{
+    return len; // receive only, nowhere to send to
+}
+
+static void session_status_cb(nghq_session *session, nghq_error status,
+                              void *session_user_data)
+{
+}
+
+static int recv_control_data_cb(nghq_session *session, const uint8_t *buf,
+                                size_t buflen, void *session_user_data)
+{
+    return NGHQ_OK;
+}
+
+static int on_begin_headers_cb(nghq_session *session, void *session_user_data,
+                               void *request_user_data)
+{
+    return NGHQ_OK;
+}
+
+static int on_begin_promise_cb(nghq_session *session, void *session_user_data,
+                               void *request_user_data,
+                               void *promise_user_data)
+{
+    return NGHQ_OK;
+}
+
+static int on_headers_cb(nghq_session *session, uint8_t flags,
+                         nghq_header *hdr, void *request_user_data)
+{
+    return NGHQ_OK;
+}
+
+static soak_client *_find_client(nghq_session *session)
+{
+    int i;
+    for (i = 0; i < g_num_clients; i++) {
+        if (g_clients[i].session == session) return &g_clients[i];
+    }
+    return NULL;
+}
+
+static int on_data_recv_cb(nghq_session *session, uint8_t flags,
+                           const uint8_t *data, size_t len, size_t off,
+                           void *request_user_data)
+{
+    soak_client *client = _find_client(session);
+    if (client != NULL) {
+        client->body_bytes += len;
+    }
+    return NGHQ_OK;
+}
+
+static int on_push_cancel_cb(nghq_session *session, void *request_user_data)
+{
+    return NGHQ_OK;
+}
+
+static int on_request_close_cb(nghq_session *session, nghq_error status,
+                               void *request_user_data)
+{
+    soak_client *client = _find_client(session);
+    if (client != NULL) {
+        client->objects++;
+    }
+    return NGHQ_OK;
+}
+
+static void *set_timer_cb(nghq_session *session, double seconds,
+                          void *session_user_data, nghq_timer_event fn,
+                          void *nghq_data)
+{
+    soak_timer *timer = (soak_timer *) calloc(1, sizeof(soak_timer));
+    if (timer == NULL) return NULL;
+    timer->due = _now() + seconds;
+    timer->session = session;
+    timer->event_fn = fn;
+    timer->nghq_data = nghq_data;
+    timer->active = 1;
+    timer->next = g_timers;
+    g_timers = timer;
+    return timer;
+}
+
+static void _unlink_timer(soak_timer *timer)
+{
+    soak_timer **it;
+    for (it = &g_timers; *it; it = &(*it)->next) {
+        if (*it == timer) {
+            *it = timer->next;
+            break;
+        }
+    }
+    timer->active = 0;
+}
+
+static int cancel_timer_cb(nghq_session *session, void *session_user_data,
+                           void *timer_id)
+{
+    soak_timer *timer = (soak_timer *) timer_id;
+    if (timer == NULL || !timer->active) return NGHQ_ERROR;
+    _unlink_timer(timer);
+    free(timer);
+    return NGHQ_OK;
+}
+
+static int reset_timer_cb(nghq_session *session, void *session_user_data,
+                          void *timer_id, double seconds)
+{
+    soak_timer *timer = (soak_timer *) timer_id;
+    if (timer == NULL) return NGHQ_ERROR;
+    timer->due = _now() + seconds;
+    if (!timer->active) {
+        timer->active = 1;
+        timer->next = g_timers;
+        g_timers = timer;
+    }
+    return NGHQ_OK;
+}
+
+/* Fire every timer that is due, returning when the next one will be */
+static double _run_timers(double now)
+{
+    double next = now + 1.0;
+    soak_timer *timer;
+
+    for (;;) {
+        for (timer = g_timers; timer; timer = timer->next) {
+            if (timer->due <= now) break;
+        }
+        if (timer == NULL) break;
+        /* Taken off the list first, as with ev_timer, so it can be reset */
+        _unlink_timer(timer);
+        timer->event_fn(timer->session, timer, timer->nghq_data);
+        if (!timer->active) free(timer);
+    }
+
+    for (timer = g_timers; timer; timer = timer->next) {
+        if (timer->due < next) next = timer->due;
+    }
+    return next;
+}
+
+/* Drop any timers left behind by a session that has been freed */
+static void _free_session_timers(nghq_session *session)
+{
+    soak_timer **it = &g_timers;
+    while (*it) {
+        soak_timer *timer = *it;
+        if (timer->session == session) {
+            *it = timer->next;
+            free(timer);
+        } else {
+            it = &timer->next;
+        }
+    }
+}
+
+static void log_cb(nghq_session *session, nghq_log_level lvl, const char *msg,
+                   size_t len)
+{
+    fprintf(stderr, "[%s] %s", nghq_get_loglevel_str(lvl), msg);
+}
+
+static nghq_callbacks g_server_callbacks = {
+    server_recv_cb,
+    decrypt_cb,
+    encrypt_cb,
+    server_send_cb,
+    session_status_cb,
+    recv_control_data_cb,
+    on_begin_headers_cb,
+    NULL,
+    on_headers_cb,
+    on_data_recv_cb,
+    on_push_cancel_cb,
+    on_request_close_cb,
+    set_timer_cb,
+    cancel_timer_cb,
+    reset_timer_cb
+};
+
+static nghq_callbacks g_client_callbacks = {
+    client_recv_cb,
+    decrypt_cb,
+    encrypt_cb,
+    client_send_cb,
+    session_status_cb,
+    recv_control_data_cb,
+    on_begin_headers_cb,
+    on_begin_promise_cb,
+    on_headers_cb,
+    on_data_recv_cb,
+    on_push_cancel_cb,
+    on_request_close_cb,
+    set_timer_cb,
+    cancel_timer_cb,
+    reset_timer_cb
+};
+
+static nghq_settings g_settings = {
+    NGHQ_SETTINGS_DEFAULT_MAX_HEADER_LIST_SIZE,   /* max_header_list_size */
+    NGHQ_SETTINGS_DEFAULT_NUM_PLACEHOLDERS,       /* number_of_placeholders */
+};
+
+static uint8_t _session_id[] = {
+    0x53, 0x6f, 0x61, 0x6b /* "Soak" */
+};
+
+static nghq_transport_settings g_trans_settings = {
+    NGHQ_MODE_MULTICAST,         /* mode */
+    16,                          /* max_open_requests */
+    0x3FFFFFFFFFFFFFFFULL,       /* max_open_server_pushes */
+    60,                          /* idle_timeout (seconds) */
+    MAX_PACKET_LEN,              /* max_packet_size */
+    0,  /* use default */        /* ack_delay_exponent */
+    _session_id, sizeof(_session_id), /* session_id and session_id_len */
+    UINT32_C(2)*1024*1024*1024,  /* max_stream_data */
+    4611686018427387903ULL,      /* max_data - 2^62 max value */
+    NULL,                        /* destination_address */
+    0,                           /* destination_address_len */
+    NULL,                        /* source_address */
+    0,                           /* source_address_len */
+    NGHQ_PKTNUM_LEN_AUTO,        /* packet_number_length */
+    0,                           /* encryption_overhead */
+    5,                           /* stream_timeout */
+    4096,                        /* max_recv_fragments */
+    1024,                        /* max_pending_frames */
+    4096,                        /* max_frame_gaps */
+};
+
+/*
+ * Workload
+ */
+
+static int _client_start(soak_client *client, int late)
+{
+    if (client->queue == NULL) {
+        client->queue = (soak_packet *) malloc(QUEUE_PACKETS *
+                                               sizeof(soak_packet));
+        if (client->queue == NULL) return -1;
+    }
+    client->head = 0;
+    client->count = 0;
+    client->late = late;
+    client->latency_count = 0;
+    client->latency_usecs = 0;
+    client->session = nghq_session_client_new(&g_client_callbacks, &g_settings,
+                                              &g_trans_settings, client);
+    if (client->session == NULL) {
+        fprintf(stderr, "Failed to get nghq client instance!\n");
+        return -1;
+    }
+    nghq_set_loglevel(client->session, g_log_level, log_cb);
+    if (late && nghq_session_enable_push_beacons(client->session, 0) != NGHQ_OK) {
+        fprintf(stderr, "Can't join late\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void _client_stop(soak_client *client)
+{
+    if (client->session == NULL) return;
+    nghq_session_free(client->session);
+    _free_session_timers(client->session);
+    client->session = NULL;
+    client->count = 0;
+}
+
+/* Send everything the server has queued, handing the packets to receivers */
+static void _pump(void)
+{
+    int sent;
+    int rv;
+    int i;
+
+    do {
+        sent = nghq_session_send(g_server);
+        nghq_session_recv(g_server);
+        for (i = 0; i < g_num_clients; i++) {
+            soak_client *client = &g_clients[i];
+            if (client->session == NULL || client->count == 0) continue;
+            rv = nghq_session_recv(client->session);
+            if (rv != NGHQ_OK && rv != NGHQ_NO_MORE_DATA) {
+                fprintf(stderr, "Receiver %d failed: %s\n", i,
+                        nghq_strerror(rv));
+            }
+        }
+    } while ((sent == NGHQ_OK || sent == NGHQ_SESSION_BLOCKED) &&
+             nghq_session_want_write(g_server));
+
+    if (sent != NGHQ_OK && sent != NGHQ_NO_MORE_DATA) {
+        fprintf(stderr, "Sending failed: %s\n", nghq_strerror(sent));
+    }
+}
+
+/* Mostly small objects, with some larger and a few of several megabytes */
+static size_t _object_size(void)
+{
+    long pick = random() % 100;
+    if (pick < 70) return 512 + random() % (16 * 1024);
+    if (pick < 95) return 16 * 1024 + random() % (240 * 1024);
+    return 256 * 1024 + random() % (4 * 1024 * 1024);
+}
+
+static int _publish(int cancel_pct)
+{
+    void *user_data = (void *) (uintptr_t) ++g_pushes;
+    size_t size = _object_size();
+    size_t cancel_at = size;
+    size_t sent = 0;
+    int result;
+
+    if (random() % 100 < cancel_pct) {
+        cancel_at = random() % size;
+    }
+
+    path_header.value_len = snprintf(path_value, sizeof(path_value),
+                                     "/soak/%" PRIu64, g_pushes);
+    result = nghq_submit_push_promise(g_server, NULL, g_request_hdrs,
+                                      sizeof(g_request_hdrs) /
+                                      sizeof(g_request_hdrs[0]), user_data);
+    if (result != NGHQ_OK) {
+        fprintf(stderr, "Failed to submit push promise: %s\n",
+                nghq_strerror(result));
+        return -1;
+    }
+    result = nghq_feed_headers(g_server, g_response_hdrs,
+                               sizeof(g_response_hdrs) /
+                               sizeof(g_response_hdrs[0]), 0, user_data);
+    if (result != NGHQ_OK) {
+        fprintf(stderr, "Failed to feed push headers: %s\n",
+                nghq_strerror(result));
+        return -1;
+    }
+
+    while (sent < size) {
+        size_t len = size - sent;
+        ssize_t fed;
+
+        if (len > CHUNK_LEN) len = CHUNK_LEN;
+        if (sent >= cancel_at) {
+            nghq_end_request(g_server, NGHQ_CANCELLED, user_data);
+            g_cancelled++;
+            break;
+        }
+        fed = nghq_feed_payload_data(g_server, g_body, len,
+                                     sent + len == size, user_data);
+        if (fed == NGHQ_REQUEST_BLOCKED) {
+            _pump();
+            continue;
+        }
+        if (fed < 0) {
+            fprintf(stderr, "Failed to feed push body: %s\n",
+                    nghq_strerror(fed));
+            return -1;
+        }
+        sent += fed;
+    }
+
+    _pump();
+    return 0;
+}
+
+/*
+ * Sampling
+ */
+
+static double _rss_kib(void)
+{
+    unsigned long size, resident;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024.0);
+}
+
+static double _heap_kib(void)
+{
+#if HAVE_MALLINFO2
+    struct mallinfo2 mi = mallinfo2();
+    return (mi.uordblks + mi.hblkhd) / 1024.0;
+#else
+    return 0; // not known, so never drifts
+#endif
+}
+
+static double _cpu_secs(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void _sample(double *values, double cpu_secs, uint64_t packets)
+{
+    nghq_session_sizes sizes;
+    uint64_t lat_count = 0, lat_usecs = 0;
+    int i;
+
+    memset(values, 0, NUM_METRICS * sizeof(double));
+    values[METRIC_RSS] = _rss_kib();
+    values[METRIC_HEAP] = _heap_kib();
+
+    nghq_session_get_sizes(g_server, &sizes);
+    values[METRIC_STREAMS] += sizes.streams;
+    values[METRIC_PROMISES] += sizes.promises;
+    values[METRIC_SEND] = sizes.pending_send_bytes / 1024.0;
+
+    for (i = 0; i < g_num_clients; i++) {
+        soak_client *client = &g_clients[i];
+        nghq_latency_histogram hist;
+
+        if (client->session == NULL) continue;
+        nghq_session_get_sizes(client->session, &sizes);
+        values[METRIC_STREAMS] += sizes.streams;
+        values[METRIC_PROMISES] += sizes.promises;
+        values[METRIC_RECV] += sizes.recv_bytes / 1024.0;
+        values[METRIC_PUSH_STREAM] += sizes.push_stream_bytes / 1024.0;
+        values[METRIC_ORPHANS] += sizes.orphan_push_bytes / 1024.0;
+
+        /* Only the latency since the last sample */
+        if (nghq_session_get_latency(client->session, NGHQ_LATENCY_OBJECT,
+                                     &hist) == NGHQ_OK) {
+            lat_count += hist.count - client->latency_count;
+            lat_usecs += hist.total_usecs - client->latency_usecs;
+            client->latency_count = hist.count;
+            client->latency_usecs = hist.total_usecs;
+        }
+    }
+
+    if (packets > 0) {
+        values[METRIC_PACKET_CPU] = cpu_secs * 1e9 / packets;
+    }
+    if (lat_count > 0) {
+        values[METRIC_LATENCY] = (double) lat_usecs / lat_count;
+    }
+}
+
+static void _window_add(soak_window *win, const double *values)
+{
+    double *slot = win->samples[win->num % WINDOW_SAMPLES];
+    int m;
+
+    for (m = 0; m < NUM_METRICS; m++) {
+        if (win->num >= WINDOW_SAMPLES) win->sum[m] -= slot[m];
+        slot[m] = values[m];
+        win->sum[m] += values[m];
+    }
+    win->num++;
+}
+
+/* Returns the first metric to have drifted, or NUM_METRICS if none have */
+static int _check_drift(const soak_window *baseline, const soak_window *latest,
+                        double drift_pct)
+{
+    int m;
+
+    if (baseline->num < WINDOW_SAMPLES || latest->num < WINDOW_SAMPLES) {
+        return NUM_METRICS;
+    }
+    for (m = 0; m < NUM_METRICS; m++) {
+        double base = baseline->sum[m] / WINDOW_SAMPLES;
+        double now = latest->sum[m] / WINDOW_SAMPLES;
+        if (now > base * (1 + drift_pct / 100) + g_metrics[m].slack) {
+            return m;
+        }
+    }
+    return NUM_METRICS;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char short_opts[] = "hc:C:d:D:i:j:l:r:s:w:x:";
+    static const struct option long_opts[] = {
+        {"help", 0, NULL, 'h'},
+        {"clients", 1, NULL, 'c'},
+        {"cancel", 1, NULL, 'C'},
+        {"duration", 1, NULL, 'd'},
+        {"interval", 1, NULL, 'i'},
+        {"join-interval", 1, NULL, 'j'},
+        {"loss", 1, NULL, 'l'},
+        {"rate", 1, NULL, 'r'},
+        {"seed", 1, NULL, 's'},
+        {"warmup", 1, NULL, 'w'},
+        {"drift", 1, NULL, 'x'},
+        {"debug", 1, NULL, 'D'},
+        {NULL, 0, NULL, 0}
+    };
+    double duration = DEFAULT_DURATION;
+    double interval = DEFAULT_INTERVAL;
+    double warmup = DEFAULT_WARMUP;
+    double rate = DEFAULT_RATE;
+    double join_interval = DEFAULT_JOIN_INTERVAL;
+    double drift = DEFAULT_DRIFT;
+    int cancel_pct = DEFAULT_CANCEL;
+    int clients = DEFAULT_CLIENTS;
+    unsigned int seed = (unsigned int) time(NULL);
+    const char *debug_level = DEFAULT_DEBUG_LEVEL;
+    soak_window baseline, latest;
+    double start, now, next_push, next_join, next_sample, next_timer;
+    double last_cpu;
+    uint64_t last_packets;
+    int failed = -1;
+    int opt;
+    int i;
+
+    while ((opt = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'C':
+            cancel_pct = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'j':
+            join_interval = atof(optarg);
+            break;
+        case 'l':
+            g_loss = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            warmup = atof(optarg);
+            break;
+        case 'x':
+            drift = atof(optarg);
+            break;
+        case 'D':
+            debug_level = optarg;
+            break;
+        case 'h':
+        default:
+            fprintf((opt == 'h')?stdout:stderr,
+"Usage: %s [-h] [-d <secs>] [-i <secs>] [-w <secs>] [-r <rate>] [-l <pct>]\n"
+"          [-C <pct>] [-c <n>] [-j <secs>] [-x <pct>] [-s <seed>] [-D <level>]\n"
+"\n"
+"Options:\n"
+"  --help          -h          Display this help text.\n"
+"  --duration      -d <secs>   How long to run for [default: " STR(DEFAULT_DURATION) "].\n"
+"  --interval      -i <secs>   Time between samples [default: " STR(DEFAULT_INTERVAL) "].\n"
+"  --warmup        -w <secs>   Time before the baseline samples [default: " STR(DEFAULT_WARMUP) "].\n"
+"  --rate          -r <rate>   Objects published a second [default: " STR(DEFAULT_RATE) "].\n"
+"  --loss          -l <pct>    Percentage of packets each receiver loses [default: " STR(DEFAULT_LOSS) "].\n"
+"  --cancel        -C <pct>    Percentage of pushes cancelled part way through\n"
+"                              [default: " STR(DEFAULT_CANCEL) "].\n"
+"  --clients       -c <n>      Receivers there from the start, up to\n"
+"                              " STR(MAX_CLIENTS) " less one for late joiners [default: " STR(DEFAULT_CLIENTS) "].\n"
+"  --join-interval -j <secs>   Replace the late joining receiver this often, or\n"
+"                              0 for none [default: " STR(DEFAULT_JOIN_INTERVAL) "].\n"
+"  --drift         -x <pct>    Growth over the baseline that fails the run\n"
+"                              [default: " STR(DEFAULT_DRIFT) "].\n"
+"  --seed          -s <seed>   Seed for the workload [default: the time].\n"
+"  --debug         -D <level>  Specify the debug level, one of ALERT, ERROR, WARN, INFO, DEBUG or TRACE [default: " DEFAULT_DEBUG_LEVEL "].\n"
+"\n"
+"Exits with 1 if anything drifts, and 0 if the run completes without drift.\n"
+"\n", argv[0]);
+            return (opt == 'h')?0:2;
+        }
+    }
+
+    if (clients < 1 || clients > MAX_CLIENTS - 1 || rate <= 0 ||
+        interval <= 0 || duration <= 0) {
+        fprintf(stderr, "Bad workload, see --help\n");
+        return 2;
+    }
+
+    srandom(seed);
+    for (i = 0; i < CHUNK_LEN; i++) {
+        g_body[i] = random();
+    }
+    g_log_level = nghq_get_loglevel_from_str(debug_level,
+                                             strnlen(debug_level, 6));
+    signal(SIGINT, sig_cb);
+    signal(SIGTERM, sig_cb);
+
+    g_server = nghq_session_server_new(&g_server_callbacks, &g_settings,
+                                       &g_trans_settings, NULL);
+    if (g_server == NULL) {
+        fprintf(stderr, "Failed to get nghq server instance!\n");
+        return 2;
+    }
+    nghq_set_loglevel(g_server, g_log_level, log_cb);
+    nghq_session_enable_push_beacons(g_server, BEACON_INTERVAL);
+    nghq_session_enable_send_timestamps(g_server, 1, 1);
+
+    g_num_clients = clients + (join_interval > 0);
+    for (i = 0; i < clients; i++) {
+        if (_client_start(&g_clients[i], 0) != 0) return 2;
+    }
+
+    memset(&baseline, 0, sizeof(baseline));
+    memset(&latest, 0, sizeof(latest));
+
+    printf("# seed %u\nsecs,objects,packets,dropped,cancelled", seed);
+    for (i = 0; i < NUM_METRICS; i++) {
+        printf(",%s", g_metrics[i].name);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    start = _now();
+    next_push = start;
+    next_join = start + join_interval;
+    next_sample = start + interval;
+    last_cpu = _cpu_secs();
+    last_packets = 0;
+
+    while (!g_interrupted && failed < 0) {
+        double wake;
+
+        now = _now();
+        if (now - start >= duration) break;
+
+        next_timer = _run_timers(now);
+
+        if (now >= next_push) {
+            if (_publish(cancel_pct) != 0) {
+                failed = NUM_METRICS;
+                break;
+            }
+            next_push += 1 / rate;
+            /* Don't try to catch up after falling far behind */
+            if (next_push < now - 1) next_push = now;
+        }
+
+        if (join_interval > 0 && now >= next_join) {
+            soak_client *client = &g_clients[g_num_clients - 1];
+            _client_stop(client);
+            if (_client_start(client, 1) != 0) return 2;
+            next_join += join_interval;
+        }
+
+        if (now >= next_sample) {
+            double values[NUM_METRICS];
+            double cpu = _cpu_secs();
+            uint64_t objects = 0;
+            int m;
+
+            _sample(values, cpu - last_cpu, g_packets - last_packets);
+            last_cpu = cpu;
+            last_packets = g_packets;
+            for (i = 0; i < g_num_clients; i++) {
+                objects += g_clients[i].objects;
+            }
+
+            printf("%.0f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+                   now - start, objects, g_packets, g_dropped, g_cancelled);
+            for (m = 0; m < NUM_METRICS; m++) {
+                printf(",%.1f", values[m]);
+            }
+            printf("\n");
+            fflush(stdout);
+
+            if (now - start >= warmup) {
+                if (baseline.num < WINDOW_SAMPLES) {
+                    _window_add(&baseline, values);
+                } else {
+                    _window_add(&latest, values);
+                    m = _check_drift(&baseline, &latest, drift);
+                    if (m < NUM_METRICS) {
+                        fprintf(stderr, "%s drifted from %.1f to %.1f\n",
+                                g_metrics[m].name,
+                                baseline.sum[m] / WINDOW_SAMPLES,
+                                latest.sum[m] / WINDOW_SAMPLES);
+                        failed = m;
+                    }
+                }
+            }
+            next_sample += interval;
+        }
+
+        wake = next_push;
+        if (next_timer < wake) wake = next_timer;
+        if (next_sample < wake) wake = next_sample;
+        if (join_interval > 0 && next_join < wake) wake = next_join;
+        now = _now();
+        if (wake > now) {
+            struct timespec ts;
+            ts.tv_sec = (time_t) (wake - now);
+            ts.tv_nsec = (long) ((wake - now - ts.tv_sec) * 1e9);
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    if (failed < 0 && baseline.num < WINDOW_SAMPLES) {
+        fprintf(stderr, "Too short a run to take a baseline after the warm up\n");
+    }
+
+    for (i = 0; i < g_num_clients; i++) {
+        _client_stop(&g_clients[i]);
+        free(g_clients[i].queue);
+    }
+    nghq_session_free(g_server);
+    _free_session_timers(g_server);
+
+    return (failed < 0)?0:1;
+}
+
+// vim:ts=8:sts=4:sw=4:expandtab:
@@ -66,6 +66,7 @@ typedef enum {
   NGHQ_OUT_OF_MEMORY = -3,
   NGHQ_NOT_IMPLEMENTED = -4,
   NGHQ_MISSING_DATA = -5,
+  NGHQ_BAD_SNAPSHOT = -6,
   /* Connection errors */
   NGHQ_INCOMPATIBLE_METHOD = -10,
   NGHQ_TOO_MUCH_DATA = -11,
@@ -162,8 +163,88 @@ typedef struct {
   size_t encryption_overhead;
 
   double stream_timeout;
+
+  /*
+   * Limits on the work done putting a received stream back together, so that
+   * heavy loss or reordering, or a sender trying it on, can't tie a receiver
+   * up. A stream that goes over one is cancelled. 0 means no limit.
+   */
+  size_t max_recv_fragments; /* separate pieces of data held for a stream */
+  size_t max_pending_frames; /* frames started but not finished on a stream */
+  size_t max_frame_gaps;     /* holes in any one frame being assembled */
 } nghq_transport_settings;
 
+/* Phases of packet handling timed by nghq_session_get_phase_stats() */
+typedef enum {
+  NGHQ_PHASE_PACKET_HEADER,  /* short header and header protection */
+  NGHQ_PHASE_DECRYPT,        /* the decrypt_callback */
+  NGHQ_PHASE_FRAME_PARSE,    /* QUIC and HTTP/3 frames in received packets */
+  NGHQ_PHASE_REASSEMBLY,     /* putting stream data back in order */
+  NGHQ_PHASE_HEADER_DECODE,  /* QPACK decoding of header blocks */
+  NGHQ_PHASE_APP_CALLBACKS,  /* headers, data, promise and close callbacks */
+  NGHQ_PHASE_PACKET_BUILD,   /* filling packets to send */
+  NGHQ_PHASE_ENCRYPT,        /* the encrypt_callback */
+  NGHQ_PHASE_SEND_CALLBACK,  /* the send_callback */
+  NGHQ_PHASE_MAX
+} nghq_phase;
+
+typedef struct {
+  uint64_t nsecs;  /* time spent in the phase, not counting nested phases */
+  uint64_t count;  /* times the phase was entered */
+} nghq_phase_stats;
+
+/* Number of buckets in a nghq_latency_histogram */
+#define NGHQ_LATENCY_BUCKETS 25
+
+/*
+ * One-way latencies in microseconds, from the send times stamped by the
+ * sender to when packets were read from the socket. These are only as good
+ * as the clock sync between the sender and receiver. Bucket 0 counts
+ * latencies under 1us. Bucket n counts those from 2^(n-1)us up to 2^n us.
+ * The last bucket counts everything longer.
+ */
+typedef struct {
+  uint64_t buckets[NGHQ_LATENCY_BUCKETS];
+  uint64_t count;
+  uint64_t total_usecs;
+  uint64_t max_usecs;
+  uint64_t clock_behind; /* sent "after" they arrived, not in the buckets */
+} nghq_latency_histogram;
+
+typedef enum {
+  NGHQ_LATENCY_PACKET,  /* each packet, from its timestamp trailer */
+  NGHQ_LATENCY_OBJECT,  /* each push, from its headers being fed to arriving */
+  NGHQ_LATENCY_MAX
+} nghq_latency_kind;
+
+/* Reasons for cancelling a stream, counted by nghq_session_get_limit_hits() */
+typedef enum {
+  NGHQ_LIMIT_RECV_FRAGMENTS,  /* over max_recv_fragments */
+  NGHQ_LIMIT_PENDING_FRAMES,  /* over max_pending_frames */
+  NGHQ_LIMIT_FRAME_GAPS,      /* over max_frame_gaps */
+  NGHQ_LIMIT_HEADER_LIST_SIZE, /* headers over SETTINGS_MAX_HEADER_LIST_SIZE */
+  NGHQ_LIMIT_MAX
+} nghq_limit;
+
+/* What a session is holding, from nghq_session_get_sizes() */
+typedef struct {
+  size_t streams;                /* open streams, including stream 0 */
+  size_t promises;               /* promised pushes not started yet */
+  size_t recv_fragments;         /* out of order buffers on all streams */
+  size_t recv_bytes;             /* and the bytes in them */
+  size_t pending_frames;         /* frames part way through reassembly */
+  size_t push_stream_fragments;  /* recv_fragments on stream 0 */
+  size_t push_stream_bytes;      /* recv_bytes on stream 0 */
+  size_t push_stream_frames;     /* pending_frames on stream 0 */
+  size_t orphan_pushes;          /* push streams waiting for their promise */
+  size_t orphan_push_bytes;
+  size_t pending_send_bytes;     /* as nghq_session_get_pending_bytes() */
+  size_t cache_bytes;            /* as nghq_object_cache_get_size() */
+} nghq_session_sizes;
+
+/* The largest max_packet_size accepted, the biggest UDP payload over IPv6 */
+#define NGHQ_MAX_PACKET_SIZE 65527
+
 #define NGHQ_SETTINGS_MAX_HEADER_LIST_SIZE 0x6LL
 #define NGHQ_SETTINGS_NUM_PLACEHOLDERS 0x9LL
 /*
@@ -183,9 +264,19 @@ typedef struct {
 
 #define NGHQ_HEADERS_FLAGS_END_REQUEST 0x1
 #define NGHQ_HEADERS_FLAGS_TRAILERS 0x2
+#define NGHQ_HEADERS_FLAGS_RESUMED 0x4
 
 #define NGHQ_DATA_FLAGS_END_DATA 0x1
 
+/* A range of body bytes, from begin up to but not including end */
+typedef struct {
+  uint64_t begin;
+  uint64_t end;
+} nghq_byte_range;
+
+/* End of a hole when nothing is known about the body beyond its start */
+#define NGHQ_BYTE_RANGE_END_UNKNOWN UINT64_MAX
+
 /*
  * NGHQ Session Functions
  */
@@ -318,6 +409,33 @@ extern int nghq_session_recv (nghq_session *session);
  */
 extern int nghq_session_send (nghq_session *session);
 
+/**
+ * @brief Find out if nghq_session_send() has anything to do
+ *
+ * An event loop can use this to decide whether to wait for the socket to
+ * become writable, rather than calling nghq_session_send() speculatively. See
+ * also nghq_on_send_ready_callback.
+ *
+ * @param session A running NGHQ session
+ *
+ * @return 1 if there is data waiting to be sent, otherwise 0
+ */
+extern int nghq_session_want_write (nghq_session *session);
+
+/**
+ * @brief Get the number of bytes waiting to be sent on a session
+ *
+ * This counts HTTP frames queued on all requests and pushes, control frames
+ * and packets that have been built but not yet accepted by the
+ * nghq_send_callback(). Applications can use this to stop feeding in more
+ * data until the session has caught up.
+ *
+ * @param session A running NGHQ session
+ *
+ * @return The number of bytes queued for sending
+ */
+extern size_t nghq_session_get_pending_bytes (nghq_session *session);
+
 /**
  * @brief Retrieve transport parameter buffer
  *
@@ -516,7 +634,12 @@ const char * nghq_get_loglevel_str (nghq_log_level lvl);
  * @brief Used to pull data from the socket
  *
  * The implementer of this function should put at most @p len bytes of data into
- * @p data, and return the number of bytes that it actually wrote.
+ * @p data, and return the number of bytes that it actually wrote. @p len is one
+ * byte more than the session's max_packet_size, so that a datagram which is
+ * too large can be told apart from one that fits exactly. If the transport can
+ * report the real size of a datagram it truncated (e.g. recv() with MSG_TRUNC)
+ * then returning that size is also fine. Either way, datagrams larger than
+ * max_packet_size are dropped.
  *
  * If there is no more data to be received (i.e. the socket buffer has been
  * completely drained, and any further attempt to read would block) then this
@@ -690,7 +813,10 @@ typedef int (*nghq_on_begin_promise_callback) (nghq_session *session,
  * If the @p flags param satisfies the bitmask NGHQ_HEADERS_FLAGS_END_REQUEST
  * then this callback is the last callback for a request and you should not
  * expect any data for the request. If the @p flags param satisfies the bitmask
- * NGHQ_HEADERS_FLAGS_TRAILERS then these are trailing headers.
+ * NGHQ_HEADERS_FLAGS_TRAILERS then these are trailing headers. If the @p flags
+ * param satisfies the bitmask NGHQ_HEADERS_FLAGS_RESUMED then these headers
+ * are being replayed by nghq_session_restore() for a request that was already
+ * in progress, and any body data already received is still to be kept.
  *
  * @return NGHQ_OK, unless you want to receive no more data from this
  *    request/response, then you may return NGHQ_NOT_INTERESTED
@@ -709,7 +835,9 @@ typedef int (*nghq_on_headers_callback) (nghq_session *session, uint8_t flags,
  * The buffer @p data is the block of data, of length @p len at offset @p off.
  * When in multicast mode, there may be gaps where the offset in a new call
  * to this callback will be greater than the previous offset plus the length.
- * This indicates that there was multicast packet loss.
+ * This indicates that there was multicast packet loss. Packets that arrive
+ * out of order can also give data at a lower offset than an earlier call, so
+ * place data by @p off rather than appending it.
  *
  * @return NGHQ_OK, unless you want to receive no more data from this
  *    request/response, then you may return NGHQ_NOT_INTERESTED
@@ -758,6 +886,43 @@ typedef int (*nghq_on_request_close_callback) (nghq_session *session,
                                                nghq_error status,
                                                void *request_user_data);
 
+/**
+ * @brief Inform an application that a request has closed, with any holes
+ *
+ * If set, this is called instead of nghq_on_request_close_callback() when a
+ * received request or response closes. The @p holes array holds the
+ * @p num_holes body byte ranges that were never received, as would be
+ * returned by nghq_get_stream_holes(). When @p status is NGHQ_OK, @p num_holes
+ * will be 0.
+ *
+ * The @p holes array is only valid for the duration of the callback.
+ *
+ * As with nghq_get_stream_holes(), the holes of a push that was decoded are
+ * offsets into the encoded body, not the decoded one.
+ *
+ * @return NGHQ_OK
+ */
+typedef int (*nghq_on_request_close_holes_callback) (nghq_session *session,
+                                              nghq_error status,
+                                              const nghq_byte_range *holes,
+                                              size_t num_holes,
+                                              void *request_user_data);
+
+/**
+ * @brief Inform an application that there is now data to be sent
+ *
+ * If set, this is called when data is queued on a session that had nothing
+ * waiting to be sent, for example by nghq_feed_payload_data(). The
+ * application should arrange for nghq_session_send() to be called, but must
+ * not call it from within this callback. It will not be called again until
+ * everything queued has been sent.
+ *
+ * @param session A running NGHQ session
+ * @param session_user_data The session_user_data for @p session
+ */
+typedef void (*nghq_on_send_ready_callback) (nghq_session *session,
+                                             void *session_user_data);
+
 /**
  * @brief Timer firing callback (call into NGHQ)
  *
@@ -887,6 +1052,52 @@ extern int nghq_submit_push_promise (nghq_session *session,
                                      const nghq_header **hdrs, size_t num_hdrs,
                                      void *promised_request_user_data);
 
+/* One server push submitted with nghq_submit_push_batch() */
+typedef struct {
+  void *              init_request_user_data; /**< Ignored in multicast mode */
+  const nghq_header **promise_hdrs;  /**< Request headers for PUSH_PROMISE */
+  size_t              num_promise_hdrs;
+  const nghq_header **response_hdrs; /**< Response headers for the push */
+  size_t              num_response_hdrs;
+  const uint8_t *     body;          /**< Whole body, or NULL to feed later */
+  size_t              body_len;
+  void *              request_user_data; /**< promised_request_user_data */
+} nghq_push_desc;
+
+/**
+ * @brief Submit a number of complete server pushes at once
+ *
+ * This is the same as calling nghq_submit_push_promise(), nghq_feed_headers()
+ * and nghq_feed_payload_data() for each entry in @p descs, but is much cheaper
+ * when there are many small objects to push. All of the PUSH_PROMISE frames
+ * are queued together in one buffer, and each push's HEADERS and DATA frames
+ * share a single buffer on their push stream.
+ *
+ * If the body of a descriptor is NULL, the push is left open after its
+ * response headers and the body can be fed in later with
+ * nghq_feed_payload_data(). Otherwise the push is finished with @p body_len
+ * bytes of @p body, which is copied.
+ *
+ * In unicast mode, every entry in @p descs must have the same
+ * init_request_user_data.
+ *
+ * If a push cannot be submitted, the ones before it in @p descs will still
+ * have been submitted and the rest are not.
+ *
+ * @param session A running NGHQ server session
+ * @param descs The pushes to submit
+ * @param n The number of entries in @p descs
+ *
+ * @return The number of pushes submitted, from the start of @p descs
+ * @return NGHQ_SERVER_ONLY if @p session is that of a client instance.
+ * @return NGHQ_ERROR if the init request couldn't be found
+ * @return NGHQ_PUSH_LIMIT_REACHED If the client's MAX_PUSH_ID limit has been
+ *    reached before the first push
+ * @return NGHQ_OUT_OF_MEMORY if the first push couldn't be allocated
+ */
+extern int nghq_submit_push_batch (nghq_session *session,
+                                   const nghq_push_desc *descs, size_t n);
+
 /**
  * @brief Change request user data
  *
@@ -973,7 +1184,9 @@ extern int nghq_feed_headers (nghq_session *session, const nghq_header **hdrs,
  *    previous invocation of this function
  * @return NGHQ_REQUEST_CLOSED if the request is closed
  * @return NGHQ_ERROR if the session doesn't exist or another internal error
- *    occurs.
+ *    occurs, or if the body is being compressed by the library (see
+ *    nghq_session_set_content_encoding() and
+ *    nghq_session_enable_delta_encoding()).
  */
 extern int nghq_promise_data (nghq_session *session, size_t len, int final,
                               void *request_user_data);
@@ -1008,6 +1221,22 @@ extern ssize_t nghq_feed_payload_data(nghq_session *session, const uint8_t *buf,
                                       size_t len, int final,
                                       void *request_user_data);
 
+/**
+ * @brief Get the number of bytes waiting to be sent on a request
+ *
+ * This is the amount of HTTP frame data that has been given to a request or
+ * server push with nghq_feed_headers() and nghq_feed_payload_data(), that
+ * nghq_session_send() has not yet put into packets.
+ *
+ * @param session A running NGHQ session
+ * @param request_user_data The request or push to query
+ *
+ * @return The number of bytes queued on the request
+ * @return NGHQ_REQUEST_CLOSED if the request is not running
+ */
+extern ssize_t nghq_request_get_queued_bytes (nghq_session *session,
+                                              void *request_user_data);
+
 /**
  * @brief End the request
  *
@@ -1027,6 +1256,44 @@ extern ssize_t nghq_feed_payload_data(nghq_session *session, const uint8_t *buf,
 extern int nghq_end_request (nghq_session *session, nghq_error result,
                              void *request_user_data);
 
+/**
+ * @brief Get the body byte ranges of a request that have not been received
+ *
+ * Reports the holes in the body data delivered so far through
+ * nghq_on_data_recv_callback(), in ascending order. Only the first @p n holes
+ * are written to @p ranges, but the return value is always the total number
+ * of holes, so a caller may pass an @p n of 0 first to size its array.
+ *
+ * If the end of the body isn't known, either because the end of the stream
+ * hasn't been seen or because loss has made the framing of later body data
+ * unknown, then the last hole runs from the end of the known body data and
+ * has an end of NGHQ_BYTE_RANGE_END_UNKNOWN.
+ *
+ * If the session decodes content-encodings (see
+ * nghq_session_set_content_encoding()), the holes of a push that was decoded
+ * are byte ranges of the encoded body as it was sent, not offsets into the
+ * decoded body given to nghq_on_data_recv_callback(). Nothing after a hole is
+ * decoded, so the decoded body delivered ends where the first hole begins in
+ * the encoded body.
+ *
+ * This may be called from within nghq_on_request_close_callback(), for
+ * example to keep the data of an object that closed with NGHQ_MISSING_DATA
+ * and fetch the missing parts from elsewhere.
+ *
+ * @param session A running NGHQ session
+ * @param request_user_data The request to examine
+ * @param ranges An array of at least @p n byte ranges to fill, may be NULL if
+ *    @p n is 0
+ * @param n The size of @p ranges
+ *
+ * @return The number of holes in the request body
+ * @return NGHQ_REQUEST_CLOSED if @p request_user_data doesn't match a running
+ *    request
+ */
+extern ssize_t nghq_get_stream_holes (nghq_session *session,
+                                      void *request_user_data,
+                                      nghq_byte_range *ranges, size_t n);
+
 /*
  * Connection calls
  */
@@ -1119,6 +1386,436 @@ extern uint64_t nghq_get_max_promises (nghq_session *session);
  */
 extern int nghq_set_max_promises (nghq_session* session, uint64_t max_push);
 
+/*
+ * Object cache
+ */
+
+/* A completed server push held in the session's object cache */
+typedef struct {
+  const char *    authority;    /**< :authority of the push promise */
+  size_t          authority_len;
+  const char *    path;         /**< :path of the push promise */
+  size_t          path_len;
+  nghq_header **  headers;      /**< Response headers, then any trailers */
+  size_t          num_headers;
+  const uint8_t * body;
+  size_t          body_len;
+} nghq_cached_object;
+
+/**
+ * @brief Keep completed server pushes in an in-memory LRU cache
+ *
+ * When enabled, every push that completes successfully is kept with its
+ * response headers and body, indexed by the :authority and :path of its
+ * PUSH_PROMISE. Body data is written straight into a buffer owned by the
+ * cache as it is reassembled, and if the response carries a content-length
+ * that buffer is allocated once for the whole object.
+ *
+ * The least recently used objects are evicted to stay within @p max_bytes.
+ * If a push arrives for a resource that is already cached, then it replaces
+ * the cached copy unless both have the same ETag, or the new copy has an
+ * older Last-Modified (or Date) header than the cached one.
+ *
+ * The cache is still filled when there is no on_data_recv_callback interest
+ * in the body, so an application may serve objects entirely from the cache.
+ * Calling this again changes the budget, evicting objects if necessary, and a
+ * @p max_bytes of 0 disables and empties the cache.
+ *
+ * @param session A running NGHQ client session
+ * @param max_bytes The most memory the cache may use for objects
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_CLIENT_ONLY if @p session is a server instance
+ * @return NGHQ_OUT_OF_MEMORY if the cache couldn't be allocated
+ */
+extern int nghq_object_cache_enable (nghq_session *session, size_t max_bytes);
+
+/**
+ * @brief Find a cached object
+ *
+ * Looks up a completed push by the :authority and :path it was promised with.
+ * The returned object is held for the caller and stays valid, even if it is
+ * evicted or replaced in the meantime, until it is given back with
+ * nghq_object_cache_release().
+ *
+ * @param session A running NGHQ client session
+ * @param authority The :authority, or NULL if the promise didn't have one
+ * @param authority_len The length of @p authority
+ * @param path The :path
+ * @param path_len The length of @p path
+ *
+ * @return The cached object, or NULL if there isn't one or caching is disabled
+ */
+extern const nghq_cached_object *
+nghq_object_cache_lookup (nghq_session *session,
+                          const char *authority, size_t authority_len,
+                          const char *path, size_t path_len);
+
+/**
+ * @brief Give back an object returned by nghq_object_cache_lookup()
+ */
+extern void nghq_object_cache_release (nghq_session *session,
+                                       const nghq_cached_object *obj);
+
+/**
+ * @brief Get the number of bytes currently held by the object cache
+ */
+extern size_t nghq_object_cache_get_size (nghq_session *session);
+
+/**
+ * @brief Start keeping the state needed by nghq_session_snapshot()
+ *
+ * Headers delivered from now on are kept with their promise or stream, so that
+ * they can be saved in a snapshot. Call this before the first
+ * nghq_session_recv(), as promises received earlier can't be resumed.
+ * nghq_session_restore() also enables this.
+ *
+ * @param session A running NGHQ client session
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_CLIENT_ONLY if @p session is a server instance
+ */
+extern int nghq_session_enable_snapshots (nghq_session *session);
+
+/**
+ * @brief Deliver body data past lost DATA frame headers
+ *
+ * Body data is given to the on_data_recv_callback as soon as the header of
+ * the DATA frame it's in has been seen, but frame headers can only be found
+ * in order. So by default, a lost packet that held a DATA frame header holds
+ * back the rest of the body in reassembly until the stream times out.
+ *
+ * With this enabled, when the next frame header is missing but the body has
+ * been arriving in DATA frames of one length, the missing frame is taken to be
+ * another DATA frame of that length as long as the frame header that would
+ * follow it agrees. As the header may only be late, this is done once it has
+ * been missing for 100ms, using the set_timer_callback. The missing frame's
+ * data, and everything after it, is then delivered at the right body offsets.
+ * If the real header turns up later and doesn't match, the body has gone to
+ * the wrong offsets, so the request is cancelled and closed with
+ * NGHQ_HTTP_MALFORMED_FRAME. This suits bodies fed in fixed size blocks with
+ * nghq_feed_payload_data(), and receivers that write by offset. Bodies sent
+ * as a single DATA frame never need it.
+ *
+ * @param session A running NGHQ client session
+ * @param enable Non-zero to turn unordered delivery on, 0 to turn it off
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_CLIENT_ONLY if @p session is a server instance
+ */
+extern int nghq_session_set_unordered_delivery (nghq_session *session,
+                                                int enable);
+
+/**
+ * @brief Deliver body data in fewer, larger chunks
+ *
+ * Body data is normally given to the on_data_recv_callback a packet's worth
+ * at a time. With this set, contiguous body data is gathered for each request
+ * and given in one call once @p chunk_size bytes have built up, the body ends,
+ * the next data received isn't contiguous, or it has been held for
+ * @p max_delay seconds. Anything still held when a request closes is
+ * delivered before the close callback.
+ *
+ * Timing out held data needs the set_timer_callback. If @p max_delay is 0,
+ * data is only held until one of the other conditions is met.
+ *
+ * @param session A running NGHQ client session
+ * @param chunk_size Bytes to gather before delivering, or 0 to deliver data as
+ *    it arrives
+ * @param max_delay The most seconds to hold data for
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_CLIENT_ONLY if @p session is a server instance
+ */
+extern int nghq_session_set_body_coalescing (nghq_session *session,
+                                             size_t chunk_size,
+                                             double max_delay);
+
+/**
+ * @brief Find how many times a stream has been cancelled for going over a limit
+ *
+ * The reassembly limits are set in nghq_transport_settings. The header list
+ * limit is the max_header_list_size in nghq_settings. It is measured as in
+ * HTTP/3, as the length of each name and value plus 32 bytes per header. It
+ * is checked as each HEADERS or PUSH_PROMISE frame is decoded. A
+ * PUSH_PROMISE over the limit is ignored, so the push it promises is never
+ * delivered.
+ *
+ * @param session A running NGHQ session
+ * @param limit The limit to get the count for
+ *
+ * @return The number of streams cancelled, or promises ignored, for @p limit
+ */
+extern uint64_t nghq_session_get_limit_hits (nghq_session *session,
+                                             nghq_limit limit);
+
+/**
+ * @brief Find how much state a session is holding
+ *
+ * Counts the streams, promises and buffers a session has at the moment, for
+ * watching a long running session for growth. This walks every open stream,
+ * so it is better called every few seconds than on every packet.
+ *
+ * @param session A running NGHQ session
+ * @param sizes Filled in with the current sizes
+ *
+ * @return NGHQ_OK, or NGHQ_ERROR if @p session or @p sizes is NULL
+ */
+extern int nghq_session_get_sizes (nghq_session *session,
+                                   nghq_session_sizes *sizes);
+
+/**
+ * @brief Find where a session's time has gone
+ *
+ * Only available if the library was configured with --enable-phase-stats, as
+ * timing each phase costs a couple of clock reads. Time spent in one phase
+ * while inside another, such as an application callback made while a stream
+ * is reassembled, only counts towards the inner phase.
+ *
+ * @param session A running NGHQ session
+ * @param stats An array of NGHQ_PHASE_MAX entries to fill in, indexed by
+ *    nghq_phase
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_NOT_IMPLEMENTED if the library was built without phase stats
+ */
+extern int nghq_session_get_phase_stats (nghq_session *session,
+                                         nghq_phase_stats *stats);
+
+/**
+ * @brief Stamp what is sent with the time it was sent
+ *
+ * Each push's HEADERS gets a "nghq-sent-time" header with the time its
+ * headers were fed to nghq_feed_headers(), in microseconds since the Unix
+ * epoch. If @p per_packet is set, each packet also ends with a timestamp. It
+ * goes after a PADDING frame, so older receivers skip it as padding.
+ *
+ * A receiver with its clock in step with the sender's can then measure
+ * one-way latency, see nghq_session_get_latency().
+ *
+ * @param session A running NGHQ server session
+ * @param enable Non-zero to stamp pushes, 0 to stop
+ * @param per_packet Non-zero to stamp each packet as well
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_SERVER_ONLY if @p session is a client instance
+ */
+extern int nghq_session_enable_send_timestamps (nghq_session *session,
+                                                int enable, int per_packet);
+
+/**
+ * @brief Get the one-way latencies measured from a sender's timestamps
+ *
+ * A packet's receive time is taken as it is read from the recv_callback.
+ *
+ * @param session A running NGHQ client session
+ * @param kind Whether to get per-packet or per-push latencies
+ * @param hist Filled in with the latencies seen so far
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_CLIENT_ONLY if @p session is a server instance
+ */
+extern int nghq_session_get_latency (nghq_session *session,
+                                     nghq_latency_kind kind,
+                                     nghq_latency_histogram *hist);
+
+/**
+ * @brief Save the receive state of a session, so it can be resumed later
+ *
+ * Serialises the outstanding push promises, the push streams in progress
+ * with their offsets, received body ranges and any out-of-order data still
+ * being held, along with the largest packet number seen. The result is a
+ * compact binary blob that the application may write to a file and pass to
+ * nghq_session_restore() on a new session after a restart.
+ *
+ * Only promises and streams whose headers were delivered after
+ * nghq_session_enable_snapshots() was called are saved. Streams with a
+ * content encoding being decoded, or a delta being reconstructed, are left
+ * out. Any body data held back by nghq_session_set_body_coalescing() is delivered
+ * before this returns.
+ *
+ * @param session A running NGHQ client session
+ * @param buf A pointer which will be set to the snapshot, which the caller
+ *    must free().
+ *
+ * @return The length of the snapshot in @p buf
+ * @return NGHQ_CLIENT_ONLY if @p session is a server instance
+ * @return NGHQ_OUT_OF_MEMORY if the snapshot couldn't be allocated
+ */
+extern ssize_t nghq_session_snapshot (nghq_session *session, uint8_t **buf);
+
+/**
+ * @brief Resume the receive state saved by nghq_session_snapshot()
+ *
+ * Must be called on a new client session for the same session ID, before the
+ * first call to nghq_session_recv(). For each promise and stream in the
+ * snapshot, nghq_on_begin_promise_callback() is called with a NULL
+ * request_user_data, and the saved headers are delivered again through
+ * nghq_on_headers_callback() with NGHQ_HEADERS_FLAGS_RESUMED set, so that the
+ * application can re-attach its partially written output. Streams then carry
+ * on from where they stopped, and nghq_get_stream_holes() reports the body
+ * ranges that are still missing. Any promise the application refuses is
+ * dropped.
+ *
+ * @param session A new NGHQ client session
+ * @param buf The snapshot
+ * @param len The length of @p buf
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_CLIENT_ONLY if @p session is a server instance
+ * @return NGHQ_ERROR if @p session has already received packets
+ * @return NGHQ_BAD_SNAPSHOT if @p buf is not a snapshot of this session, or is
+ *    damaged. Part of it may have been restored, so free the session and start
+ *    a new one.
+ * @return NGHQ_OUT_OF_MEMORY if the state couldn't be allocated
+ */
+extern int nghq_session_restore (nghq_session *session, const uint8_t *buf,
+                                 size_t len);
+
+/*
+ * Content encoding
+ */
+
+typedef enum {
+  NGHQ_CONTENT_ENCODING_NONE = 0,
+  NGHQ_CONTENT_ENCODING_DEFLATE = 1, /* Needs zlib */
+  NGHQ_CONTENT_ENCODING_GZIP = 2,    /* Needs zlib */
+  NGHQ_CONTENT_ENCODING_ZSTD = 3,    /* Needs libzstd */
+} nghq_content_encoding;
+
+/**
+ * @brief Compress pushed bodies, or decompress received ones
+ *
+ * On a server session, the body of every push whose response headers don't
+ * already have a content-encoding is compressed with @p encoding as it is fed
+ * in with nghq_feed_payload_data() or nghq_submit_push_batch(), and a
+ * content-encoding header is added. Such pushes can't use nghq_promise_data().
+ *
+ * On a client session, any encoding other than NGHQ_CONTENT_ENCODING_NONE
+ * turns on decoding of received pushes whose content-encoding is supported.
+ * The content-encoding header is not passed to nghq_on_headers_callback(),
+ * and nghq_on_data_recv_callback() is given the decoded body with offsets into
+ * the decoded body. Data received out of order is held until the gap before
+ * it is filled, so nothing after a lost packet is delivered. The object cache,
+ * snapshots and nghq_get_stream_holes() still work on the encoded body.
+ *
+ * For small objects, a dictionary shared by the sender and receivers helps a
+ * great deal. It is used with zstd and deflate, but not gzip. See
+ * nghq_train_content_dictionary().
+ *
+ * @param session A running NGHQ session
+ * @param encoding The encoding to use, or NGHQ_CONTENT_ENCODING_NONE to stop
+ * @param level The compression level, or 0 for the default for @p encoding
+ * @param dict The dictionary, or NULL. This is copied.
+ * @param dict_len The length of @p dict
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_NOT_IMPLEMENTED if the library was built without @p encoding
+ * @return NGHQ_OUT_OF_MEMORY if the dictionary couldn't be copied
+ */
+extern int nghq_session_set_content_encoding (nghq_session *session,
+                                              nghq_content_encoding encoding,
+                                              int level, const uint8_t *dict,
+                                              size_t dict_len);
+
+/**
+ * @brief Train a compression dictionary from example objects
+ *
+ * Builds a zstd dictionary to give to nghq_session_set_content_encoding() from
+ * a set of typical bodies, which are concatenated in @p samples.
+ *
+ * @param samples All the sample bodies, one after another
+ * @param sample_lens The length of each sample in @p samples
+ * @param num_samples The number of entries in @p sample_lens
+ * @param dict The buffer to write the dictionary into
+ * @param dict_capacity The size of @p dict, around 100KB is typical
+ *
+ * @return The length of the dictionary written to @p dict
+ * @return NGHQ_ERROR if training failed, usually from too few samples
+ * @return NGHQ_NOT_IMPLEMENTED if the library was built without libzstd
+ */
+extern ssize_t nghq_train_content_dictionary (const uint8_t *samples,
+                                              const size_t *sample_lens,
+                                              size_t num_samples,
+                                              uint8_t *dict,
+                                              size_t dict_capacity);
+
+/**
+ * @brief Send or receive pushes of a path as deltas against an earlier version
+ *
+ * On a server session, pushes promised with a :path of @p path are sent as a
+ * binary delta against the last version of that path which was pushed in
+ * full, known as the base. The first push of the path, and every
+ * @p full_every'th push after it, is sent in full and becomes the new base, so
+ * receivers that join late or lose the base can pick the path up again. A
+ * delta response carries "im" and "delta-base" headers, naming the algorithm
+ * and the ETag of the base. Full responses are given an ETag if the
+ * application didn't set one. The delta is made with zstd, or with deflate if
+ * that's the session's content encoding or zstd isn't available, in which case
+ * only the last 32KiB of the base can be referenced.
+ *
+ * On a client session, the last full body of @p path is kept and deltas
+ * against it are reconstructed, so the application sees full bodies without
+ * the "im" and "delta-base" headers. A delta whose base isn't held, for
+ * example because it was lost, has its headers delivered but no body, and
+ * closes with NGHQ_MISSING_DATA. Bodies of the path are always decoded, as in
+ * nghq_session_set_content_encoding(). The object cache and snapshots hold
+ * deltas as they were received, and bases are not kept in snapshots.
+ *
+ * Deltas are made while the body is fed in, so nghq_promise_data() can't be
+ * used with them. Calling this again for the same path changes @p full_every.
+ *
+ * @param session A running NGHQ session
+ * @param path The :path to delta encode
+ * @param path_len The length of @p path
+ * @param full_every How often to send a full version, 1 for every time.
+ *    Ignored on a client session.
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_ERROR if @p path is missing or @p full_every is 0
+ * @return NGHQ_NOT_IMPLEMENTED if the library was built without zstd or zlib
+ * @return NGHQ_OUT_OF_MEMORY if the path couldn't be added
+ */
+extern int nghq_session_enable_delta_encoding (nghq_session *session,
+                                               const char *path,
+                                               size_t path_len,
+                                               unsigned int full_every);
+
+/**
+ * @brief Let receivers join a multicast session part way through
+ *
+ * A receiver that joins after a push was promised never sees its
+ * PUSH_PROMISE, and can't tell where the next frame starts on the request
+ * stream that carries them. On a server session, this sends a beacon every
+ * @p interval seconds, using the set_timer_callback, listing every push still
+ * being sent: its PUSH_PROMISE, the stream it's on and the start of that
+ * stream up to the first DATA frame header. A beacon also says where the next
+ * PUSH_PROMISE will begin. Only pushes promised after this is called are
+ * listed. An @p interval of 0 stops the beacons.
+ *
+ * On a client session, this holds on to promises that arrive part way through
+ * until a beacon is received, then starts every push listed in it as if it
+ * had been promised normally. Pushes whose stream had already started are
+ * joined too, and the body ranges missed before joining are reported as holes
+ * when they close. Pushes with a body in a single DATA frame, as made by
+ * nghq_promise_data(), can be joined at any point, but otherwise body data
+ * after the first missing frame header can't be delivered. @p interval is
+ * ignored on a client session.
+ *
+ * Each beacon is sent in a packet of its own, after a PADDING frame, so
+ * receivers that don't call this, including those built before beacons were
+ * added, take it as padding and lose nothing by skipping it.
+ *
+ * @param session A running NGHQ multicast session
+ * @param interval Seconds between beacons from a server session
+ *
+ * @return NGHQ_OK if the call succeeds
+ * @return NGHQ_ERROR if @p session isn't a multicast session or a server
+ *    session has no set_timer_callback
+ */
+extern int nghq_session_enable_push_beacons (nghq_session *session,
+                                             double interval);
+
 struct nghq_callbacks {
   nghq_recv_callback              recv_callback;
   nghq_decrypt_callback           decrypt_callback;
@@ -1135,6 +1832,8 @@ struct nghq_callbacks {
   nghq_set_timer_callback         set_timer_callback;
   nghq_cancel_timer_callback      cancel_timer_callback;
   nghq_reset_timer_callback       reset_timer_callback;
+  nghq_on_request_close_holes_callback on_request_close_holes_callback;
+  nghq_on_send_ready_callback     on_send_ready_callback;
 };
 
 #ifdef __cplusplus
@@ -0,0 +1,423 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+#if HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include "content_coding.h"
+#include "io_buf.h"
+
+#if HAVE_ZLIB || HAVE_ZSTD
+/* Smallest amount of output space to offer the codec on each pass */
+#define CODER_OUT_CHUNK 4096
+#endif
+
+struct nghq_content_coder {
+  nghq_content_encoding encoding;
+  int             decode;
+  int             finished;   /* end of body reached, or the codec failed */
+  size_t          in_offset;  /* next encoded offset to decode */
+  size_t          out_offset; /* decoded bytes produced so far */
+  nghq_io_buf *   held;       /* out of order encoded data, ascending */
+  uint8_t *       dict;       /* for inflate, which asks for it mid-stream */
+  size_t          dict_len;
+#if HAVE_ZLIB
+  z_stream        zs;
+#endif
+#if HAVE_ZSTD
+  ZSTD_CCtx *     cctx;
+  ZSTD_DCtx *     dctx;
+#endif
+};
+
+static const struct {
+  nghq_content_encoding encoding;
+  const char *name;
+} _encoding_names[] = {
+  { NGHQ_CONTENT_ENCODING_DEFLATE, "deflate" },
+  { NGHQ_CONTENT_ENCODING_GZIP, "gzip" },
+  { NGHQ_CONTENT_ENCODING_ZSTD, "zstd" },
+};
+
+int nghq_content_encoding_supported (nghq_content_encoding encoding) {
+  switch (encoding) {
+#if HAVE_ZLIB
+    case NGHQ_CONTENT_ENCODING_DEFLATE:
+    case NGHQ_CONTENT_ENCODING_GZIP:
+      return 1;
+#endif
+#if HAVE_ZSTD
+    case NGHQ_CONTENT_ENCODING_ZSTD:
+      return 1;
+#endif
+    default:
+      break;
+  }
+  return 0;
+}
+
+nghq_content_encoding nghq_content_encoding_from_name (const uint8_t *name,
+                                                       size_t len) {
+  size_t i;
+  for (i = 0; i < sizeof(_encoding_names)/sizeof(_encoding_names[0]); i++) {
+    if ((strlen (_encoding_names[i].name) == len) &&
+        (strncasecmp (_encoding_names[i].name, (const char *) name,
+                      len) == 0) &&
+        nghq_content_encoding_supported (_encoding_names[i].encoding)) {
+      return _encoding_names[i].encoding;
+    }
+  }
+  return NGHQ_CONTENT_ENCODING_NONE;
+}
+
+const char *nghq_content_encoding_name (nghq_content_encoding encoding) {
+  size_t i;
+  for (i = 0; i < sizeof(_encoding_names)/sizeof(_encoding_names[0]); i++) {
+    if (_encoding_names[i].encoding == encoding) {
+      return _encoding_names[i].name;
+    }
+  }
+  return NULL;
+}
+
+nghq_content_coder *nghq_content_coder_new (nghq_content_encoding encoding,
+                                            int decode, int level,
+                                            const uint8_t *dict,
+                                            size_t dict_len) {
+  nghq_content_coder *coder;
+  int ok = 0;
+
+  if (!nghq_content_encoding_supported (encoding)) return NULL;
+
+  coder = (nghq_content_coder *) calloc (1, sizeof(nghq_content_coder));
+  if (coder == NULL) return NULL;
+
+  coder->encoding = encoding;
+  coder->decode = decode;
+  if (dict == NULL) dict_len = 0;
+
+  switch (encoding) {
+#if HAVE_ZLIB
+    case NGHQ_CONTENT_ENCODING_DEFLATE:
+    case NGHQ_CONTENT_ENCODING_GZIP: {
+      /* "deflate" is the zlib format, gzip needs 16 added to the window */
+      int window_bits = (encoding == NGHQ_CONTENT_ENCODING_GZIP)?(31):(15);
+      if (decode) {
+        ok = (inflateInit2 (&coder->zs, window_bits) == Z_OK);
+        if (ok && dict_len && (encoding == NGHQ_CONTENT_ENCODING_DEFLATE)) {
+          coder->dict = (uint8_t *) malloc (dict_len);
+          ok = (coder->dict != NULL);
+          if (ok) {
+            memcpy (coder->dict, dict, dict_len);
+            coder->dict_len = dict_len;
+          } else {
+            inflateEnd (&coder->zs);
+          }
+        }
+      } else {
+        ok = (deflateInit2 (&coder->zs, (level)?(level):(Z_DEFAULT_COMPRESSION),
+                            Z_DEFLATED, window_bits, 8,
+                            Z_DEFAULT_STRATEGY) == Z_OK);
+        /* gzip has nowhere to say a dictionary was used */
+        if (ok && dict_len && (encoding == NGHQ_CONTENT_ENCODING_DEFLATE)) {
+          ok = (deflateSetDictionary (&coder->zs, dict,
+                                      (uInt) dict_len) == Z_OK);
+          if (!ok) deflateEnd (&coder->zs);
+        }
+      }
+      break;
+    }
+#endif
+#if HAVE_ZSTD
+    case NGHQ_CONTENT_ENCODING_ZSTD:
+      if (decode) {
+        coder->dctx = ZSTD_createDCtx ();
+        ok = (coder->dctx != NULL) &&
+            (!dict_len ||
+             !ZSTD_isError (ZSTD_DCtx_loadDictionary (coder->dctx, dict,
+                                                      dict_len)));
+      } else {
+        coder->cctx = ZSTD_createCCtx ();
+        ok = (coder->cctx != NULL) &&
+            !ZSTD_isError (ZSTD_CCtx_setParameter (coder->cctx,
+                                   ZSTD_c_compressionLevel,
+                                   (level)?(level):(ZSTD_CLEVEL_DEFAULT))) &&
+            (!dict_len ||
+             !ZSTD_isError (ZSTD_CCtx_loadDictionary (coder->cctx, dict,
+                                                      dict_len)));
+      }
+      if (!ok) {
+        ZSTD_freeCCtx (coder->cctx);
+        ZSTD_freeDCtx (coder->dctx);
+      }
+      break;
+#endif
+    default:
+      (void) dict_len; /* only read by the codecs built in */
+      break;
+  }
+
+  if (!ok) {
+    free (coder);
+    return NULL;
+  }
+  return coder;
+}
+
+void nghq_content_coder_free (nghq_content_coder *coder) {
+  if (coder == NULL) return;
+
+  switch (coder->encoding) {
+#if HAVE_ZLIB
+    case NGHQ_CONTENT_ENCODING_DEFLATE:
+    case NGHQ_CONTENT_ENCODING_GZIP:
+      if (coder->decode) {
+        inflateEnd (&coder->zs);
+      } else {
+        deflateEnd (&coder->zs);
+      }
+      break;
+#endif
+#if HAVE_ZSTD
+    case NGHQ_CONTENT_ENCODING_ZSTD:
+      ZSTD_freeCCtx (coder->cctx);
+      ZSTD_freeDCtx (coder->dctx);
+      break;
+#endif
+    default:
+      break;
+  }
+  nghq_io_buf_clear (&coder->held);
+  free (coder->dict);
+  free (coder);
+}
+
+#if HAVE_ZLIB || HAVE_ZSTD
+/*
+ * Make sure there's at least CODER_OUT_CHUNK bytes free at the end of *out
+ */
+static int _out_reserve (uint8_t **out, size_t *cap, size_t used) {
+  if (*cap - used < CODER_OUT_CHUNK) {
+    size_t new_cap = (*cap)?(*cap * 2):(CODER_OUT_CHUNK);
+    uint8_t *grown;
+    while (new_cap - used < CODER_OUT_CHUNK) new_cap *= 2;
+    grown = (uint8_t *) realloc (*out, new_cap);
+    if (grown == NULL) return NGHQ_OUT_OF_MEMORY;
+    *out = grown;
+    *cap = new_cap;
+  }
+  return NGHQ_OK;
+}
+#endif
+
+/*
+ * Run @p in through the codec, appending everything it produces to *out.
+ * Sets coder->finished once the end of the body has been produced or seen.
+ */
+static int _coder_run (nghq_content_coder *coder, const uint8_t *in,
+                       size_t in_len, int final, uint8_t **out,
+                       size_t *out_len) {
+  int rv = NGHQ_OK;
+
+  *out = NULL;
+  *out_len = 0;
+
+  switch (coder->encoding) {
+#if HAVE_ZLIB
+    case NGHQ_CONTENT_ENCODING_DEFLATE:
+    case NGHQ_CONTENT_ENCODING_GZIP: {
+      size_t cap = 0;
+      int zrv = Z_OK;
+      coder->zs.next_in = (Bytef *) in;
+      coder->zs.avail_in = (uInt) in_len;
+      do {
+        rv = _out_reserve (out, &cap, *out_len);
+        if (rv != NGHQ_OK) break;
+        coder->zs.next_out = *out + *out_len;
+        coder->zs.avail_out = (uInt) (cap - *out_len);
+        if (coder->decode) {
+          zrv = inflate (&coder->zs, Z_NO_FLUSH);
+          if ((zrv == Z_NEED_DICT) && coder->dict_len) {
+            zrv = inflateSetDictionary (&coder->zs, coder->dict,
+                                        (uInt) coder->dict_len);
+          }
+        } else {
+          zrv = deflate (&coder->zs, (final)?(Z_FINISH):(Z_NO_FLUSH));
+        }
+        *out_len = cap - coder->zs.avail_out;
+        if ((zrv != Z_OK) && (zrv != Z_BUF_ERROR)) break;
+      } while ((coder->zs.avail_in > 0) || (coder->zs.avail_out == 0) ||
+               (final && !coder->decode));
+      if (zrv == Z_STREAM_END) {
+        coder->finished = 1;
+      } else if ((rv == NGHQ_OK) && (zrv != Z_OK) && (zrv != Z_BUF_ERROR)) {
+        rv = NGHQ_ERROR;
+      }
+      break;
+    }
+#endif
+#if HAVE_ZSTD
+    case NGHQ_CONTENT_ENCODING_ZSTD: {
+      ZSTD_inBuffer input = { in, in_len, 0 };
+      size_t cap = 0;
+      size_t zrv;
+      do {
+        ZSTD_outBuffer output;
+        rv = _out_reserve (out, &cap, *out_len);
+        if (rv != NGHQ_OK) break;
+        output.dst = *out;
+        output.size = cap;
+        output.pos = *out_len;
+        if (coder->decode) {
+          zrv = ZSTD_decompressStream (coder->dctx, &output, &input);
+        } else {
+          zrv = ZSTD_compressStream2 (coder->cctx, &output, &input,
+                                      (final)?(ZSTD_e_end):(ZSTD_e_continue));
+        }
+        *out_len = output.pos;
+        if (ZSTD_isError (zrv)) {
+          rv = NGHQ_ERROR;
+          break;
+        }
+        if ((zrv == 0) && (coder->decode || final)) {
+          coder->finished = (input.pos == input.size);
+          if (coder->finished) break;
+        }
+      } while ((input.pos < input.size) || (output.pos == output.size) ||
+               (final && !coder->decode));
+      break;
+    }
+#endif
+    default:
+      rv = NGHQ_ERROR;
+      break;
+  }
+
+  if (rv != NGHQ_OK) {
+    coder->finished = 1;
+    free (*out);
+    *out = NULL;
+    *out_len = 0;
+  }
+  return rv;
+}
+
+int nghq_content_encode (nghq_content_coder *coder, const uint8_t *in,
+                         size_t in_len, int final, uint8_t **out,
+                         size_t *out_len) {
+  if ((coder == NULL) || coder->decode || coder->finished) return NGHQ_ERROR;
+  return _coder_run (coder, in, in_len, final, out, out_len);
+}
+
+/*
+ * Decode data that starts at or before the next expected offset.
+ */
+static int _decode_in_order (nghq_content_coder *coder, const uint8_t *data,
+                             size_t len, size_t offset, int final,
+                             nghq_content_sink sink, void *sink_data) {
+  uint8_t *out;
+  size_t out_len, skip = coder->in_offset - offset;
+  int rv;
+
+  if (skip >= len && !final) return NGHQ_OK; /* already decoded */
+  if (skip > len) skip = len;
+
+  rv = _coder_run (coder, data + skip, len - skip, final, &out, &out_len);
+  if (rv != NGHQ_OK) return rv;
+
+  if (offset + len > coder->in_offset) coder->in_offset = offset + len;
+  if ((out_len > 0) || final) {
+    sink (sink_data, out, out_len, coder->out_offset, final);
+    coder->out_offset += out_len;
+  }
+  free (out);
+  if (final) coder->finished = 1;
+  return NGHQ_OK;
+}
+
+int nghq_content_decode (nghq_content_coder *coder, const uint8_t *data,
+                         size_t len, size_t offset, int final,
+                         nghq_content_sink sink, void *sink_data) {
+  int rv;
+
+  if ((coder == NULL) || !coder->decode) return NGHQ_ERROR;
+  if (coder->finished) return NGHQ_OK;
+
+  if (offset > coder->in_offset) {
+    /* Hold on to it until the gap before it is filled */
+    nghq_io_buf **pos = &coder->held;
+    nghq_io_buf *held = nghq_io_buf_alloc (NULL, len, final, offset);
+    if (held == NULL) return NGHQ_OUT_OF_MEMORY;
+    memcpy (held->buf, data, len);
+    while ((*pos != NULL) && ((*pos)->offset < offset)) {
+      pos = &(*pos)->next_buf;
+    }
+    held->next_buf = *pos;
+    *pos = held;
+    return NGHQ_OK;
+  }
+
+  rv = _decode_in_order (coder, data, len, offset, final, sink, sink_data);
+
+  while ((rv == NGHQ_OK) && !coder->finished && (coder->held != NULL) &&
+         (coder->held->offset <= coder->in_offset)) {
+    nghq_io_buf *next = coder->held;
+    rv = _decode_in_order (coder, next->buf, next->buf_len, next->offset,
+                           next->complete, sink, sink_data);
+    nghq_io_buf_pop (&coder->held);
+  }
+
+  if (coder->finished) nghq_io_buf_clear (&coder->held);
+  return rv;
+}
+
+ssize_t nghq_train_content_dictionary (const uint8_t *samples,
+                                       const size_t *sample_lens,
+                                       size_t num_samples, uint8_t *dict,
+                                       size_t dict_capacity) {
+#if HAVE_ZSTD
+  size_t rv = ZDICT_trainFromBuffer (dict, dict_capacity, samples,
+                                     sample_lens, (unsigned) num_samples);
+  if (ZDICT_isError (rv)) return NGHQ_ERROR;
+  return (ssize_t) rv;
+#else
+  return NGHQ_NOT_IMPLEMENTED;
+#endif
+}
+
+// vim:ts=8:sts=2:sw=2:expandtab:
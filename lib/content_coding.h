@@ -0,0 +1,110 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIB_CONTENT_CODING_H_
+#define LIB_CONTENT_CODING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "nghq/nghq.h"
+
+struct nghq_content_coder;
+typedef struct nghq_content_coder nghq_content_coder;
+
+/* Receives decoded body data, in order, from nghq_content_decode() */
+typedef void (*nghq_content_sink) (void *sink_data, const uint8_t *data,
+                                   size_t len, size_t offset, int final);
+
+/**
+ * @brief Look up a content-encoding header value
+ *
+ * @return The matching encoding, or NGHQ_CONTENT_ENCODING_NONE if it isn't
+ *    one this build of the library can decode.
+ */
+nghq_content_encoding nghq_content_encoding_from_name (const uint8_t *name,
+                                                       size_t len);
+
+/**
+ * @brief The content-encoding header value for an encoding
+ */
+const char *nghq_content_encoding_name (nghq_content_encoding encoding);
+
+/**
+ * @brief Check whether this build of the library supports an encoding
+ */
+int nghq_content_encoding_supported (nghq_content_encoding encoding);
+
+/**
+ * @brief Create a new compressor or decompressor for a single body
+ *
+ * @param encoding The content encoding to use
+ * @param decode Non-zero to decompress, zero to compress
+ * @param level Compression level, or 0 for the default of @p encoding
+ * @param dict Preset dictionary shared with the peer, or NULL. The coder
+ *    keeps its own copy if it needs one.
+ * @param dict_len The length of @p dict
+ *
+ * @return The new coder, or NULL if @p encoding isn't supported or memory
+ *    couldn't be allocated.
+ */
+nghq_content_coder *nghq_content_coder_new (nghq_content_encoding encoding,
+                                            int decode, int level,
+                                            const uint8_t *dict,
+                                            size_t dict_len);
+
+void nghq_content_coder_free (nghq_content_coder *coder);
+
+/**
+ * @brief Compress the next chunk of a body
+ *
+ * The compressed output, which may be empty until enough input has been
+ * given, is returned in a newly allocated @p out.
+ *
+ * @param final Non-zero if @p in is the end of the body
+ *
+ * @return NGHQ_OK, NGHQ_OUT_OF_MEMORY or NGHQ_ERROR if the compressor failed
+ */
+int nghq_content_encode (nghq_content_coder *coder, const uint8_t *in,
+                         size_t in_len, int final, uint8_t **out,
+                         size_t *out_len);
+
+/**
+ * @brief Decompress received body data
+ *
+ * Data can be given in any order. Anything beyond the next expected offset is
+ * held until the gap before it has been filled. Decoded data is passed to
+ * @p sink in order, with offsets into the decoded body.
+ *
+ * @param offset The offset of @p data in the encoded body
+ * @param final Non-zero if @p data ends the encoded body
+ *
+ * @return NGHQ_OK, NGHQ_OUT_OF_MEMORY or NGHQ_ERROR if the data couldn't be
+ *    decoded, after which the coder will not produce any more output.
+ */
+int nghq_content_decode (nghq_content_coder *coder, const uint8_t *data,
+                         size_t len, size_t offset, int final,
+                         nghq_content_sink sink, void *sink_data);
+
+#endif /* LIB_CONTENT_CODING_H_ */
@@ -0,0 +1,128 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nghq/nghq.h"
+#include "delta.h"
+
+nghq_delta_path *nghq_delta_path_find (nghq_delta_path *paths,
+                                       const uint8_t *path, size_t path_len) {
+  for (; paths != NULL; paths = paths->next) {
+    if ((paths->path_len == path_len) &&
+        (memcmp (paths->path, path, path_len) == 0)) {
+      return paths;
+    }
+  }
+  return NULL;
+}
+
+int nghq_delta_path_add (nghq_delta_path **paths, const char *path,
+                         size_t path_len, unsigned int full_every) {
+  nghq_delta_path *entry = nghq_delta_path_find (*paths,
+                                                 (const uint8_t *) path,
+                                                 path_len);
+  if (entry == NULL) {
+    entry = (nghq_delta_path *) calloc (1, sizeof(nghq_delta_path));
+    if (entry == NULL) {
+      return NGHQ_OUT_OF_MEMORY;
+    }
+    entry->path = (char *) malloc (path_len);
+    if (entry->path == NULL) {
+      free (entry);
+      return NGHQ_OUT_OF_MEMORY;
+    }
+    memcpy (entry->path, path, path_len);
+    entry->path_len = path_len;
+    entry->next = *paths;
+    *paths = entry;
+  }
+  entry->full_every = full_every;
+  return NGHQ_OK;
+}
+
+void nghq_delta_paths_free (nghq_delta_path *paths) {
+  while (paths != NULL) {
+    nghq_delta_path *next = paths->next;
+    nghq_delta_version_free (paths->base);
+    free (paths->path);
+    free (paths);
+    paths = next;
+  }
+}
+
+void nghq_delta_path_set_base (nghq_delta_path *path,
+                               nghq_delta_version *version) {
+  nghq_delta_version_free (path->base);
+  path->base = version;
+  path->since_full = 0;
+}
+
+nghq_delta_version *nghq_delta_version_new (const uint8_t *etag,
+                                            size_t etag_len) {
+  nghq_delta_version *version =
+      (nghq_delta_version *) calloc (1, sizeof(nghq_delta_version));
+  if (version == NULL) {
+    return NULL;
+  }
+  version->etag = (uint8_t *) malloc (etag_len);
+  if (version->etag == NULL) {
+    free (version);
+    return NULL;
+  }
+  memcpy (version->etag, etag, etag_len);
+  version->etag_len = etag_len;
+  return version;
+}
+
+int nghq_delta_version_write (nghq_delta_version *version,
+                              const uint8_t *data, size_t len, size_t off) {
+  if (off + len > version->body_alloc) {
+    size_t alloc = (version->body_alloc)?(version->body_alloc):(4096);
+    uint8_t *grown;
+    while (alloc < off + len) alloc *= 2;
+    grown = (uint8_t *) realloc (version->body, alloc);
+    if (grown == NULL) {
+      return NGHQ_OUT_OF_MEMORY;
+    }
+    version->body = grown;
+    version->body_alloc = alloc;
+  }
+  memcpy (version->body + off, data, len);
+  if (off + len > version->body_len) {
+    version->body_len = off + len;
+  }
+  return NGHQ_OK;
+}
+
+void nghq_delta_version_free (nghq_delta_version *version) {
+  if (version == NULL) return;
+  free (version->etag);
+  free (version->body);
+  free (version);
+}
+
+// vim:ts=8:sts=2:sw=2:expandtab:
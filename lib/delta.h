@@ -0,0 +1,92 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIB_DELTA_H_
+#define LIB_DELTA_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "nghq_internal.h"
+
+/* A complete body of one version of a resource, identified by its ETag */
+struct nghq_delta_version {
+  uint8_t *       etag;
+  size_t          etag_len;
+  uint8_t *       body;
+  size_t          body_len;
+  size_t          body_alloc;
+};
+
+/* A :path whose pushes are delta encoded, and the version deltas are against */
+struct nghq_delta_path {
+  char *                  path;
+  size_t                  path_len;
+  unsigned int            full_every;
+  unsigned int            since_full;  /* deltas sent since the base */
+  nghq_delta_version *    base;
+  struct nghq_delta_path *next;
+};
+
+/**
+ * @brief Find the entry for @p path in a list of delta encoded paths
+ *
+ * @return The entry, or NULL if @p path isn't delta encoded
+ */
+nghq_delta_path *nghq_delta_path_find (nghq_delta_path *paths,
+                                       const uint8_t *path, size_t path_len);
+
+/**
+ * @brief Add @p path to a list, or update its entry if it's already there
+ *
+ * @return NGHQ_OK or NGHQ_OUT_OF_MEMORY
+ */
+int nghq_delta_path_add (nghq_delta_path **paths, const char *path,
+                         size_t path_len, unsigned int full_every);
+
+void nghq_delta_paths_free (nghq_delta_path *paths);
+
+/**
+ * @brief Replace the base of @p path with @p version, taking ownership of it
+ */
+void nghq_delta_path_set_base (nghq_delta_path *path,
+                               nghq_delta_version *version);
+
+/**
+ * @brief Start collecting a version of a body, @p etag is copied
+ */
+nghq_delta_version *nghq_delta_version_new (const uint8_t *etag,
+                                            size_t etag_len);
+
+/**
+ * @brief Write body data into a version at body offset @p off
+ *
+ * @return NGHQ_OK or NGHQ_OUT_OF_MEMORY
+ */
+int nghq_delta_version_write (nghq_delta_version *version,
+                              const uint8_t *data, size_t len, size_t off);
+
+void nghq_delta_version_free (nghq_delta_version *version);
+
+#endif /* LIB_DELTA_H_ */
@@ -112,6 +112,28 @@ ssize_t create_data_frame(nghq_session *session, const uint8_t* block,
   return (ssize_t) block_to_write;
 }
 
+ssize_t append_data_frame(nghq_session *session, const uint8_t* block,
+                          size_t block_len, uint8_t** frame,
+                          size_t* frame_len) {
+  size_t data_frame_len = _calculate_frame_size (block_len,
+                                                 NGHQ_FRAME_TYPE_DATA);
+  uint8_t *grown = (uint8_t *) realloc (*frame, *frame_len + data_frame_len);
+  if (grown == NULL) {
+    return NGHQ_OUT_OF_MEMORY;
+  }
+
+  _create_frame(NGHQ_FRAME_TYPE_DATA, block_len, block, block_len,
+                grown + *frame_len, data_frame_len);
+
+  NGHQ_LOG_DEBUG (session, "Appended DATA frame of size %lu bytes\n",
+                  block_len);
+
+  *frame = grown;
+  *frame_len += data_frame_len;
+
+  return (ssize_t) block_len;
+}
+
 /*
  *  0                   1                   2                   3
  *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
@@ -70,6 +70,27 @@ ssize_t create_data_frame(nghq_session *session, const uint8_t* block,
                           size_t block_len, size_t full_len, uint8_t** frame,
                           size_t* frame_len);
 
+/**
+ * @brief Append a whole block of data as a DATA frame to an existing buffer
+ *
+ * Grows the buffer at @p frame, which may be NULL, by enough to hold a DATA
+ * frame carrying all of @p block and writes the frame at the end of it. This
+ * lets a HEADERS frame and the body that follows it share one allocation.
+ *
+ * @param session The NGHQ session for debug logging context
+ * @param block The buffer containing the data block to package
+ * @param block_len The length of @p block
+ * @param frame The buffer to append the DATA frame to
+ * @param frame_len The length of @p frame, updated with the new length
+ *
+ * @return The number of bytes from @p block that was written into @p frame
+ * @return NGHQ_OUT_OF_MEMORY if @p frame couldn't be grown, in which case it
+ *    is left untouched
+ */
+ssize_t append_data_frame(nghq_session *session, const uint8_t* block,
+                          size_t block_len, uint8_t** frame,
+                          size_t* frame_len);
+
 /**
  * @brief Package a series of name-value pair headers into a HEADERS frame
  *
@@ -31,6 +31,7 @@
 #include "header_compression.h"
 #include "util.h"
 #include "debug.h"
+#include "phase_stats.h"
 
 /*
  * Parse the frame header - returns the length of the frame payload, excluding
@@ -54,20 +55,63 @@ static uint64_t _get_frame_payload_length (uint8_t* buf, nghq_frame_type *type,
  * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
  */
 
+void frame_header_parser_reset (nghq_frame_hdr_parser *parser) {
+  memset (parser, 0, sizeof(*parser));
+}
+
+int parse_frame_header_bytes (nghq_frame_hdr_parser *parser,
+                              const uint8_t *buf, size_t len, size_t *used,
+                              nghq_frame_type *type, uint64_t *payload_len) {
+  size_t i = 0;
+
+  while (i < len) {
+    uint8_t b = buf[i++];
+    parser->hdr_len++;
+    if (parser->need == 0) {
+      /* first byte of a varint, the top two bits give its length */
+      parser->need = (1 << (b >> 6)) - 1;
+      parser->value = b & 0x3f;
+    } else {
+      parser->value = (parser->value << 8) | b;
+      parser->need--;
+    }
+    if (parser->need > 0) continue;
+
+    if (parser->field == 0) {
+      parser->type = parser->value;
+      if (parser->type > NGHQ_FRAME_TYPE_MAX_PUSH_ID) {
+        *used = i;
+        return NGHQ_ERROR;
+      }
+      parser->field = 1;
+    } else {
+      *used = i;
+      *type = parser->type;
+      *payload_len = parser->value;
+      return 1;
+    }
+  }
+
+  *used = i;
+  return 0;
+}
+
 ssize_t parse_frame_header (nghq_io_buf* buf, nghq_frame_type *type) {
+  nghq_frame_hdr_parser parser;
   uint64_t frame_length = 0;
-  size_t header_offset = 0;
+  size_t used = 0;
+  int rv;
 
   if (buf == NULL) return 0;
 
-  *type = _get_varlen_int(buf->send_pos, &header_offset, 16);
-  frame_length = _get_varlen_int(buf->send_pos + header_offset, &header_offset, 16);
-
-  if (*type < NGHQ_FRAME_TYPE_DATA || *type > NGHQ_FRAME_TYPE_MAX_PUSH_ID) {
-    return NGHQ_ERROR;
+  frame_header_parser_reset (&parser);
+  rv = parse_frame_header_bytes (&parser, buf->send_pos, buf->remaining, &used,
+                                 type, &frame_length);
+  if (rv <= 0) {
+    return rv;
   }
 
-  return frame_length + header_offset;
+  return frame_length + parser.hdr_len;
 }
 
 /*
@@ -130,8 +174,10 @@ ssize_t parse_headers_frame (nghq_session *session,
     return expected_header_block_len + header_len;
   }
 
+  NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_HEADER_DECODE);
   result = nghq_inflate_hdr(session, ctx, buf->send_pos + header_len,
                             expected_header_block_len, 1, hdrs, num_hdrs);
+  NGHQ_PHASE_END (session);
 
   if (result < 0) return result;
 
@@ -301,10 +347,12 @@ ssize_t parse_push_promise_frame (nghq_session *session,
     return NGHQ_HTTP_MALFORMED_FRAME;
   }
 
+  NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_HEADER_DECODE);
   result = nghq_inflate_hdr(session, ctx,
                             buf->send_pos + push_header_len + push_id_len,
                             frame_payload_len - push_id_len, 1, hdrs,
                             num_hdrs);
+  NGHQ_PHASE_END (session);
 
   if (result == NGHQ_OK) {
     buf->send_pos += push_header_len + frame_payload_len;
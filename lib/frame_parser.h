@@ -46,6 +46,36 @@ typedef struct nghq_hdr_compression_ctx nghq_hdr_compression_ctx;
  */
 ssize_t parse_frame_header (nghq_io_buf* buf, nghq_frame_type *type);
 
+/**
+ * @brief Read some more of a frame header
+ *
+ * Feeds bytes to @p parser, which keeps hold of how far it has got through the
+ * type and length fields, so a header split between buffers can be read a
+ * piece at a time without going back over bytes it has already seen. Only
+ * the bytes that belong to the header are consumed from @p buf.
+ *
+ * Once the header is complete, parser->hdr_len holds its length. Call
+ * frame_header_parser_reset() before starting on the next header.
+ *
+ * @param parser The state of the header being read
+ * @param buf The next bytes of the stream
+ * @param len The number of bytes in @p buf
+ * @param used Set to the number of bytes of @p buf consumed
+ * @param type Set to the frame type when the header is complete
+ * @param payload_len Set to the payload length when the header is complete
+ *
+ * @return 1 if the header is complete, 0 if more bytes are needed
+ * @return NGHQ_ERROR if the frame type is not one we know
+ */
+int parse_frame_header_bytes (nghq_frame_hdr_parser *parser,
+                              const uint8_t *buf, size_t len, size_t *used,
+                              nghq_frame_type *type, uint64_t *payload_len);
+
+/**
+ * @brief Get a frame header parser ready for the start of a new header
+ */
+void frame_header_parser_reset (nghq_frame_hdr_parser *parser);
+
 /**
  * @brief Pull the data out of a HTTP/QUIC data frame
  *
@@ -45,4 +45,16 @@ typedef uint64_t nghq_frame_type;
 #define NGHQ_SETTINGS_FLAG_PUSH_DEPENDENT 0x02
 #define NGHQ_SETTINGS_FLAG_EXCLUSIVE 0x01
 
+/*
+ * Progress through a frame header that may arrive a few bytes at a time. All
+ * zeroes is the state before the first byte of a header.
+ */
+typedef struct {
+  uint8_t   field;   /* 0 while reading the type, 1 while reading the length */
+  uint8_t   need;    /* bytes of the current varint still to come */
+  uint8_t   hdr_len; /* bytes of the frame header read so far */
+  uint64_t  value;   /* the current varint, as far as it has been read */
+  uint64_t  type;    /* the frame type, once it has been read */
+} nghq_frame_hdr_parser;
+
 #endif /* LIB_FRAME_TYPES_H_ */
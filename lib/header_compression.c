@@ -72,6 +72,19 @@ ssize_t nghq_inflate_hdr (nghq_session *session, nghq_hdr_compression_ctx *ctx,
     default:;
   }
 
+  uint64_t list_size = 0;
+  for (i = 0; i < hlist->qhl_count; i++) {
+    /* HTTP/3 counts 32 bytes of overhead for each header */
+    list_size += hlist->qhl_headers[i]->qh_name_len +
+                 hlist->qhl_headers[i]->qh_value_len + 32;
+  }
+  if (list_size > session->settings.max_header_list_size) {
+    NGHQ_LOG_WARN (session, "Header list of %lu bytes is over the limit of "
+                   "%lu\n", list_size, session->settings.max_header_list_size);
+    lsqpack_dec_destroy_header_list (hlist);
+    return NGHQ_TOO_MUCH_DATA;
+  }
+
   *hdrs = (nghq_header**) malloc (hlist->qhl_count * sizeof(nghq_header*));
   if (*hdrs == NULL) {
     NGHQ_LOG_ERROR (session, "Failed to allocate %u header entries: %s\n",
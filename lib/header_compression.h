@@ -48,6 +48,8 @@ int nghq_init_hdr_compression_ctx(nghq_hdr_compression_ctx **ctx);
  *    received.
  * @return NGHQ_HDR_COMPRESS_FAILURE if decompression fails
  * @return NGHQ_OUT_OF_MEMORY if function could not allocate returned headers
+ * @return NGHQ_TOO_MUCH_DATA if the headers are over the session's
+ *    max_header_list_size
  * @return NGHQ_ERROR if @p ctx is not initialised
  */
 ssize_t nghq_inflate_hdr (nghq_session *session, nghq_hdr_compression_ctx *ctx,
@@ -39,6 +39,8 @@ int nghq_io_buf_new (nghq_io_buf** list, uint8_t *buf, size_t buflen, int fin,
   io_buf->remaining = io_buf->buf_len = buflen;
   io_buf->complete = (fin)?(1):(0);
   io_buf->offset = offset;
+  io_buf->rx_ts = 0;
+  io_buf->pkt_num = 0;
 
   nghq_io_buf_push(list, io_buf);
   return NGHQ_OK;
@@ -58,6 +60,8 @@ nghq_io_buf* nghq_io_buf_alloc (nghq_io_buf **list, size_t buflen, int fin,
   io_buf->remaining = io_buf->buf_len = buflen;
   io_buf->complete = (fin)?(1):(0);
   io_buf->offset = offset;
+  io_buf->rx_ts = 0;
+  io_buf->pkt_num = 0;
 
   if (list != NULL) nghq_io_buf_push (list, io_buf);
 
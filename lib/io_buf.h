@@ -37,6 +37,8 @@ typedef struct nghq_io_buf {
   size_t  remaining; /**< The data remaining to process from this buffer */
   int     complete;  /**< Non-zero if the stream finishes with this buffer */
   size_t  offset;    /**< Offset within the stream for this buffer */
+  uint64_t rx_ts;    /**< When a received datagram was read, or 0 */
+  uint64_t pkt_num;  /**< The packet number of a packet queued to send */
 
   struct nghq_io_buf *next_buf; /**< The next buffer after this one */
 } nghq_io_buf;
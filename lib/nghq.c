@@ -23,6 +23,7 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -41,6 +42,13 @@
 #include "io_buf.h"
 #include "lang.h"
 #include "quic_transport.h"
+#include "object_cache.h"
+#include "session_state.h"
+#include "content_coding.h"
+#include "delta.h"
+#include "phase_stats.h"
+#include "probes.h"
+#include "orphan_push.h"
 
 #include "debug.h"
 
@@ -50,6 +58,12 @@
  * (quic pkt header + quic stream frame header + http/quic data header) */
 #define MIN_STREAM_PACKET_OVERHEAD 27
 
+static size_t _stream_holes (nghq_stream *stream, nghq_byte_range *ranges,
+                             size_t n);
+static void _frame_free (nghq_stream_frame *frame);
+static void _flush_coalesced_body (nghq_session *session, nghq_stream *stream,
+                                   int final);
+
 static void _check_for_trailers (nghq_stream *stream, const nghq_header **hdrs,
                                  size_t num_hdrs)
 {
@@ -78,6 +92,28 @@ nghq_stream * nghq_stream_init() {
   return stream;
 }
 
+/*
+ * Account for data queued to be sent on a stream, or on the session itself if
+ * stream is NULL. Tells the application when the session stops being idle.
+ */
+static void _queued_for_send (nghq_session *session, nghq_stream *stream,
+                              size_t len) {
+  int was_idle = (session->pending_bytes == 0);
+  if (stream != NULL) stream->queued_bytes += len;
+  session->pending_bytes += len;
+  if (was_idle && (len > 0) &&
+      (session->callbacks.on_send_ready_callback != NULL)) {
+    session->callbacks.on_send_ready_callback (session,
+                                               session->session_user_data);
+  }
+}
+
+static void _dequeued_for_send (nghq_session *session, nghq_stream *stream,
+                                size_t len) {
+  if (stream != NULL) stream->queued_bytes -= len;
+  session->pending_bytes -= len;
+}
+
 static void _nghq_stream_timeout (nghq_session *session, void *timer_id,
                                       void *nghq_data)
 {
@@ -90,6 +126,7 @@ static void _nghq_stream_timeout (nghq_session *session, void *timer_id,
   }
   NGHQ_LOG_DEBUG (session, "Received stream timeout, ending stream %lu with "
                   "outstanding data\n", stream->stream_id);
+  NGHQ_PROBE1 (stream_timeout, stream->stream_id);
   nghq_stream_close (session, stream, QUIC_ERR_PACKET_LOSS);
 }
 
@@ -97,6 +134,7 @@ static void _nghq_session_timeout (nghq_session *session, void *timer_id,
                                    void *nghq_data)
 {
   NGHQ_LOG_DEBUG (session, "Session timeout fired!\n");
+  NGHQ_PROBE0 (session_timeout);
   nghq_close_all_streams (session, &session->transfers);
   nghq_close_all_streams (session, &session->promises);
   session->session_timed_out = 1;
@@ -119,6 +157,15 @@ static nghq_session * _nghq_session_new_common(const nghq_callbacks *callbacks,
     free (session);
     return NULL;
   }
+  if (transport->max_packet_size <= (int64_t) (MIN_STREAM_PACKET_OVERHEAD +
+                                    transport->session_id_len +
+                                    transport->encryption_overhead) ||
+      transport->max_packet_size > NGHQ_MAX_PACKET_SIZE) {
+    NGHQ_LOG_ERROR (session, "Maximum packet size of %ld is not allowed\n",
+                    transport->max_packet_size);
+    free (session);
+    return NULL;
+  }
   session->session_id = (uint8_t *) malloc (transport->session_id_len);
   if (session->session_id == NULL) {
     NGHQ_LOG_ERROR (session, "Couldn't allocate space for a session ID of size "
@@ -144,6 +191,7 @@ static nghq_session * _nghq_session_new_common(const nghq_callbacks *callbacks,
          sizeof(nghq_transport_settings));
   session->packet_buf_len =
       transport->max_packet_size - transport->encryption_overhead;
+  session->recv_buf_len = (size_t) transport->max_packet_size;
 
   session->transfers = nghq_stream_id_map_init();
   nghq_open_stream (session, NGHQ_STREAM_CLIENT_BIDI); /* Stream 0 */
@@ -154,6 +202,8 @@ static nghq_session * _nghq_session_new_common(const nghq_callbacks *callbacks,
 
   session->send_buf = NULL;
   session->recv_buf = NULL;
+  session->ctrl_frames = NULL;
+  session->beacon_frames = NULL;
 
   session->tx_pkt_num = 0;
   session->rx_pkt_num = 0;
@@ -308,8 +358,20 @@ int nghq_session_free (nghq_session *session) {
   nghq_close_all_streams (session, &session->transfers);
   nghq_close_all_streams (session, &session->promises);
   nghq_free_hdr_compression_ctx (session->hdr_ctx);
+  nghq_object_cache_free (session->object_cache);
+  free (session->content_dict);
+  nghq_delta_paths_free (session->delta_paths);
+  nghq_orphan_pushes_free (session->orphan_pushes);
+  if (session->beacon_timer != NULL) {
+    session->callbacks.cancel_timer_callback (session,
+                                              session->session_user_data,
+                                              session->beacon_timer);
+  }
   nghq_io_buf_clear (&session->send_buf);
   nghq_io_buf_clear (&session->recv_buf);
+  free (session->recv_scratch);
+  nghq_io_buf_clear (&session->ctrl_frames);
+  nghq_io_buf_clear (&session->beacon_frames);
   if (session->session_id) {
     free (session->session_id);
     session->session_id = NULL;
@@ -318,50 +380,61 @@ int nghq_session_free (nghq_session *session) {
   return NGHQ_OK;
 }
 
-#define BUFFER_READ_SIZE 4096
-
 int nghq_session_recv (nghq_session *session) {
   int recv = 1;
   int rv = NGHQ_NO_MORE_DATA;
+  size_t buflen;
 
   if (nghq_check_timeout(session) == NGHQ_TRANSPORT_TIMEOUT) {
     return NGHQ_TRANSPORT_TIMEOUT;
   }
 
-  while (recv) {
-    uint8_t* buf;
-    size_t buflen;
-
-    buf = (uint8_t *) malloc (BUFFER_READ_SIZE);
-    if (buf == NULL) {
-      rv = NGHQ_OUT_OF_MEMORY;
-      break;
+  /* One spare byte, so a datagram that was cut short can be spotted */
+  buflen = session->recv_buf_len + 1;
+  if (session->recv_scratch == NULL) {
+    session->recv_scratch = (uint8_t *) malloc (buflen);
+    if (session->recv_scratch == NULL) {
+      return NGHQ_OUT_OF_MEMORY;
     }
+  }
 
-    buflen = BUFFER_READ_SIZE;
-
-    ssize_t socket_rv = session->callbacks.recv_callback(session, buf, buflen,
+  while (recv) {
+    ssize_t socket_rv = session->callbacks.recv_callback(session,
+                                                   session->recv_scratch,
+                                                   buflen,
                                                    session->session_user_data);
     if (socket_rv < 0) {
-      free (buf);
       /* errors */
       if (socket_rv == NGHQ_EOF) {
         return NGHQ_SESSION_CLOSED;
       }
       return NGHQ_ERROR;
     } else if (socket_rv == 0) {
-      free (buf);
       /* no more data to read */
       recv = 0;
+    } else if ((size_t) socket_rv > session->recv_buf_len) {
+      NGHQ_PROBE2 (packet_drop, socket_rv, NGHQ_PROBE_DROP_TOO_LARGE);
+      NGHQ_LOG_WARN (session, "Dropping datagram larger than the maximum "
+                     "packet size of %lu bytes\n", session->recv_buf_len);
     } else {
-      nghq_io_buf_new(&session->recv_buf, buf, (size_t) socket_rv, 0, 0);
+      /* Only the bytes read are kept, as many may be queued before parsing */
+      nghq_io_buf *pkt = nghq_io_buf_alloc (&session->recv_buf,
+                                            (size_t) socket_rv, 0, 0);
+      if (pkt == NULL) {
+        rv = NGHQ_OUT_OF_MEMORY;
+        break;
+      }
+      memcpy (pkt->buf, session->recv_scratch, (size_t) socket_rv);
+      pkt->rx_ts = get_timestamp_now();
     }
   }
 
   while (session->recv_buf != NULL) {
+    NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_FRAME_PARSE);
     rv = quic_transport_packet_parse (session, session->recv_buf->buf,
                                       session->recv_buf->buf_len,
-                                      get_timestamp_now());
+                                      session->recv_buf->rx_ts);
+    NGHQ_PHASE_END (session);
     free (session->recv_buf->buf);
     nghq_io_buf *pop = session->recv_buf;
     session->recv_buf = session->recv_buf->next_buf;
@@ -379,6 +452,43 @@ int nghq_session_recv (nghq_session *session) {
   return rv;
 }
 
+/*
+ * Copy as many of the queued control frames as will fit into a packet being
+ * built. Returns the number of bytes written to @p buf.
+ */
+static size_t _pack_control_frames (nghq_session *session, uint8_t *buf,
+                                    size_t len) {
+  size_t off = 0;
+  while ((session->ctrl_frames != NULL) &&
+         (session->ctrl_frames->buf_len <= len - off)) {
+    memcpy (buf + off, session->ctrl_frames->buf,
+            session->ctrl_frames->buf_len);
+    off += session->ctrl_frames->buf_len;
+    _dequeued_for_send (session, NULL, session->ctrl_frames->buf_len);
+    nghq_io_buf_pop (&session->ctrl_frames);
+  }
+  return off;
+}
+
+/*
+ * Copy the next queued push beacon frame into a packet being built, which then
+ * can't carry anything else. Returns the number of bytes written to @p buf.
+ */
+static size_t _pack_beacon_frame (nghq_session *session, uint8_t *buf,
+                                  size_t len) {
+  size_t off = 0;
+  if (session->beacon_frames == NULL) return 0;
+  if (session->beacon_frames->buf_len <= len) {
+    memcpy (buf, session->beacon_frames->buf, session->beacon_frames->buf_len);
+    off = session->beacon_frames->buf_len;
+  } else {
+    NGHQ_LOG_WARN (session, "Dropping push beacon too big for a packet\n");
+  }
+  _dequeued_for_send (session, NULL, session->beacon_frames->buf_len);
+  nghq_io_buf_pop (&session->beacon_frames);
+  return off;
+}
+
 int nghq_session_send (nghq_session *session) {
   int rv = NGHQ_NO_MORE_DATA;
 
@@ -392,23 +502,44 @@ int nghq_session_send (nghq_session *session) {
    */
   nghq_stream *it = nghq_stream_id_map_find(session->transfers, 0);
 
+  NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_PACKET_BUILD);
   while ((rv != NGHQ_ERROR) && (rv != NGHQ_EOF)) {
-    size_t packet_len;
+    size_t packet_len, beacon_len;
     ssize_t res;
     uint64_t pktnum;
 
     nghq_io_buf *new_pkt = nghq_io_buf_alloc (NULL, session->packet_buf_len, 0,
                                               0);
     if (new_pkt == NULL) {
+      NGHQ_PHASE_END (session);
       return NGHQ_OUT_OF_MEMORY;
     }
+    if (session->packet_timestamps) {
+      /* Leave room for the timestamp at the end */
+      new_pkt->buf_len -= QUIC_TIMESTAMP_TRAILER_LEN;
+    }
 
     res = quic_transport_write_quic_header (session, new_pkt->buf,
                                             new_pkt->buf_len, &pktnum);
-    if (res < NGHQ_OK) return res;
+    if (res < NGHQ_OK) {
+      NGHQ_PHASE_END (session);
+      return res;
+    }
     packet_len = res;
 
-    while (packet_len < new_pkt->buf_len) {
+    /* A beacon starts with PADDING, so receivers that don't know it skip the
+     * rest of the packet, and it gets the packet to itself */
+    beacon_len = _pack_beacon_frame (session, new_pkt->buf + packet_len,
+                                     new_pkt->buf_len - packet_len);
+    packet_len += beacon_len;
+
+    /* Control frames go first, so they share packets with the stream data */
+    if (beacon_len == 0) {
+      packet_len += _pack_control_frames (session, new_pkt->buf + packet_len,
+                                          new_pkt->buf_len - packet_len);
+    }
+
+    while ((beacon_len == 0) && (packet_len < new_pkt->buf_len)) {
       uint8_t *outbuf = new_pkt->buf + packet_len;
       size_t len_remain = new_pkt->buf_len - packet_len;
       while ((it != NULL) && (it->send_buf == NULL)) {
@@ -431,29 +562,31 @@ int nghq_session_send (nghq_session *session) {
                       it->send_buf->remaining, it->stream_id);
 
       size_t written = 0;
-      ssize_t off = quic_transport_write_stream (session, it,
-                                                it->send_buf->send_pos,
-                                                it->send_buf->remaining,
-                                                outbuf, len_remain,
-                                                it->send_buf->complete,
-                                                &written);
+      ssize_t off = quic_transport_write_stream (session, it, it->send_buf,
+                                                outbuf, len_remain, &written);
 
       if (off < NGHQ_OK) {
         if (off != NGHQ_TOO_MUCH_DATA) rv = (int) off;
         break;
       }
       packet_len += off;
-      if (written == it->send_buf->remaining) {
+      _dequeued_for_send (session, it, written);
+      /* The frame may have taken data from several of the queued buffers */
+      while ((it->send_buf != NULL) && (written >= it->send_buf->remaining)) {
+        written -= it->send_buf->remaining;
         if (it->send_buf->complete) {
           NGHQ_LOG_DEBUG (session, "Ending stream %lu\n", it->stream_id);
           if (session->callbacks.on_request_close_callback != NULL) {
+            NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_APP_CALLBACKS);
             session->callbacks.on_request_close_callback(session, it->status,
                                                          it->user_data);
+            NGHQ_PHASE_END (session);
           }
           it->send_state = STATE_DONE;
         }
         nghq_io_buf_pop (&it->send_buf);
-      } else {
+      }
+      if (written > 0) {
         it->send_buf->send_pos += written;
         it->send_buf->remaining -= written;
       }
@@ -468,6 +601,12 @@ int nghq_session_send (nghq_session *session) {
       break;
     }
 
+    if (session->packet_timestamps) {
+      packet_len += quic_transport_write_timestamp (session,
+                                                new_pkt->buf + packet_len,
+                                                QUIC_TIMESTAMP_TRAILER_LEN,
+                                                get_timestamp_now());
+    }
     new_pkt->buf_len = packet_len;
 
     nghq_io_buf *enc_pkt = new_pkt;
@@ -478,12 +617,15 @@ int nghq_session_send (nghq_session *session) {
       if (enc_pkt == NULL) {
         free (new_pkt->buf);
         free (new_pkt);
+        NGHQ_PHASE_END (session);
         return NGHQ_OUT_OF_MEMORY;
       }
     }
 
+    NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_ENCRYPT);
     res = quic_transport_encrypt (session, new_pkt->buf, new_pkt->buf_len,
                                   enc_pkt->buf, enc_pkt->buf_len);
+    NGHQ_PHASE_END (session);
     if (res < NGHQ_OK) {
       if (new_pkt != enc_pkt) {
         free (enc_pkt->buf);
@@ -491,23 +633,55 @@ int nghq_session_send (nghq_session *session) {
       }
       free (new_pkt->buf);
       free (new_pkt);
+      NGHQ_PHASE_END (session);
       return res;
     }
     enc_pkt->buf_len = res;
+    enc_pkt->pkt_num = pktnum;
 
     nghq_io_buf_push(&session->send_buf, enc_pkt);
+    session->pending_bytes += enc_pkt->buf_len;
 
     if (session->transport_settings.encryption_overhead) {
       free (new_pkt->buf);
       free (new_pkt);
     }
   }
+  NGHQ_PHASE_END (session);
 
   rv = nghq_write_send_buffer (session);
 
   return rv;
 }
 
+int nghq_session_want_write (nghq_session *session) {
+  if (session == NULL) return 0;
+  return (session->pending_bytes > 0)?(1):(0);
+}
+
+size_t nghq_session_get_pending_bytes (nghq_session *session) {
+  if (session == NULL) return 0;
+  return session->pending_bytes;
+}
+
+ssize_t nghq_request_get_queued_bytes (nghq_session *session,
+                                       void *request_user_data) {
+  nghq_stream *stream;
+  if (session == NULL) return NGHQ_ERROR;
+
+  stream = nghq_stream_id_map_stream_search (session->transfers,
+                                             request_user_data);
+  if (stream == NULL) {
+    /* Promised but not started, so nothing has been queued on it yet */
+    if (nghq_stream_id_map_stream_search (session->promises,
+                                          request_user_data) != NULL) {
+      return 0;
+    }
+    return NGHQ_REQUEST_CLOSED;
+  }
+  return (ssize_t) stream->queued_bytes;
+}
+
 ssize_t nghq_get_transport_params (nghq_session *session, uint8_t **buf) {
   return NGHQ_NOT_IMPLEMENTED;
 }
@@ -570,6 +744,303 @@ int nghq_submit_request (nghq_session *session, const nghq_header **hdrs,
   return rv;
 }
 
+static const char _content_encoding_hdr[] = "content-encoding";
+static const char _etag_hdr[] = "etag";
+static const char _im_hdr[] = "im";
+static const char _delta_base_hdr[] = "delta-base";
+static const char _sent_time_hdr[] = "nghq-sent-time";
+
+static int _hdr_name_is (const nghq_header *hdr, const char *name) {
+  size_t len = strlen (name);
+  return (hdr->name_len == len) &&
+      (strncasecmp ((const char *) hdr->name, name, len) == 0);
+}
+
+static int _is_content_encoding (const nghq_header *hdr) {
+  return _hdr_name_is (hdr, _content_encoding_hdr);
+}
+
+static void _set_header (nghq_header *hdr, const char *name,
+                         const uint8_t *value, size_t value_len) {
+  hdr->name = (uint8_t *) name;
+  hdr->name_len = strlen (name);
+  hdr->value = (uint8_t *) value;
+  hdr->value_len = value_len;
+}
+
+/* The most headers _start_push_encoding() adds to a response */
+#define MAX_ADDED_PUSH_HDRS 3
+
+/* Find the delta encoded path entry for a push promise, if there is one */
+static nghq_delta_path *_find_delta_path (nghq_session *session,
+                                          nghq_header **hdrs,
+                                          size_t num_hdrs) {
+  size_t i;
+  if (session->delta_paths == NULL) return NULL;
+  for (i = 0; i < num_hdrs; i++) {
+    if (_hdr_name_is (hdrs[i], ":path")) {
+      return nghq_delta_path_find (session->delta_paths, hdrs[i]->value,
+                                   hdrs[i]->value_len);
+    }
+  }
+  return NULL;
+}
+
+/* deflate only reaches back 32KiB, so zstd is preferred unless asked for */
+static nghq_content_encoding _delta_encoding (nghq_session *session) {
+  if ((session->content_encoding == NGHQ_CONTENT_ENCODING_DEFLATE) ||
+      (session->content_encoding == NGHQ_CONTENT_ENCODING_ZSTD)) {
+    return session->content_encoding;
+  }
+  if (nghq_content_encoding_supported (NGHQ_CONTENT_ENCODING_ZSTD)) {
+    return NGHQ_CONTENT_ENCODING_ZSTD;
+  }
+  return NGHQ_CONTENT_ENCODING_DEFLATE;
+}
+
+/*
+ * Decide whether a push of a delta encoded path goes out as a delta against
+ * the path's base, or in full to become the new base. A full body is collected
+ * in stream->delta_version as it is fed in, and given an ETag in added[] if
+ * the response doesn't have one.
+ *
+ * Returns the base to make a delta against, or NULL to send it in full.
+ */
+static nghq_delta_version *_start_push_delta (nghq_session *session,
+                                              nghq_stream *stream,
+                                              const nghq_header *etag,
+                                              nghq_header *added,
+                                              size_t *num_added) {
+  nghq_delta_path *path = stream->delta_path;
+  char etag_buf[24];
+
+  if ((path->base != NULL) && (path->since_full + 1 < path->full_every)) {
+    path->since_full++;
+    return path->base;
+  }
+
+  if (etag != NULL) {
+    stream->delta_version = nghq_delta_version_new (etag->value,
+                                                    etag->value_len);
+  } else {
+    int len = snprintf (etag_buf, sizeof(etag_buf), "\"%lx\"",
+                        (unsigned long) get_timestamp_now());
+    stream->delta_version = nghq_delta_version_new ((uint8_t *) etag_buf,
+                                                    (size_t) len);
+    if (stream->delta_version != NULL) {
+      _set_header (&added[(*num_added)++], _etag_hdr,
+                   stream->delta_version->etag,
+                   stream->delta_version->etag_len);
+    }
+  }
+  if (stream->delta_version == NULL) {
+    NGHQ_LOG_WARN (session, "Couldn't keep push %lu as a delta base\n",
+                   stream->push_id);
+  }
+  return NULL;
+}
+
+/*
+ * If the session compresses pushed bodies, or the push is of a delta encoded
+ * path, start encoding the body of a push whose response headers are about to
+ * be sent. *hdrs is then replaced by a new array, which the caller must free,
+ * with up to MAX_ADDED_PUSH_HDRS headers from added[] at the end of it. The
+ * send time is added here too, if the session stamps pushes.
+ */
+static int _start_push_encoding (nghq_session *session, nghq_stream *stream,
+                                 const nghq_header ***hdrs, size_t *num_hdrs,
+                                 nghq_header *added) {
+  const nghq_header **with_added;
+  const nghq_header *etag = NULL;
+  nghq_content_encoding encoding = session->content_encoding;
+  const uint8_t *dict = session->content_dict;
+  size_t dict_len = session->content_dict_len;
+  nghq_delta_version *base = NULL;
+  size_t num_added = 0;
+  const char *name;
+  size_t i;
+
+  if (session->send_timestamps) {
+    int len = snprintf (session->sent_time_hdr, sizeof(session->sent_time_hdr),
+                        "%lu", get_timestamp_now());
+    _set_header (&added[num_added++], _sent_time_hdr,
+                 (const uint8_t *) session->sent_time_hdr, len);
+  }
+
+  for (i = 0; i < *num_hdrs; i++) {
+    if (_is_content_encoding ((*hdrs)[i])) {
+      /* Already encoded by the application, so it can't be a delta either */
+      stream->delta_path = NULL;
+      encoding = NGHQ_CONTENT_ENCODING_NONE;
+      break;
+    }
+    if (_hdr_name_is ((*hdrs)[i], _etag_hdr)) {
+      etag = (*hdrs)[i];
+    }
+  }
+
+  if (stream->delta_path != NULL) {
+    base = _start_push_delta (session, stream, etag, added, &num_added);
+    if (base != NULL) {
+      encoding = _delta_encoding (session);
+      dict = base->body;
+      dict_len = base->body_len;
+    }
+  }
+
+  if ((encoding == NGHQ_CONTENT_ENCODING_NONE) && (num_added == 0)) {
+    return NGHQ_OK;
+  }
+
+  with_added = (const nghq_header **) malloc ((*num_hdrs + MAX_ADDED_PUSH_HDRS)
+                                              * sizeof(nghq_header *));
+  if (with_added == NULL) {
+    return NGHQ_OUT_OF_MEMORY;
+  }
+
+  if (encoding != NGHQ_CONTENT_ENCODING_NONE) {
+    stream->coder = nghq_content_coder_new (encoding, 0,
+                                            session->content_level, dict,
+                                            dict_len);
+    if (stream->coder == NULL) {
+      free (with_added);
+      return NGHQ_OUT_OF_MEMORY;
+    }
+
+    name = nghq_content_encoding_name (encoding);
+    if (base != NULL) {
+      NGHQ_LOG_DEBUG (session, "Sending push %lu as a %s delta\n",
+                      stream->push_id, name);
+      _set_header (&added[num_added++], _im_hdr, (const uint8_t *) name,
+                   strlen (name));
+      _set_header (&added[num_added++], _delta_base_hdr, base->etag,
+                   base->etag_len);
+    } else {
+      _set_header (&added[num_added++], _content_encoding_hdr,
+                   (const uint8_t *) name, strlen (name));
+    }
+  }
+
+  memcpy (with_added, *hdrs, *num_hdrs * sizeof(nghq_header *));
+  for (i = 0; i < num_added; i++) {
+    with_added[(*num_hdrs)++] = &added[i];
+  }
+  *hdrs = with_added;
+  return NGHQ_OK;
+}
+
+/*
+ * Keep the body of a full push of a delta encoded path as it is fed in, and
+ * make it the path's base once it's complete.
+ */
+static void _keep_delta_version (nghq_session *session, nghq_stream *stream,
+                                 const uint8_t *buf, size_t len, int final) {
+  nghq_delta_version *version = stream->delta_version;
+  if (nghq_delta_version_write (version, buf, len,
+                                version->body_len) != NGHQ_OK) {
+    NGHQ_LOG_WARN (session, "Couldn't keep push %lu as a delta base\n",
+                   stream->push_id);
+    nghq_delta_version_free (version);
+    stream->delta_version = NULL;
+    return;
+  }
+  if (final) {
+    nghq_delta_path_set_base (stream->delta_path, version);
+    stream->delta_version = NULL;
+  }
+}
+
+/*
+ * With push beacons on, keep a copy of a push's PUSH_PROMISE and where it
+ * ends on stream 0, so it can be repeated for receivers that join later.
+ */
+static void _keep_beacon_promise (nghq_session *session, nghq_stream *stream,
+                                  const uint8_t *frame, size_t len,
+                                  size_t end) {
+  if (session->beacon_interval <= 0) return;
+
+  stream->beacon_promise = (uint8_t *) malloc (len);
+  if (stream->beacon_promise == NULL) {
+    NGHQ_LOG_WARN (session, "Push %lu won't be in beacons\n", stream->push_id);
+    return;
+  }
+  memcpy (stream->beacon_promise, frame, len);
+  stream->beacon_promise_len = len;
+  stream->promise_end = end;
+}
+
+/*
+ * Find how much of the start of a push stream is whole frames, stopping after
+ * the header of the first DATA frame, which is set in done.
+ */
+static size_t _beacon_prefix_boundary (const uint8_t *buf, size_t len,
+                                       int *done) {
+  size_t off = 0, boundary;
+  uint64_t type, frame_len;
+
+  *done = 0;
+  if (len == 0) return 0;
+
+  /* Stream type and push ID */
+  _get_varlen_int (buf, &off, len);
+  if (off >= len) return 0;
+  _get_varlen_int (buf + off, &off, len);
+  if (off > len) return 0;
+  boundary = off;
+
+  while (off < len) {
+    type = _get_varlen_int (buf + off, &off, len);
+    if (off >= len) break;
+    frame_len = _get_varlen_int (buf + off, &off, len);
+    if (off > len) break;
+    if (type == NGHQ_FRAME_TYPE_DATA) {
+      /* The body doesn't need repeating, only where it starts */
+      *done = 1;
+      return off;
+    }
+    if (frame_len > len - off) break;
+    off += frame_len;
+    boundary = off;
+  }
+
+  return boundary;
+}
+
+/* The most of the start of a push stream that is kept for beacons */
+#define MAX_BEACON_PREFIX 1024
+
+/*
+ * Keep the start of a push stream being sent, up to its first DATA frame
+ * header, so beacons can give it to receivers that missed it.
+ */
+static void _keep_push_prefix (nghq_session *session, nghq_stream *stream,
+                               const uint8_t *buf, size_t len) {
+  uint8_t *grown;
+  int done;
+
+  if (stream->beacon_promise == NULL) return;
+
+  _beacon_prefix_boundary (stream->beacon_prefix, stream->beacon_prefix_len,
+                           &done);
+  if (done || (stream->beacon_prefix_len >= MAX_BEACON_PREFIX)) return;
+
+  if (len > MAX_BEACON_PREFIX - stream->beacon_prefix_len) {
+    len = MAX_BEACON_PREFIX - stream->beacon_prefix_len;
+  }
+  grown = (uint8_t *) realloc (stream->beacon_prefix,
+                               stream->beacon_prefix_len + len);
+  if (grown == NULL) {
+    /* A prefix with a piece missing would be worse than none at all */
+    NGHQ_LOG_WARN (session, "Push %lu won't be in beacons\n", stream->push_id);
+    free (stream->beacon_promise);
+    stream->beacon_promise = NULL;
+    return;
+  }
+  memcpy (grown + stream->beacon_prefix_len, buf, len);
+  stream->beacon_prefix = grown;
+  stream->beacon_prefix_len += len;
+}
+
 int nghq_submit_push_promise (nghq_session *session,
                               void * init_request_user_data,
                               const nghq_header **hdrs, size_t num_hdrs,
@@ -636,6 +1107,9 @@ int nghq_submit_push_promise (nghq_session *session,
   promised_stream->stream_id = NGHQ_INVALID_STREAM_ID;
   promised_stream->user_data = promised_request_user_data;
   promised_stream->recv_state = STATE_DONE;
+  promised_stream->delta_path = _find_delta_path (session,
+                                                  (nghq_header **) hdrs,
+                                                  num_hdrs);
 
   nghq_stream_id_map_add (session->promises, promised_stream->push_id,
                           promised_stream);
@@ -648,6 +1122,10 @@ int nghq_submit_push_promise (nghq_session *session,
     NGHQ_LOG_ERROR (session, "Couldn't add push promise buffer to send buffer\n");
     goto push_promise_io_err;
   }
+  _queued_for_send (session, init_stream, push_promise_len);
+  _keep_beacon_promise (session, promised_stream, push_promise_buf,
+                        push_promise_len,
+                        init_stream->tx_offset + init_stream->queued_bytes);
 
   return NGHQ_OK;
 
@@ -660,6 +1138,175 @@ push_promise_frame_err:
   return rv;
 }
 
+int nghq_submit_push_batch (nghq_session *session,
+                            const nghq_push_desc *descs, size_t n) {
+  int rv = NGHQ_OK;
+  size_t i;
+  uint64_t init_request_stream_id = NGHQ_INIT_REQUEST_STREAM_ID;
+  nghq_stream *init_stream;
+  nghq_io_buf *promise_frames;
+  size_t promise_base;
+
+  if ((session == NULL) || ((descs == NULL) && (n > 0))) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->role != NGHQ_ROLE_SERVER) {
+    return NGHQ_SERVER_ONLY;
+  }
+
+  if (n == 0) return 0;
+
+  if (session->mode != NGHQ_MODE_MULTICAST) {
+    init_request_stream_id =
+        nghq_stream_id_map_search(session->transfers,
+                                  descs[0].init_request_user_data);
+    if (init_request_stream_id == NGHQ_STREAM_ID_MAP_NOT_FOUND) {
+      return NGHQ_ERROR;
+    }
+  }
+  init_stream = nghq_stream_id_map_find(session->transfers,
+                                        init_request_stream_id);
+
+  /* Every PUSH_PROMISE in the batch is gathered into this one buffer */
+  promise_frames = (nghq_io_buf *) calloc (1, sizeof(nghq_io_buf));
+  if ((init_stream == NULL) || (promise_frames == NULL)) {
+    free (promise_frames);
+    return (init_stream == NULL)?(NGHQ_ERROR):(NGHQ_OUT_OF_MEMORY);
+  }
+  /* Where the first of the PUSH_PROMISE frames will start on stream 0 */
+  promise_base = init_stream->tx_offset + init_stream->queued_bytes;
+
+  for (i = 0; i < n; i++) {
+    const nghq_push_desc *desc = &descs[i];
+    uint64_t push_id = session->next_push_promise;
+    int64_t stream_id;
+    uint8_t *frames = NULL, *promise = NULL, *grown;
+    size_t frames_len = 0, promise_len = 0;
+    nghq_stream *stream;
+    int added;
+    const nghq_header **response_hdrs;
+    size_t num_response_hdrs;
+    nghq_header added_hdrs[MAX_ADDED_PUSH_HDRS];
+
+    if (push_id >= session->max_push_promise) {
+      rv = NGHQ_PUSH_LIMIT_REACHED;
+      break;
+    }
+
+    if ((session->mode != NGHQ_MODE_MULTICAST) &&
+        (desc->init_request_user_data != descs[0].init_request_user_data)) {
+      rv = NGHQ_ERROR;
+      break;
+    }
+
+    stream_id = quic_transport_open_stream(session, NGHQ_STREAM_SERVER_UNI);
+    if (stream_id < NGHQ_OK) {
+      rv = (int) stream_id;
+      break;
+    }
+
+    stream = nghq_stream_init();
+    if (stream == NULL) {
+      /* Give the stream ID back, as nothing will be sent on it */
+      session->next_stream_id[NGHQ_STREAM_SERVER_UNI]--;
+      rv = NGHQ_OUT_OF_MEMORY;
+      break;
+    }
+
+    stream->push_id = push_id;
+    stream->delta_path = _find_delta_path (session,
+                                           (nghq_header **) desc->promise_hdrs,
+                                           desc->num_promise_hdrs);
+    response_hdrs = desc->response_hdrs;
+    num_response_hdrs = desc->num_response_hdrs;
+    rv = _start_push_encoding (session, stream, &response_hdrs,
+                               &num_response_hdrs, added_hdrs);
+    if (rv >= 0) {
+      rv = create_headers_frame (session, session->hdr_ctx, (int64_t) push_id,
+                                 response_hdrs, num_response_hdrs, &frames,
+                                 &frames_len);
+    }
+    if (response_hdrs != desc->response_hdrs) free (response_hdrs);
+    if ((rv >= 0) && (desc->body != NULL) && (stream->coder != NULL)) {
+      uint8_t *encoded;
+      size_t encoded_len;
+      rv = nghq_content_encode (stream->coder, desc->body, desc->body_len, 1,
+                                &encoded, &encoded_len);
+      if (rv >= 0) {
+        rv = append_data_frame (session, encoded, encoded_len, &frames,
+                                &frames_len);
+        free (encoded);
+      }
+      nghq_content_coder_free (stream->coder);
+      stream->coder = NULL;
+    } else if ((rv >= 0) && (desc->body != NULL)) {
+      rv = append_data_frame (session, desc->body, desc->body_len, &frames,
+                              &frames_len);
+    }
+    if ((rv >= 0) && (stream->delta_version != NULL) && (desc->body != NULL)) {
+      _keep_delta_version (session, stream, desc->body, desc->body_len, 1);
+    }
+    if (rv >= 0) {
+      rv = create_push_promise_frame (session, session->hdr_ctx, push_id,
+                                      desc->promise_hdrs,
+                                      desc->num_promise_hdrs, &promise,
+                                      &promise_len);
+    }
+    grown = (rv >= 0)?((uint8_t *) realloc (promise_frames->buf,
+                                promise_frames->buf_len + promise_len)):(NULL);
+    added = (grown != NULL) &&
+            (nghq_stream_id_map_add (session->transfers, stream_id,
+                                     stream) == 0);
+    if (!added ||
+        (nghq_io_buf_new (&stream->send_buf, frames, frames_len,
+                          desc->body != NULL, 0) != NGHQ_OK)) {
+      if (added) nghq_stream_id_map_remove (session->transfers, stream_id);
+      if (grown != NULL) promise_frames->buf = grown;
+      if (rv >= 0) rv = NGHQ_OUT_OF_MEMORY;
+      session->next_stream_id[NGHQ_STREAM_SERVER_UNI]--;
+      nghq_content_coder_free (stream->coder);
+      nghq_delta_version_free (stream->delta_version);
+      free (stream);
+      free (frames);
+      free (promise);
+      break;
+    }
+
+    memcpy (grown + promise_frames->buf_len, promise, promise_len);
+    promise_frames->buf = grown;
+    promise_frames->buf_len += promise_len;
+    _keep_beacon_promise (session, stream, promise, promise_len,
+                          promise_base + promise_frames->buf_len);
+    free (promise);
+
+    session->next_push_promise++;
+    stream->stream_id = stream_id;
+    stream->user_data = desc->request_user_data;
+    stream->recv_state = STATE_DONE;
+    stream->send_state = (desc->body != NULL)?(STATE_BODY):(STATE_HDRS);
+    _check_for_trailers(stream, desc->response_hdrs, desc->num_response_hdrs);
+
+    _queued_for_send (session, stream, frames_len);
+    _keep_push_prefix (session, stream, frames, frames_len);
+  }
+
+  NGHQ_LOG_DEBUG (session, "Submitted %lu of %lu pushes in a batch\n", i, n);
+
+  if (promise_frames->buf_len > 0) {
+    /* Stream 0 is sent first, so these all go out ahead of the push streams */
+    promise_frames->send_pos = promise_frames->buf;
+    promise_frames->remaining = promise_frames->buf_len;
+    nghq_io_buf_push (&init_stream->send_buf, promise_frames);
+    _queued_for_send (session, init_stream, promise_frames->buf_len);
+  } else {
+    free (promise_frames->buf);
+    free (promise_frames);
+  }
+
+  return (i > 0)?((int) i):(rv);
+}
+
 int nghq_set_request_user_data(nghq_session *session, void * current_user_data,
                                void * new_user_data) {
   nghq_stream *stream = nghq_stream_id_map_stream_search(session->transfers,
@@ -734,8 +1381,15 @@ int nghq_feed_headers (nghq_session *session, const nghq_header **hdrs,
     NGHQ_LOG_INFO (session, "Push promise %lu will be sent on stream ID %lu\n",
                    push_id, new_stream_id);
 
-    rv = create_headers_frame (session, session->hdr_ctx, (int64_t) push_id,
-                               hdrs, num_hdrs, &buf, &buf_len);
+    const nghq_header **send_hdrs = hdrs;
+    nghq_header added_hdrs[MAX_ADDED_PUSH_HDRS];
+    rv = _start_push_encoding (session, stream, &send_hdrs, &num_hdrs,
+                               added_hdrs);
+    if (rv == NGHQ_OK) {
+      rv = create_headers_frame (session, session->hdr_ctx, (int64_t) push_id,
+                                 send_hdrs, num_hdrs, &buf, &buf_len);
+    }
+    if (send_hdrs != hdrs) free (send_hdrs);
     if (rv < 0) {
       return rv;
     } else {
@@ -780,7 +1434,10 @@ int nghq_feed_headers (nghq_session *session, const nghq_header **hdrs,
     }
   }
 
-  nghq_io_buf_new(&stream->send_buf, buf, buf_len, final, 0);
+  _keep_push_prefix (session, stream, buf, buf_len);
+  if (nghq_io_buf_new(&stream->send_buf, buf, buf_len, final, 0) == NGHQ_OK) {
+    _queued_for_send (session, stream, buf_len);
+  }
 
   return rv;
 }
@@ -803,6 +1460,11 @@ int nghq_promise_data (nghq_session *session, size_t len, int final,
     return NGHQ_TOO_MUCH_DATA;
   }
 
+  if (stream->coder != NULL) {
+    /* The encoded length isn't known until the whole body has been fed */
+    return NGHQ_ERROR;
+  }
+
   stream->long_data_frame_remaining = len;
   stream->flags |= STREAM_FLAG_LONG_DATA_FRAME_REQ;
   if (final) {
@@ -812,6 +1474,60 @@ int nghq_promise_data (nghq_session *session, size_t len, int final,
   return NGHQ_OK;
 }
 
+/*
+ * Compress a block of body data for a push and queue whatever the compressor
+ * has produced so far as a DATA frame.
+ */
+static ssize_t _feed_encoded_payload (nghq_session *session,
+                                      nghq_stream *stream, const uint8_t *buf,
+                                      size_t len, int final) {
+  uint8_t *encoded;
+  size_t encoded_len;
+  nghq_io_buf *frame;
+  ssize_t rv;
+
+  rv = nghq_content_encode (stream->coder, buf, len, final, &encoded,
+                            &encoded_len);
+  if (rv != NGHQ_OK) {
+    NGHQ_LOG_ERROR (session, "Failed to compress body data for stream %lu\n",
+                    stream->stream_id);
+    return rv;
+  }
+
+  if (final) {
+    nghq_content_coder_free (stream->coder);
+    stream->coder = NULL;
+  }
+
+  if ((encoded_len == 0) && !final) {
+    /* Nothing to send yet, the compressor is still collecting */
+    return (ssize_t) len;
+  }
+
+  frame = (nghq_io_buf *) calloc (1, sizeof(nghq_io_buf));
+  if (frame == NULL) {
+    free (encoded);
+    return NGHQ_OUT_OF_MEMORY;
+  }
+  rv = append_data_frame (session, encoded, encoded_len, &frame->buf,
+                          &frame->buf_len);
+  free (encoded);
+  if (rv < 0) {
+    free (frame);
+    return rv;
+  }
+
+  frame->complete = (final)?(1):(0);
+  frame->send_pos = frame->buf;
+  frame->remaining = frame->buf_len;
+
+  _keep_push_prefix (session, stream, frame->buf, frame->buf_len);
+  nghq_io_buf_push(&stream->send_buf, frame);
+  _queued_for_send (session, stream, frame->buf_len);
+
+  return (ssize_t) len;
+}
+
 ssize_t nghq_feed_payload_data(nghq_session *session, const uint8_t *buf,
                                size_t len, int final, void *request_user_data) {
   nghq_io_buf* frame;
@@ -839,6 +1555,16 @@ ssize_t nghq_feed_payload_data(nghq_session *session, const uint8_t *buf,
   }
   stream->send_state = STATE_BODY;
 
+  if (stream->delta_version != NULL) {
+    int last = final || (STREAM_LONG_DATA_FRAME_FIN(stream->flags) &&
+                         (len >= stream->long_data_frame_remaining));
+    _keep_delta_version (session, stream, buf, len, last);
+  }
+
+  if (stream->coder != NULL) {
+    return _feed_encoded_payload (session, stream, buf, len, final);
+  }
+
   frame = (nghq_io_buf *) calloc (1, sizeof(nghq_io_buf));
 
   if (stream->long_data_frame_remaining) {
@@ -896,7 +1622,9 @@ ssize_t nghq_feed_payload_data(nghq_session *session, const uint8_t *buf,
   frame->send_pos = frame->buf;
   frame->remaining = frame->buf_len;
 
+  _keep_push_prefix (session, stream, frame->buf, frame->buf_len);
   nghq_io_buf_push(&stream->send_buf, frame);
+  _queued_for_send (session, stream, frame->buf_len);
 
   return rv;
 }
@@ -931,6 +1659,27 @@ int nghq_end_request (nghq_session *session, nghq_error result,
   return nghq_stream_cancel(session, stream, result);
 }
 
+ssize_t nghq_get_stream_holes (nghq_session *session, void *request_user_data,
+                               nghq_byte_range *ranges, size_t n) {
+  nghq_stream *stream;
+
+  if (session == NULL) {
+    return NGHQ_ERROR;
+  }
+
+  stream = nghq_stream_id_map_stream_search (session->transfers,
+                                             request_user_data);
+  if (stream == NULL) {
+    return NGHQ_REQUEST_CLOSED;
+  }
+
+  if (ranges == NULL) {
+    n = 0;
+  }
+
+  return (ssize_t) _stream_holes (stream, ranges, n);
+}
+
 uint64_t nghq_get_max_client_requests (nghq_session *session) {
   return session->max_open_requests;
 }
@@ -976,6 +1725,507 @@ int nghq_set_max_promises (nghq_session* session, uint64_t max_push) {
   return rv;
 }
 
+int nghq_object_cache_enable (nghq_session *session, size_t max_bytes) {
+  if (session == NULL) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->role != NGHQ_ROLE_CLIENT) {
+    return NGHQ_CLIENT_ONLY;
+  }
+
+  if (max_bytes == 0) {
+    nghq_object_cache_free (session->object_cache);
+    session->object_cache = NULL;
+    return NGHQ_OK;
+  }
+
+  if (session->object_cache != NULL) {
+    nghq_object_cache_set_budget (session->object_cache, max_bytes);
+    return NGHQ_OK;
+  }
+
+  session->object_cache = nghq_object_cache_new (max_bytes);
+  if (session->object_cache == NULL) {
+    return NGHQ_OUT_OF_MEMORY;
+  }
+
+  NGHQ_LOG_DEBUG (session, "Caching pushed objects, up to %lu bytes\n",
+                  max_bytes);
+
+  return NGHQ_OK;
+}
+
+int nghq_session_set_content_encoding (nghq_session *session,
+                                       nghq_content_encoding encoding,
+                                       int level, const uint8_t *dict,
+                                       size_t dict_len) {
+  uint8_t *dict_copy = NULL;
+
+  if (session == NULL) {
+    return NGHQ_ERROR;
+  }
+
+  if ((encoding != NGHQ_CONTENT_ENCODING_NONE) &&
+      !nghq_content_encoding_supported (encoding)) {
+    return NGHQ_NOT_IMPLEMENTED;
+  }
+
+  if ((dict != NULL) && (dict_len > 0)) {
+    dict_copy = (uint8_t *) malloc (dict_len);
+    if (dict_copy == NULL) {
+      return NGHQ_OUT_OF_MEMORY;
+    }
+    memcpy (dict_copy, dict, dict_len);
+  } else {
+    dict_len = 0;
+  }
+
+  free (session->content_dict);
+  session->content_encoding = encoding;
+  session->content_level = level;
+  session->content_dict = dict_copy;
+  session->content_dict_len = dict_len;
+
+  NGHQ_LOG_DEBUG (session, "Content encoding set to %s\n",
+                  (encoding == NGHQ_CONTENT_ENCODING_NONE)?("none"):
+                  (nghq_content_encoding_name (encoding)));
+
+  return NGHQ_OK;
+}
+
+int nghq_session_enable_delta_encoding (nghq_session *session,
+                                        const char *path, size_t path_len,
+                                        unsigned int full_every) {
+  int rv;
+
+  if ((session == NULL) || (path == NULL) || (path_len == 0) ||
+      (full_every == 0)) {
+    return NGHQ_ERROR;
+  }
+
+  if (!nghq_content_encoding_supported (NGHQ_CONTENT_ENCODING_ZSTD) &&
+      !nghq_content_encoding_supported (NGHQ_CONTENT_ENCODING_DEFLATE)) {
+    return NGHQ_NOT_IMPLEMENTED;
+  }
+
+  rv = nghq_delta_path_add (&session->delta_paths, path, path_len,
+                            full_every);
+  if (rv == NGHQ_OK) {
+    NGHQ_LOG_DEBUG (session, "Delta encoding %.*s, in full every %u\n",
+                    (int) path_len, path, full_every);
+  }
+  return rv;
+}
+
+/*
+ * Write the beacon entry for a push into buf, or just find its length if buf
+ * is NULL. An entry is the push's stream ID plus one (0 if it hasn't started),
+ * then its PUSH_PROMISE frame and the start of its stream, each after a length.
+ */
+static size_t _write_beacon_entry (nghq_stream *stream, uint8_t *buf) {
+  uint64_t stream_id = 0;
+  size_t prefix_len = 0, off = 0;
+  int done;
+
+  if (stream->stream_id != NGHQ_INVALID_STREAM_ID) {
+    stream_id = stream->stream_id + 1;
+    prefix_len = _beacon_prefix_boundary (stream->beacon_prefix,
+                                          stream->beacon_prefix_len, &done);
+  }
+
+  if (buf == NULL) {
+    return _make_varlen_int (NULL, stream_id) +
+           _make_varlen_int (NULL, stream->beacon_promise_len) +
+           stream->beacon_promise_len +
+           _make_varlen_int (NULL, prefix_len) + prefix_len;
+  }
+
+  off += _make_varlen_int (buf + off, stream_id);
+  off += _make_varlen_int (buf + off, stream->beacon_promise_len);
+  memcpy (buf + off, stream->beacon_promise, stream->beacon_promise_len);
+  off += stream->beacon_promise_len;
+  off += _make_varlen_int (buf + off, prefix_len);
+  memcpy (buf + off, stream->beacon_prefix, prefix_len);
+  return off + prefix_len;
+}
+
+static void _queue_beacon_frame (nghq_session *session, uint64_t init_offset,
+                                 int last, uint64_t count,
+                                 const uint8_t *entries, size_t entries_len) {
+  ssize_t frame_len = quic_transport_write_push_beacon (session, NULL, 0,
+                                                        init_offset, last,
+                                                        count, entries,
+                                                        entries_len);
+  nghq_io_buf *buf = nghq_io_buf_alloc (&session->beacon_frames, frame_len, 0,
+                                        0);
+  if (buf == NULL) {
+    NGHQ_LOG_WARN (session, "Couldn't queue push beacon\n");
+    return;
+  }
+  quic_transport_write_push_beacon (session, buf->buf, buf->buf_len,
+                                    init_offset, last, count, entries,
+                                    entries_len);
+  _queued_for_send (session, NULL, buf->buf_len);
+}
+
+/*
+ * Queue a beacon listing every push whose PUSH_PROMISE has been sent, split
+ * into as many frames as it takes for each to fit in a packet.
+ */
+static void _queue_push_beacon (nghq_session *session) {
+  nghq_stream *init_stream = nghq_stream_id_map_find (session->transfers,
+                                                      NGHQ_INIT_REQUEST_STREAM_ID);
+  nghq_map_ctx *maps[2] = { session->promises, session->transfers };
+  size_t boundary, capacity, overhead, max_entries, entries_len = 0;
+  uint64_t count = 0;
+  uint8_t *entries;
+  int m;
+
+  if (init_stream == NULL) return;
+
+  /* A PUSH_PROMISE part way out the door still counts as unsent */
+  boundary = init_stream->tx_offset;
+  if ((init_stream->send_buf != NULL) &&
+      (init_stream->send_buf->send_pos != init_stream->send_buf->buf)) {
+    boundary += init_stream->send_buf->remaining;
+  }
+
+  /* Each beacon frame has a packet to itself after the short header */
+  capacity = session->packet_buf_len - (1 + session->session_id_len + 4);
+  if (session->packet_timestamps) {
+    capacity -= QUIC_TIMESTAMP_TRAILER_LEN;
+  }
+  overhead = quic_transport_write_push_beacon (session, NULL, 0, boundary, 1,
+                                               UINT32_MAX, NULL, capacity) -
+             capacity;
+  max_entries = capacity - overhead;
+  entries = (uint8_t *) malloc (max_entries);
+  if (entries == NULL) {
+    NGHQ_LOG_WARN (session, "Couldn't queue push beacon\n");
+    return;
+  }
+
+  for (m = 0; m < 2; m++) {
+    nghq_stream *stream;
+    for (stream = nghq_stream_id_map_iterator (maps[m], NULL); stream != NULL;
+         stream = nghq_stream_id_map_iterator (maps[m], stream)) {
+      size_t entry_len;
+      if ((stream->beacon_promise == NULL) || (stream->promise_end > boundary)) {
+        continue;
+      }
+      entry_len = _write_beacon_entry (stream, NULL);
+      if (entry_len > max_entries) {
+        NGHQ_LOG_DEBUG (session, "Push %lu is too big to fit in a beacon\n",
+                        stream->push_id);
+        continue;
+      }
+      if (entries_len + entry_len > max_entries) {
+        _queue_beacon_frame (session, boundary, 0, count, entries,
+                             entries_len);
+        entries_len = 0;
+        count = 0;
+      }
+      entries_len += _write_beacon_entry (stream, entries + entries_len);
+      count++;
+    }
+  }
+
+  /* Sent even if empty, as it still tells joiners where to start */
+  _queue_beacon_frame (session, boundary, 1, count, entries, entries_len);
+  free (entries);
+
+  NGHQ_LOG_DEBUG (session, "Queued push beacon at stream 0 offset %lu\n",
+                  boundary);
+}
+
+static void _nghq_beacon_timeout (nghq_session *session, void *timer_id,
+                                  void *nghq_data)
+{
+  NGHQ_PROBE0 (beacon_timer);
+  _queue_push_beacon (session);
+  session->beacon_timer =
+      session->callbacks.set_timer_callback (session,
+                                             session->beacon_interval,
+                                             session->session_user_data,
+                                             _nghq_beacon_timeout, NULL);
+}
+
+int nghq_session_enable_push_beacons (nghq_session *session,
+                                      double interval) {
+  if ((session == NULL) || (session->mode != NGHQ_MODE_MULTICAST) ||
+      (interval < 0)) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->role == NGHQ_ROLE_CLIENT) {
+    nghq_stream *init_stream =
+        nghq_stream_id_map_find (session->transfers,
+                                 NGHQ_INIT_REQUEST_STREAM_ID);
+    if (session->beacon_join != BEACON_JOIN_OFF) return NGHQ_OK;
+    if ((init_stream != NULL) && ((init_stream->recv_buf != NULL) ||
+                                  (init_stream->next_recv_offset > 0))) {
+      /* Already following stream 0 */
+      session->beacon_join = BEACON_JOIN_DONE;
+    } else {
+      session->beacon_join = BEACON_JOIN_WAITING;
+    }
+    return NGHQ_OK;
+  }
+
+  if (session->callbacks.set_timer_callback == NULL) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->beacon_timer != NULL) {
+    session->callbacks.cancel_timer_callback (session,
+                                              session->session_user_data,
+                                              session->beacon_timer);
+    session->beacon_timer = NULL;
+  }
+
+  session->beacon_interval = interval;
+  if (interval > 0) {
+    session->beacon_timer =
+        session->callbacks.set_timer_callback (session, interval,
+                                               session->session_user_data,
+                                               _nghq_beacon_timeout, NULL);
+    if (session->beacon_timer == NULL) {
+      session->beacon_interval = 0;
+      return NGHQ_ERROR;
+    }
+  }
+
+  NGHQ_LOG_DEBUG (session, "Push beacons every %f seconds\n", interval);
+
+  return NGHQ_OK;
+}
+
+const nghq_cached_object *
+nghq_object_cache_lookup (nghq_session *session,
+                          const char *authority, size_t authority_len,
+                          const char *path, size_t path_len) {
+  if (session == NULL || session->object_cache == NULL || path == NULL) {
+    return NULL;
+  }
+  if (authority == NULL) {
+    authority_len = 0;
+  }
+  return nghq_object_cache_find (session->object_cache, authority,
+                                 authority_len, path, path_len);
+}
+
+void nghq_object_cache_release (nghq_session *session,
+                                const nghq_cached_object *obj) {
+  nghq_cache_entry_release ((nghq_cached_object *) obj);
+}
+
+size_t nghq_object_cache_get_size (nghq_session *session) {
+  if (session == NULL || session->object_cache == NULL) {
+    return 0;
+  }
+  return nghq_object_cache_bytes_used (session->object_cache);
+}
+
+int nghq_session_enable_snapshots (nghq_session *session) {
+  if (session == NULL) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->role != NGHQ_ROLE_CLIENT) {
+    return NGHQ_CLIENT_ONLY;
+  }
+
+  session->keep_state = 1;
+  return NGHQ_OK;
+}
+
+int nghq_session_set_unordered_delivery (nghq_session *session, int enable) {
+  if (session == NULL) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->role != NGHQ_ROLE_CLIENT) {
+    return NGHQ_CLIENT_ONLY;
+  }
+
+  session->unordered_delivery = (enable)?(1):(0);
+  return NGHQ_OK;
+}
+
+int nghq_session_set_body_coalescing (nghq_session *session,
+                                      size_t chunk_size, double max_delay) {
+  if ((session == NULL) || (max_delay < 0)) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->role != NGHQ_ROLE_CLIENT) {
+    return NGHQ_CLIENT_ONLY;
+  }
+
+  session->coalesce_bytes = chunk_size;
+  session->coalesce_delay = max_delay;
+  return NGHQ_OK;
+}
+
+int nghq_session_enable_send_timestamps (nghq_session *session, int enable,
+                                         int per_packet) {
+  if (session == NULL) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->role != NGHQ_ROLE_SERVER) {
+    return NGHQ_SERVER_ONLY;
+  }
+
+  session->send_timestamps = enable;
+  session->packet_timestamps = enable && per_packet;
+  return NGHQ_OK;
+}
+
+int nghq_session_get_latency (nghq_session *session, nghq_latency_kind kind,
+                              nghq_latency_histogram *hist) {
+  if ((session == NULL) || (kind >= NGHQ_LATENCY_MAX) || (hist == NULL)) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->role != NGHQ_ROLE_CLIENT) {
+    return NGHQ_CLIENT_ONLY;
+  }
+
+  memcpy (hist, &session->latency[kind], sizeof(nghq_latency_histogram));
+  return NGHQ_OK;
+}
+
+uint64_t nghq_session_get_limit_hits (nghq_session *session,
+                                      nghq_limit limit) {
+  if ((session == NULL) || (limit >= NGHQ_LIMIT_MAX)) {
+    return 0;
+  }
+
+  return session->limit_hits[limit];
+}
+
+int nghq_session_get_sizes (nghq_session *session, nghq_session_sizes *sizes) {
+  nghq_stream *it;
+  nghq_orphan_push *orphan;
+
+  if ((session == NULL) || (sizes == NULL)) {
+    return NGHQ_ERROR;
+  }
+
+  memset (sizes, 0, sizeof(nghq_session_sizes));
+  for (it = nghq_stream_id_map_iterator (session->transfers, NULL); it;
+       it = nghq_stream_id_map_iterator (session->transfers, it)) {
+    size_t bytes = 0;
+    nghq_io_buf *b;
+
+    for (b = it->recv_buf; b; b = b->next_buf) {
+      bytes += b->buf_len;
+    }
+    sizes->streams++;
+    sizes->recv_fragments += it->num_recv_bufs;
+    sizes->recv_bytes += bytes;
+    sizes->pending_frames += it->num_active_frames;
+    if (it->stream_id == NGHQ_PUSH_PROMISE_STREAM) {
+      sizes->push_stream_fragments = it->num_recv_bufs;
+      sizes->push_stream_bytes = bytes;
+      sizes->push_stream_frames = it->num_active_frames;
+    }
+  }
+  for (it = nghq_stream_id_map_iterator (session->promises, NULL); it;
+       it = nghq_stream_id_map_iterator (session->promises, it)) {
+    sizes->promises++;
+  }
+  for (orphan = session->orphan_pushes; orphan; orphan = orphan->next) {
+    sizes->orphan_pushes++;
+  }
+  sizes->orphan_push_bytes = session->orphan_push_bytes;
+  sizes->pending_send_bytes = session->pending_bytes;
+  sizes->cache_bytes = nghq_object_cache_get_size (session);
+  return NGHQ_OK;
+}
+
+int nghq_session_get_phase_stats (nghq_session *session,
+                                  nghq_phase_stats *stats) {
+  if ((session == NULL) || (stats == NULL)) {
+    return NGHQ_ERROR;
+  }
+
+#if NGHQ_PHASE_STATS
+  memcpy (stats, session->phase_stats, sizeof(session->phase_stats));
+  return NGHQ_OK;
+#else
+  return NGHQ_NOT_IMPLEMENTED;
+#endif
+}
+
+ssize_t nghq_session_snapshot (nghq_session *session, uint8_t **buf) {
+  nghq_stream *it;
+
+  if (session == NULL || buf == NULL) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->role != NGHQ_ROLE_CLIENT) {
+    return NGHQ_CLIENT_ONLY;
+  }
+
+  /* Body held back for coalescing is already counted as received, so it
+   * must reach the application before the snapshot says so */
+  for (it = nghq_stream_id_map_iterator (session->transfers, NULL); it;
+       it = nghq_stream_id_map_iterator (session->transfers, it)) {
+    _flush_coalesced_body (session, it, 0);
+  }
+
+  return nghq_state_snapshot (session, buf);
+}
+
+int nghq_session_restore (nghq_session *session, const uint8_t *buf,
+                          size_t len) {
+  nghq_stream *it;
+  double timeout;
+  int rv;
+
+  if (session == NULL || buf == NULL) {
+    return NGHQ_ERROR;
+  }
+
+  if (session->role != NGHQ_ROLE_CLIENT) {
+    return NGHQ_CLIENT_ONLY;
+  }
+
+  if (session->rx_pkt_num != 0) {
+    NGHQ_LOG_ERROR (session, "Can't restore a snapshot into a session that "
+                    "has already received packets\n");
+    return NGHQ_ERROR;
+  }
+
+  session->keep_state = 1;
+
+  rv = nghq_state_restore (session, buf, len);
+  if (rv != NGHQ_OK) {
+    return rv;
+  }
+
+  /* Resumed streams may never see another packet, so make sure they end */
+  timeout = session->transport_settings.stream_timeout;
+  if (timeout > 0) {
+    for (it = nghq_stream_id_map_iterator (session->transfers, NULL); it;
+         it = nghq_stream_id_map_iterator (session->transfers, it)) {
+      if (SERVER_PUSH_STREAM(it->stream_id) && it->timer_id == NULL) {
+        it->timer_id = session->callbacks.set_timer_callback (session,
+                                                    timeout,
+                                                    session->session_user_data,
+                                                    _nghq_stream_timeout,
+                                                    (void *) it);
+      }
+    }
+  }
+
+  return NGHQ_OK;
+}
+
 /*
  * Private
  */
@@ -1033,6 +2283,7 @@ static int _nghq_insert_recv_stream_data (nghq_stream* stream,
     }
     nghq_io_buf_new(pbuf, buf, datalen, eos, off);
     (*pbuf)->next_buf = next;
+    stream->num_recv_bufs++;
     memcpy (buf, data, datalen);
   } else {
     /* new data adjacent or overlapping this buffer */
@@ -1059,16 +2310,251 @@ static int _nghq_insert_recv_stream_data (nghq_stream* stream,
     }
     (*pbuf)->complete |= (*next)->complete;
     nghq_io_buf_pop (next);
+    stream->num_recv_bufs--;
   }
 
   return NGHQ_OK;
 }
 
+static void _remove_header (nghq_header **hdrs, size_t *num_hdrs, size_t i) {
+  free (hdrs[i]->name);
+  free (hdrs[i]->value);
+  free (hdrs[i]);
+  memmove (&hdrs[i], &hdrs[i + 1], (*num_hdrs - i - 1) * sizeof(hdrs[0]));
+  (*num_hdrs)--;
+}
+
+/*
+ * Start decoding a received body if its content-encoding is one we support.
+ * The content-encoding header no longer applies to what the application will
+ * be given, so it's taken out of hdrs.
+ *
+ * Returns 0 if the body has a content-encoding that won't be decoded.
+ */
+static int _start_body_decoding (nghq_session *session, nghq_stream *stream,
+                                 nghq_header **hdrs, size_t *num_hdrs) {
+  size_t i;
+  for (i = 0; i < *num_hdrs; i++) {
+    nghq_content_encoding encoding;
+    if (!_is_content_encoding (hdrs[i])) continue;
+
+    encoding = nghq_content_encoding_from_name (hdrs[i]->value,
+                                                hdrs[i]->value_len);
+    if (encoding == NGHQ_CONTENT_ENCODING_NONE) return 0;
+
+    stream->coder = nghq_content_coder_new (encoding, 1, 0,
+                                            session->content_dict,
+                                            session->content_dict_len);
+    if (stream->coder == NULL) {
+      NGHQ_LOG_WARN (session, "Couldn't start decoding the body of stream %lu"
+                     "\n", stream->stream_id);
+      return 0;
+    }
+
+    NGHQ_LOG_DEBUG (session, "Decoding %s body of stream %lu\n",
+                    nghq_content_encoding_name (encoding), stream->stream_id);
+    _remove_header (hdrs, num_hdrs, i);
+    return 1;
+  }
+  return 1;
+}
+
+/*
+ * Set up reconstruction of a received push of a delta encoded path. A delta
+ * is decoded with the path's base as the dictionary, and has its "im" and
+ * "delta-base" headers taken out of hdrs. A full body is decoded if need be
+ * and collected in stream->delta_version, to become the base once complete.
+ */
+static void _start_delta_decoding (nghq_session *session, nghq_stream *stream,
+                                   nghq_header **hdrs, size_t *num_hdrs) {
+  nghq_delta_version *base = stream->delta_path->base;
+  nghq_header *im = NULL, *delta_base = NULL, *etag = NULL;
+  nghq_content_encoding encoding;
+  size_t i;
+
+  for (i = 0; i < *num_hdrs; i++) {
+    if (_hdr_name_is (hdrs[i], _im_hdr)) {
+      im = hdrs[i];
+    } else if (_hdr_name_is (hdrs[i], _delta_base_hdr)) {
+      delta_base = hdrs[i];
+    } else if (_hdr_name_is (hdrs[i], _etag_hdr)) {
+      etag = hdrs[i];
+    }
+  }
+
+  if ((im == NULL) || (delta_base == NULL)) {
+    if ((etag != NULL) && _start_body_decoding (session, stream, hdrs,
+                                                num_hdrs)) {
+      stream->delta_version = nghq_delta_version_new (etag->value,
+                                                      etag->value_len);
+    }
+    return;
+  }
+
+  encoding = nghq_content_encoding_from_name (im->value, im->value_len);
+  if ((encoding != NGHQ_CONTENT_ENCODING_NONE) && (base != NULL) &&
+      (base->etag_len == delta_base->value_len) &&
+      (memcmp (base->etag, delta_base->value, base->etag_len) == 0)) {
+    stream->coder = nghq_content_coder_new (encoding, 1, 0, base->body,
+                                            base->body_len);
+  }
+  if (stream->coder == NULL) {
+    NGHQ_LOG_WARN (session, "Can't reconstruct the delta on stream %lu, its "
+                   "base isn't held\n", stream->stream_id);
+    stream->flags |= STREAM_FLAG_DELTA_NO_BASE;
+  } else {
+    NGHQ_LOG_DEBUG (session, "Reconstructing %s delta on stream %lu\n",
+                    nghq_content_encoding_name (encoding), stream->stream_id);
+  }
+
+  for (i = *num_hdrs; i > 0; i--) {
+    if ((hdrs[i - 1] == im) || (hdrs[i - 1] == delta_base)) {
+      _remove_header (hdrs, num_hdrs, i - 1);
+    }
+  }
+}
+
+/* Give the application any body data held back for coalescing */
+static void _flush_coalesced_body (nghq_session *session, nghq_stream *stream,
+                                   int final) {
+  if (stream->coalesce_timer != NULL) {
+    session->callbacks.cancel_timer_callback (session,
+                                              session->session_user_data,
+                                              stream->coalesce_timer);
+    stream->coalesce_timer = NULL;
+  }
+  if (stream->coalesce_len == 0) return;
+
+  NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_APP_CALLBACKS);
+  session->callbacks.on_data_recv_callback (session,
+                                            final?NGHQ_DATA_FLAGS_END_DATA:0,
+                                            stream->coalesce_buf,
+                                            stream->coalesce_len,
+                                            stream->coalesce_offset,
+                                            stream->user_data);
+  NGHQ_PHASE_END (session);
+  stream->coalesce_len = 0;
+}
+
+static void _nghq_coalesce_timeout (nghq_session *session, void *timer_id,
+                                    void *nghq_data)
+{
+  nghq_stream *stream = (nghq_stream *) nghq_data;
+  NGHQ_PROBE2 (coalesce_timer, stream->stream_id, stream->coalesce_len);
+  /* The timer has fired, so it mustn't be cancelled */
+  stream->coalesce_timer = NULL;
+  _flush_coalesced_body (session, stream, 0);
+}
+
+/*
+ * Hold on to body data until there's a chunk's worth. Returns 0 if the data
+ * should be delivered as it is instead, as there's already more than a chunk.
+ */
+static int _coalesce_body_data (nghq_session *session, nghq_stream *stream,
+                                const uint8_t *data, size_t len,
+                                size_t offset, int final) {
+  if ((stream->coalesce_len > 0) &&
+      ((offset != stream->coalesce_offset + stream->coalesce_len) ||
+       (stream->coalesce_len + len > session->coalesce_bytes))) {
+    _flush_coalesced_body (session, stream, 0);
+  }
+
+  if ((stream->coalesce_len == 0) && (len >= session->coalesce_bytes)) {
+    return 0;
+  }
+
+  if (stream->coalesce_alloc < session->coalesce_bytes) {
+    uint8_t *grown = (uint8_t *) realloc (stream->coalesce_buf,
+                                          session->coalesce_bytes);
+    if (grown == NULL) {
+      _flush_coalesced_body (session, stream, 0);
+      return 0;
+    }
+    stream->coalesce_buf = grown;
+    stream->coalesce_alloc = session->coalesce_bytes;
+  }
+  if (stream->coalesce_len == 0) {
+    stream->coalesce_offset = offset;
+  }
+  memcpy (stream->coalesce_buf + stream->coalesce_len, data, len);
+  stream->coalesce_len += len;
+
+  if (final || (stream->coalesce_len == session->coalesce_bytes)) {
+    _flush_coalesced_body (session, stream, final);
+  } else if ((stream->coalesce_timer == NULL) &&
+             (session->coalesce_delay > 0) &&
+             (session->callbacks.set_timer_callback != NULL)) {
+    stream->coalesce_timer =
+        session->callbacks.set_timer_callback (session,
+                                               session->coalesce_delay,
+                                               session->session_user_data,
+                                               _nghq_coalesce_timeout,
+                                               (void *) stream);
+  }
+  return 1;
+}
+
+/*
+ * Give body data to the application, keeping a copy if it will become a delta
+ * base.
+ */
+static void _deliver_body_data (nghq_session *session, nghq_stream *stream,
+                                const uint8_t *data, size_t len,
+                                size_t offset, int final) {
+  if ((stream->delta_version != NULL) &&
+      (nghq_delta_version_write (stream->delta_version, data, len,
+                                 offset) != NGHQ_OK)) {
+    NGHQ_LOG_WARN (session, "Couldn't keep stream %lu as a delta base\n",
+                   stream->stream_id);
+    nghq_delta_version_free (stream->delta_version);
+    stream->delta_version = NULL;
+  }
+  if (session->coalesce_bytes == 0) {
+    /* In case coalescing was only just turned off */
+    _flush_coalesced_body (session, stream, 0);
+  } else if (_coalesce_body_data (session, stream, data, len, offset, final)) {
+    return;
+  }
+  NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_APP_CALLBACKS);
+  session->callbacks.on_data_recv_callback (session,
+                                            final?NGHQ_DATA_FLAGS_END_DATA:0,
+                                            data, len, offset,
+                                            stream->user_data);
+  NGHQ_PHASE_END (session);
+}
+
+typedef struct {
+  nghq_session *session;
+  nghq_stream *stream;
+} _decoded_body_sink_data;
+
+static void _decoded_body_sink (void *sink_data, const uint8_t *data,
+                                size_t len, size_t offset, int final) {
+  _decoded_body_sink_data *d = (_decoded_body_sink_data *) sink_data;
+  _deliver_body_data (d->session, d->stream, data, len, offset, final);
+}
+
+/*
+ * Pass received body data through the stream's decoder, which gives the
+ * decoded body to the application in order.
+ */
+static void _nghq_decode_body_data (nghq_session *session,
+                                    nghq_stream *stream, const uint8_t *data,
+                                    size_t len, size_t offset, int final) {
+  _decoded_body_sink_data sink_data = { session, stream };
+  int rv = nghq_content_decode (stream->coder, data, len, offset, final,
+                                _decoded_body_sink, &sink_data);
+  if (rv != NGHQ_OK) {
+    NGHQ_LOG_ERROR (session, "Couldn't decode the body of stream %lu: %s\n",
+                    stream->stream_id, nghq_strerror (rv));
+  }
+}
+
 int _nghq_stream_headers_frame (nghq_session* session, nghq_stream* stream,
                                 nghq_stream_frame *frame) {
   nghq_header** hdrs = NULL;
   size_t num_hdrs;
-  size_t to_process;
+  ssize_t to_process;
   switch (stream->recv_state) {
     case STATE_OPEN:
       stream->recv_state = STATE_HDRS;
@@ -1100,9 +2586,11 @@ int _nghq_stream_headers_frame (nghq_session* session, nghq_stream* stream,
 
     if (STREAM_STARTED(stream->flags)) {
       if (session->callbacks.on_begin_headers_callback) {
+        NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_APP_CALLBACKS);
         rv = session->callbacks.on_begin_headers_callback(session,
-                                                  session->session_user_data,
-                                                  stream->user_data);
+                                                    session->session_user_data,
+                                                    stream->user_data);
+        NGHQ_PHASE_END (session);
         if (rv != NGHQ_OK) {
           return rv;
         }
@@ -1113,6 +2601,50 @@ int _nghq_stream_headers_frame (nghq_session* session, nghq_stream* stream,
       flags |= NGHQ_HEADERS_FLAGS_TRAILERS;
     }
 
+    if (stream->cache_entry != NULL &&
+        nghq_cache_entry_add_headers (stream->cache_entry, hdrs,
+                                      num_hdrs) != NGHQ_OK) {
+      NGHQ_LOG_WARN (session, "Couldn't cache headers for stream %lu\n",
+                     stream->stream_id);
+      nghq_cache_entry_discard (stream->cache_entry);
+      stream->cache_entry = NULL;
+    }
+
+    if (session->keep_state &&
+        nghq_state_save_headers (stream, 1, flags, hdrs,
+                                 num_hdrs) != NGHQ_OK) {
+      NGHQ_LOG_WARN (session, "Couldn't keep headers of stream %lu, it won't "
+                     "be in snapshots\n", stream->stream_id);
+    }
+
+    if ((session->role == NGHQ_ROLE_CLIENT) &&
+        !(flags & NGHQ_HEADERS_FLAGS_TRAILERS)) {
+      for (size_t i = 0; i < num_hdrs; i++) {
+        if (_hdr_name_is (hdrs[i], _sent_time_hdr)) {
+          uint64_t sent_ts = 0;
+          size_t j;
+          /* Header values aren't NUL terminated, so no strtoull() */
+          for (j = 0; j < hdrs[i]->value_len; j++) {
+            if ((hdrs[i]->value[j] < '0') || (hdrs[i]->value[j] > '9')) break;
+            sent_ts = (sent_ts * 10) + (hdrs[i]->value[j] - '0');
+          }
+          if ((j > 0) && (j == hdrs[i]->value_len)) {
+            nghq_record_latency (session, NGHQ_LATENCY_OBJECT, sent_ts);
+          }
+          break;
+        }
+      }
+    }
+
+    if ((session->role == NGHQ_ROLE_CLIENT) &&
+        !(flags & NGHQ_HEADERS_FLAGS_TRAILERS) && (stream->coder == NULL)) {
+      if (stream->delta_path != NULL) {
+        _start_delta_decoding (session, stream, hdrs, &num_hdrs);
+      } else if (session->content_encoding != NGHQ_CONTENT_ENCODING_NONE) {
+        _start_body_decoding (session, stream, hdrs, &num_hdrs);
+      }
+    }
+
     rv = nghq_deliver_headers (session, flags, hdrs, num_hdrs,
                                stream->user_data);
     if (rv != 0) {
@@ -1175,12 +2707,70 @@ static void _free_headers(nghq_header **hdrs, size_t num_hdrs)
   free (hdrs);
 }
 
+int nghq_hold_orphan_push (nghq_session* session, uint64_t push_id,
+                           int64_t stream_id, int fin, const uint8_t* data,
+                           size_t datalen) {
+  uint64_t now = get_timestamp_now();
+  size_t expired;
+  int rv;
+
+  expired = nghq_orphan_push_expire (&session->orphan_pushes,
+                                     &session->orphan_push_bytes,
+                                     now - MAX_ORPHAN_PUSH_AGE);
+  if (expired > 0) {
+    NGHQ_LOG_WARN (session, "Gave up waiting for %lu push promises\n",
+                   expired);
+  }
+
+  rv = nghq_orphan_push_hold (&session->orphan_pushes,
+                              &session->orphan_push_bytes, push_id, stream_id,
+                              fin, data, datalen, now);
+  if (rv != NGHQ_OK) {
+    NGHQ_LOG_WARN (session, "Received new server push stream %lu, but Push "
+                   "ID %lu has not been previously promised, or has already "
+                   "been started!\n", stream_id, push_id);
+    return NGHQ_HTTP_BAD_PUSH;
+  }
+
+  NGHQ_LOG_DEBUG (session, "Holding push stream %lu until push %lu is "
+                  "promised\n", stream_id, push_id);
+  return NGHQ_OK;
+}
+
+/*
+ * Feed in the start of the push stream for push_id if it arrived before the
+ * PUSH_PROMISE did.
+ */
+static void _replay_orphan_push (nghq_session *session, uint64_t push_id) {
+  nghq_orphan_push *orphan;
+  int rv;
+
+  if (session->orphan_pushes == NULL) return;
+
+  nghq_orphan_push_expire (&session->orphan_pushes,
+                           &session->orphan_push_bytes,
+                           get_timestamp_now() - MAX_ORPHAN_PUSH_AGE);
+  orphan = nghq_orphan_push_take (&session->orphan_pushes,
+                                  &session->orphan_push_bytes, push_id);
+  if (orphan == NULL) return;
+
+  NGHQ_LOG_DEBUG (session, "Push %lu was promised after its stream %lu "
+                  "started\n", push_id, orphan->stream_id);
+  rv = _transport_recv_stream_data (session, orphan->stream_id, orphan->fin,
+                                    0, orphan->data, orphan->len);
+  if (rv != NGHQ_OK) {
+    NGHQ_LOG_WARN (session, "Couldn't start push stream %lu: %d\n",
+                   orphan->stream_id, rv);
+  }
+  nghq_orphan_push_free (orphan);
+}
+
 static int _nghq_stream_push_promise_frame (nghq_session* session,
                                             nghq_stream* stream,
                                             nghq_stream_frame *frame) {
   nghq_header** hdrs = NULL;
   size_t num_hdrs;
-  size_t to_process;
+  ssize_t to_process;
   uint64_t push_id;
 
   if (stream->recv_state == STATE_DONE) {
@@ -1191,6 +2781,14 @@ static int _nghq_stream_push_promise_frame (nghq_session* session,
                                          frame->data, &push_id,
                                          &hdrs, &num_hdrs);
 
+  if (to_process == NGHQ_TOO_MUCH_DATA) {
+    /* Stream 0 carries on, but this push will never be picked up */
+    session->limit_hits[NGHQ_LIMIT_HEADER_LIST_SIZE]++;
+    NGHQ_PROBE2 (limit_hit, stream->stream_id, NGHQ_LIMIT_HEADER_LIST_SIZE);
+    NGHQ_LOG_WARN (session, "Ignoring push promise %lu, its headers are too "
+                   "large\n", push_id);
+    return NGHQ_OK;
+  }
   if (to_process < 0) {
     return to_process;
   }
@@ -1217,6 +2815,25 @@ static int _nghq_stream_push_promise_frame (nghq_session* session,
   new_promised_stream->user_data = &new_promised_stream->push_id;
   nghq_stream_id_map_add(session->promises, push_id, new_promised_stream);
 
+  if (session->object_cache != NULL && hdrs != NULL) {
+    new_promised_stream->cache_entry =
+        nghq_cache_entry_new (session->object_cache, hdrs, num_hdrs);
+  }
+
+  if (hdrs != NULL) {
+    new_promised_stream->delta_path = _find_delta_path (session, hdrs,
+                                                        num_hdrs);
+  }
+
+  if (session->keep_state && hdrs != NULL &&
+      nghq_state_save_headers (new_promised_stream, 0,
+                               (frame->data->complete)?
+                                 (NGHQ_HEADERS_FLAGS_END_REQUEST):(0),
+                               hdrs, num_hdrs) != NGHQ_OK) {
+    NGHQ_LOG_WARN (session, "Couldn't keep headers of push promise %lu, it "
+                   "won't be in snapshots\n", push_id);
+  }
+
   if (hdrs != NULL) {
     int rv;
     uint8_t flags = 0;
@@ -1226,9 +2843,11 @@ static int _nghq_stream_push_promise_frame (nghq_session* session,
     }
 
     if (session->callbacks.on_begin_promise_callback) {
+      NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_APP_CALLBACKS);
       rv = session->callbacks.on_begin_promise_callback(session,
                             session->session_user_data, stream->user_data,
                             new_promised_stream->user_data);
+      NGHQ_PHASE_END (session);
       if (rv != NGHQ_OK) {
         _free_headers(hdrs, num_hdrs);
         return rv;
@@ -1249,6 +2868,8 @@ static int _nghq_stream_push_promise_frame (nghq_session* session,
   NGHQ_LOG_DEBUG (session, "Received push promise on stream ID %lu with push ID"
                   " %lu\n", stream->stream_id, push_id);
 
+  _replay_orphan_push (session, push_id);
+
   return NGHQ_OK;
 }
 
@@ -1348,6 +2969,7 @@ static void _nghq_stream_recv_pop_data (nghq_stream* stream, size_t offset,
           (*pb)->remaining = second_len;
           tmp->next_buf = *pb;
           *pb = tmp;
+          stream->num_recv_bufs++;
         } else {
           nghq_io_buf *tmp = NULL;
           nghq_io_buf_new (&tmp, (*pb)->buf + (offset - (*pb)->offset) + len,
@@ -1355,10 +2977,12 @@ static void _nghq_stream_recv_pop_data (nghq_stream* stream, size_t offset,
           (*pb)->remaining = first_len;
           tmp->next_buf = (*pb)->next_buf;
           (*pb)->next_buf = tmp;
+          stream->num_recv_bufs++;
         }
       }
       if ((*pb)->remaining == 0) {
         nghq_io_buf_pop(pb);
+        stream->num_recv_bufs--;
       }
       break;
     }
@@ -1367,18 +2991,28 @@ static void _nghq_stream_recv_pop_data (nghq_stream* stream, size_t offset,
 
   if (*pb && (*pb)->remaining == 0) {
     nghq_io_buf_pop (pb);
+    stream->num_recv_bufs--;
   }
 }
 
 static int _nghq_stream_frame_add (nghq_session *session, nghq_stream* stream,
                                    nghq_frame_type frame_type,
-                                   size_t frame_size, size_t offset,
-                                   nghq_io_buf *data) {
+                                   size_t frame_size, size_t hdr_len,
+                                   size_t offset, nghq_io_buf *data) {
+  size_t max_frames = session->transport_settings.max_pending_frames;
   nghq_stream_frame **pf;
-  nghq_stream_frame *f =
-                    (nghq_stream_frame*) calloc (1, sizeof(nghq_stream_frame));
+  nghq_stream_frame *f;
   uint8_t *buf = NULL;
   int complete = 0;
+
+  if ((max_frames > 0) && (stream->num_active_frames >= max_frames)) {
+    return NGHQ_TOO_MUCH_DATA;
+  }
+
+  f = (nghq_stream_frame*) calloc (1, sizeof(nghq_stream_frame));
+  if (!f) {
+    return NGHQ_OUT_OF_MEMORY;
+  }
   f->frame_type = frame_type;
   if (frame_type != NGHQ_FRAME_TYPE_DATA) {
     buf = (uint8_t*) malloc (frame_size);
@@ -1387,17 +3021,13 @@ static int _nghq_stream_frame_add (nghq_session *session, nghq_stream* stream,
       return NGHQ_OUT_OF_MEMORY;
     }
   } else {
-    uint8_t *bodydata = NULL;
-    size_t datalen = 0;
-    ssize_t to_process = parse_data_frame (session, data, &bodydata, &datalen);
-    if (to_process < 0) {
-      free (f);
-      return to_process;
-    }
-    size_t hdr_len = frame_size - datalen;
+    size_t datalen = frame_size - hdr_len;
+    NGHQ_LOG_DEBUG (session, "Received DATA frame of length %lu\n", datalen);
     f->end_header_offset = offset + hdr_len;
     f->data_offset_adjust = f->end_header_offset - stream->data_frames_total;
     stream->data_frames_total += datalen;
+    stream->last_data_len = datalen;
+    stream->last_data_hdr_len = hdr_len;
   }
   if (data->complete && frame_size == data->buf_len) complete=1;
   nghq_io_buf_new (&f->data, buf, frame_size, complete, offset);
@@ -1407,15 +3037,122 @@ static int _nghq_stream_frame_add (nghq_session *session, nghq_stream* stream,
     return NGHQ_OUT_OF_MEMORY;
   }
   f->gaps->end = frame_size;
+  f->num_gaps = 1;
 
   // Append frame to active stream frames
   for (pf = &stream->active_frames; *pf; pf = &(*pf)->next);
   *pf = f;
+  stream->num_active_frames++;
+
+  return NGHQ_OK;
+}
+
+static int _nghq_stream_frame_process (nghq_session *session,
+                                       nghq_stream *stream,
+                                       nghq_stream_frame *frame) {
+  switch (frame->frame_type) {
+    case NGHQ_FRAME_TYPE_DATA:
+      // Already dealt with data
+      return NGHQ_OK;
+    case NGHQ_FRAME_TYPE_HEADERS:
+      return _nghq_stream_headers_frame (session, stream, frame);
+    case NGHQ_FRAME_TYPE_CANCEL_PUSH:
+      return _nghq_stream_cancel_push_frame (session, stream, frame);
+    case NGHQ_FRAME_TYPE_SETTINGS:
+      return _nghq_stream_settings_frame (session, stream, frame);
+    case NGHQ_FRAME_TYPE_PUSH_PROMISE:
+      return _nghq_stream_push_promise_frame (session, stream, frame);
+    case NGHQ_FRAME_TYPE_GOAWAY:
+      return _nghq_stream_goaway_frame (session, stream, frame);
+    case NGHQ_FRAME_TYPE_MAX_PUSH_ID:
+      return _nghq_stream_max_push_id_frame (session, stream, frame);
+    default:
+      /* Unknown frame type! */
+      NGHQ_LOG_ERROR (session, "Unknown frame type 0x%x\n",
+                      frame->frame_type);
+  }
+  return NGHQ_INTERNAL_ERROR;
+}
+
+/*
+ * A HEADERS or PUSH_PROMISE frame that has arrived whole, with nothing ahead
+ * of it on the stream still waiting to be processed, can be decoded where it
+ * sits in the receive buffer. That saves building a frame buffer and gap
+ * list for it and copying the frame into them.
+ *
+ * Returns 1 if the frame was processed (with the result in *rv), or 0 if it
+ * has to be assembled in the usual way.
+ */
+static int _nghq_stream_frame_in_place (nghq_session *session,
+                                        nghq_stream *stream,
+                                        nghq_frame_type frame_type,
+                                        size_t frame_size, nghq_io_buf *data,
+                                        int *rv) {
+  nghq_io_buf frame_buf;
+  nghq_stream_frame frame;
+
+  if ((frame_type != NGHQ_FRAME_TYPE_HEADERS) &&
+      (frame_type != NGHQ_FRAME_TYPE_PUSH_PROMISE)) {
+    return 0;
+  }
+  if ((stream->active_frames != NULL) || (data->buf_len < frame_size)) {
+    return 0;
+  }
+
+  memset (&frame_buf, 0, sizeof(frame_buf));
+  frame_buf.buf = data->buf;
+  frame_buf.buf_len = frame_size;
+  frame_buf.send_pos = frame_buf.buf;
+  frame_buf.remaining = frame_size;
+  frame_buf.offset = data->offset;
+  frame_buf.complete = data->complete && (frame_size == data->buf_len);
+
+  memset (&frame, 0, sizeof(frame));
+  frame.frame_type = frame_type;
+  frame.data = &frame_buf;
+
+  *rv = _nghq_stream_frame_process (session, stream, &frame);
+
+  /* Only let go of the received data once the handler is done with it */
+  _nghq_stream_recv_pop_data (stream, frame_buf.offset, frame_size);
+
+  return 1;
+}
 
+/*
+ * Deal with a stream that has gone over one of the reassembly limits. Other
+ * streams are cancelled, but stream 0 is needed for the rest of the session,
+ * so that just drops what it was holding and picks up again from the next
+ * data to arrive, like a client joining late.
+ */
+static int _nghq_stream_over_limit (nghq_session *session, nghq_stream *stream,
+                                    nghq_limit limit) {
+  session->limit_hits[limit]++;
+  NGHQ_PROBE2 (limit_hit, stream->stream_id, limit);
+
+  if (stream->stream_id == NGHQ_PUSH_PROMISE_STREAM) {
+    NGHQ_LOG_WARN (session, "Stream 0 over reassembly limit %d, dropping the "
+                   "data held for it\n", limit);
+    while (stream->active_frames != NULL) {
+      nghq_stream_frame *frame = stream->active_frames;
+      stream->active_frames = frame->next;
+      _frame_free (frame);
+    }
+    stream->num_active_frames = 0;
+    nghq_io_buf_clear (&stream->recv_buf);
+    stream->num_recv_bufs = 0;
+    frame_header_parser_reset (&stream->frame_hdr);
+    return NGHQ_OK;
+  }
+
+  NGHQ_LOG_WARN (session, "Cancelling stream %lu, over reassembly limit %d\n",
+                 stream->stream_id, limit);
+  nghq_stream_cancel (session, stream, NGHQ_TOO_MUCH_DATA);
   return NGHQ_OK;
 }
 
-static void _remove_gap (nghq_gap **list, size_t begin, size_t end) {
+static void _remove_gap (nghq_gap **list, size_t *num, size_t begin,
+                         size_t end) {
   nghq_gap **pg = list;
   while (*pg && (*pg)->end <= begin) pg = &(*pg)->next;
   if (*pg && ((*pg)->begin < end || (*pg)->end > begin)) {
@@ -1428,6 +3165,7 @@ static void _remove_gap (nghq_gap **list, size_t begin, size_t end) {
       (*pg)->end = begin;
       new_gap->next = (*pg)->next;
       (*pg)->next = new_gap;
+      (*num)++;
     } else {
       // truncate/delete
       if ((*pg)->begin >= begin) {
@@ -1440,9 +3178,72 @@ static void _remove_gap (nghq_gap **list, size_t begin, size_t end) {
         nghq_gap *to_del = *pg;
         *pg = (*pg)->next;
         free (to_del);
+        (*num)--;
+      }
+    }
+  }
+}
+
+/* Add a range to an ascending list, merging with any it overlaps or touches */
+static int _add_range (nghq_gap **list, size_t begin, size_t end) {
+  nghq_gap **pg = list;
+  if (begin >= end) return NGHQ_OK;
+  while (*pg && (*pg)->end < begin) pg = &(*pg)->next;
+  if (*pg == NULL || (*pg)->begin > end) {
+    nghq_gap *new_range = (nghq_gap*) malloc (sizeof(nghq_gap));
+    if (new_range == NULL) return NGHQ_OUT_OF_MEMORY;
+    new_range->begin = begin;
+    new_range->end = end;
+    new_range->next = *pg;
+    *pg = new_range;
+    return NGHQ_OK;
+  }
+  if (begin < (*pg)->begin) (*pg)->begin = begin;
+  if (end > (*pg)->end) (*pg)->end = end;
+  /* swallow any following ranges that now touch this one */
+  while ((*pg)->next && (*pg)->next->begin <= (*pg)->end) {
+    nghq_gap *to_del = (*pg)->next;
+    if (to_del->end > (*pg)->end) (*pg)->end = to_del->end;
+    (*pg)->next = to_del->next;
+    free (to_del);
+  }
+  return NGHQ_OK;
+}
+
+/*
+ * Work out the holes in the body data delivered for a stream. The body length
+ * is only known once the FIN has been seen and every frame header up to it has
+ * been parsed, otherwise the last hole is open ended.
+ */
+static size_t _stream_holes (nghq_stream *stream, nghq_byte_range *ranges,
+                             size_t n) {
+  size_t num = 0;
+  uint64_t pos = 0;
+  int end_known = STREAM_FIN_SEEN(stream->flags) &&
+                  (stream->next_recv_offset >= stream->final_size);
+  nghq_gap *r;
+
+  for (r = stream->body_ranges; r; r = r->next) {
+    if (r->begin > pos) {
+      if (num < n) {
+        ranges[num].begin = pos;
+        ranges[num].end = r->begin;
       }
+      num++;
+    }
+    pos = r->end;
+  }
+
+  if (!end_known || pos < stream->data_frames_total) {
+    if (num < n) {
+      ranges[num].begin = pos;
+      ranges[num].end = (end_known)?(stream->data_frames_total):
+                                    (NGHQ_BYTE_RANGE_END_UNKNOWN);
     }
+    num++;
   }
+
+  return num;
 }
 
 static size_t _frame_add_data(nghq_stream_frame *frame, nghq_io_buf *data) {
@@ -1463,7 +3264,8 @@ static size_t _frame_add_data(nghq_stream_frame *frame, nghq_io_buf *data) {
 
   frame->data->complete |= complete;
 
-  _remove_gap(&frame->gaps, copy_offset, copy_offset + copy_len);
+  _remove_gap(&frame->gaps, &frame->num_gaps, copy_offset,
+              copy_offset + copy_len);
 
   return copy_len;
 }
@@ -1495,12 +3297,188 @@ static void _frame_free (nghq_stream_frame *frame) {
   free (frame);
 }
 
+/* Seconds a missing DATA frame header is given to turn up out of order before
+ * unordered delivery stands in for it */
+#define INFER_DATA_HDR_DELAY 0.1
+
+static void _nghq_infer_timeout (nghq_session *session, void *timer_id,
+                                 void *nghq_data);
+
+/*
+ * With unordered delivery, stand in for a DATA frame whose header was lost.
+ * Bodies are mostly sent as DATA frames of one length, so if the header that
+ * would follow another one of those is there and agrees, the missing frame is
+ * taken to be that. The header may only be late, so it is first given
+ * INFER_DATA_HDR_DELAY to arrive, and the guess is kept to check against it
+ * if it arrives later still.
+ *
+ * Returns 1 if a frame was added and the next frame header is ready to parse.
+ */
+static int _nghq_stream_infer_data_frame (nghq_session *session,
+                                          nghq_stream *stream) {
+  size_t len = stream->last_data_len;
+  size_t hdr_len = stream->last_data_hdr_len;
+  size_t start = stream->next_recv_offset;
+  size_t next = start + hdr_len + len;
+  nghq_io_buf following, hdr_buf;
+  nghq_frame_type type;
+  nghq_stream_frame *f;
+  nghq_inferred_hdr *guess, **pg;
+  ssize_t size;
+
+  if (!session->unordered_delivery || (len == 0) ||
+      (stream->frame_hdr.hdr_len > 0) ||
+      (stream->stream_id == NGHQ_PUSH_PROMISE_STREAM) ||
+      (STREAM_FIN_SEEN(stream->flags) && (start >= stream->final_size))) {
+    return 0;
+  }
+
+  if ((_nghq_stream_recv_data_at (stream, next, &following) <= 0) ||
+      (following.buf_len < hdr_len)) {
+    return 0;
+  }
+  size = parse_frame_header (&following, &type);
+  if ((size <= 0) || (type != NGHQ_FRAME_TYPE_DATA) ||
+      (((size_t) size != hdr_len + len) &&
+       !(STREAM_FIN_SEEN(stream->flags) &&
+         (next + size == stream->final_size)))) {
+    return 0;
+  }
+
+  if (!stream->infer_ready || (stream->infer_offset != start)) {
+    if ((stream->infer_timer != NULL) && (stream->infer_offset == start)) {
+      return 0;
+    }
+    if (stream->infer_timer != NULL) {
+      session->callbacks.cancel_timer_callback (session,
+                                                session->session_user_data,
+                                                stream->infer_timer);
+    }
+    stream->infer_offset = start;
+    stream->infer_ready = 0;
+    stream->infer_timer =
+        session->callbacks.set_timer_callback (session, INFER_DATA_HDR_DELAY,
+                                               session->session_user_data,
+                                               _nghq_infer_timeout,
+                                               (void *) stream);
+    return 0;
+  }
+  stream->infer_ready = 0;
+
+  guess = (nghq_inferred_hdr *) calloc (1, sizeof(nghq_inferred_hdr));
+  if (guess == NULL) {
+    return 0;
+  }
+  guess->offset = start;
+  guess->len = _make_varlen_int (guess->hdr, NGHQ_FRAME_TYPE_DATA);
+  guess->len += _make_varlen_int (guess->hdr + guess->len, len);
+
+  memset (&hdr_buf, 0, sizeof(hdr_buf));
+  hdr_buf.buf = hdr_buf.send_pos = guess->hdr;
+  hdr_buf.remaining = hdr_buf.buf_len = guess->len;
+  hdr_buf.offset = start;
+  if (_nghq_stream_frame_add (session, stream, NGHQ_FRAME_TYPE_DATA,
+                              hdr_len + len, hdr_len, start,
+                              &hdr_buf) != NGHQ_OK) {
+    free (guess);
+    return 0;
+  }
+
+  /* Frames are found in order, so this keeps the list ascending */
+  for (pg = &stream->inferred_hdrs; *pg; pg = &(*pg)->next);
+  *pg = guess;
+
+  /* The header itself is never going to turn up */
+  for (f = stream->active_frames; f->next != NULL; f = f->next);
+  _remove_gap (&f->gaps, &f->num_gaps, 0, hdr_len);
+
+  NGHQ_LOG_DEBUG (session, "Taking the lost frame at offset %lu of stream %lu "
+                  "to be %lu bytes of DATA\n", start, stream->stream_id, len);
+
+  stream->next_recv_offset = next;
+  return 1;
+}
+
+/*
+ * Compare received data with any DATA frame headers that were stood in for.
+ * Returns 0 if it agrees with them, or -1 if a guess was wrong.
+ */
+static int _check_inferred_hdrs (nghq_stream *stream, const uint8_t *data,
+                                 size_t datalen, size_t off) {
+  nghq_inferred_hdr *h;
+  for (h = stream->inferred_hdrs; h && (h->offset < off + datalen);
+       h = h->next) {
+    size_t begin = (h->offset > off)?(h->offset):(off);
+    size_t end = (h->offset + h->len < off + datalen)?
+                    (h->offset + h->len):(off + datalen);
+    if ((begin < end) && (memcmp (data + (begin - off),
+                                  h->hdr + (begin - h->offset),
+                                  end - begin) != 0)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Keep received data for reassembly, leaving out the DATA frame headers that
+ * have already been stood in for, as they have no frame to go to now. A guess
+ * is forgotten once the whole of the real header has been seen.
+ */
+static void _insert_past_inferred_hdrs (nghq_stream *stream,
+                                        const uint8_t *data, size_t datalen,
+                                        size_t off, uint8_t eos) {
+  size_t end = off + datalen;
+  nghq_inferred_hdr **ph = &stream->inferred_hdrs;
+
+  while (*ph && ((*ph)->offset < end)) {
+    nghq_inferred_hdr *h = *ph;
+    size_t h_end = h->offset + h->len;
+    if (h_end <= off) {
+      ph = &h->next;
+      continue;
+    }
+    if (h->offset > off) {
+      _nghq_insert_recv_stream_data (stream, data, h->offset - off, off, 0);
+    }
+    if ((h->offset >= off) && (h_end <= end)) {
+      *ph = h->next;
+      free (h);
+    } else {
+      ph = &h->next;
+    }
+    if (h_end >= end) {
+      return;
+    }
+    data += h_end - off;
+    off = h_end;
+  }
+
+  _nghq_insert_recv_stream_data (stream, data, end - off, off, eos);
+}
+
+static int _nghq_stream_recv_process (nghq_session *session,
+                                      nghq_stream *stream);
+
+static void _nghq_infer_timeout (nghq_session *session, void *timer_id,
+                                 void *nghq_data)
+{
+  nghq_stream *stream = (nghq_stream *) nghq_data;
+  int rv;
+  /* The timer has fired, so it mustn't be cancelled */
+  stream->infer_timer = NULL;
+  stream->infer_ready = 1;
+  rv = _nghq_stream_recv_process (session, stream);
+  if (rv != NGHQ_OK) {
+    NGHQ_LOG_WARN (session, "Couldn't carry on with stream %lu past a "
+                   "missing frame header: %s\n", stream->stream_id,
+                   nghq_strerror (rv));
+  }
+}
+
 int nghq_recv_stream_data (nghq_session* session, nghq_stream* stream,
                            const uint8_t* data, size_t datalen, size_t off,
                            uint8_t end_of_stream) {
-  nghq_io_buf frame_data;
-  nghq_frame_type frame_type;
-
   if (!STREAM_STARTED(stream->flags)) {
     return NGHQ_REQUEST_CLOSED;
   }
@@ -1531,9 +3509,51 @@ int nghq_recv_stream_data (nghq_session* session, nghq_stream* stream,
 
   if (end_of_stream) {
     stream->flags |= STREAM_FLAG_FIN_SEEN;
+    stream->final_size = off + datalen;
+  }
+
+  if (stream->inferred_hdrs == NULL) {
+    _nghq_insert_recv_stream_data(stream, data, datalen, off, end_of_stream);
+  } else if (_check_inferred_hdrs (stream, data, datalen, off) == 0) {
+    _insert_past_inferred_hdrs (stream, data, datalen, off, end_of_stream);
+  } else {
+    /* Body data has gone to the wrong offsets, so all of it is suspect */
+    NGHQ_LOG_WARN (session, "A DATA frame header stood in for on stream %lu "
+                   "was wrong, cancelling it\n", stream->stream_id);
+    nghq_stream_cancel (session, stream, NGHQ_HTTP_MALFORMED_FRAME);
+    return NGHQ_OK;
+  }
+
+  return _nghq_stream_recv_process (session, stream);
+}
+
+/*
+ * Find the frames in what has been received on a stream so far, and deliver
+ * or process all that can be.
+ */
+static int _nghq_stream_recv_process (nghq_session *session,
+                                      nghq_stream *stream) {
+  nghq_io_buf frame_data;
+  nghq_frame_type frame_type;
+  size_t off, datalen;
+
+  if ((session->transport_settings.max_recv_fragments > 0) &&
+      (stream->num_recv_bufs >
+       session->transport_settings.max_recv_fragments)) {
+    return _nghq_stream_over_limit (session, stream,
+                                    NGHQ_LIMIT_RECV_FRAGMENTS);
   }
 
-  _nghq_insert_recv_stream_data(stream, data, datalen, off, end_of_stream);
+  if ((stream->stream_id == NGHQ_PUSH_PROMISE_STREAM) &&
+      (session->beacon_join == BEACON_JOIN_WAITING) &&
+      (stream->recv_buf != NULL)) {
+    if (stream->recv_buf->offset > 0) {
+      /* Joined part way through, so a beacon is needed to find where the
+       * next PUSH_PROMISE starts */
+      return NGHQ_OK;
+    }
+    session->beacon_join = BEACON_JOIN_DONE;
+  }
 
   /* Add new frames */
   if (stream->stream_id == NGHQ_PUSH_PROMISE_STREAM && stream->recv_buf) {
@@ -1542,8 +3562,26 @@ int nghq_recv_stream_data (nghq_session* session, nghq_stream* stream,
                                stream->recv_buf->buf_len -
                                stream->recv_buf->remaining;
   }
-  while (_nghq_stream_recv_data_at(stream, stream->next_recv_offset,
-                                   &frame_data) > 0) {
+  while ((_nghq_stream_recv_data_at(stream, stream->next_recv_offset +
+                                    stream->frame_hdr.hdr_len,
+                                    &frame_data) > 0) ||
+         (_nghq_stream_infer_data_frame (session, stream) &&
+          (_nghq_stream_recv_data_at(stream, stream->next_recv_offset,
+                                     &frame_data) > 0))) {
+    size_t hdr_start = stream->next_recv_offset + stream->frame_hdr.hdr_len;
+    size_t hdr_used = 0;
+    uint64_t payload_len = 0;
+    size_t size;
+    int hdr_rv;
+
+    if (frame_data.offset != hdr_start) {
+      /* Stream 0 skips over gaps to pick up again at the next buffer, so
+       * anything read of a header before the gap is no use */
+      frame_header_parser_reset (&stream->frame_hdr);
+      stream->next_recv_offset = frame_data.offset;
+      hdr_start = frame_data.offset;
+    }
+
     if (SERVER_PUSH_STREAM(stream->stream_id) &&
         stream->next_recv_offset == 0) {
       size_t push_off = 0;
@@ -1564,15 +3602,45 @@ int nghq_recv_stream_data (nghq_session* session, nghq_stream* stream,
       continue;
     }
 
-    ssize_t size = parse_frame_header (&frame_data, &frame_type);
-
-    if (size > 0) {
-      _nghq_stream_frame_add(session, stream, frame_type, size,
-                             frame_data.offset, &frame_data);
-      stream->next_recv_offset = frame_data.offset+size;
-    } else {
+    /* Pick up the frame header from wherever the last call left off */
+    hdr_rv = parse_frame_header_bytes (&stream->frame_hdr, frame_data.buf,
+                                       frame_data.buf_len, &hdr_used,
+                                       &frame_type, &payload_len);
+    if (hdr_rv <= 0) {
+      if (hdr_rv < 0) {
+        frame_header_parser_reset (&stream->frame_hdr);
+      }
       break;
     }
+
+    size_t hdr_len = stream->frame_hdr.hdr_len;
+    size = hdr_len + payload_len;
+    NGHQ_PROBE3 (frame_parse, stream->stream_id, frame_type, size);
+    frame_header_parser_reset (&stream->frame_hdr);
+    if (hdr_start != stream->next_recv_offset) {
+      /* The header started in an earlier call, get the whole frame */
+      _nghq_stream_recv_data_at(stream, stream->next_recv_offset, &frame_data);
+    }
+
+    int rv;
+    stream->next_recv_offset = frame_data.offset+size;
+    if (_nghq_stream_frame_in_place (session, stream, frame_type, size,
+                                     &frame_data, &rv)) {
+      if (rv == NGHQ_TOO_MUCH_DATA) {
+        return _nghq_stream_over_limit (session, stream,
+                                        NGHQ_LIMIT_HEADER_LIST_SIZE);
+      }
+      if (rv != NGHQ_OK) {
+        return rv;
+      }
+      continue;
+    }
+    rv = _nghq_stream_frame_add(session, stream, frame_type, size, hdr_len,
+                                frame_data.offset, &frame_data);
+    if (rv == NGHQ_TOO_MUCH_DATA) {
+      return _nghq_stream_over_limit (session, stream,
+                                      NGHQ_LIMIT_PENDING_FRAMES);
+    }
   }
 
   // Populate the active frames with unused data that fits
@@ -1585,8 +3653,20 @@ int nghq_recv_stream_data (nghq_session* session, nghq_stream* stream,
     for (nghq_stream_frame **pf = &stream->active_frames; *pf; ) {
       size_t frame_data_offset = 0;
       if (_frame_contains_stream_range(*pf, off, datalen, &frame_data_offset)) {
+        if (((*pf)->frame_type == NGHQ_FRAME_TYPE_DATA) &&
+            (stream->recv_state == STATE_OPEN)) {
+          // headers frame not seen yet, hang onto data for now
+          pf = &(*pf)->next;
+          continue;
+        }
         _nghq_stream_recv_data_at(stream, frame_data_offset, &frame_data);
         size_t used = _frame_add_data(*pf, &frame_data);
+        if ((session->transport_settings.max_frame_gaps > 0) &&
+            ((*pf)->num_gaps >
+             session->transport_settings.max_frame_gaps)) {
+          return _nghq_stream_over_limit (session, stream,
+                                          NGHQ_LIMIT_FRAME_GAPS);
+        }
         if ((*pf)->frame_type == NGHQ_FRAME_TYPE_DATA) {
           uint8_t *data = frame_data.buf;
           size_t data_offset;
@@ -1594,11 +3674,6 @@ int nghq_recv_stream_data (nghq_session* session, nghq_stream* stream,
           size_t hdr_bytes = 0;
           int last_data = (*pf)->data->complete;
 
-          if (stream->recv_state == STATE_OPEN) {
-            // headers frame not seen yet, hang onto data for now
-            continue;
-          }
-
           if (stream->recv_state == STATE_HDRS) {
             stream->recv_state = STATE_BODY;
           }
@@ -1610,11 +3685,26 @@ int nghq_recv_stream_data (nghq_session* session, nghq_stream* stream,
           data_used -= hdr_bytes;
           data += hdr_bytes;
           data_offset = frame_data.offset + hdr_bytes - (*pf)->data_offset_adjust;
+          if (stream->cache_entry != NULL &&
+              nghq_cache_entry_write (stream->cache_entry, data, data_used,
+                                      data_offset) != NGHQ_OK) {
+            NGHQ_LOG_WARN (session, "Couldn't cache body data for stream %lu"
+                           "\n", stream->stream_id);
+            nghq_cache_entry_discard (stream->cache_entry);
+            stream->cache_entry = NULL;
+          }
+          _add_range (&stream->body_ranges, data_offset,
+                      data_offset + data_used);
           // send data immediately - not stored in DATA frames
-          session->callbacks.on_data_recv_callback(session,
-                                         last_data?NGHQ_DATA_FLAGS_END_DATA:0,
-                                         data, data_used, data_offset,
-                                         stream->user_data);
+          if (STREAM_DELTA_NO_BASE(stream->flags)) {
+            // a delta that can't be reconstructed is no use to anyone
+          } else if (stream->coder != NULL) {
+            _nghq_decode_body_data (session, stream, data, data_used,
+                                    data_offset, last_data);
+          } else {
+            _deliver_body_data (session, stream, data, data_used,
+                                data_offset, last_data);
+          }
         }
         _nghq_stream_recv_pop_data(stream, frame_data.offset, used);
         data_modified = 1;
@@ -1624,37 +3714,14 @@ int nghq_recv_stream_data (nghq_session* session, nghq_stream* stream,
            (*pf)->frame_type == NGHQ_FRAME_TYPE_DATA) &&
           (*pf)->gaps == NULL) {
         nghq_stream_frame *frame = *pf;
-        int rv = NGHQ_OK;
-        switch (frame->frame_type) {
-          case NGHQ_FRAME_TYPE_DATA:
-            // Already dealt with data
-            break;
-          case NGHQ_FRAME_TYPE_HEADERS:
-            rv = _nghq_stream_headers_frame (session, stream, frame);
-            break;
-          case NGHQ_FRAME_TYPE_CANCEL_PUSH:
-            rv = _nghq_stream_cancel_push_frame (session, stream, frame);
-            break;
-          case NGHQ_FRAME_TYPE_SETTINGS:
-            rv = _nghq_stream_settings_frame (session, stream, frame);
-            break;
-          case NGHQ_FRAME_TYPE_PUSH_PROMISE:
-            rv = _nghq_stream_push_promise_frame (session, stream, frame);
-            break;
-          case NGHQ_FRAME_TYPE_GOAWAY:
-            rv = _nghq_stream_goaway_frame (session, stream, frame);
-            break;
-          case NGHQ_FRAME_TYPE_MAX_PUSH_ID:
-            rv = _nghq_stream_max_push_id_frame (session, stream, frame);
-            break;
-          default:
-            /* Unknown frame type! */
-            NGHQ_LOG_ERROR (session, "Unknown frame type 0x%x\n",
-                            frame->frame_type);
-            rv = NGHQ_INTERNAL_ERROR;
-        }
+        int rv = _nghq_stream_frame_process (session, stream, frame);
         *pf = frame->next;
+        stream->num_active_frames--;
         _frame_free (frame);
+        if (rv == NGHQ_TOO_MUCH_DATA) {
+          return _nghq_stream_over_limit (session, stream,
+                                          NGHQ_LIMIT_HEADER_LIST_SIZE);
+        }
         if (rv != NGHQ_OK) {
           return rv;
         }
@@ -1672,13 +3739,195 @@ int nghq_recv_stream_data (nghq_session* session, nghq_stream* stream,
     }
   }
 
-  if ((stream->active_frames == NULL) && STREAM_FIN_SEEN(stream->flags)) {
+  if ((stream->infer_timer != NULL) &&
+      (stream->next_recv_offset > stream->infer_offset)) {
+    /* The header being waited for turned up */
+    session->callbacks.cancel_timer_callback (session,
+                                              session->session_user_data,
+                                              stream->infer_timer);
+    stream->infer_timer = NULL;
+  }
+
+  /* Not while a missing DATA frame header still has time to turn up */
+  if ((stream->active_frames == NULL) && STREAM_FIN_SEEN(stream->flags) &&
+      (stream->infer_timer == NULL)) {
     nghq_stream_close (session, stream, QUIC_ERR_HTTP_NO_ERROR);
   }
 
   return NGHQ_OK;
 }
 
+/*
+ * Start following a push listed in a beacon, as if its PUSH_PROMISE and the
+ * start of its stream had been received.
+ */
+static void _join_push (nghq_session *session, nghq_stream *init_stream,
+                        uint64_t stream_id, const uint8_t *promise,
+                        size_t promise_len, const uint8_t *prefix,
+                        size_t prefix_len) {
+  nghq_stream *stream = NULL;
+  uint64_t push_id;
+  size_t off = 0;
+  int rv;
+
+  if (stream_id > 0) {
+    stream = nghq_stream_id_map_find (session->transfers, stream_id - 1);
+    if ((stream != NULL) &&
+        (stream->push_id != NGHQ_STREAM_ID_MAP_NOT_FOUND)) {
+      /* Already following it */
+      return;
+    }
+  }
+
+  /* Frame type, length and then the push ID */
+  _get_varlen_int (promise, &off, promise_len);
+  if (off >= promise_len) return;
+  _get_varlen_int (promise + off, &off, promise_len);
+  if (off >= promise_len) return;
+  push_id = _get_varlen_int (promise + off, &off, promise_len);
+  if (off > promise_len) return;
+
+  if (nghq_stream_id_map_find (session->promises, push_id) == NULL) {
+    nghq_io_buf data;
+    nghq_stream_frame frame;
+
+    memset (&data, 0, sizeof(data));
+    data.buf = data.send_pos = (uint8_t *) promise;
+    data.buf_len = data.remaining = promise_len;
+    memset (&frame, 0, sizeof(frame));
+    frame.frame_type = NGHQ_FRAME_TYPE_PUSH_PROMISE;
+    frame.data = &data;
+
+    rv = _nghq_stream_push_promise_frame (session, init_stream, &frame);
+    if (rv != NGHQ_OK) {
+      NGHQ_LOG_DEBUG (session, "Not joining push %lu from beacon: %d\n",
+                      push_id, rv);
+      return;
+    }
+
+    /* The stream may have been waiting for the promise */
+    if (stream_id > 0) {
+      stream = nghq_stream_id_map_find (session->transfers, stream_id - 1);
+      if ((stream != NULL) &&
+          (stream->push_id != NGHQ_STREAM_ID_MAP_NOT_FOUND)) {
+        return;
+      }
+    }
+  }
+
+  if ((stream_id > 0) && (prefix_len > 0)) {
+    rv = _transport_recv_stream_data (session, (int64_t) (stream_id - 1), 0,
+                                      0, prefix, prefix_len);
+    if (rv != NGHQ_OK) {
+      NGHQ_LOG_DEBUG (session, "Couldn't join push %lu on stream %lu: %d\n",
+                      push_id, stream_id - 1, rv);
+    }
+  }
+}
+
+int nghq_recv_push_beacon (nghq_session* session, uint64_t init_offset,
+                           int last, uint64_t count, const uint8_t* entries,
+                           size_t entries_len) {
+  nghq_stream *init_stream;
+  nghq_io_buf *held = NULL;
+  size_t off = 0;
+  uint64_t i;
+
+  if ((session->role != NGHQ_ROLE_CLIENT) ||
+      (session->beacon_join == BEACON_JOIN_OFF) ||
+      (session->beacon_join == BEACON_JOIN_DONE) ||
+      ((session->beacon_join == BEACON_JOIN_JOINING) &&
+       (init_offset != session->beacon_offset))) {
+    return NGHQ_OK;
+  }
+
+  init_stream = nghq_stream_id_map_find (session->transfers,
+                                         NGHQ_INIT_REQUEST_STREAM_ID);
+  if (init_stream == NULL) {
+    return NGHQ_OK;
+  }
+
+  if (session->beacon_join == BEACON_JOIN_WAITING) {
+    if ((init_stream->recv_buf != NULL) &&
+        (init_stream->recv_buf->offset > init_offset)) {
+      /* Joined after this beacon was made, so wait for the next one */
+      return NGHQ_OK;
+    }
+    NGHQ_LOG_INFO (session, "Joining session at stream 0 offset %lu\n",
+                   init_offset);
+    held = init_stream->recv_buf;
+    init_stream->recv_buf = NULL;
+    init_stream->num_recv_bufs = 0;
+    init_stream->next_recv_offset = init_offset;
+    session->beacon_join = BEACON_JOIN_JOINING;
+    session->beacon_offset = init_offset;
+  }
+
+  for (i = 0; i < count; i++) {
+    uint64_t stream_id, promise_len, prefix_len;
+    const uint8_t *promise;
+
+    if (off >= entries_len) break;
+    stream_id = _get_varlen_int (entries + off, &off, entries_len);
+    if (off >= entries_len) break;
+    promise_len = _get_varlen_int (entries + off, &off, entries_len);
+    if ((off > entries_len) || (promise_len >= entries_len - off)) break;
+    promise = entries + off;
+    off += promise_len;
+    prefix_len = _get_varlen_int (entries + off, &off, entries_len);
+    if ((off > entries_len) || (prefix_len > entries_len - off)) break;
+
+    _join_push (session, init_stream, stream_id, promise, promise_len,
+                entries + off, prefix_len);
+    off += prefix_len;
+  }
+  if (i < count) {
+    NGHQ_LOG_WARN (session, "Push beacon was cut short after %lu of %lu "
+                   "entries\n", i, count);
+  }
+
+  if (last) {
+    session->beacon_join = BEACON_JOIN_DONE;
+  }
+
+  /* Anything held from stream 0 after the beacon's offset can now be used */
+  while (held != NULL) {
+    size_t start = held->offset + (held->send_pos - held->buf);
+    if (start + held->remaining > init_offset) {
+      size_t skip = (start < init_offset)?(init_offset - start):(0);
+      nghq_recv_stream_data (session, init_stream, held->send_pos + skip,
+                             held->remaining - skip, start + skip,
+                             held->complete);
+    }
+    nghq_io_buf_pop (&held);
+  }
+
+  return NGHQ_OK;
+}
+
+void nghq_record_latency (nghq_session* session, nghq_latency_kind kind,
+                          uint64_t sent_ts) {
+  nghq_latency_histogram *hist = &session->latency[kind];
+  uint64_t latency;
+  size_t bucket = 0;
+
+  if (sent_ts > session->packet_rx_ts) {
+    hist->clock_behind++;
+    return;
+  }
+
+  latency = session->packet_rx_ts - sent_ts;
+  while ((bucket < NGHQ_LATENCY_BUCKETS - 1) && (latency >> bucket)) {
+    bucket++;
+  }
+  hist->buckets[bucket]++;
+  hist->count++;
+  hist->total_usecs += latency;
+  if (latency > hist->max_usecs) {
+    hist->max_usecs = latency;
+  }
+}
+
 int nghq_deliver_headers (nghq_session* session, uint8_t flags,
                           nghq_header **hdrs, size_t num_hdrs,
                           void *request_user_data) {
@@ -1694,8 +3943,10 @@ int nghq_deliver_headers (nghq_session* session, uint8_t flags,
       flags |= fin;
     }
     if (rv == NGHQ_OK) {
+      NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_APP_CALLBACKS);
       rv = session->callbacks.on_headers_callback(session, flags, hdrs[i],
                                                   request_user_data);
+      NGHQ_PHASE_END (session);
     }
     free (hdrs[i]->name);
     free (hdrs[i]->value);
@@ -1711,8 +3962,8 @@ int nghq_queue_send_frame (nghq_session* session, uint64_t stream_id,
   int rv = NGHQ_INTERNAL_ERROR;
   nghq_stream *stream = nghq_stream_id_map_find(session->transfers, stream_id);
   if (stream != NULL) {
-    nghq_io_buf_new (&stream->send_buf, buf, buflen, 0, 0);
-    rv = NGHQ_OK;
+    rv = nghq_io_buf_new (&stream->send_buf, buf, buflen, 0, 0);
+    if (rv == NGHQ_OK) _queued_for_send (session, stream, buflen);
   }
   return rv;
 }
@@ -1721,10 +3972,14 @@ int nghq_write_send_buffer (nghq_session* session) {
   int rv = NGHQ_NO_MORE_DATA;
   while (session->send_buf != NULL) {
     if (session->handshake_complete) {
+      NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_SEND_CALLBACK);
       ssize_t written =
           session->callbacks.send_callback (session, session->send_buf->buf,
                                              session->send_buf->buf_len,
                                              session->session_user_data);
+      NGHQ_PHASE_END (session);
+      NGHQ_PROBE3 (packet_send, session->send_buf->pkt_num,
+                   session->send_buf->buf_len, written);
 
       if (written != session->send_buf->buf_len) {
         if (written == 0) {
@@ -1739,6 +3994,7 @@ int nghq_write_send_buffer (nghq_session* session) {
       }
     }
 
+    session->pending_bytes -= session->send_buf->buf_len;
     free (session->send_buf->buf);
     nghq_io_buf *pop = session->send_buf;
     session->send_buf = session->send_buf->next_buf;
@@ -1749,6 +4005,47 @@ int nghq_write_send_buffer (nghq_session* session) {
   return rv;
 }
 
+/*
+ * Tell the application that a received request is finished, with its holes if
+ * it asked for them.
+ */
+static void _nghq_request_closed (nghq_session* session, nghq_stream *stream,
+                                  nghq_error status) {
+  _flush_coalesced_body (session, stream, 0);
+
+  if (session->callbacks.on_request_close_holes_callback) {
+    nghq_byte_range stack_holes[8];
+    nghq_byte_range *holes = stack_holes;
+    size_t num_holes = 0;
+
+    if (status != NGHQ_OK) {
+      num_holes = _stream_holes (stream, holes, 8);
+      if (num_holes > 8) {
+        holes = (nghq_byte_range *) malloc (num_holes *
+                                            sizeof(nghq_byte_range));
+        if (holes == NULL) {
+          /* Better to report the first few than none at all */
+          holes = stack_holes;
+          num_holes = 8;
+        } else {
+          _stream_holes (stream, holes, num_holes);
+        }
+      }
+    }
+    NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_APP_CALLBACKS);
+    session->callbacks.on_request_close_holes_callback (session, status,
+                                                        holes, num_holes,
+                                                        stream->user_data);
+    NGHQ_PHASE_END (session);
+    if (holes != stack_holes) free (holes);
+  } else if (session->callbacks.on_request_close_callback) {
+    NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_APP_CALLBACKS);
+    session->callbacks.on_request_close_callback (session, status,
+                                                  stream->user_data);
+    NGHQ_PHASE_END (session);
+  }
+}
+
 /*
  * Call this method if you want to stop a stream that is currently running.
  */
@@ -1759,6 +4056,7 @@ int nghq_stream_cancel (nghq_session* session, nghq_stream *stream,
     return NGHQ_ERROR;
   }
 
+  NGHQ_PROBE2 (stream_cancel, stream->stream_id, error);
   switch (error) {
     case NGHQ_ERROR:
     case NGHQ_INTERNAL_ERROR:
@@ -1769,28 +4067,30 @@ int nghq_stream_cancel (nghq_session* session, nghq_stream *stream,
     case NGHQ_REQUEST_CLOSED:
       app_error_code = QUIC_ERR_HTTP_REQUEST_CANCELLED;
       break;
+    case NGHQ_TOO_MUCH_DATA:
+      app_error_code = QUIC_ERR_HTTP_EXCESSIVE_LOAD;
+      break;
     default:
       break;
   }
   if (session->role == NGHQ_ROLE_SERVER) {
-    uint64_t pktnum;
-    nghq_io_buf *buf = nghq_io_buf_alloc (NULL, session->packet_buf_len, 1, 0);
-    ssize_t off = quic_transport_write_quic_header (session, buf->buf,
-                                                    buf->buf_len, &pktnum);
-    off += quic_transport_write_reset_stream (session, buf->buf + off,
-                                              buf->buf_len - off, stream,
-                                              app_error_code);
-    buf->buf_len = quic_transport_encrypt (session, buf->buf, off, buf->buf,
-                                           buf->buf_len);
-    nghq_io_buf_push (&session->send_buf, buf);
+    /* Queued rather than sent alone, nghq_session_send will pack it */
+    ssize_t frame_len = quic_transport_write_reset_stream (session, NULL, 0,
+                                                           stream,
+                                                           app_error_code);
+    nghq_io_buf *buf = nghq_io_buf_alloc (&session->ctrl_frames, frame_len,
+                                          0, 0);
+    if (buf != NULL) {
+      quic_transport_write_reset_stream (session, buf->buf, buf->buf_len,
+                                         stream, app_error_code);
+      _queued_for_send (session, NULL, buf->buf_len);
+    }
   }
 
-  nghq_stream_id_map_remove (session->transfers, stream->stream_id);
+  /* Still in the map for the callback, so nghq_get_stream_holes works */
+  _nghq_request_closed (session, stream, error);
 
-  if (session->callbacks.on_request_close_callback) {
-    session->callbacks.on_request_close_callback (session, error,
-                                                  stream->user_data);
-  }
+  nghq_stream_id_map_remove (session->transfers, stream->stream_id);
 
   return nghq_stream_ended (session, stream);
 }
@@ -1801,9 +4101,62 @@ int nghq_stream_cancel (nghq_session* session, nghq_stream *stream,
 int nghq_stream_ended (nghq_session* session, nghq_stream *stream) {
   if (stream == NULL) return NGHQ_OK;
 
+  _dequeued_for_send (session, stream, stream->queued_bytes);
   nghq_io_buf_clear(&stream->send_buf);
   nghq_io_buf_clear(&stream->recv_buf);
 
+  /* Frames part way through reassembly when the stream was cut off */
+  while (stream->active_frames != NULL) {
+    nghq_stream_frame *frame = stream->active_frames;
+    stream->active_frames = frame->next;
+    _frame_free (frame);
+  }
+
+  /* Anything still being collected for the cache didn't complete */
+  nghq_cache_entry_discard (stream->cache_entry);
+  stream->cache_entry = NULL;
+
+  free (stream->saved_hdrs);
+  stream->saved_hdrs = NULL;
+
+  nghq_content_coder_free (stream->coder);
+  stream->coder = NULL;
+
+  nghq_delta_version_free (stream->delta_version);
+  stream->delta_version = NULL;
+
+  if (stream->coalesce_timer) {
+    session->callbacks.cancel_timer_callback (session,
+                                              session->session_user_data,
+                                              stream->coalesce_timer);
+    stream->coalesce_timer = NULL;
+  }
+  free (stream->coalesce_buf);
+  stream->coalesce_buf = NULL;
+
+  if (stream->infer_timer) {
+    session->callbacks.cancel_timer_callback (session,
+                                              session->session_user_data,
+                                              stream->infer_timer);
+    stream->infer_timer = NULL;
+  }
+  while (stream->inferred_hdrs) {
+    nghq_inferred_hdr *to_del = stream->inferred_hdrs;
+    stream->inferred_hdrs = to_del->next;
+    free (to_del);
+  }
+
+  free (stream->beacon_promise);
+  stream->beacon_promise = NULL;
+  free (stream->beacon_prefix);
+  stream->beacon_prefix = NULL;
+
+  while (stream->body_ranges) {
+    nghq_gap *to_del = stream->body_ranges;
+    stream->body_ranges = to_del->next;
+    free (to_del);
+  }
+
   if (stream->timer_id) {
     session->callbacks.cancel_timer_callback (session,
                                               session->session_user_data,
@@ -1827,6 +4180,7 @@ int nghq_stream_close (nghq_session* session, nghq_stream *stream,
 
   NGHQ_LOG_DEBUG (session, "Stream %lu is closing with code 0x%04X\n",
                   stream->stream_id, app_error_code);
+  NGHQ_PROBE2 (stream_close, stream->stream_id, app_error_code);
 
   switch (app_error_code) {
     case QUIC_ERR_STOPPING:
@@ -1890,8 +4244,20 @@ int nghq_stream_close (nghq_session* session, nghq_stream *stream,
 
   if (request_closing) {
     uint64_t stream_id = stream->stream_id;
-    session->callbacks.on_request_close_callback (session, status,
-                                                  stream->user_data);
+    if (STREAM_DELTA_NO_BASE(stream->flags)) {
+      status = NGHQ_MISSING_DATA;
+    }
+    if (stream->delta_version != NULL && status == NGHQ_OK) {
+      nghq_delta_path_set_base (stream->delta_path, stream->delta_version);
+      stream->delta_version = NULL;
+    }
+    if (stream->cache_entry != NULL) {
+      /* Cache before the callback, so the application can look it up there */
+      nghq_cache_entry_complete (session->object_cache, stream->cache_entry,
+                                 status);
+      stream->cache_entry = NULL;
+    }
+    _nghq_request_closed (session, stream, status);
     rv = nghq_stream_ended (session, stream);
     nghq_stream_id_map_remove (session->transfers, stream_id);
   }
@@ -1949,6 +4315,7 @@ nghq_stream *nghq_open_stream (nghq_session* session, nghq_stream_type type) {
     free (stream);
     return NULL;
   }
+  NGHQ_PROBE1 (stream_open, stream->stream_id);
 
   return stream;
 }
@@ -2085,6 +4452,8 @@ const char * nghq_strerror (int err) {
       return "Could not allocate memory";
     case NGHQ_NOT_IMPLEMENTED:
       return "Requested functionality not implemented in this version of nghq";
+    case NGHQ_BAD_SNAPSHOT:
+      return "Session snapshot is invalid or for a different session";
     case NGHQ_INCOMPATIBLE_METHOD:
       return "Incompatible connection method";
     case NGHQ_TOO_MUCH_DATA:
@@ -42,6 +42,34 @@ typedef struct nghq_hdr_compression_ctx nghq_hdr_compression_ctx;
 struct nghq_io_buf;
 typedef struct nghq_io_buf nghq_io_buf;
 
+struct nghq_object_cache;
+typedef struct nghq_object_cache nghq_object_cache;
+
+struct nghq_cache_entry;
+typedef struct nghq_cache_entry nghq_cache_entry;
+
+struct nghq_content_coder;
+typedef struct nghq_content_coder nghq_content_coder;
+
+struct nghq_delta_path;
+typedef struct nghq_delta_path nghq_delta_path;
+
+struct nghq_delta_version;
+typedef struct nghq_delta_version nghq_delta_version;
+
+struct nghq_orphan_push;
+typedef struct nghq_orphan_push nghq_orphan_push;
+
+typedef enum {
+  BEACON_JOIN_OFF,
+  BEACON_JOIN_WAITING,  /* holding stream 0 data until a beacon arrives */
+  BEACON_JOIN_JOINING,  /* taking the rest of the beacon at beacon_offset */
+  BEACON_JOIN_DONE      /* following stream 0, beacons no longer needed */
+} nghq_beacon_join;
+
+/* How deeply phases can be nested when timing them */
+#define NGHQ_PHASE_STACK_DEPTH 8
+
 typedef enum nghq_stream_state {
   STATE_OPEN,
   STATE_HDRS,
@@ -58,6 +86,7 @@ typedef enum nghq_stream_state {
 #define STREAM_FLAG_FIN_SEEN UINT8_C(0x04)
 #define STREAM_FLAG_LONG_DATA_FRAME_REQ UINT8_C(0x08)
 #define STREAM_FLAG_LONG_DATA_FRAME_FIN UINT8_C(0x10)
+#define STREAM_FLAG_DELTA_NO_BASE UINT8_C(0x20)
 
 typedef struct nghq_gap {
   uint64_t begin;
@@ -68,6 +97,7 @@ typedef struct nghq_gap {
 typedef struct nghq_stream_frame {
   nghq_frame_type           frame_type;
   nghq_gap*                 gaps;
+  size_t                    num_gaps;
 
   // Single buffer to cover whole frame. Buffer memory (data->buf) only present
   // when frame_type != NGHQ_FRAME_TYPE_DATA.
@@ -84,23 +114,60 @@ typedef struct nghq_stream_frame {
   struct nghq_stream_frame* next;
 } nghq_stream_frame;
 
+/* A DATA frame header that unordered delivery stood in for, kept to check
+ * against the real one if that turns up after all */
+typedef struct nghq_inferred_hdr {
+  size_t                    offset; /* stream offset of the header */
+  size_t                    len;
+  uint8_t                   hdr[16];
+  struct nghq_inferred_hdr* next;
+} nghq_inferred_hdr;
+
 typedef struct {
   uint64_t      push_id;
   int64_t       stream_id;
   nghq_io_buf*  send_buf;
   nghq_io_buf*  recv_buf;
+  size_t        num_recv_bufs; /* kept as it changes, for the limits */
   size_t        buf_idx;
   uint64_t      tx_offset;  /*Offset where all data before is acked by remote peer*/
   size_t        data_frames_total; /* total size of BODY data seen so far */
+  size_t        last_data_len; /* payload length of the last DATA frame */
+  size_t        last_data_hdr_len; /* and the length of its frame header */
+  void *        infer_timer; /* giving a missing DATA header time to arrive */
+  size_t        infer_offset; /* stream offset of the header being waited for */
+  int           infer_ready; /* waited long enough to stand in for it */
+  nghq_inferred_hdr* inferred_hdrs; /* headers stood in for, ascending */
+  uint8_t*      coalesce_buf; /* body data waiting to be delivered together */
+  size_t        coalesce_len;
+  size_t        coalesce_alloc;
+  size_t        coalesce_offset; /* body offset of coalesce_buf */
+  void *        coalesce_timer;
   void *        user_data;
   nghq_stream_state recv_state;
   nghq_stream_state send_state;
   nghq_error    status;
   uint8_t       flags;
   size_t        next_recv_offset;
+  nghq_frame_hdr_parser frame_hdr; /* header being read at next_recv_offset */
   size_t        long_data_frame_remaining;
   nghq_stream_frame* active_frames;
+  size_t        num_active_frames;
   void *        timer_id;
+  nghq_cache_entry* cache_entry; /* object being collected for the cache */
+  nghq_gap*     body_ranges; /* body byte ranges delivered, ascending */
+  size_t        final_size;  /* stream offset of the FIN, if seen */
+  uint8_t*      saved_hdrs;  /* headers delivered, kept for snapshots */
+  size_t        saved_hdrs_len;
+  size_t        queued_bytes; /* bytes in send_buf not yet packetised */
+  nghq_content_coder* coder; /* compresses or decompresses the body */
+  nghq_delta_path* delta_path; /* if the :path of this push is delta encoded */
+  nghq_delta_version* delta_version; /* full body being kept as a delta base */
+  size_t        promise_end; /* stream 0 offset after this PUSH_PROMISE */
+  uint8_t*      beacon_promise; /* the PUSH_PROMISE frame, for beacons */
+  size_t        beacon_promise_len;
+  uint8_t*      beacon_prefix; /* start of the push stream, for beacons */
+  size_t        beacon_prefix_len;
 } nghq_stream;
 
 #define STREAM_STARTED(x) (x & STREAM_FLAG_STARTED)
@@ -108,6 +175,7 @@ typedef struct {
 #define STREAM_FIN_SEEN(x) (x & STREAM_FLAG_FIN_SEEN)
 #define STREAM_LONG_DATA_FRAME_REQ(x) (x & STREAM_FLAG_LONG_DATA_FRAME_REQ)
 #define STREAM_LONG_DATA_FRAME_FIN(x) (x & STREAM_FLAG_LONG_DATA_FRAME_FIN)
+#define STREAM_DELTA_NO_BASE(x) (x & STREAM_FLAG_DELTA_NO_BASE)
 
 typedef struct tls13_varlen_vector {
   size_t size;
@@ -197,12 +265,20 @@ struct nghq_session {
   int             handshake_complete;
 
   size_t          packet_buf_len;
+  size_t          recv_buf_len;
+  uint8_t*        recv_scratch; /* recv_buf_len + 1, each datagram is read here */
 
   nghq_ts         last_recv_ts;
 
   uint64_t        tx_pkt_num;
   uint64_t        rx_pkt_num;
 
+  /* Packets sent in the current and previous reorder windows, for choosing
+   * the packet number length with NGHQ_PKTNUM_LEN_AUTO */
+  uint64_t        tx_window_start;
+  uint64_t        tx_window_pkts;
+  uint64_t        tx_prev_window_pkts;
+
   /* Application-specific stuff */
   nghq_callbacks  callbacks;
   nghq_settings   settings;
@@ -215,11 +291,76 @@ struct nghq_session {
 
   nghq_hdr_compression_ctx *hdr_ctx;
 
+  nghq_object_cache *object_cache;
+
+  /* Keep delivered headers with each stream for nghq_session_snapshot() */
+  int             keep_state;
+
+  /* Carry on past lost DATA frame headers, see
+   * nghq_session_set_unordered_delivery() */
+  int             unordered_delivery;
+
+  /* Deliver body data in chunks of up to coalesce_bytes, holding it for no
+   * more than coalesce_delay seconds, or as it arrives if coalesce_bytes is 0 */
+  size_t          coalesce_bytes;
+  double          coalesce_delay;
+
+  /* Body compression for pushes, or decompression of received bodies */
+  nghq_content_encoding content_encoding;
+  int             content_level;
+  uint8_t *       content_dict;
+  size_t          content_dict_len;
+
+  /* Paths whose pushes are sent or received as deltas */
+  nghq_delta_path *delta_paths;
+
+  /* Beacons of outstanding pushes, sent every beacon_interval seconds by a
+   * server, or used by a client to join part way through a session */
+  double          beacon_interval;
+  void *          beacon_timer;
+  nghq_beacon_join beacon_join;
+  uint64_t        beacon_offset; /* stream 0 offset a client joined at */
+
+  /* Push streams that arrived before their PUSH_PROMISE */
+  nghq_orphan_push *orphan_pushes;
+  size_t          orphan_push_bytes;
+
+  /* Streams cancelled for going over each of the reassembly limits */
+  uint64_t        limit_hits[NGHQ_LIMIT_MAX];
+
+  /* Time spent in each phase, only kept with --enable-phase-stats */
+  nghq_phase_stats phase_stats[NGHQ_PHASE_MAX];
+  nghq_phase      phase_stack[NGHQ_PHASE_STACK_DEPTH];
+  int             phase_depth;
+  uint64_t        phase_since; /* when the innermost phase last started */
+
+  /* Send time stamping, see nghq_session_enable_send_timestamps() */
+  int             send_timestamps;
+  int             packet_timestamps;
+  char            sent_time_hdr[24]; /* value of the header being added */
+
+  /* One-way latencies measured from a sender's timestamps, against the time
+   * the packet being parsed was received */
+  nghq_latency_histogram latency[NGHQ_LATENCY_MAX];
+  uint64_t        packet_rx_ts;
+
   void *          session_user_data;
 
   nghq_io_buf*  send_buf;
   nghq_io_buf*  recv_buf;
 
+  /* Encoded QUIC control frames (e.g. RESET_STREAM) waiting to be packed into
+   * the next packets built by nghq_session_send, ahead of any stream data */
+  nghq_io_buf*  ctrl_frames;
+
+  /* Encoded push beacon frames, each sent in a packet of its own as it has to
+   * come after the PADDING that hides it from receivers that don't know it */
+  nghq_io_buf*  beacon_frames;
+
+  /* Bytes queued on streams, in ctrl_frames, beacon_frames and in send_buf
+   * that haven't yet been given to the send callback */
+  size_t        pending_bytes;
+
   void *        session_timeout_timer;
   int           session_timed_out;
 
@@ -231,6 +372,36 @@ int nghq_recv_stream_data (nghq_session* session, nghq_stream* stream,
                            const uint8_t* data, size_t datalen, size_t off,
                            uint8_t end_of_stream);
 
+/**
+ * @brief Hold the start of a push stream whose push hasn't been promised yet
+ *
+ * It is fed in again once the PUSH_PROMISE for @p push_id is received.
+ *
+ * @return NGHQ_OK if it's being held, or NGHQ_HTTP_BAD_PUSH
+ */
+int nghq_hold_orphan_push (nghq_session* session, uint64_t push_id,
+                           int64_t stream_id, int fin, const uint8_t* data,
+                           size_t datalen);
+
+/**
+ * @brief Handle the contents of a received push beacon
+ *
+ * @param init_offset The stream 0 offset where the next PUSH_PROMISE starts
+ * @param last Non-zero if this is the last frame of the beacon
+ * @param count The number of entries in @p entries
+ */
+int nghq_recv_push_beacon (nghq_session* session, uint64_t init_offset,
+                           int last, uint64_t count, const uint8_t* entries,
+                           size_t entries_len);
+
+/**
+ * @brief Add a one-way latency to the session's histogram for @p kind
+ *
+ * @param sent_ts The time stamped by the sender, from get_timestamp_now()
+ */
+void nghq_record_latency (nghq_session* session, nghq_latency_kind kind,
+                          uint64_t sent_ts);
+
 int nghq_deliver_headers (nghq_session* session, uint8_t flags,
                           nghq_header **hdrs, size_t num_hdrs,
                           void *request_user_data);
@@ -250,6 +421,7 @@ int nghq_stream_close (nghq_session* session, nghq_stream *stream,
 
 int nghq_change_max_stream_id (nghq_session* session, uint64_t max_stream_id);
 
+nghq_stream *nghq_stream_init ();
 nghq_stream *nghq_stream_new (uint64_t stream_id);
 nghq_stream *nghq_req_stream_new(nghq_session* session);
 
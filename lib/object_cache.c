@@ -0,0 +1,502 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "object_cache.h"
+
+#define INITIAL_BUCKETS 64
+
+struct nghq_cache_entry {
+  /* Must be first, lookups hand this back to the application */
+  nghq_cached_object        obj;
+
+  char *                    key;       /* :authority NUL :path */
+  size_t                    key_len;
+  uint32_t                  hash;
+
+  size_t                    body_alloc;
+  size_t                    hdrs_alloc;
+  size_t                    max_body;  /* the cache's budget when promised */
+  size_t                    size;      /* bytes counted against the budget */
+
+  const nghq_header *       etag;
+  int64_t                   date;      /* last-modified, else date, else 0 */
+
+  unsigned int              refs;
+  bool                      cached;
+
+  struct nghq_cache_entry * bucket_next;
+  struct nghq_cache_entry * lru_prev;
+  struct nghq_cache_entry * lru_next;
+};
+
+struct nghq_object_cache {
+  nghq_cache_entry **       buckets;
+  size_t                    num_buckets;
+  size_t                    num_entries;
+
+  /* Most recently used at the head */
+  nghq_cache_entry *        lru_head;
+  nghq_cache_entry *        lru_tail;
+
+  size_t                    bytes_used;
+  size_t                    max_bytes;
+};
+
+static uint32_t _hash_key (const char *key, size_t len) {
+  /* FNV-1a */
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (uint8_t) key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static bool _hdr_name_is (const nghq_header *hdr, const char *name) {
+  size_t len = strlen (name);
+  return (hdr->name_len == len) &&
+         (strncasecmp ((const char *) hdr->name, name, len) == 0);
+}
+
+static int _month_from_str (const uint8_t *s) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  int i;
+  for (i = 0; i < 12; i++) {
+    if (memcmp (s, months + (i * 3), 3) == 0) return i + 1;
+  }
+  return 0;
+}
+
+static int _two_digits (const uint8_t *s) {
+  if (s[0] < '0' || s[0] > '9' || s[1] < '0' || s[1] > '9') return -1;
+  return ((s[0] - '0') * 10) + (s[1] - '0');
+}
+
+/*
+ * Parse an IMF-fixdate (RFC 7231 section 7.1.1.1), e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT", into seconds since the epoch. The obsolete
+ * formats aren't worth supporting for pushed objects. Returns 0 on failure.
+ */
+static int64_t _parse_http_date (const uint8_t *s, size_t len) {
+  int day, month, year_hi, year_lo, hour, min, sec;
+  int64_t y, era, yoe, doy, doe, days;
+
+  if (len != 29 || s[3] != ',' || s[4] != ' ' || s[7] != ' ' ||
+      s[11] != ' ' || s[16] != ' ' || s[19] != ':' || s[22] != ':' ||
+      memcmp (s + 25, " GMT", 4) != 0) {
+    return 0;
+  }
+
+  day = _two_digits (s + 5);
+  month = _month_from_str (s + 8);
+  year_hi = _two_digits (s + 12);
+  year_lo = _two_digits (s + 14);
+  hour = _two_digits (s + 17);
+  min = _two_digits (s + 20);
+  sec = _two_digits (s + 23);
+  if (day < 1 || month == 0 || year_hi < 0 || year_lo < 0 || hour < 0 ||
+      min < 0 || sec < 0) {
+    return 0;
+  }
+
+  /* Days from civil date, see http://howardhinnant.github.io/date_algorithms */
+  y = (year_hi * 100) + year_lo - (month <= 2);
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - (era * 400);
+  doy = ((153 * (month + (month > 2 ? -3 : 9))) + 2) / 5 + day - 1;
+  doe = (yoe * 365) + (yoe / 4) - (yoe / 100) + doy;
+  days = (era * 146097) + doe - 719468;
+
+  return (days * 86400) + (hour * 3600) + (min * 60) + sec;
+}
+
+static nghq_header *_copy_header (const nghq_header *hdr) {
+  nghq_header *copy = (nghq_header *) malloc (sizeof(nghq_header));
+  if (copy == NULL) return NULL;
+  copy->name = (uint8_t *) malloc (hdr->name_len + hdr->value_len);
+  if (copy->name == NULL) {
+    free (copy);
+    return NULL;
+  }
+  /* name and value share one allocation */
+  copy->value = copy->name + hdr->name_len;
+  memcpy (copy->name, hdr->name, hdr->name_len);
+  memcpy (copy->value, hdr->value, hdr->value_len);
+  copy->name_len = hdr->name_len;
+  copy->value_len = hdr->value_len;
+  return copy;
+}
+
+static void _entry_free (nghq_cache_entry *entry) {
+  size_t i;
+  for (i = 0; i < entry->obj.num_headers; i++) {
+    free (entry->obj.headers[i]->name);
+    free (entry->obj.headers[i]);
+  }
+  free (entry->obj.headers);
+  free ((uint8_t *) entry->obj.body);
+  free (entry->key);
+  free (entry);
+}
+
+static void _lru_unlink (nghq_object_cache *cache, nghq_cache_entry *entry) {
+  if (entry->lru_prev) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    cache->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    cache->lru_tail = entry->lru_prev;
+  }
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void _lru_push_head (nghq_object_cache *cache, nghq_cache_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head) {
+    cache->lru_head->lru_prev = entry;
+  } else {
+    cache->lru_tail = entry;
+  }
+  cache->lru_head = entry;
+}
+
+static nghq_cache_entry **_bucket_find (nghq_object_cache *cache,
+                                        const char *key, size_t key_len,
+                                        uint32_t hash) {
+  nghq_cache_entry **pe = &cache->buckets[hash & (cache->num_buckets - 1)];
+  while (*pe) {
+    if ((*pe)->hash == hash && (*pe)->key_len == key_len &&
+        memcmp ((*pe)->key, key, key_len) == 0) {
+      break;
+    }
+    pe = &(*pe)->bucket_next;
+  }
+  return pe;
+}
+
+static void _grow_buckets (nghq_object_cache *cache) {
+  size_t new_num = cache->num_buckets * 2;
+  size_t i;
+  nghq_cache_entry **new_buckets =
+      (nghq_cache_entry **) calloc (new_num, sizeof(nghq_cache_entry *));
+  if (new_buckets == NULL) {
+    /* Keep going with longer chains */
+    return;
+  }
+  for (i = 0; i < cache->num_buckets; i++) {
+    nghq_cache_entry *e = cache->buckets[i];
+    while (e) {
+      nghq_cache_entry *next = e->bucket_next;
+      e->bucket_next = new_buckets[e->hash & (new_num - 1)];
+      new_buckets[e->hash & (new_num - 1)] = e;
+      e = next;
+    }
+  }
+  free (cache->buckets);
+  cache->buckets = new_buckets;
+  cache->num_buckets = new_num;
+}
+
+/* Take an entry out of the cache, it stays alive while it is referenced */
+static void _evict (nghq_object_cache *cache, nghq_cache_entry *entry) {
+  nghq_cache_entry **pe = _bucket_find (cache, entry->key, entry->key_len,
+                                        entry->hash);
+  if (*pe == entry) {
+    *pe = entry->bucket_next;
+  }
+  entry->bucket_next = NULL;
+  _lru_unlink (cache, entry);
+  cache->num_entries--;
+  cache->bytes_used -= entry->size;
+  entry->cached = false;
+  if (entry->refs == 0) {
+    _entry_free (entry);
+  }
+}
+
+static void _evict_to_budget (nghq_object_cache *cache, size_t needed) {
+  while (cache->lru_tail &&
+         cache->bytes_used + needed > cache->max_bytes) {
+    _evict (cache, cache->lru_tail);
+  }
+}
+
+nghq_object_cache *nghq_object_cache_new (size_t max_bytes) {
+  nghq_object_cache *cache =
+      (nghq_object_cache *) calloc (1, sizeof(nghq_object_cache));
+  if (cache == NULL) return NULL;
+  cache->buckets =
+      (nghq_cache_entry **) calloc (INITIAL_BUCKETS, sizeof(nghq_cache_entry *));
+  if (cache->buckets == NULL) {
+    free (cache);
+    return NULL;
+  }
+  cache->num_buckets = INITIAL_BUCKETS;
+  cache->max_bytes = max_bytes;
+  return cache;
+}
+
+void nghq_object_cache_set_budget (nghq_object_cache *cache, size_t max_bytes) {
+  cache->max_bytes = max_bytes;
+  _evict_to_budget (cache, 0);
+}
+
+size_t nghq_object_cache_bytes_used (nghq_object_cache *cache) {
+  return cache->bytes_used;
+}
+
+void nghq_object_cache_free (nghq_object_cache *cache) {
+  if (cache == NULL) return;
+  while (cache->lru_head) {
+    _evict (cache, cache->lru_head);
+  }
+  free (cache->buckets);
+  free (cache);
+}
+
+nghq_cached_object *nghq_object_cache_find (nghq_object_cache *cache,
+                                            const char *authority,
+                                            size_t authority_len,
+                                            const char *path, size_t path_len) {
+  char stack_key[256];
+  char *key = stack_key;
+  size_t key_len = authority_len + 1 + path_len;
+  nghq_cache_entry *entry;
+
+  if (key_len > sizeof(stack_key)) {
+    key = (char *) malloc (key_len);
+    if (key == NULL) return NULL;
+  }
+  if (authority_len) memcpy (key, authority, authority_len);
+  key[authority_len] = '\0';
+  memcpy (key + authority_len + 1, path, path_len);
+
+  entry = *_bucket_find (cache, key, key_len, _hash_key (key, key_len));
+
+  if (key != stack_key) free (key);
+
+  if (entry == NULL) return NULL;
+
+  _lru_unlink (cache, entry);
+  _lru_push_head (cache, entry);
+  entry->refs++;
+
+  return &entry->obj;
+}
+
+void nghq_cache_entry_release (nghq_cached_object *obj) {
+  nghq_cache_entry *entry = (nghq_cache_entry *) obj;
+  if (entry == NULL || entry->refs == 0) return;
+  if (--entry->refs == 0 && !entry->cached) {
+    _entry_free (entry);
+  }
+}
+
+nghq_cache_entry *nghq_cache_entry_new (nghq_object_cache *cache,
+                                        nghq_header **req_hdrs,
+                                        size_t num_req_hdrs) {
+  const nghq_header *authority = NULL, *path = NULL;
+  nghq_cache_entry *entry;
+  size_t i, authority_len;
+
+  for (i = 0; i < num_req_hdrs; i++) {
+    if (_hdr_name_is (req_hdrs[i], ":authority")) {
+      authority = req_hdrs[i];
+    } else if (_hdr_name_is (req_hdrs[i], ":path")) {
+      path = req_hdrs[i];
+    }
+  }
+  if (path == NULL) return NULL;
+
+  entry = (nghq_cache_entry *) calloc (1, sizeof(nghq_cache_entry));
+  if (entry == NULL) return NULL;
+
+  authority_len = (authority)?(authority->value_len):(0);
+  entry->key_len = authority_len + 1 + path->value_len;
+  entry->key = (char *) malloc (entry->key_len);
+  if (entry->key == NULL) {
+    free (entry);
+    return NULL;
+  }
+  if (authority) memcpy (entry->key, authority->value, authority_len);
+  entry->key[authority_len] = '\0';
+  memcpy (entry->key + authority_len + 1, path->value, path->value_len);
+  entry->hash = _hash_key (entry->key, entry->key_len);
+  entry->max_body = cache->max_bytes;
+
+  entry->obj.authority = entry->key;
+  entry->obj.authority_len = authority_len;
+  entry->obj.path = entry->key + authority_len + 1;
+  entry->obj.path_len = path->value_len;
+
+  return entry;
+}
+
+int nghq_cache_entry_add_headers (nghq_cache_entry *entry, nghq_header **hdrs,
+                                  size_t num_hdrs) {
+  size_t i;
+
+  if (entry->obj.num_headers + num_hdrs > entry->hdrs_alloc) {
+    size_t new_alloc = entry->obj.num_headers + num_hdrs;
+    nghq_header **new_hdrs = (nghq_header **) realloc (entry->obj.headers,
+                                              new_alloc * sizeof(nghq_header*));
+    if (new_hdrs == NULL) return NGHQ_OUT_OF_MEMORY;
+    entry->obj.headers = new_hdrs;
+    entry->hdrs_alloc = new_alloc;
+  }
+
+  for (i = 0; i < num_hdrs; i++) {
+    nghq_header *copy = _copy_header (hdrs[i]);
+    if (copy == NULL) return NGHQ_OUT_OF_MEMORY;
+    entry->obj.headers[entry->obj.num_headers++] = copy;
+    entry->size += sizeof(nghq_header) + copy->name_len + copy->value_len;
+
+    if (_hdr_name_is (copy, "etag")) {
+      entry->etag = copy;
+    } else if (_hdr_name_is (copy, "last-modified")) {
+      int64_t date = _parse_http_date (copy->value, copy->value_len);
+      if (date) entry->date = date;
+    } else if (_hdr_name_is (copy, "date") && entry->date == 0) {
+      entry->date = _parse_http_date (copy->value, copy->value_len);
+    } else if (_hdr_name_is (copy, "content-length") &&
+               entry->body_alloc == 0) {
+      /* Size the body buffer once so data can go straight into place. The
+       * value is from the sender, so don't trust it with more than the cache
+       * could ever hold. */
+      size_t clen = 0, j;
+      for (j = 0; j < copy->value_len; j++) {
+        if (copy->value[j] < '0' || copy->value[j] > '9') break;
+        clen = (clen * 10) + (copy->value[j] - '0');
+        if (clen > entry->max_body) return NGHQ_TOO_MUCH_DATA;
+      }
+      if (j == copy->value_len && clen > 0) {
+        uint8_t *body = (uint8_t *) malloc (clen);
+        if (body != NULL) {
+          entry->obj.body = body;
+          entry->body_alloc = clen;
+        }
+      }
+    }
+  }
+
+  return NGHQ_OK;
+}
+
+int nghq_cache_entry_write (nghq_cache_entry *entry, const uint8_t *data,
+                            size_t len, size_t off) {
+  if (off + len > entry->max_body) {
+    /* It would only be evicted as soon as it's complete */
+    return NGHQ_TOO_MUCH_DATA;
+  }
+  if (off + len > entry->body_alloc) {
+    size_t new_alloc = (entry->body_alloc)?(entry->body_alloc * 2):(4096);
+    uint8_t *body;
+    while (new_alloc < off + len) new_alloc *= 2;
+    body = (uint8_t *) realloc ((uint8_t *) entry->obj.body, new_alloc);
+    if (body == NULL) return NGHQ_OUT_OF_MEMORY;
+    entry->obj.body = body;
+    entry->body_alloc = new_alloc;
+  }
+
+  memcpy ((uint8_t *) entry->obj.body + off, data, len);
+  if (off + len > entry->obj.body_len) {
+    entry->obj.body_len = off + len;
+  }
+
+  return NGHQ_OK;
+}
+
+/* True if @p newer should replace @p older in the cache */
+static bool _should_replace (const nghq_cache_entry *older,
+                             const nghq_cache_entry *newer) {
+  if (older->etag && newer->etag &&
+      older->etag->value_len == newer->etag->value_len &&
+      memcmp (older->etag->value, newer->etag->value,
+              older->etag->value_len) == 0) {
+    /* Same representation, keep what we already have */
+    return false;
+  }
+  if (older->date && newer->date && newer->date < older->date) {
+    /* Late or reordered delivery of an older version */
+    return false;
+  }
+  return true;
+}
+
+void nghq_cache_entry_complete (nghq_object_cache *cache,
+                                nghq_cache_entry *entry, nghq_error status) {
+  nghq_cache_entry **pe;
+
+  if (cache == NULL || status != NGHQ_OK) {
+    _entry_free (entry);
+    return;
+  }
+
+  entry->size += sizeof(nghq_cache_entry) + entry->key_len + entry->body_alloc;
+  if (entry->size > cache->max_bytes) {
+    _entry_free (entry);
+    return;
+  }
+
+  pe = _bucket_find (cache, entry->key, entry->key_len, entry->hash);
+  if (*pe) {
+    if (!_should_replace (*pe, entry)) {
+      _lru_unlink (cache, *pe);
+      _lru_push_head (cache, *pe);
+      _entry_free (entry);
+      return;
+    }
+    _evict (cache, *pe);
+  }
+
+  _evict_to_budget (cache, entry->size);
+
+  if (cache->num_entries >= cache->num_buckets) {
+    _grow_buckets (cache);
+  }
+
+  pe = &cache->buckets[entry->hash & (cache->num_buckets - 1)];
+  entry->bucket_next = *pe;
+  *pe = entry;
+  _lru_push_head (cache, entry);
+  entry->cached = true;
+  cache->num_entries++;
+  cache->bytes_used += entry->size;
+}
+
+void nghq_cache_entry_discard (nghq_cache_entry *entry) {
+  if (entry != NULL) _entry_free (entry);
+}
+
+// vim:ts=8:sts=2:sw=2:expandtab:
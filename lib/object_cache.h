@@ -0,0 +1,118 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIB_OBJECT_CACHE_H_
+#define LIB_OBJECT_CACHE_H_
+
+#include <stdint.h>
+#include "nghq_internal.h"
+
+struct nghq_object_cache;
+typedef struct nghq_object_cache nghq_object_cache;
+
+struct nghq_cache_entry;
+typedef struct nghq_cache_entry nghq_cache_entry;
+
+nghq_object_cache *nghq_object_cache_new (size_t max_bytes);
+
+/**
+ * @brief Change the byte budget of a cache, evicting objects as necessary
+ */
+void nghq_object_cache_set_budget (nghq_object_cache *cache, size_t max_bytes);
+
+size_t nghq_object_cache_bytes_used (nghq_object_cache *cache);
+
+/**
+ * @brief Free a cache and all unreferenced objects within it
+ *
+ * Objects still held by the application from nghq_object_cache_lookup() are
+ * freed when they are released.
+ */
+void nghq_object_cache_free (nghq_object_cache *cache);
+
+/**
+ * @brief Find an object by its :authority and :path
+ *
+ * The object is referenced on behalf of the caller, and must be given back
+ * with nghq_cache_entry_release().
+ */
+nghq_cached_object *nghq_object_cache_find (nghq_object_cache *cache,
+                                            const char *authority,
+                                            size_t authority_len,
+                                            const char *path, size_t path_len);
+
+void nghq_cache_entry_release (nghq_cached_object *obj);
+
+/**
+ * @brief Start collecting a new object from a push promise
+ *
+ * The entry does not belong to any cache until it is passed to
+ * nghq_cache_entry_complete(), so it is safe to hold one across changes to
+ * the session's cache.
+ *
+ * @param cache The cache the entry is meant for, objects larger than its
+ *    budget are refused
+ * @param req_hdrs The PUSH_PROMISE headers, :authority and :path are copied
+ * @param num_req_hdrs The size of the array @p req_hdrs
+ *
+ * @return A new entry, or NULL if the promise has no :path or the entry
+ *    couldn't be allocated.
+ */
+nghq_cache_entry *nghq_cache_entry_new (nghq_object_cache *cache,
+                                        nghq_header **req_hdrs,
+                                        size_t num_req_hdrs);
+
+/**
+ * @brief Add response headers (or trailers) to an entry
+ *
+ * The headers are copied, the caller retains ownership of @p hdrs.
+ *
+ * @return NGHQ_TOO_MUCH_DATA if the content-length is larger than the cache's
+ *    budget, and the entry should be discarded
+ */
+int nghq_cache_entry_add_headers (nghq_cache_entry *entry, nghq_header **hdrs,
+                                  size_t num_hdrs);
+
+/**
+ * @brief Write body data into the entry's buffer at body offset @p off
+ *
+ * If a content-length was seen in the response headers, the whole body buffer
+ * is allocated up front and this never reallocates for a well-formed object.
+ */
+int nghq_cache_entry_write (nghq_cache_entry *entry, const uint8_t *data,
+                            size_t len, size_t off);
+
+/**
+ * @brief Finish an entry, adding it to @p cache if @p status is NGHQ_OK
+ *
+ * Ownership of @p entry passes to this function. If @p cache is NULL, or the
+ * object did not complete successfully, the entry is freed.
+ */
+void nghq_cache_entry_complete (nghq_object_cache *cache,
+                                nghq_cache_entry *entry, nghq_error status);
+
+void nghq_cache_entry_discard (nghq_cache_entry *entry);
+
+#endif /* LIB_OBJECT_CACHE_H_ */
@@ -0,0 +1,125 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nghq/nghq.h"
+#include "orphan_push.h"
+#include "probes.h"
+
+/* Held oldest first, so the head of the list is always the next to go */
+static void _drop_oldest (nghq_orphan_push **orphans, size_t *bytes) {
+  nghq_orphan_push *oldest = *orphans;
+  NGHQ_PROBE2 (orphan_push_drop, oldest->stream_id, oldest->len);
+  *orphans = oldest->next;
+  *bytes -= oldest->len;
+  nghq_orphan_push_free (oldest);
+}
+
+int nghq_orphan_push_hold (nghq_orphan_push **orphans, size_t *bytes,
+                           uint64_t push_id, int64_t stream_id, int fin,
+                           const uint8_t *data, size_t len, uint64_t now) {
+  nghq_orphan_push **tail, *orphan;
+
+  if (len > MAX_ORPHAN_PUSH_BYTES) {
+    return NGHQ_TOO_MUCH_DATA;
+  }
+
+  for (tail = orphans; *tail != NULL; tail = &(*tail)->next) {
+    if ((*tail)->push_id == push_id) {
+      /* Already waiting, this is a repeat */
+      return NGHQ_OK;
+    }
+  }
+
+  orphan = (nghq_orphan_push *) calloc (1, sizeof(nghq_orphan_push));
+  if (orphan == NULL) {
+    return NGHQ_OUT_OF_MEMORY;
+  }
+  orphan->data = (uint8_t *) malloc (len);
+  if (orphan->data == NULL) {
+    free (orphan);
+    return NGHQ_OUT_OF_MEMORY;
+  }
+  memcpy (orphan->data, data, len);
+  orphan->len = len;
+  orphan->push_id = push_id;
+  orphan->stream_id = stream_id;
+  orphan->fin = fin;
+  orphan->received = now;
+
+  while (*bytes + len > MAX_ORPHAN_PUSH_BYTES) {
+    _drop_oldest (orphans, bytes);
+  }
+  for (tail = orphans; *tail != NULL; tail = &(*tail)->next);
+  *tail = orphan;
+  *bytes += len;
+
+  return NGHQ_OK;
+}
+
+nghq_orphan_push *nghq_orphan_push_take (nghq_orphan_push **orphans,
+                                         size_t *bytes, uint64_t push_id) {
+  nghq_orphan_push **it, *orphan;
+
+  for (it = orphans; *it != NULL; it = &(*it)->next) {
+    if ((*it)->push_id == push_id) {
+      orphan = *it;
+      *it = orphan->next;
+      orphan->next = NULL;
+      *bytes -= orphan->len;
+      return orphan;
+    }
+  }
+  return NULL;
+}
+
+size_t nghq_orphan_push_expire (nghq_orphan_push **orphans, size_t *bytes,
+                                uint64_t before) {
+  size_t dropped = 0;
+
+  while ((*orphans != NULL) && ((*orphans)->received < before)) {
+    _drop_oldest (orphans, bytes);
+    dropped++;
+  }
+  return dropped;
+}
+
+void nghq_orphan_push_free (nghq_orphan_push *orphan) {
+  if (orphan == NULL) return;
+  free (orphan->data);
+  free (orphan);
+}
+
+void nghq_orphan_pushes_free (nghq_orphan_push *orphans) {
+  while (orphans != NULL) {
+    nghq_orphan_push *next = orphans->next;
+    nghq_orphan_push_free (orphans);
+    orphans = next;
+  }
+}
+
+// vim:ts=8:sts=2:sw=2:expandtab:
@@ -0,0 +1,84 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIB_ORPHAN_PUSH_H_
+#define LIB_ORPHAN_PUSH_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "nghq_internal.h"
+
+/* The most data held for push streams waiting on their PUSH_PROMISE */
+#define MAX_ORPHAN_PUSH_BYTES (256 * 1024)
+/* How long a push stream waits for its PUSH_PROMISE, in microseconds */
+#define MAX_ORPHAN_PUSH_AGE   2000000
+
+/* The start of a push stream that arrived before its PUSH_PROMISE */
+struct nghq_orphan_push {
+  uint64_t                  push_id;
+  int64_t                   stream_id;
+  uint8_t *                 data;
+  size_t                    len;
+  int                       fin;
+  uint64_t                  received;  /* from get_timestamp_now() */
+  struct nghq_orphan_push * next;
+};
+
+/**
+ * @brief Hold the start of a push stream until its push is promised
+ *
+ * The oldest held streams are dropped to keep the total under
+ * MAX_ORPHAN_PUSH_BYTES. @p data is copied.
+ *
+ * @param bytes The total held in @p orphans, updated
+ *
+ * @return NGHQ_OK, NGHQ_TOO_MUCH_DATA if @p len is more than can ever be held,
+ *    or NGHQ_OUT_OF_MEMORY
+ */
+int nghq_orphan_push_hold (nghq_orphan_push **orphans, size_t *bytes,
+                           uint64_t push_id, int64_t stream_id, int fin,
+                           const uint8_t *data, size_t len, uint64_t now);
+
+/**
+ * @brief Take the held start of the push stream for @p push_id
+ *
+ * @return The orphan, which the caller frees, or NULL if none is held
+ */
+nghq_orphan_push *nghq_orphan_push_take (nghq_orphan_push **orphans,
+                                         size_t *bytes, uint64_t push_id);
+
+/**
+ * @brief Drop everything held since before @p before
+ *
+ * @return The number of push streams dropped
+ */
+size_t nghq_orphan_push_expire (nghq_orphan_push **orphans, size_t *bytes,
+                                uint64_t before);
+
+void nghq_orphan_push_free (nghq_orphan_push *orphan);
+
+void nghq_orphan_pushes_free (nghq_orphan_push *orphans);
+
+#endif /* LIB_ORPHAN_PUSH_H_ */
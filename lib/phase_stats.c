@@ -0,0 +1,72 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <time.h>
+
+#include "nghq/nghq.h"
+#include "phase_stats.h"
+
+#if NGHQ_PHASE_STATS
+
+static uint64_t _now_ns () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void nghq_phase_begin (nghq_session *session, nghq_phase phase) {
+  uint64_t now = _now_ns ();
+
+  if ((session->phase_depth > 0) &&
+      (session->phase_depth <= NGHQ_PHASE_STACK_DEPTH)) {
+    nghq_phase outer = session->phase_stack[session->phase_depth - 1];
+    session->phase_stats[outer].nsecs += now - session->phase_since;
+  }
+  if (session->phase_depth < NGHQ_PHASE_STACK_DEPTH) {
+    session->phase_stack[session->phase_depth] = phase;
+  }
+  session->phase_depth++;
+  session->phase_since = now;
+}
+
+void nghq_phase_end (nghq_session *session) {
+  uint64_t now = _now_ns ();
+  nghq_phase phase;
+
+  if (session->phase_depth == 0) return;
+  session->phase_depth--;
+  if (session->phase_depth < NGHQ_PHASE_STACK_DEPTH) {
+    phase = session->phase_stack[session->phase_depth];
+    session->phase_stats[phase].nsecs += now - session->phase_since;
+    session->phase_stats[phase].count++;
+  }
+  session->phase_since = now;
+}
+
+#endif /* NGHQ_PHASE_STATS */
+
+// vim:ts=8:sts=2:sw=2:expandtab:
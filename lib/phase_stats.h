@@ -0,0 +1,56 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIB_PHASE_STATS_H_
+#define LIB_PHASE_STATS_H_
+
+#include "config.h"
+#include "nghq_internal.h"
+
+/*
+ * Time spent in each phase of sending and receiving, kept per session. Each
+ * phase is charged only for its own time, so a phase started inside another
+ * (say, an application callback made while reassembling a stream) stops the
+ * clock on the outer one until it ends. Every NGHQ_PHASE_BEGIN() needs a
+ * matching NGHQ_PHASE_END() on all paths out.
+ *
+ * Only built in with --enable-phase-stats, otherwise the macros are empty.
+ */
+#if NGHQ_PHASE_STATS
+
+void nghq_phase_begin (nghq_session *session, nghq_phase phase);
+void nghq_phase_end (nghq_session *session);
+
+#define NGHQ_PHASE_BEGIN(s, p) nghq_phase_begin ((s), (p))
+#define NGHQ_PHASE_END(s) nghq_phase_end ((s))
+
+#else
+
+#define NGHQ_PHASE_BEGIN(s, p) do {} while (0)
+#define NGHQ_PHASE_END(s) do {} while (0)
+
+#endif /* NGHQ_PHASE_STATS */
+
+#endif /* LIB_PHASE_STATS_H_ */
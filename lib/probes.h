@@ -0,0 +1,73 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIB_PROBES_H_
+#define LIB_PROBES_H_
+
+#include "config.h"
+
+/*
+ * USDT tracepoints for bpftrace, perf or SystemTap, under the provider name
+ * "nghq". They're only compiled in if <sys/sdt.h> was found by configure.
+ * An unused probe costs a single NOP, so they can stay in release builds.
+ *
+ *   packet_recv      (packet number, length)
+ *   packet_send      (packet number, length, bytes the send callback took)
+ *   packet_drop      (length, NGHQ_PROBE_DROP_* reason)
+ *   frame_parse      (stream ID, HTTP/3 frame type, frame length)
+ *   stream_open      (stream ID)
+ *   stream_close     (stream ID, application error code)
+ *   stream_cancel    (stream ID, nghq_error)
+ *   stream_timeout   (stream ID)
+ *   session_timeout  ()
+ *   beacon_timer     ()
+ *   coalesce_timer   (stream ID, bytes held)
+ *   limit_hit        (stream ID, nghq_limit)
+ *   orphan_push_drop (stream ID, bytes held)
+ */
+#if HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define NGHQ_PROBE0(name) DTRACE_PROBE(nghq, name)
+#define NGHQ_PROBE1(name, a) DTRACE_PROBE1(nghq, name, a)
+#define NGHQ_PROBE2(name, a, b) DTRACE_PROBE2(nghq, name, a, b)
+#define NGHQ_PROBE3(name, a, b, c) DTRACE_PROBE3(nghq, name, a, b, c)
+
+#else
+
+#define NGHQ_PROBE0(name) do {} while (0)
+#define NGHQ_PROBE1(name, a) do {} while (0)
+#define NGHQ_PROBE2(name, a, b) do {} while (0)
+#define NGHQ_PROBE3(name, a, b, c) do {} while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+/* Reasons given by the packet_drop probe */
+#define NGHQ_PROBE_DROP_TOO_LARGE   1
+#define NGHQ_PROBE_DROP_SESSION_ID  2
+#define NGHQ_PROBE_DROP_DECRYPT     3
+
+#endif /* LIB_PROBES_H_ */
@@ -12,10 +12,19 @@
 #include "util.h"
 #include "debug.h"
 #include "map.h"
+#include "io_buf.h"
+#include "phase_stats.h"
+#include "probes.h"
 
 #define NGHQ_IS_SHORT_HEADER(b) (!(b & 0x80))
 #define NGHQ_PKT_NUMLEN_MASK 0x03
 
+/* How far apart in time packets may be reordered or lost in a burst, and still
+ * have their packet numbers decoded correctly with NGHQ_PKTNUM_LEN_AUTO */
+#define NGHQ_PKTNUM_REORDER_WINDOW_US 100000
+/* Least number of packets the AUTO packet number must cover, at low rates */
+#define NGHQ_PKTNUM_MIN_SPAN 32
+
 #define QUIC_FRAME_PADDING 0x00ULL
 #define QUIC_FRAME_PING 0x01ULL
 /* ACK frames prohibited in multicast QUIC (0x02 - 0x03) */
@@ -35,20 +44,24 @@
  * PATH_RESPONSE, CONNECTION_CLOSE and HANDSHAKE_DONE frames prohibited in
  * multicast QUIC (0x10 - 0x1e)
  */
+/* nghq extension, outside the range RFC 9000 assigns. Only sent after PADDING,
+ * so receivers that don't know it skip it */
+#define QUIC_FRAME_PUSH_BEACON 0x2f4eULL
+#define PUSH_BEACON_FLAG_LAST 0x01
+/* nghq extension, a send time hidden after PADDING at the end of a packet */
+#define QUIC_FRAME_TIMESTAMP 0x2f4fULL
 
 ssize_t _parse_stream_frame (nghq_session *ctx, uint8_t stream_type,
                              uint8_t *buf, size_t len);
 ssize_t _parse_reset_stream_frame (nghq_session *ctx, uint8_t *buf, size_t len);
+ssize_t _parse_push_beacon_frame (nghq_session *ctx, uint8_t *buf, size_t len);
+ssize_t _parse_padding_trailer (nghq_session *ctx, uint8_t *buf, size_t len);
 
 /* TODO: Get this from the application? */
 static uint8_t _hp_mask[5] = {0, 0, 0, 0, 0};
 int _transport_hp_mask (nghq_session *ctx, uint8_t *dest, const uint8_t *hp_key,
                         const uint8_t *sample);
 
-int _transport_recv_stream_data (nghq_session *session, int64_t stream_id,
-                                 int fin, uint64_t stream_offset,
-                                 const uint8_t *data, size_t datalen);
-
 ssize_t quic_transport_packet_parse (nghq_session *ctx, uint8_t *buf,
                                      size_t len, uint64_t ts) {
   ssize_t rv;
@@ -59,15 +72,18 @@ ssize_t quic_transport_packet_parse (nghq_session *ctx, uint8_t *buf,
   if (!NGHQ_IS_SHORT_HEADER(buf[0])) {
     return NGHQ_TRANSPORT_ERROR;
   }
+  ctx->packet_rx_ts = ts;
 
   /* Check the connection ID */
   if (memcmp (buf + off, ctx->session_id, ctx->session_id_len) != 0) {
     NGHQ_LOG_ERROR (ctx, "Mismatched session ID!\n");
+    NGHQ_PROBE2 (packet_drop, len, NGHQ_PROBE_DROP_SESSION_ID);
     return NGHQ_TRANSPORT_BAD_SESSION_ID;
   }
   nghq_update_timeout (ctx);
   off += ctx->session_id_len;
 
+  NGHQ_PHASE_BEGIN (ctx, NGHQ_PHASE_PACKET_HEADER);
   /* Get the packet number, after removing potential packet protection */
   _transport_hp_mask (ctx, hp_mask, NULL, NULL);
   buf[0] = buf[0] ^ (hp_mask[0] & 0x1f);
@@ -81,6 +97,7 @@ ssize_t quic_transport_packet_parse (nghq_session *ctx, uint8_t *buf,
   off += pkt_num_len;
 
   NGHQ_LOG_DEBUG (ctx, "Received packet with packet number %lu\n", pkt_num);
+  NGHQ_PROBE2 (packet_recv, pkt_num, len);
 
   if (pkt_num > ctx->rx_pkt_num) {
     if (pkt_num > ctx->rx_pkt_num + 1) {
@@ -93,12 +110,17 @@ ssize_t quic_transport_packet_parse (nghq_session *ctx, uint8_t *buf,
                     pkt_num, ctx->rx_pkt_num);
   }
 
+  NGHQ_PHASE_END (ctx);
+
   /* Remove packet encryption */
+  NGHQ_PHASE_BEGIN (ctx, NGHQ_PHASE_DECRYPT);
   rv = (ssize_t) ctx->callbacks.decrypt_callback (ctx, buf + off, len - off,
                                                   NULL, NULL, 0, NULL, 0,
                                                   buf + off,
                                                   ctx->session_user_data);
+  NGHQ_PHASE_END (ctx);
   if (rv != NGHQ_OK) {
+    NGHQ_PROBE2 (packet_drop, len, NGHQ_PROBE_DROP_DECRYPT);
     return NGHQ_CRYPTO_ERROR;
   }
 
@@ -106,13 +128,18 @@ ssize_t quic_transport_packet_parse (nghq_session *ctx, uint8_t *buf,
   while (off < len) {
     ssize_t _rv = NGHQ_OK;
     //size_t frame_off = off;
-    uint64_t frame_type = _get_varlen_int (buf + off, &off, len - off);
+    uint64_t frame_type = _get_varlen_int (buf + off, &off, len);
+    if (off > len) {
+      NGHQ_LOG_ERROR (ctx, "Truncated frame type at the end of packet\n");
+      return NGHQ_TRANSPORT_FRAME_FORMAT;
+    }
     if ((frame_type >= 0x08) && (frame_type <= 0x0f)) {
       _rv = _parse_stream_frame (ctx, (uint8_t) frame_type, buf + off,
                                  len - off);
     } else {
       switch (frame_type) {
         case QUIC_FRAME_PADDING:
+          _rv = _parse_padding_trailer (ctx, buf + off, len - off);
           off = len;
           break;
         case QUIC_FRAME_PING:
@@ -138,61 +165,105 @@ ssize_t quic_transport_packet_parse (nghq_session *ctx, uint8_t *buf,
   return rv;
 }
 
+/*
+ * With no acknowledgements in multicast, the packet number has to cover the
+ * packets that receivers may still see out of order. Following RFC 9000
+ * section 17.1, use enough bytes for twice the number of packets sent in a
+ * reorder window, judged on the busier of this window and the last.
+ */
+static size_t _auto_pkt_num_len (nghq_session *ctx) {
+  uint64_t now = get_timestamp_now ();
+  uint64_t span;
+
+  if (now - ctx->tx_window_start >= NGHQ_PKTNUM_REORDER_WINDOW_US) {
+    if (now - ctx->tx_window_start < 2 * NGHQ_PKTNUM_REORDER_WINDOW_US) {
+      ctx->tx_prev_window_pkts = ctx->tx_window_pkts;
+    } else {
+      /* idle for at least a whole window */
+      ctx->tx_prev_window_pkts = 0;
+    }
+    ctx->tx_window_pkts = 0;
+    ctx->tx_window_start = now;
+  }
+  ctx->tx_window_pkts++;
+
+  span = (ctx->tx_window_pkts > ctx->tx_prev_window_pkts)?
+            ctx->tx_window_pkts:ctx->tx_prev_window_pkts;
+  span = (span + NGHQ_PKTNUM_MIN_SPAN) * 2;
+
+  if (span < (1ULL << 8)) return 1;
+  if (span < (1ULL << 16)) return 2;
+  if (span < (1ULL << 24)) return 3;
+  return 4;
+}
+
 ssize_t quic_transport_write_quic_header (nghq_session *ctx, uint8_t *buf,
                                           size_t len, uint64_t *pktnum) {
   ssize_t off = 0;
   uint64_t packet_number;
-  buf[0] = 0x40; /* Short header, 1 byte packet number */
-  if ((ctx->transport_settings.packet_number_length > NGHQ_PKTNUM_LEN_1_BYTE) &&
+  size_t pkt_num_len = 1;
+
+  if ((ctx->transport_settings.packet_number_length > NGHQ_PKTNUM_LEN_AUTO) &&
       (ctx->transport_settings.packet_number_length < NGHQ_PKTNUM_LEN_MAX)) {
-    buf[0] += ctx->transport_settings.packet_number_length - 1;
+    pkt_num_len = ctx->transport_settings.packet_number_length;
+  } else {
+    pkt_num_len = _auto_pkt_num_len (ctx);
   }
+
+  /* Short header, with the packet number length in the bottom bits */
+  buf[0] = 0x40 | (uint8_t) (pkt_num_len - 1);
   memcpy(buf + 1, ctx->session_id, ctx->session_id_len);
   off = ctx->session_id_len + 1;
   packet_number = ctx->tx_pkt_num++;
-  switch (ctx->transport_settings.packet_number_length) {
-    case NGHQ_PKTNUM_LEN_2_BYTE:
-    case NGHQ_PKTNUM_LEN_3_BYTE:
-    case NGHQ_PKTNUM_LEN_4_BYTE:
-      put_packet_number (packet_number,
-                         ctx->transport_settings.packet_number_length,
-                         buf + off, len);
-      off += ctx->transport_settings.packet_number_length;
-      break;
-    case NGHQ_PKTNUM_LEN_1_BYTE:
-    case NGHQ_PKTNUM_LEN_AUTO:
-    default:
-      buf[off++] = (uint8_t) packet_number;
-  }
+  off += put_packet_number (packet_number, pkt_num_len, buf + off, len - off);
   *pktnum = packet_number;
   return off;
 }
 
 void quic_transport_abandon_packet (nghq_session *ctx, uint8_t *buf,
                                     size_t len, uint64_t pktnum) {
+  /* Decoding against the packet before gives back exactly pktnum if the
+   * header carries it, whatever length was used */
   uint64_t hdr_pkt_num = get_packet_number (buf[0],
-                                            buf + ctx->session_id_len + 1, 0);
-  // TODO: Check all the packet number available
-  if ((pktnum & 0x00000000000000FF) != (hdr_pkt_num & 0x00000000000000FF)) {
+                                            buf + ctx->session_id_len + 1,
+                                            (pktnum)?(pktnum - 1):(0));
+  if (pktnum != hdr_pkt_num) {
     NGHQ_LOG_WARN (ctx, "Packet number supplied does not match that in the "
                    "header!\n");
     return;
   }
   if (pktnum == (ctx->tx_pkt_num - 1)) {
     --ctx->tx_pkt_num;
+    /* The header never goes out, so it mustn't count towards the send rate
+     * that sizes automatic packet numbers */
+    if (ctx->tx_window_pkts > 0) {
+      --ctx->tx_window_pkts;
+    }
   }
 }
 
 ssize_t quic_transport_write_stream (nghq_session *ctx, nghq_stream *stream,
-                                     uint8_t *buf_in, size_t len_in,
+                                     nghq_io_buf *bufs,
                                      uint8_t *buf_out, size_t buf_out_len,
-                                     int fin, size_t *buf_written) {
+                                     size_t *buf_written) {
   uint64_t stream_frame_type = 0x0aULL; /* Always going to have a length */
-  size_t off = 0;
-  size_t payload_len = len_in;
+  size_t off = 0, len_in = 0, copied = 0;
+  size_t payload_len;
+  int fin = 0;
+  nghq_io_buf *it;
 
   *buf_written = 0;
 
+  /* Everything queued, up to the end of the stream, can share one frame */
+  for (it = bufs; it != NULL; it = it->next_buf) {
+    len_in += it->remaining;
+    if (it->complete) {
+      fin = 1;
+      break;
+    }
+  }
+  payload_len = len_in;
+
   if (stream->tx_offset > 0) {
     stream_frame_type = stream_frame_type | 0x04;
   }
@@ -227,7 +298,14 @@ ssize_t quic_transport_write_stream (nghq_session *ctx, nghq_stream *stream,
   off += _make_varlen_int (buf_out + off, payload_len);
   assert(off + payload_len <= buf_out_len);
 
-  memcpy (buf_out + off, buf_in, payload_len);
+  for (it = bufs; copied < payload_len; it = it->next_buf) {
+    size_t chunk = it->remaining;
+    if (chunk > payload_len - copied) {
+      chunk = payload_len - copied;
+    }
+    memcpy (buf_out + off + copied, it->send_pos, chunk);
+    copied += chunk;
+  }
 
   *buf_written = payload_len;
   stream->tx_offset += payload_len;
@@ -238,7 +316,7 @@ ssize_t quic_transport_write_stream (nghq_session *ctx, nghq_stream *stream,
 ssize_t quic_transport_encrypt (nghq_session *ctx,
                                 uint8_t *buf_in, size_t len_in,
                                 uint8_t *buf_out, size_t len_out) {
-  int rv, i;
+  int rv, i, pkt_num_len;
   uint8_t hp_mask[5];
   if (ctx->callbacks.encrypt_callback) {
     if (len_out < len_in + ctx->transport_settings.encryption_overhead) {
@@ -250,8 +328,10 @@ ssize_t quic_transport_encrypt (nghq_session *ctx,
     if (rv != NGHQ_OK) return NGHQ_CRYPTO_ERROR;
 
     _transport_hp_mask (ctx, hp_mask, NULL, NULL);
+    /* Take the length from the header, as AUTO varies it packet to packet */
+    pkt_num_len = (buf_in[0] & NGHQ_PKT_NUMLEN_MASK) + 1;
     buf_in[0] = buf_in[0] ^ (hp_mask[0] & 0x1f);
-    for (i = 1; i <= ctx->transport_settings.packet_number_length; i++) {
+    for (i = 1; i <= pkt_num_len; i++) {
       buf_in[i + ctx->session_id_len] =
           buf_in[i + ctx->session_id_len] ^ hp_mask[i];
     }
@@ -264,22 +344,76 @@ ssize_t quic_transport_write_reset_stream (nghq_session *ctx, uint8_t *buf,
                                            uint64_t error_code)
 {
   ssize_t rv = 0;
+  size_t frame_len;
   if (stream == NULL) return NGHQ_ERROR;
 
+  frame_len = _make_varlen_int(NULL, QUIC_FRAME_RESET_STREAM) +
+              _make_varlen_int(NULL, stream->stream_id) +
+              _make_varlen_int(NULL, error_code) +
+              _make_varlen_int(NULL, stream->tx_offset);
+  if (buf == NULL) return frame_len;
+
   /* Make sure there's enough space to write the frame! */
-  if (len < (_make_varlen_int(NULL, stream->stream_id) +
-      _make_varlen_int(NULL, error_code) +
-      _make_varlen_int(NULL, stream->tx_offset))) {
+  if (len < frame_len) {
     return NGHQ_ERROR;
   }
 
-  rv += _make_varlen_int (buf, stream->stream_id);
+  rv += _make_varlen_int (buf, QUIC_FRAME_RESET_STREAM);
+  rv += _make_varlen_int (buf + rv, stream->stream_id);
   rv += _make_varlen_int (buf + rv, error_code);
   rv += _make_varlen_int (buf + rv, stream->tx_offset);
 
   return rv;
 }
 
+ssize_t quic_transport_write_push_beacon (nghq_session *ctx, uint8_t *buf,
+                                          size_t len, uint64_t init_offset,
+                                          int last, uint64_t count,
+                                          const uint8_t *entries,
+                                          size_t entries_len)
+{
+  size_t payload_len = _make_varlen_int (NULL, init_offset) + 1 +
+                       _make_varlen_int (NULL, count) + entries_len;
+  size_t frame_len = 1 + _make_varlen_int (NULL, QUIC_FRAME_PUSH_BEACON) +
+                     _make_varlen_int (NULL, payload_len) + payload_len;
+  ssize_t rv = 0;
+
+  if (buf == NULL) return frame_len;
+
+  if (len < frame_len) {
+    return NGHQ_ERROR;
+  }
+
+  buf[rv++] = QUIC_FRAME_PADDING;
+  rv += _make_varlen_int (buf + rv, QUIC_FRAME_PUSH_BEACON);
+  rv += _make_varlen_int (buf + rv, payload_len);
+  rv += _make_varlen_int (buf + rv, init_offset);
+  buf[rv++] = (last)?(PUSH_BEACON_FLAG_LAST):(0);
+  rv += _make_varlen_int (buf + rv, count);
+  memcpy (buf + rv, entries, entries_len);
+
+  return rv + entries_len;
+}
+
+ssize_t quic_transport_write_timestamp (nghq_session *ctx, uint8_t *buf,
+                                        size_t len, uint64_t ts)
+{
+  size_t off = 0;
+  int i;
+
+  if (len < QUIC_TIMESTAMP_TRAILER_LEN) {
+    return NGHQ_ERROR;
+  }
+
+  buf[off++] = QUIC_FRAME_PADDING;
+  off += _make_varlen_int (buf + off, QUIC_FRAME_TIMESTAMP);
+  for (i = 7; i >= 0; i--) {
+    buf[off++] = (uint8_t) (ts >> (i * 8));
+  }
+
+  return off;
+}
+
 int64_t quic_transport_open_stream (nghq_session *ctx, nghq_stream_type type) {
   int64_t rv;
   switch (type) {
@@ -355,6 +489,7 @@ int _transport_recv_stream_data (nghq_session *session, int64_t stream_id,
   if (stream == NULL) {
     /* New stream time! */
     NGHQ_LOG_DEBUG (session, "Seen start of new stream %lu\n", stream_id);
+    NGHQ_PROBE1 (stream_open, stream_id);
     stream = nghq_stream_new(stream_id);
     if (stream == NULL) {
       return NGHQ_OUT_OF_MEMORY;
@@ -381,6 +516,7 @@ int _transport_recv_stream_data (nghq_session *session, int64_t stream_id,
   }
 
   if (SERVER_PUSH_STREAM(stream_id) && stream_offset==0 &&
+      (stream->push_id == NGHQ_STREAM_ID_MAP_NOT_FOUND) &&
         (_get_varlen_int(data, &data_offset, datalen) == 0x1)) {
     /* Find the server push stream! */
     nghq_stream* push_stream;
@@ -392,15 +528,19 @@ int _transport_recv_stream_data (nghq_session *session, int64_t stream_id,
     }
     push_stream = nghq_stream_id_map_find(session->promises, push_id);
     if (push_stream == NULL) {
-      NGHQ_LOG_WARN (session, "Received new server push stream %lu, but Push "
-                     "ID %lu has not been previously promised, or has already "
-                     "been started!\n", stream_id, push_id);
-      return NGHQ_HTTP_BAD_PUSH;
+      /* Packets can overtake the PUSH_PROMISE on stream 0 */
+      return nghq_hold_orphan_push (session, push_id, stream_id, fin, data,
+                                    datalen);
     }
 
     /* copy over push information to stream */
     stream->push_id = push_id;
     stream->user_data = push_stream->user_data;
+    stream->cache_entry = push_stream->cache_entry;
+    push_stream->cache_entry = NULL;
+    stream->saved_hdrs = push_stream->saved_hdrs;
+    stream->saved_hdrs_len = push_stream->saved_hdrs_len;
+    push_stream->saved_hdrs = NULL;
 
     nghq_stream_id_map_remove(session->promises, push_id);
     nghq_stream_ended(session, push_stream);
@@ -415,8 +555,10 @@ int _transport_recv_stream_data (nghq_session *session, int64_t stream_id,
     return NGHQ_INTERNAL_ERROR;
   }
 
+  NGHQ_PHASE_BEGIN (session, NGHQ_PHASE_REASSEMBLY);
   rv = nghq_recv_stream_data(session, stream, data, datalen, stream_offset,
                              fin);
+  NGHQ_PHASE_END (session);
 
   if (rv == NGHQ_NOT_INTERESTED) {
     /* Client has indicated it doesn't care about this stream anymore, stop */
@@ -432,8 +574,11 @@ ssize_t _parse_reset_stream_frame (nghq_session *ctx, uint8_t *buf, size_t len){
   nghq_stream *stream;
 
   stream_id = _get_varlen_int (buf, &off, len);
-  app_error_code = _get_varlen_int (buf, &off, len);
-  final_size = _get_varlen_int (buf, &off, len);
+  app_error_code = _get_varlen_int (buf + off, &off, len);
+  final_size = _get_varlen_int (buf + off, &off, len);
+  if (off > len) {
+    return NGHQ_TRANSPORT_FRAME_FORMAT;
+  }
 
   NGHQ_LOG_DEBUG (ctx, "Received RESET_STREAM for stream ID %lu, error code %lu"
                   " and final size of %lu\n", stream_id, app_error_code,
@@ -441,12 +586,79 @@ ssize_t _parse_reset_stream_frame (nghq_session *ctx, uint8_t *buf, size_t len){
 
   stream = nghq_stream_id_map_find (ctx->transfers, stream_id);
   if (stream == NULL) {
-    NGHQ_LOG_ERROR (ctx, "Received reset stream for %lu, but couldn't find it "
-                    "in the map\n", stream_id);
-    return NGHQ_REQUEST_CLOSED;
+    /* Resets are packed together, so skip this one and carry on with the
+     * rest of the packet */
+    NGHQ_LOG_WARN (ctx, "Received reset stream for %lu, but couldn't find it "
+                   "in the map\n", stream_id);
+    return off;
   }
+  nghq_stream_id_map_remove (ctx->transfers, stream_id);
   nghq_stream_ended (ctx, stream);
-  return len;
+  return off;
+}
+
+ssize_t _parse_push_beacon_frame (nghq_session *ctx, uint8_t *buf, size_t len){
+  size_t off = 0, payload_start;
+  uint64_t payload_len, init_offset, count;
+  uint8_t flags;
+  int rv;
+
+  payload_len = _get_varlen_int (buf, &off, len);
+  if ((off > len) || (payload_len > len - off)) {
+    return NGHQ_TRANSPORT_FRAME_FORMAT;
+  }
+  payload_start = off;
+  len = off + payload_len;
+
+  init_offset = _get_varlen_int (buf + off, &off, len);
+  if (off + 1 >= len) return NGHQ_TRANSPORT_FRAME_FORMAT;
+  flags = buf[off++];
+  count = _get_varlen_int (buf + off, &off, len);
+  if (off > len) return NGHQ_TRANSPORT_FRAME_FORMAT;
+
+  NGHQ_LOG_DEBUG (ctx, "Received push beacon of %lu pushes, next promise at "
+                  "%lu\n", count, init_offset);
+
+  rv = nghq_recv_push_beacon (ctx, init_offset, flags & PUSH_BEACON_FLAG_LAST,
+                              count, buf + off, len - off);
+  if (rv != NGHQ_OK) {
+    return rv;
+  }
+  return payload_start + payload_len;
+}
+
+/*
+ * What follows a PADDING frame is normally just more padding, but it may be
+ * push beacons and a send timestamp, which nghq puts there so that receivers
+ * that don't know them skip them. Returns an error only if a push beacon is
+ * malformed.
+ */
+ssize_t _parse_padding_trailer (nghq_session *ctx, uint8_t *buf, size_t len) {
+  size_t off = 0;
+
+  while (off < len) {
+    uint64_t frame_type = _get_varlen_int (buf + off, &off, len);
+    if (off > len) break;
+
+    if (frame_type == QUIC_FRAME_PUSH_BEACON) {
+      ssize_t rv = _parse_push_beacon_frame (ctx, buf + off, len - off);
+      if (rv < NGHQ_OK) return rv;
+      off += rv;
+    } else {
+      if ((frame_type == QUIC_FRAME_TIMESTAMP) &&
+          (len - off == QUIC_TIMESTAMP_TRAILER_LEN - 3)) {
+        uint64_t ts = 0;
+        for (; off < len; off++) {
+          ts = (ts << 8) | buf[off];
+        }
+        nghq_record_latency (ctx, NGHQ_LATENCY_PACKET, ts);
+      }
+      /* Anything else is padding to the end of the packet */
+      break;
+    }
+  }
+
+  return NGHQ_OK;
 }
 
 int _transport_hp_mask (nghq_session *ctx, uint8_t *dest, const uint8_t *hp_key,
@@ -70,37 +70,36 @@ void quic_transport_abandon_packet (nghq_session *ctx, uint8_t *buf,
 /**
  * @brief Create a stream frame in a QUIC packet to be sent
  *
- * This function will take some stream data in @p buf_in and create a QUIC
- * packet and stream frame header in the buffer passed to @p buf_out.
+ * This function will take the stream data queued in @p bufs and create a
+ * stream frame in the buffer passed to @p buf_out. As much of each buffer in
+ * the list as will fit is gathered into the one frame, rather than a frame
+ * for each buffer.
  *
- * This function returns the number of bytes of @p buf_in that were succesfully
- * written into the resultant QUIC packet. If this value is not equal to that
- * of @p len_in, then the output buffer could not contain the full payload.
- * Callers should then call this function again with a fresh @p buf_out buffer
- * and @p buf_in offset against the previous return value, and @p len_in
- * decreased appropriately. Then you will have a series of QUIC packets that
- * need to be sent.
+ * The number of bytes taken from @p bufs is given back in @p buf_written. If
+ * this is less than the data queued, the output buffer could not contain it
+ * all. Callers should then take that many bytes off the front of @p bufs and
+ * call this function again with a fresh @p buf_out buffer. Then you will have
+ * a series of QUIC packets that need to be sent.
  *
  * @param ctx The NGHQ session context
- * @param stream The stream context that this buffer is to be sent on
- * @param buf_in A buffer containing one or more HTTP/3 frames
- * @param len_in The length of the buffer @p buf_in
+ * @param stream The stream context that this data is to be sent on
+ * @param bufs The stream's queue of buffers, each containing one or more
+ *            HTTP/3 frames. The FIN bit is set if the buffer marked complete
+ *            is reached and fits.
  * @param buf_out A buffer to contain the resulting QUIC packet. The buffer must
- *            be pre-allocated, and must not overlap with the buffer @p buf_in.
+ *            be pre-allocated, and must not overlap with the buffers in
+ *            @p bufs.
  * @param buf_out_len The length of the allocated buffer in @p buf_out
- * @param fin Set the fin bit in this packet if it is the last packet. If the
- *            whole buffer in @p buf_in cannot be used, then the FIN bit will
- *            not be set and this function should be called again.
- * @param buf_written The number of bytes of @p buf_in that were written
+ * @param buf_written The number of bytes of @p bufs that were written
  *
  * @return The size of the resulting QUIC stream frame, which will be less than
  *            or equal to @p buf_out_len.
- * @return NGHQ_CRYPTO_ERROR if the underlying encryption callback fails
+ * @return NGHQ_TOO_MUCH_DATA if there isn't room for a stream frame
  */
 ssize_t quic_transport_write_stream (nghq_session *ctx, nghq_stream *stream,
-                                     uint8_t *buf_in, size_t len_in,
+                                     nghq_io_buf *bufs,
                                      uint8_t *buf_out, size_t buf_out_len,
-                                     int fin, size_t *buf_written);
+                                     size_t *buf_written);
 
 /**
  * @brief Encrypt a QUIC transport packet.
@@ -122,11 +121,66 @@ ssize_t quic_transport_encrypt (nghq_session *ctx,
                                 uint8_t *buf_in, size_t len_in,
                                 uint8_t *buf_out, size_t len_out);
 
+/**
+ * @brief Write a push beacon frame
+ *
+ * An nghq extension frame, listing the pushes a receiver joining part way
+ * through a session needs to know about. It is written after a PADDING frame
+ * and must be the last thing in its packet apart from a send timestamp, so
+ * receivers that don't know it take it as padding and skip it.
+ *
+ * @param ctx The NGHQ session context
+ * @param buf The buffer to write the frame into, or NULL to just find out how
+ *            long the frame will be.
+ * @param len The length of the buffer @p buf
+ * @param init_offset The stream 0 offset where the next PUSH_PROMISE starts
+ * @param last Non-zero if this is the last frame of the beacon
+ * @param count The number of entries in @p entries
+ * @param entries The encoded entries
+ * @param entries_len The length of @p entries
+ * @return The length of the frame with the PADDING before it, or NGHQ_ERROR.
+ */
+ssize_t quic_transport_write_push_beacon (nghq_session *ctx, uint8_t *buf,
+                                          size_t len, uint64_t init_offset,
+                                          int last, uint64_t count,
+                                          const uint8_t *entries,
+                                          size_t entries_len);
+
+/* Length of the send timestamp put at the end of a packet */
+#define QUIC_TIMESTAMP_TRAILER_LEN 11
+
+/**
+ * @brief Write a send timestamp to go at the end of a packet
+ *
+ * An nghq extension. The timestamp follows a PADDING frame, so receivers
+ * that don't know it take it as padding and skip it.
+ *
+ * @param ctx The NGHQ session context
+ * @param buf The buffer to write into, which must be the last
+ *            QUIC_TIMESTAMP_TRAILER_LEN bytes of the packet
+ * @param len The length of the buffer @p buf
+ * @param ts The send time, from get_timestamp_now()
+ * @return QUIC_TIMESTAMP_TRAILER_LEN, or NGHQ_ERROR if @p len is too short
+ */
+ssize_t quic_transport_write_timestamp (nghq_session *ctx, uint8_t *buf,
+                                        size_t len, uint64_t ts);
+
+/**
+ * @brief Feed received data for a stream into a session
+ *
+ * Used for each STREAM frame, and for the start of push streams given in a
+ * push beacon.
+ */
+int _transport_recv_stream_data (nghq_session *session, int64_t stream_id,
+                                 int fin, uint64_t stream_offset,
+                                 const uint8_t *data, size_t datalen);
+
 /**
  * @brief Write a RESET_STREAM frame
  *
  * @param ctx The NGHQ session context
- * @param buf The buffer to write the stream into
+ * @param buf The buffer to write the frame into, or NULL to just find out how
+ *            long the frame will be.
  * @param len The length of the buffer @p buf_in
  * @param stream The stream to be reset.
  * @param error_code The QUIC Application Error code to reset the stream with
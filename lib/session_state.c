@@ -0,0 +1,591 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "session_state.h"
+#include "map.h"
+#include "io_buf.h"
+#include "util.h"
+#include "debug.h"
+
+/*
+ * Snapshot layout, all numbers are QUIC variable length integers:
+ *
+ *   "NGHQ" version
+ *   session_id_len session_id rx_pkt_num max_push_promise next_stream_id[4]
+ *   num_promises { push_id hdrs_len hdrs }
+ *   num_streams {
+ *     stream_id push_id flags recv_state final_size data_frames_total
+ *     next_recv_offset long_data_frame_remaining hdrs_len hdrs
+ *     num_ranges { begin end }
+ *     num_bufs { offset complete len bytes }
+ *     num_frames { type offset size complete end_header_offset
+ *                  data_offset_adjust num_gaps { begin end } [size bytes] }
+ *   }
+ *
+ * Saved headers are a sequence of
+ *   response flags num_hdrs { name_len name value_len value }
+ *
+ * DATA frames hold no body bytes, they're delivered as soon as they arrive,
+ * so only the frame layout and its missing ranges are kept for them.
+ */
+
+static const uint8_t _state_magic[4] = { 'N', 'G', 'H', 'Q' };
+#define STATE_VERSION 1
+
+typedef struct {
+  uint8_t *buf;
+  size_t   len;
+  size_t   alloc;
+  int      failed;
+} _state_writer;
+
+typedef struct {
+  const uint8_t *buf;
+  size_t         len;
+  size_t         off;
+  int            failed;
+} _state_reader;
+
+static int _reserve (_state_writer *w, size_t n) {
+  if (w->failed) return 0;
+  if (w->len + n > w->alloc) {
+    size_t alloc = (w->alloc)?(w->alloc * 2):1024;
+    uint8_t *buf;
+    while (alloc < w->len + n) alloc *= 2;
+    buf = (uint8_t *) realloc (w->buf, alloc);
+    if (buf == NULL) {
+      w->failed = 1;
+      return 0;
+    }
+    w->buf = buf;
+    w->alloc = alloc;
+  }
+  return 1;
+}
+
+static void _put_int (_state_writer *w, uint64_t n) {
+  if (n >= _VARLEN_INT_MAX_62_BIT) {
+    w->failed = 1;
+    return;
+  }
+  if (_reserve (w, 8)) {
+    w->len += _make_varlen_int (w->buf + w->len, n);
+  }
+}
+
+static void _put_bytes (_state_writer *w, const uint8_t *data, size_t len) {
+  if (_reserve (w, len) && len > 0) {
+    memcpy (w->buf + w->len, data, len);
+    w->len += len;
+  }
+}
+
+static uint64_t _get_int (_state_reader *r) {
+  uint64_t rv;
+  if (r->failed || r->off >= r->len) {
+    r->failed = 1;
+    return 0;
+  }
+  rv = _get_varlen_int (r->buf + r->off, &r->off, r->len);
+  if (r->off > r->len) {
+    r->failed = 1;
+    return 0;
+  }
+  return rv;
+}
+
+static const uint8_t *_get_bytes (_state_reader *r, size_t len) {
+  const uint8_t *rv;
+  if (r->failed || len > r->len - r->off) {
+    r->failed = 1;
+    return NULL;
+  }
+  rv = r->buf + r->off;
+  r->off += len;
+  return rv;
+}
+
+int nghq_state_save_headers (nghq_stream *stream, int response, uint8_t flags,
+                             nghq_header **hdrs, size_t num_hdrs) {
+  _state_writer w;
+  size_t i;
+
+  w.buf = stream->saved_hdrs;
+  w.len = w.alloc = stream->saved_hdrs_len;
+  w.failed = 0;
+
+  _put_int (&w, (response)?(1):(0));
+  _put_int (&w, flags);
+  _put_int (&w, num_hdrs);
+  for (i = 0; i < num_hdrs; i++) {
+    _put_int (&w, hdrs[i]->name_len);
+    _put_bytes (&w, hdrs[i]->name, hdrs[i]->name_len);
+    _put_int (&w, hdrs[i]->value_len);
+    _put_bytes (&w, hdrs[i]->value, hdrs[i]->value_len);
+  }
+
+  /* keep the blob tight, there may be many of these held at once */
+  if (!w.failed && w.alloc > w.len) {
+    uint8_t *buf = (uint8_t *) realloc (w.buf, w.len);
+    if (buf != NULL) w.buf = buf;
+  }
+  stream->saved_hdrs = w.buf;
+  if (w.failed) {
+    /* Partial blob would be replayed wrongly, so drop it all */
+    free (stream->saved_hdrs);
+    stream->saved_hdrs = NULL;
+    stream->saved_hdrs_len = 0;
+    return NGHQ_OUT_OF_MEMORY;
+  }
+  stream->saved_hdrs_len = w.len;
+  return NGHQ_OK;
+}
+
+static void _put_gaps (_state_writer *w, nghq_gap *list) {
+  size_t n = 0;
+  nghq_gap *g;
+  for (g = list; g; g = g->next) n++;
+  _put_int (w, n);
+  for (g = list; g; g = g->next) {
+    _put_int (w, g->begin);
+    _put_int (w, g->end);
+  }
+}
+
+static void _put_stream (_state_writer *w, nghq_stream *stream) {
+  size_t n = 0;
+  nghq_io_buf *b;
+  nghq_stream_frame *f;
+
+  _put_int (w, stream->stream_id);
+  _put_int (w, stream->push_id);
+  _put_int (w, stream->flags);
+  _put_int (w, stream->recv_state);
+  _put_int (w, stream->final_size);
+  _put_int (w, stream->data_frames_total);
+  _put_int (w, stream->next_recv_offset);
+  _put_int (w, stream->long_data_frame_remaining);
+  _put_int (w, stream->saved_hdrs_len);
+  _put_bytes (w, stream->saved_hdrs, stream->saved_hdrs_len);
+
+  _put_gaps (w, stream->body_ranges);
+
+  /* Stream data that arrived ahead of the frame it belongs to */
+  for (b = stream->recv_buf; b; b = b->next_buf) n++;
+  _put_int (w, n);
+  for (b = stream->recv_buf; b; b = b->next_buf) {
+    _put_int (w, b->offset + (b->send_pos - b->buf));
+    _put_int (w, b->complete);
+    _put_int (w, b->remaining);
+    _put_bytes (w, b->send_pos, b->remaining);
+  }
+
+  n = 0;
+  for (f = stream->active_frames; f; f = f->next) n++;
+  _put_int (w, n);
+  for (f = stream->active_frames; f; f = f->next) {
+    _put_int (w, f->frame_type);
+    _put_int (w, f->data->offset);
+    _put_int (w, f->data->buf_len);
+    _put_int (w, f->data->complete);
+    _put_int (w, f->end_header_offset);
+    _put_int (w, f->data_offset_adjust);
+    _put_gaps (w, f->gaps);
+    if (f->data->buf != NULL) {
+      _put_bytes (w, f->data->buf, f->data->buf_len);
+    }
+  }
+}
+
+/* Only streams the application has headers for can be picked up again */
+static int _stream_resumable (nghq_stream *stream) {
+  return SERVER_PUSH_STREAM(stream->stream_id) &&
+         STREAM_STARTED(stream->flags) &&
+         stream->recv_state != STATE_DONE &&
+         stream->push_id != NGHQ_STREAM_ID_MAP_NOT_FOUND &&
+         stream->saved_hdrs != NULL;
+}
+
+/*
+ * The decoder or delta state of a stream isn't saved, and a restored stream
+ * would hand the application encoded bytes as its body, so leave these out.
+ */
+static int _stream_decoded (nghq_stream *stream) {
+  return (stream->coder != NULL) || (stream->delta_path != NULL) ||
+         (stream->delta_version != NULL);
+}
+
+ssize_t nghq_state_snapshot (nghq_session *session, uint8_t **buf) {
+  _state_writer w;
+  nghq_stream *it;
+  size_t n;
+  int i;
+
+  memset (&w, 0, sizeof(w));
+
+  _put_bytes (&w, _state_magic, sizeof(_state_magic));
+  _put_int (&w, STATE_VERSION);
+  _put_int (&w, session->session_id_len);
+  _put_bytes (&w, session->session_id, session->session_id_len);
+  _put_int (&w, session->rx_pkt_num);
+  _put_int (&w, session->max_push_promise);
+  for (i = 0; i < 4; i++) {
+    _put_int (&w, session->next_stream_id[i]);
+  }
+
+  n = 0;
+  for (it = nghq_stream_id_map_iterator (session->promises, NULL); it;
+       it = nghq_stream_id_map_iterator (session->promises, it)) {
+    if (it->saved_hdrs != NULL) n++;
+  }
+  _put_int (&w, n);
+  for (it = nghq_stream_id_map_iterator (session->promises, NULL); it;
+       it = nghq_stream_id_map_iterator (session->promises, it)) {
+    if (it->saved_hdrs != NULL) {
+      _put_int (&w, it->push_id);
+      _put_int (&w, it->saved_hdrs_len);
+      _put_bytes (&w, it->saved_hdrs, it->saved_hdrs_len);
+    }
+  }
+
+  n = 0;
+  for (it = nghq_stream_id_map_iterator (session->transfers, NULL); it;
+       it = nghq_stream_id_map_iterator (session->transfers, it)) {
+    if (!_stream_resumable (it)) continue;
+    if (_stream_decoded (it)) {
+      NGHQ_LOG_INFO (session, "Not saving stream %lu, its body is being "
+                     "decoded\n", it->stream_id);
+      continue;
+    }
+    n++;
+  }
+  _put_int (&w, n);
+  for (it = nghq_stream_id_map_iterator (session->transfers, NULL); it;
+       it = nghq_stream_id_map_iterator (session->transfers, it)) {
+    if (_stream_resumable (it) && !_stream_decoded (it)) {
+      _put_stream (&w, it);
+    }
+  }
+
+  if (w.failed) {
+    free (w.buf);
+    return NGHQ_OUT_OF_MEMORY;
+  }
+
+  NGHQ_LOG_DEBUG (session, "Snapshot of %lu bytes, rx_pkt_num %lu\n", w.len,
+                  session->rx_pkt_num);
+
+  *buf = w.buf;
+  return (ssize_t) w.len;
+}
+
+static int _get_gaps (_state_reader *r, nghq_gap **list, size_t *num) {
+  nghq_gap **pg = list;
+  uint64_t n = _get_int (r);
+  if (num != NULL) *num = 0;
+  while (n-- > 0 && !r->failed) {
+    nghq_gap *g = (nghq_gap *) calloc (1, sizeof(nghq_gap));
+    if (g == NULL) return NGHQ_OUT_OF_MEMORY;
+    g->begin = _get_int (r);
+    g->end = _get_int (r);
+    if (g->end < g->begin) r->failed = 1;
+    *pg = g;
+    pg = &g->next;
+    if (num != NULL) (*num)++;
+  }
+  return NGHQ_OK;
+}
+
+static int _get_stream (_state_reader *r, nghq_stream *stream) {
+  nghq_stream_frame **pf = &stream->active_frames;
+  uint64_t n;
+  int rv;
+
+  stream->flags = (uint8_t) _get_int (r) | STREAM_FLAG_STARTED;
+  stream->recv_state = (nghq_stream_state) _get_int (r);
+  stream->final_size = _get_int (r);
+  stream->data_frames_total = _get_int (r);
+  stream->next_recv_offset = _get_int (r);
+  stream->long_data_frame_remaining = _get_int (r);
+
+  n = _get_int (r);
+  if (n > 0) {
+    const uint8_t *hdrs = _get_bytes (r, n);
+    if (hdrs == NULL) return NGHQ_BAD_SNAPSHOT;
+    stream->saved_hdrs = (uint8_t *) malloc (n);
+    if (stream->saved_hdrs == NULL) return NGHQ_OUT_OF_MEMORY;
+    memcpy (stream->saved_hdrs, hdrs, n);
+    stream->saved_hdrs_len = n;
+  }
+
+  rv = _get_gaps (r, &stream->body_ranges, NULL);
+  if (rv != NGHQ_OK) return rv;
+
+  n = _get_int (r);
+  while (n-- > 0 && !r->failed) {
+    uint64_t offset = _get_int (r);
+    int complete = (int) _get_int (r);
+    uint64_t len = _get_int (r);
+    const uint8_t *data = _get_bytes (r, len);
+    uint8_t *buf;
+    if (data == NULL) break;
+    buf = (uint8_t *) malloc (len);
+    if (buf == NULL) return NGHQ_OUT_OF_MEMORY;
+    memcpy (buf, data, len);
+    if (nghq_io_buf_new (&stream->recv_buf, buf, len, complete,
+                         offset) != NGHQ_OK) {
+      free (buf);
+      return NGHQ_OUT_OF_MEMORY;
+    }
+    stream->num_recv_bufs++;
+  }
+
+  n = _get_int (r);
+  while (n-- > 0 && !r->failed) {
+    nghq_stream_frame *f;
+    uint64_t offset, size;
+    int complete;
+    uint8_t *buf = NULL;
+
+    f = (nghq_stream_frame *) calloc (1, sizeof(nghq_stream_frame));
+    if (f == NULL) return NGHQ_OUT_OF_MEMORY;
+    *pf = f;
+    pf = &f->next;
+    stream->num_active_frames++;
+
+    f->frame_type = (nghq_frame_type) _get_int (r);
+    offset = _get_int (r);
+    size = _get_int (r);
+    complete = (int) _get_int (r);
+    f->end_header_offset = _get_int (r);
+    f->data_offset_adjust = _get_int (r);
+    rv = _get_gaps (r, &f->gaps, &f->num_gaps);
+    if (rv != NGHQ_OK) return rv;
+    if (r->failed) break;
+
+    if (f->frame_type != NGHQ_FRAME_TYPE_DATA) {
+      const uint8_t *data = _get_bytes (r, size);
+      if (data == NULL) break;
+      buf = (uint8_t *) malloc (size);
+      if (buf == NULL) return NGHQ_OUT_OF_MEMORY;
+      memcpy (buf, data, size);
+    }
+    if (nghq_io_buf_new (&f->data, buf, size, complete, offset) != NGHQ_OK) {
+      free (buf);
+      return NGHQ_OUT_OF_MEMORY;
+    }
+  }
+
+  return (r->failed)?(NGHQ_BAD_SNAPSHOT):(NGHQ_OK);
+}
+
+/*
+ * Hand the saved headers back to the application, as if they had just been
+ * received, so it can rebuild whatever it keeps for the request.
+ */
+static int _replay_headers (nghq_session *session, nghq_stream *stream) {
+  _state_reader r;
+  int rv = NGHQ_OK;
+
+  r.buf = stream->saved_hdrs;
+  r.len = stream->saved_hdrs_len;
+  r.off = 0;
+  r.failed = 0;
+
+  while (rv == NGHQ_OK && r.off < r.len) {
+    int response = (int) _get_int (&r);
+    uint8_t flags = (uint8_t) _get_int (&r) | NGHQ_HEADERS_FLAGS_RESUMED;
+    uint64_t num_hdrs = _get_int (&r);
+    nghq_header **hdrs;
+    uint64_t i;
+
+    if (r.failed || num_hdrs > r.len) return NGHQ_BAD_SNAPSHOT;
+
+    if (!response) {
+      if (session->callbacks.on_begin_promise_callback == NULL) {
+        return NGHQ_NOT_INTERESTED;
+      }
+      /* The request stream that carried the promise is long gone */
+      rv = session->callbacks.on_begin_promise_callback (session,
+                                  session->session_user_data, NULL,
+                                  stream->user_data);
+    } else if (!(flags & NGHQ_HEADERS_FLAGS_TRAILERS) &&
+               session->callbacks.on_begin_headers_callback) {
+      rv = session->callbacks.on_begin_headers_callback (session,
+                                  session->session_user_data,
+                                  stream->user_data);
+    }
+    if (rv != NGHQ_OK) return rv;
+    if (num_hdrs == 0) continue;
+
+    hdrs = (nghq_header **) calloc (num_hdrs, sizeof(nghq_header *));
+    if (hdrs == NULL) return NGHQ_OUT_OF_MEMORY;
+    for (i = 0; i < num_hdrs; i++) {
+      const uint8_t *name, *value;
+      size_t name_len, value_len;
+
+      name_len = _get_int (&r);
+      name = _get_bytes (&r, name_len);
+      value_len = _get_int (&r);
+      value = _get_bytes (&r, value_len);
+
+      hdrs[i] = (nghq_header *) calloc (1, sizeof(nghq_header));
+      if (hdrs[i] != NULL) {
+        hdrs[i]->name = (uint8_t *) malloc (name_len + 1);
+        hdrs[i]->value = (uint8_t *) malloc (value_len + 1);
+      }
+      if (r.failed || hdrs[i] == NULL || hdrs[i]->name == NULL ||
+          hdrs[i]->value == NULL) {
+        /* nghq_deliver_headers frees as it goes, so tidy up by hand */
+        uint64_t j;
+        for (j = 0; j <= i && j < num_hdrs; j++) {
+          if (hdrs[j] == NULL) continue;
+          free (hdrs[j]->name);
+          free (hdrs[j]->value);
+          free (hdrs[j]);
+        }
+        free (hdrs);
+        return (r.failed)?(NGHQ_BAD_SNAPSHOT):(NGHQ_OUT_OF_MEMORY);
+      }
+      memcpy (hdrs[i]->name, name, name_len);
+      hdrs[i]->name[name_len] = '\0';
+      hdrs[i]->name_len = name_len;
+      memcpy (hdrs[i]->value, value, value_len);
+      hdrs[i]->value[value_len] = '\0';
+      hdrs[i]->value_len = value_len;
+    }
+
+    rv = nghq_deliver_headers (session, flags, hdrs, num_hdrs,
+                               stream->user_data);
+  }
+
+  return rv;
+}
+
+int nghq_state_restore (nghq_session *session, const uint8_t *buf,
+                        size_t len) {
+  _state_reader r;
+  const uint8_t *magic, *session_id;
+  uint64_t n, session_id_len;
+  size_t restored = 0;
+  int i, rv;
+
+  r.buf = buf;
+  r.len = len;
+  r.off = 0;
+  r.failed = 0;
+
+  magic = _get_bytes (&r, sizeof(_state_magic));
+  if (magic == NULL || memcmp (magic, _state_magic, sizeof(_state_magic)) != 0
+      || _get_int (&r) != STATE_VERSION) {
+    NGHQ_LOG_ERROR (session, "Not an nghq session snapshot\n");
+    return NGHQ_BAD_SNAPSHOT;
+  }
+
+  session_id_len = _get_int (&r);
+  session_id = _get_bytes (&r, session_id_len);
+  if (session_id == NULL || session_id_len != session->session_id_len ||
+      memcmp (session_id, session->session_id, session_id_len) != 0) {
+    NGHQ_LOG_ERROR (session, "Snapshot is for a different session\n");
+    return NGHQ_BAD_SNAPSHOT;
+  }
+
+  session->rx_pkt_num = _get_int (&r);
+  session->max_push_promise = _get_int (&r);
+  for (i = 0; i < 4; i++) {
+    session->next_stream_id[i] = _get_int (&r);
+  }
+  if (r.failed) return NGHQ_BAD_SNAPSHOT;
+
+  n = _get_int (&r);
+  while (n-- > 0 && !r.failed) {
+    nghq_stream *promise = nghq_stream_init ();
+    uint64_t hdrs_len;
+    const uint8_t *hdrs;
+
+    if (promise == NULL) return NGHQ_OUT_OF_MEMORY;
+    promise->push_id = _get_int (&r);
+    promise->user_data = &promise->push_id;
+    hdrs_len = _get_int (&r);
+    hdrs = _get_bytes (&r, hdrs_len);
+    promise->saved_hdrs = (uint8_t *) malloc (hdrs_len);
+    if (hdrs == NULL || promise->saved_hdrs == NULL) {
+      nghq_stream_ended (session, promise);
+      return (r.failed)?(NGHQ_BAD_SNAPSHOT):(NGHQ_OUT_OF_MEMORY);
+    }
+    memcpy (promise->saved_hdrs, hdrs, hdrs_len);
+    promise->saved_hdrs_len = hdrs_len;
+
+    nghq_stream_id_map_add (session->promises, promise->push_id, promise);
+    rv = _replay_headers (session, promise);
+    if (rv != NGHQ_OK) {
+      NGHQ_LOG_DEBUG (session, "Not resuming push promise %lu: %s\n",
+                      promise->push_id, nghq_strerror (rv));
+      nghq_stream_id_map_remove (session->promises, promise->push_id);
+      nghq_stream_ended (session, promise);
+      if (rv == NGHQ_BAD_SNAPSHOT || rv == NGHQ_OUT_OF_MEMORY) return rv;
+    } else {
+      restored++;
+    }
+  }
+
+  n = _get_int (&r);
+  while (n-- > 0 && !r.failed) {
+    nghq_stream *stream = nghq_stream_new (_get_int (&r));
+
+    if (stream == NULL) return NGHQ_OUT_OF_MEMORY;
+    stream->push_id = _get_int (&r);
+    stream->user_data = &stream->push_id;
+    rv = _get_stream (&r, stream);
+    if (rv != NGHQ_OK) {
+      nghq_stream_ended (session, stream);
+      return rv;
+    }
+
+    nghq_stream_id_map_add (session->transfers, stream->stream_id, stream);
+    rv = _replay_headers (session, stream);
+    if (rv != NGHQ_OK) {
+      NGHQ_LOG_DEBUG (session, "Not resuming stream %lu: %s\n",
+                      stream->stream_id, nghq_strerror (rv));
+      nghq_stream_id_map_remove (session->transfers, stream->stream_id);
+      nghq_stream_ended (session, stream);
+      if (rv == NGHQ_BAD_SNAPSHOT || rv == NGHQ_OUT_OF_MEMORY) return rv;
+    } else {
+      restored++;
+    }
+  }
+
+  if (r.failed) return NGHQ_BAD_SNAPSHOT;
+
+  NGHQ_LOG_INFO (session, "Resumed %lu promises and streams from snapshot, "
+                 "rx_pkt_num %lu\n", restored, session->rx_pkt_num);
+
+  return NGHQ_OK;
+}
+
+// vim:ts=8:sts=2:sw=2:expandtab:
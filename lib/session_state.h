@@ -0,0 +1,55 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef LIB_SESSION_STATE_H_
+#define LIB_SESSION_STATE_H_
+
+#include <stdint.h>
+#include "nghq_internal.h"
+
+/**
+ * @brief Keep a copy of headers delivered on a stream, for snapshots
+ *
+ * Appended to the stream's saved header blob so that they can be replayed to
+ * the application when the stream is restored.
+ *
+ * @param response Zero for PUSH_PROMISE headers, non-zero for HEADERS frames
+ * @param flags The NGHQ_HEADERS_FLAGS_* the headers were delivered with
+ */
+int nghq_state_save_headers (nghq_stream *stream, int response, uint8_t flags,
+                             nghq_header **hdrs, size_t num_hdrs);
+
+ssize_t nghq_state_snapshot (nghq_session *session, uint8_t **buf);
+
+/**
+ * @brief Recreate the promises and push streams held in a snapshot
+ *
+ * Headers saved with each promise and stream are replayed through the
+ * application callbacks with NGHQ_HEADERS_FLAGS_RESUMED set. Any stream the
+ * application turns down is dropped.
+ */
+int nghq_state_restore (nghq_session *session, const uint8_t *buf, size_t len);
+
+#endif /* LIB_SESSION_STATE_H_ */
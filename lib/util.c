@@ -97,102 +97,37 @@ void put_int64_in_buf (uint8_t* buf, int64_t n) {
   put_uint64_in_buf( buf, (uint64_t)n);
 }
 
-#define PKTNUM_1BYTE_BASE_MASK(x) (x & 0xFFFFFFFFFFFFFF00)
-#define PKTNUM_1BYTE_UPPER_QUARTILE(x) ((uint8_t) x) >= 192
-#define PKTNUM_1BYTE_LOWER_QUARTILE(x) ((uint8_t) x) < 64
-
-#define PKTNUM_2BYTE_BASE_MASK(x) (x & 0xFFFFFFFFFFFF0000)
-#define PKTNUM_2BYTE_UPPER_QUARTILE(x) ((uint16_t) x) >= 49152
-#define PKTNUM_2BYTE_LOWER_QUARTILE(x) ((uint16_t) x) < 16384
-
-#define PKTNUM_3BYTE_BASE_MASK(x) (x & 0xFFFFFFFFFF000000)
-#define PKTNUM_3BYTE_UPPER_QUARTILE(x) (x & 0xFFFFFF) >= 12582912
-#define PKTNUM_3BYTE_LOWER_QUARTILE(x) (x & 0xFFFFFF) < 4194304
-
-#define PKTNUM_4BYTE_BASE_MASK(x) (x & 0xFFFFFFFF00000000)
-#define PKTNUM_4BYTE_UPPER_QUARTILE(x) ((uint32_t) x) >= 3221225472
-#define PKTNUM_4BYTE_LOWER_QUARTILE(x) ((uint32_t) x) < 1073741824
-
+/*
+ * Packet number decoding from RFC 9000 Appendix A.3. The truncated number is
+ * placed in the window of 2^(8*len) packet numbers centred on the next
+ * expected packet number, so wraps and reordering of up to half a window
+ * either side are both decoded correctly.
+ */
 uint64_t get_packet_number (uint8_t first_byte, const uint8_t *buf,
                             uint64_t base) {
-  uint64_t pkt_num = 0;
-  switch (first_byte & 0x03) {
-    case 0:
-      pkt_num = (uint64_t) buf[0];
-      break;
-    case 1:
-      pkt_num = (uint64_t) get_uint16_from_buf (buf);
-      break;
-    case 2:
-      pkt_num = (uint64_t) get_uint24_from_buf (buf);
-      break;
-    case 3:
-      pkt_num = (uint64_t) get_uint32_from_buf (buf);
-  }
+  size_t len = (first_byte & 0x03) + 1;
+  uint64_t truncated = 0;
+  uint64_t expected = base + 1;
+  uint64_t win = 1ULL << (len * 8);
+  uint64_t hwin = win / 2;
+  uint64_t candidate;
+  size_t i;
 
-  /* If base is zero, this is either the first packet, or we don't want to
-   * calculate the full number. We also don't want to do anything on the very
-   * lowest quartile as this could get messy with wraps back to the top of the
-   * number space!
-   */
-  if (base > 64) {
-    switch (first_byte & 0x03) {
-      case 0:
-        if (PKTNUM_1BYTE_UPPER_QUARTILE(base) &&
-            PKTNUM_1BYTE_LOWER_QUARTILE(pkt_num)) {
-          /* Probably a wrapping packet number */
-          pkt_num |= PKTNUM_1BYTE_BASE_MASK((base + 0x100));
-        } else if (PKTNUM_1BYTE_LOWER_QUARTILE(base) &&
-                   PKTNUM_1BYTE_UPPER_QUARTILE(pkt_num)) {
-          /* Probably an out-of-order packet */
-          pkt_num |= PKTNUM_1BYTE_BASE_MASK((base - 0x100));
-        } else {
-          pkt_num |= PKTNUM_1BYTE_BASE_MASK(base);
-        }
-        break;
-      case 1:
-        if (PKTNUM_2BYTE_UPPER_QUARTILE(base) &&
-            PKTNUM_2BYTE_LOWER_QUARTILE(pkt_num)) {
-          /* Probably a wrapping packet number */
-          pkt_num |= PKTNUM_2BYTE_BASE_MASK((base + 0x10000));
-        } else if (PKTNUM_2BYTE_LOWER_QUARTILE(base) &&
-                   PKTNUM_2BYTE_UPPER_QUARTILE(pkt_num)) {
-          /* Probably an out-of-order packet */
-          pkt_num |= PKTNUM_2BYTE_BASE_MASK((base - 0x10000));
-        } else {
-          pkt_num |= PKTNUM_2BYTE_BASE_MASK(base);
-        }
-        break;
-      case 2:
-        if (PKTNUM_3BYTE_UPPER_QUARTILE(base) &&
-            PKTNUM_3BYTE_LOWER_QUARTILE(pkt_num)) {
-          /* Probably a wrapping packet number */
-          pkt_num |= PKTNUM_3BYTE_BASE_MASK((base + 0x1000000));
-        } else if (PKTNUM_3BYTE_LOWER_QUARTILE(base) &&
-                   PKTNUM_3BYTE_UPPER_QUARTILE(pkt_num)) {
-          /* Probably an out-of-order packet */
-          pkt_num |= PKTNUM_3BYTE_BASE_MASK((base - 0x1000000));
-        } else {
-          pkt_num |= PKTNUM_3BYTE_BASE_MASK(base);
-        }
-        break;
-      case 3:
-        if (PKTNUM_4BYTE_UPPER_QUARTILE(base) &&
-            PKTNUM_4BYTE_LOWER_QUARTILE(pkt_num)) {
-          /* Probably a wrapping packet number */
-          pkt_num |= PKTNUM_4BYTE_BASE_MASK((base + 0x100000000));
-        } else if (PKTNUM_4BYTE_LOWER_QUARTILE(base) &&
-                   PKTNUM_4BYTE_UPPER_QUARTILE(pkt_num)) {
-          /* Probably an out-of-order packet */
-          pkt_num |= PKTNUM_4BYTE_BASE_MASK((base - 0x100000000));
-        } else {
-          pkt_num |= PKTNUM_4BYTE_BASE_MASK(base);
-        }
-        break;
-    }
+  for (i = 0; i < len; i++) {
+    truncated = (truncated << 8) | buf[i];
   }
 
-  return pkt_num;
+  candidate = (expected & ~(win - 1)) | truncated;
+  if (candidate + hwin <= expected &&
+      candidate < (1ULL << 62) - win) {
+    /* expected is near the top of its window, candidate is in the next */
+    return candidate + win;
+  }
+  if (candidate > expected + hwin && candidate >= win) {
+    /* candidate is a late packet from the previous window */
+    return candidate - win;
+  }
+  return candidate;
 }
 
 size_t put_packet_number (uint64_t pkt_num, size_t len,
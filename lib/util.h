@@ -57,6 +57,7 @@ int64_t get_int64_from_buf (const uint8_t* buf);
 void put_uint64_in_buf (uint8_t* buf, uint64_t n);
 void put_int64_in_buf (uint8_t* buf, int64_t n);
 
+/* @p base is the largest packet number received so far */
 uint64_t get_packet_number (uint8_t first_byte, const uint8_t *buf,
                             uint64_t base);
 size_t put_packet_number (uint64_t pkt_num, size_t len, uint8_t *buf,
@@ -0,0 +1,207 @@
+/*
+ * nghq
+ *
+ * Copyright (c) 2018 British Broadcasting Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks get_packet_number() against the decoding pseudocode of RFC 9000
+ * Appendix A.3, for every truncated value of 1 to 3 bytes and a spread of 4
+ * byte values, at the edges of the windows either side of a set of largest
+ * received packet numbers. Every packet number within half a window of the
+ * next expected one must also survive put_packet_number() and decoding.
+ *
+ * Then times the decoder, so changes to it can be compared.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "util.h"
+
+#define MAX_PKT_NUM ((1ULL << 62) - 1)
+#define BENCH_DECODES 20000000ULL
+/* Step through the 4 byte truncated values, it's prime so all byte values
+ * of each position are visited */
+#define LEN4_STRIDE 65521ULL
+#define LEN4_NEAR 65536ULL
+/* Packet numbers to skip between round trips for 3 byte numbers */
+#define LEN3_ROUND_TRIP_STRIDE 257ULL
+
+static uint64_t g_checked = 0;
+static uint64_t g_failed = 0;
+
+/* RFC 9000 Appendix A.3, in signed arithmetic as the pseudocode intends */
+static uint64_t _reference_decode (uint64_t largest_pn, uint64_t truncated_pn,
+                                   size_t pn_nbits) {
+  int64_t expected_pn = (int64_t) largest_pn + 1;
+  int64_t pn_win = 1LL << pn_nbits;
+  int64_t pn_hwin = pn_win / 2;
+  int64_t pn_mask = pn_win - 1;
+  int64_t candidate_pn = (expected_pn & ~pn_mask) | (int64_t) truncated_pn;
+
+  if (candidate_pn <= expected_pn - pn_hwin &&
+      candidate_pn < (1LL << 62) - pn_win) {
+    return (uint64_t) (candidate_pn + pn_win);
+  }
+  if (candidate_pn > expected_pn + pn_hwin &&
+      candidate_pn >= pn_win) {
+    return (uint64_t) (candidate_pn - pn_win);
+  }
+  return (uint64_t) candidate_pn;
+}
+
+static void _put_truncated (uint8_t *buf, uint64_t truncated, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    buf[i] = (uint8_t) (truncated >> (8 * (len - i - 1)));
+  }
+}
+
+static void _check_one (uint64_t base, uint64_t truncated, size_t len) {
+  uint8_t buf[4];
+  uint64_t got, want;
+
+  _put_truncated (buf, truncated, len);
+  got = get_packet_number ((uint8_t) (len - 1), buf, base);
+  want = _reference_decode (base, truncated, len * 8);
+  g_checked++;
+  if (got != want) {
+    if (g_failed++ < 20) {
+      fprintf (stderr, "len %zu, largest %" PRIu64 ", truncated %#" PRIx64
+               ": got %" PRIu64 ", want %" PRIu64 "\n", len, base, truncated,
+               got, want);
+    }
+  }
+}
+
+/* Every packet number close enough to be decoded must come back unchanged */
+static void _check_round_trip (uint64_t base, size_t len) {
+  uint64_t hwin = (1ULL << (len * 8)) / 2;
+  uint64_t expected = base + 1;
+  uint64_t lo = (expected > hwin - 1)?(expected - (hwin - 1)):(0);
+  uint64_t hi = expected + hwin;
+  uint64_t step = 1;
+  uint64_t pn;
+
+  if (len == 3) step = LEN3_ROUND_TRIP_STRIDE;
+  if (len == 4) step = LEN4_STRIDE;
+  if (hi > MAX_PKT_NUM) hi = MAX_PKT_NUM;
+  for (pn = lo; pn <= hi; pn += step) {
+    uint8_t buf[4];
+    uint64_t got;
+    put_packet_number (pn, len, buf, sizeof(buf));
+    got = get_packet_number ((uint8_t) (len - 1), buf, base);
+    g_checked++;
+    if (got != pn) {
+      if (g_failed++ < 20) {
+        fprintf (stderr, "len %zu, largest %" PRIu64 ": sent %" PRIu64
+                 ", decoded %" PRIu64 "\n", len, base, pn, got);
+      }
+    }
+  }
+}
+
+static void _check_len (size_t len) {
+  uint64_t win = 1ULL << (len * 8);
+  uint64_t hwin = win / 2;
+  uint64_t bases[] = {
+    0, 1, hwin - 2, hwin - 1, hwin, win - 2, win - 1, win, win + 1,
+    win + hwin - 1, win + hwin, 3 * win - 1, (1ULL << 32) + hwin,
+    (1ULL << 40) - 1, MAX_PKT_NUM - win - 1, MAX_PKT_NUM - win,
+    MAX_PKT_NUM - hwin, MAX_PKT_NUM - 2, MAX_PKT_NUM - 1
+  };
+  size_t b;
+
+  for (b = 0; b < sizeof(bases) / sizeof(bases[0]); b++) {
+    uint64_t base = bases[b];
+    uint64_t t;
+
+    if (len < 4) {
+      for (t = 0; t < win; t++) {
+        _check_one (base, t, len);
+      }
+    } else {
+      uint64_t expected_trunc = (base + 1) & (win - 1);
+      for (t = 0; t < win; t += LEN4_STRIDE) {
+        _check_one (base, t, len);
+      }
+      /* around where the next packet and the window edges fall */
+      for (t = 0; t < LEN4_NEAR; t++) {
+        _check_one (base, (expected_trunc + t) & (win - 1), len);
+        _check_one (base, (expected_trunc - t) & (win - 1), len);
+        _check_one (base, (expected_trunc + hwin + t) & (win - 1), len);
+        _check_one (base, (expected_trunc + hwin - t) & (win - 1), len);
+      }
+      _check_one (base, win - 1, len);
+    }
+    _check_round_trip (base, len);
+  }
+}
+
+static double _now (void) {
+  struct timespec tp;
+  clock_gettime (CLOCK_MONOTONIC, &tp);
+  return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/* Decode a steady stream of packets with a little reordering, as a receiver
+ * would see them */
+static void _bench (size_t len) {
+  uint64_t largest = 1000000, pn, i, sum = 0;
+  uint8_t buf[4];
+  double start, elapsed;
+
+  start = _now ();
+  for (i = 0; i < BENCH_DECODES; i++) {
+    pn = largest + 1 - ((i % 7 == 0)?(3):(0));
+    put_packet_number (pn, len, buf, sizeof(buf));
+    pn = get_packet_number ((uint8_t) (len - 1), buf, largest);
+    if (pn > largest) largest = pn;
+    sum += pn;
+  }
+  elapsed = _now () - start;
+
+  printf ("%zu byte packet numbers: %.2f ns per encode and decode "
+          "(checksum %" PRIx64 ")\n", len,
+          elapsed * 1e9 / BENCH_DECODES, sum);
+}
+
+int main (int argc, char *argv[]) {
+  size_t len;
+
+  for (len = 1; len <= 4; len++) {
+    _check_len (len);
+  }
+  printf ("%" PRIu64 " packet numbers checked, %" PRIu64 " wrong\n",
+          g_checked, g_failed);
+  if (g_failed) {
+    return 1;
+  }
+
+  for (len = 1; len <= 4; len++) {
+    _bench (len);
+  }
+  return 0;
+}